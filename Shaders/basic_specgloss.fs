@@ -6,13 +6,58 @@ struct Light
   vec3 color;
 };
 
+// Per-frame constants, shared by every shader; keep in sync with FrameConstants in Main.cpp
+layout(std140) uniform FrameConstants
+{
+  mat4x4 mat_projection;
+  mat4x4 mat_view;
+  mat4x4 mat_view_inverse;
+  mat4x4 mat_sky_projection;
+  mat4x4 mat_sky_view;
+  vec4 background_color;
+  vec3 camera_position;
+  float exposure;
+  Light lights[3];
+  float skysphere_rotation;
+  float skysphere_mip_count;
+  float skysphere_blur;
+  float skysphere_opacity;
+  uint frame_count;
+  bool has_tex_skysphere;
+  bool has_tex_skyenv;
+};
+
 struct ColorMap
 {
-  bool has_tex;
-  sampler2D tex;
   vec4 color;
+  bool has_tex;
 };
 
+// Per-material constants; keep in sync with MaterialConstants in Geometry.cpp
+layout(std140) uniform MaterialConstants
+{
+  ColorMap map_albedo;
+  ColorMap map_diffuse;
+  ColorMap map_specular;
+  ColorMap map_normals;
+  ColorMap map_roughness;
+  ColorMap map_metallic;
+  ColorMap map_ao;
+  ColorMap map_ambient;
+  ColorMap map_emissive;
+  float specular_shininess;
+};
+
+uniform sampler2D map_albedo_tex;
+uniform sampler2D map_diffuse_tex;
+uniform sampler2D map_specular_tex;
+uniform sampler2D map_normals_tex;
+uniform sampler2D map_roughness_tex;
+uniform sampler2D map_metallic_tex;
+uniform sampler2D map_ao_tex;
+uniform sampler2D map_ambient_tex;
+uniform sampler2D map_emissive_tex;
+
 in vec3 out_normal;
 in vec3 out_tangent;
 in vec3 out_binormal;
@@ -20,41 +65,38 @@ in vec2 out_texcoord;
 in vec3 out_worldpos;
 in vec3 out_to_camera;
 
-
-uniform float specular_shininess;
-
-uniform float skysphere_rotation;
-uniform float skysphere_mip_count;
-uniform float exposure;
-
-uniform vec3 camera_position;
-uniform Light lights[3];
-
 uniform vec4 global_ambient;
 
-uniform bool has_tex_skysphere;
-uniform bool has_tex_skyenv;
-
 uniform sampler2D tex_skysphere;
 uniform sampler2D tex_skyenv;
 
-uniform ColorMap map_albedo;
-uniform ColorMap map_diffuse;
-uniform ColorMap map_specular;
-uniform ColorMap map_normals;
-uniform ColorMap map_roughness;
-uniform ColorMap map_metallic;
-uniform ColorMap map_ao;
-uniform ColorMap map_ambient;
-uniform ColorMap map_emissive;
+layout(location = 0) out vec4 frag_color;
+layout(location = 1) out float frag_revealage;
 
-out vec4 frag_color;
+// Weighted blended transparency: the premultiplied color, weighted to favour
+// near and opaque surfaces, is summed in the first target and the coverage
+// multiplied into the second (McGuire and Bavoil, 2013)
+uniform bool transparency_accumulation;
+
+void write_color( vec3 color, float alpha )
+{
+  if ( transparency_accumulation )
+  {
+    float weight = clamp( pow( min( 1.0, alpha * 10.0 ) + 0.01, 3.0 ) * 1e8 * pow( 1.0 - gl_FragCoord.z * 0.9, 3.0 ), 1e-2, 3e3 );
+    frag_color = vec4( color * alpha, alpha ) * weight;
+  }
+  else
+  {
+    frag_color = vec4( color, alpha );
+  }
+  frag_revealage = alpha;
+}
 
 const float PI = 3.1415926536;
 
-vec4 sample_colormap( ColorMap map, vec2 uv)
+vec4 sample_colormap( ColorMap map, sampler2D tex, vec2 uv )
 {
-  return map.has_tex ? texture( map.tex, uv ) : map.color;
+  return map.has_tex ? texture( tex, uv ) : map.color;
 }
 
 vec2 sphere_to_polar( vec3 normal )
@@ -94,8 +136,8 @@ float calculate_specular( vec3 normal, vec3 light_direction )
 
 void main(void)
 {
-  vec3 ambient = sample_colormap( map_ambient, out_texcoord ).xyz;
-  vec4 diffusemap_alpha = sample_colormap( map_diffuse, out_texcoord );
+  vec3 ambient = sample_colormap( map_ambient, map_ambient_tex, out_texcoord ).xyz;
+  vec4 diffusemap_alpha = sample_colormap( map_diffuse, map_diffuse_tex, out_texcoord );
   vec3 diffusemap = diffusemap_alpha.xyz;
   float alpha = diffusemap_alpha.w;
   if (alpha < 0.001)
@@ -103,8 +145,8 @@ void main(void)
     discard;
   }
 
-  vec3 normalmap = normalize(texture( map_normals.tex, out_texcoord ).xyz * vec3(2.0) - vec3(1.0));
-  vec4 specularmap = sample_colormap( map_specular, out_texcoord );
+  vec3 normalmap = normalize(texture( map_normals_tex, out_texcoord ).xyz * vec3(2.0) - vec3(1.0));
+  vec4 specularmap = sample_colormap( map_specular, map_specular_tex, out_texcoord );
 
   vec3 normal = out_normal;
   if ( map_normals.has_tex )
@@ -129,7 +171,7 @@ void main(void)
     color += (diffusemap + specular) * ndotl * lights[ i ].color;
   }
 
-  color += sample_colormap( map_emissive, out_texcoord ).rgb;
+  color += sample_colormap( map_emissive, map_emissive_tex, out_texcoord ).rgb;
 
-  frag_color = vec4( pow( color * exposure, vec3(1. / 2.2) ), alpha );
+  write_color( pow( color * exposure, vec3(1. / 2.2) ), alpha );
 }
@@ -21,13 +21,58 @@ struct Light
   vec3 color;
 };
 
+// Per-frame constants, shared by every shader; keep in sync with FrameConstants in Main.cpp
+layout(std140) uniform FrameConstants
+{
+  mat4x4 mat_projection;
+  mat4x4 mat_view;
+  mat4x4 mat_view_inverse;
+  mat4x4 mat_sky_projection;
+  mat4x4 mat_sky_view;
+  vec4 background_color;
+  vec3 camera_position;
+  float exposure;
+  Light lights[3];
+  float skysphere_rotation;
+  float skysphere_mip_count;
+  float skysphere_blur;
+  float skysphere_opacity;
+  uint frame_count;
+  bool has_tex_skysphere;
+  bool has_tex_skyenv;
+};
+
 struct ColorMap
 {
-  bool has_tex;
-  sampler2D tex;
   vec4 color;
+  bool has_tex;
 };
 
+// Per-material constants; keep in sync with MaterialConstants in Geometry.cpp
+layout(std140) uniform MaterialConstants
+{
+  ColorMap map_albedo;
+  ColorMap map_diffuse;
+  ColorMap map_specular;
+  ColorMap map_normals;
+  ColorMap map_roughness;
+  ColorMap map_metallic;
+  ColorMap map_ao;
+  ColorMap map_ambient;
+  ColorMap map_emissive;
+  float specular_shininess;
+};
+
+uniform sampler2D map_albedo_tex;
+uniform sampler2D map_diffuse_tex;
+uniform sampler2D map_specular_tex;
+uniform sampler2D map_normals_tex;
+uniform sampler2D map_roughness_tex;
+uniform sampler2D map_metallic_tex;
+uniform sampler2D map_ao_tex;
+uniform sampler2D map_ambient_tex;
+uniform sampler2D map_emissive_tex;
+
 in vec3 out_normal;
 in vec3 out_tangent;
 in vec3 out_binormal;
@@ -35,32 +80,31 @@ in vec2 out_texcoord;
 in vec3 out_worldpos;
 in vec3 out_to_camera;
 
-uniform float skysphere_rotation;
-uniform float skysphere_mip_count;
-uniform float exposure;
-uniform uint frame_count;
-
-uniform vec3 camera_position;
-uniform Light lights[3];
-
 uniform sampler2D tex_skysphere;
 uniform sampler2D tex_skyenv;
 uniform sampler2D tex_brdf_lut;
 
-uniform bool has_tex_skysphere;
-uniform bool has_tex_skyenv;
+layout(location = 0) out vec4 frag_color;
+layout(location = 1) out float frag_revealage;
 
-uniform ColorMap map_albedo;
-uniform ColorMap map_diffuse;
-uniform ColorMap map_specular;
-uniform ColorMap map_normals;
-uniform ColorMap map_roughness;
-uniform ColorMap map_metallic;
-uniform ColorMap map_ao;
-uniform ColorMap map_ambient;
-uniform ColorMap map_emissive;
+// Weighted blended transparency: the premultiplied color, weighted to favour
+// near and opaque surfaces, is summed in the first target and the coverage
+// multiplied into the second (McGuire and Bavoil, 2013)
+uniform bool transparency_accumulation;
 
-out vec4 frag_color;
+void write_color( vec3 color, float alpha )
+{
+  if ( transparency_accumulation )
+  {
+    float weight = clamp( pow( min( 1.0, alpha * 10.0 ) + 0.01, 3.0 ) * 1e8 * pow( 1.0 - gl_FragCoord.z * 0.9, 3.0 ), 1e-2, 3e3 );
+    frag_color = vec4( color * alpha, alpha ) * weight;
+  }
+  else
+  {
+    frag_color = vec4( color, alpha );
+  }
+  frag_revealage = alpha;
+}
 
 const float PI = 3.1415926536;
 
@@ -88,9 +132,9 @@ float random( vec3 v )
     return random(floatBitsToUint( v ));
 }
 
-vec4 sample_colormap( ColorMap map, vec2 uv )
+vec4 sample_colormap( ColorMap map, sampler2D tex, vec2 uv )
 {
-  return map.has_tex ? texture( map.tex, uv ) : map.color;
+  return map.has_tex ? texture( tex, uv ) : map.color;
 }
 
 vec3 fresnel_schlick( vec3 H, vec3 V, vec3 F0 )
@@ -258,9 +302,9 @@ void main(void)
 
   vec4 baseColor_alpha;
   if ( map_albedo.has_tex )
-    baseColor_alpha = sample_colormap( map_albedo, out_texcoord );
+    baseColor_alpha = sample_colormap( map_albedo, map_albedo_tex, out_texcoord );
   else
-    baseColor_alpha = sample_colormap( map_diffuse, out_texcoord );
+    baseColor_alpha = sample_colormap( map_diffuse, map_diffuse_tex, out_texcoord );
   baseColor = baseColor_alpha.xyz;
   alpha = baseColor_alpha.w;
   if (alpha < 0.001)
@@ -268,18 +312,18 @@ void main(void)
     discard;
   }
 
-  roughness = sample_colormap( map_roughness, out_texcoord ).x;
-  metallic = sample_colormap( map_metallic, out_texcoord ).x;
+  roughness = sample_colormap( map_roughness, map_roughness_tex, out_texcoord ).x;
+  metallic = sample_colormap( map_metallic, map_metallic_tex, out_texcoord ).x;
 
   if ( map_ao.has_tex )
-    ao = sample_colormap( map_ao, out_texcoord ).x;
+    ao = sample_colormap( map_ao, map_ao_tex, out_texcoord ).x;
   else if ( map_ambient.has_tex )
-    ao = sample_colormap( map_ambient, out_texcoord ).x;
+    ao = sample_colormap( map_ambient, map_ambient_tex, out_texcoord ).x;
 
-  vec3 emissive = sample_colormap( map_emissive, out_texcoord ).rgb;
+  vec3 emissive = sample_colormap( map_emissive, map_emissive_tex, out_texcoord ).rgb;
 
-  vec3 normalmap = texture( map_normals.tex, out_texcoord ).xyz * vec3(2.0) - vec3(1.0);
-  float normalmap_mip = textureQueryLod( map_normals.tex, out_texcoord ).x;
+  vec3 normalmap = texture( map_normals_tex, out_texcoord ).xyz * vec3(2.0) - vec3(1.0);
+  float normalmap_mip = textureQueryLod( map_normals_tex, out_texcoord ).x;
   float normalmap_length = length(normalmap);
   normalmap /= normalmap_length;
 
@@ -361,7 +405,7 @@ void main(void)
     }
   }
 
-  vec3 ambient = sample_colormap( map_ambient, out_texcoord ).xyz;
+  vec3 ambient = sample_colormap( map_ambient, map_ambient_tex, out_texcoord ).xyz;
   vec3 diffuse_ambient;
   vec3 specular_ambient;
 
@@ -437,5 +481,5 @@ void main(void)
   color += vec3( (-1.0/256.) + (2./256.) * dither );
   
   // Technically this alpha may be too transparent, if there is a lot of reflected light we wouldn't see the background, maybe we can approximate it well enough by adding a fresnel term
-  frag_color = vec4( color, alpha );
+  write_color( color, alpha );
 }
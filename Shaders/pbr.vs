@@ -5,6 +5,8 @@ in vec3 in_normal;
 in vec3 in_tangent;
 in vec3 in_binormal;
 in vec2 in_texcoord;
+in vec2 in_normal_oct;
+in ivec2 in_tangent_oct;
 
 out vec3 out_normal;
 out vec3 out_tangent;
@@ -14,15 +16,68 @@ out vec3 out_worldpos;
 out vec3 out_viewpos;
 out vec3 out_to_camera;
 
-uniform mat4x4 mat_projection;
-uniform mat4x4 mat_view;
-uniform mat4x4 mat_view_inverse;
-uniform mat4x4 mat_world;
+struct Light
+{
+  vec3 direction;
+  vec3 color;
+};
+
+// Per-frame constants, shared by every shader; keep in sync with FrameConstants in Main.cpp
+layout(std140) uniform FrameConstants
+{
+  mat4x4 mat_projection;
+  mat4x4 mat_view;
+  mat4x4 mat_view_inverse;
+  mat4x4 mat_sky_projection;
+  mat4x4 mat_sky_view;
+  vec4 background_color;
+  vec3 camera_position;
+  float exposure;
+  Light lights[3];
+  float skysphere_rotation;
+  float skysphere_mip_count;
+  float skysphere_blur;
+  float skysphere_opacity;
+  uint frame_count;
+  bool has_tex_skysphere;
+  bool has_tex_skyenv;
+};
+
+// Per instance; Geometry::Render() draws every node sharing a mesh and material in one call
+in mat4x4 in_mat_world;
+
+// Compact vertices: position is normalized to the mesh AABB, normal and tangent
+// are octahedral encoded and the lowest bit of the tangent holds the bitangent sign
+uniform bool compact_vertices;
+uniform vec3 pos_decode_offset;
+uniform vec3 pos_decode_scale;
+
+vec3 decode_octahedral( vec2 e )
+{
+  vec3 v = vec3( e.x, e.y, 1.0 - abs( e.x ) - abs( e.y ) );
+  if ( v.z < 0.0 )
+  {
+    v.xy = ( 1.0 - abs( v.yx ) ) * vec2( v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0 );
+  }
+  return normalize( v );
+}
 
 void main()
 {
-  vec4 o = vec4( in_pos.x, in_pos.y, in_pos.z, 1.0 );
-  o = mat_world * o;
+  vec3 pos = in_pos;
+  vec3 normal = in_normal;
+  vec3 tangent = in_tangent;
+  vec3 binormal = in_binormal;
+  if ( compact_vertices )
+  {
+    pos = pos_decode_offset + in_pos * pos_decode_scale;
+    normal = decode_octahedral( in_normal_oct );
+    tangent = decode_octahedral( vec2( in_tangent_oct.x / 32767.0, ( in_tangent_oct.y >> 1 ) / 16383.0 ) );
+    binormal = cross( normal, tangent ) * ( ( in_tangent_oct.y & 1 ) != 0 ? -1.0 : 1.0 );
+  }
+
+  vec4 o = vec4( pos.x, pos.y, pos.z, 1.0 );
+  o = in_mat_world * o;
   out_worldpos = o.xyz;
   o = mat_view * o;
   out_viewpos = o.xyz;
@@ -33,8 +88,8 @@ void main()
   o = mat_projection * o;
   gl_Position = o;
 
-  out_normal = normalize( mat3( mat_world ) * in_normal );
-  out_tangent = normalize( mat3( mat_world ) * in_tangent );
-  out_binormal = normalize( mat3( mat_world ) * in_binormal );
+  out_normal = normalize( mat3( in_mat_world ) * normal );
+  out_tangent = normalize( mat3( in_mat_world ) * tangent );
+  out_binormal = normalize( mat3( in_mat_world ) * binormal );
   out_texcoord = in_texcoord;
 }
@@ -0,0 +1,26 @@
+#version 410 core
+
+// Resolves the weighted blended transparency targets; blended with
+// ( 1 - alpha, alpha ), so the layers cover the frame by 1 - revealage
+uniform sampler2D tex_accumulation;
+uniform sampler2D tex_revealage;
+
+out vec4 frag_color;
+
+void main()
+{
+  ivec2 pixel = ivec2( gl_FragCoord.xy );
+  float revealage = texelFetch( tex_revealage, pixel, 0 ).r;
+  if ( revealage == 1.0 )
+  {
+    discard;
+  }
+
+  vec4 accumulation = texelFetch( tex_accumulation, pixel, 0 );
+  // The half float sum can overflow with many bright layers
+  if ( isinf( max( max( abs( accumulation.r ), abs( accumulation.g ) ), abs( accumulation.b ) ) ) )
+  {
+    accumulation.rgb = vec3( accumulation.a );
+  }
+  frag_color = vec4( accumulation.rgb / max( accumulation.a, 1e-5 ), revealage );
+}
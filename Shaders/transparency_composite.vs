@@ -0,0 +1,8 @@
+#version 410 core
+
+// A triangle covering the screen, from the vertex index alone
+void main()
+{
+  vec2 pos = vec2( ( gl_VertexID & 1 ) * 4.0 - 1.0, ( gl_VertexID >> 1 ) * 4.0 - 1.0 );
+  gl_Position = vec4( pos, 0.0, 1.0 );
+}
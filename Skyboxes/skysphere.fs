@@ -2,17 +2,36 @@
 
 in vec3 out_worldpos;
 
+struct Light
+{
+  vec3 direction;
+  vec3 color;
+};
+
+// Per-frame constants, shared by every shader; keep in sync with FrameConstants in Main.cpp
+layout(std140) uniform FrameConstants
+{
+  mat4x4 mat_projection;
+  mat4x4 mat_view;
+  mat4x4 mat_view_inverse;
+  mat4x4 mat_sky_projection;
+  mat4x4 mat_sky_view;
+  vec4 background_color;
+  vec3 camera_position;
+  float exposure;
+  Light lights[3];
+  float skysphere_rotation;
+  float skysphere_mip_count;
+  float skysphere_blur;
+  float skysphere_opacity;
+  uint frame_count;
+  bool has_tex_skysphere;
+  bool has_tex_skyenv;
+};
+
 uniform float texture_lod;
 uniform sampler2D tex_skysphere;
 uniform sampler2D tex_skyenv;
-uniform bool has_tex_skyenv;
-uniform float skysphere_rotation;
-uniform float skysphere_blur;
-uniform float skysphere_opacity;
-uniform float skysphere_mip_count;
-uniform float exposure;
-uniform uint frame_count;
-uniform vec4 background_color;
 
 out vec4 frag_color;
 
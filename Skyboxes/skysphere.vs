@@ -4,14 +4,38 @@ in vec3 in_pos;
 
 out vec3 out_worldpos;
 
-uniform mat4x4 mat_projection;
-uniform mat4x4 mat_view;
+struct Light
+{
+  vec3 direction;
+  vec3 color;
+};
+
+// Per-frame constants, shared by every shader; keep in sync with FrameConstants in Main.cpp
+layout(std140) uniform FrameConstants
+{
+  mat4x4 mat_projection;
+  mat4x4 mat_view;
+  mat4x4 mat_view_inverse;
+  mat4x4 mat_sky_projection;
+  mat4x4 mat_sky_view;
+  vec4 background_color;
+  vec3 camera_position;
+  float exposure;
+  Light lights[3];
+  float skysphere_rotation;
+  float skysphere_mip_count;
+  float skysphere_blur;
+  float skysphere_opacity;
+  uint frame_count;
+  bool has_tex_skysphere;
+  bool has_tex_skyenv;
+};
 
 void main()
 {
   vec4 o = vec4( in_pos.x, in_pos.y, in_pos.z, 1.0 );
   out_worldpos = o.xyz;
-  o = mat_view * o;
-  o = mat_projection * o;
+  o = mat_sky_view * o;
+  o = mat_sky_projection * o;
   gl_Position = o;
 }
\ No newline at end of file
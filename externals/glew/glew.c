@@ -9283,9 +9283,8 @@ GLboolean GLEWAPIENTRY glewGetExtension (const char* name)
 
 /* ------------------------------------------------------------------------- */
 
-#ifndef GLEW_MX
-static
-#endif
+/* Exported without GLEW_MX as well (as in GLEW 2.0), so contexts without
+   GLX or WGL, e.g. surfaceless EGL, can be initialized without glxewInit() */
 GLenum GLEWAPIENTRY glewContextInit (GLEW_CONTEXT_ARG_DEF_LIST)
 {
   const GLubyte* s;
@@ -0,0 +1,364 @@
+#include "BVH.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Median splits keep the tree balanced, so its depth is at most about
+// log2( item count ); traversal stacks never hold more than depth + 1 nodes
+const int MAX_STACK_SIZE = 64;
+
+BVH::BVH()
+{
+}
+
+void BVH::Build( int _itemCount, const glm::vec3 * _min, const glm::vec3 * _max )
+{
+  Clear();
+  if ( _itemCount <= 0 )
+  {
+    return;
+  }
+
+  std::vector<glm::vec3> centers( _itemCount );
+  mItems.resize( _itemCount );
+  for ( int i = 0; i < _itemCount; i++ )
+  {
+    mItems[ i ] = i;
+    centers[ i ] = ( _min[ i ] + _max[ i ] ) * 0.5f;
+  }
+
+  mNodes.reserve( _itemCount / LEAF_SIZE * 4 + 1 );
+  BuildNode( 0, _itemCount, _min, _max, centers );
+
+  Refit( _min, _max );
+}
+
+int BVH::BuildNode( int _first, int _count, const glm::vec3 * _min, const glm::vec3 * _max, std::vector<glm::vec3> & _centers )
+{
+  const int index = (int) mNodes.size();
+  Node node;
+  node.mMin = glm::vec3( 0.0f );
+  node.mMax = glm::vec3( 0.0f );
+  node.mFirstItem = _first;
+  node.mItemCount = _count;
+  node.mRightChild = -1;
+  mNodes.push_back( node );
+
+  if ( _count <= LEAF_SIZE )
+  {
+    return index;
+  }
+
+  glm::vec3 centerMin = _centers[ mItems[ _first ] ];
+  glm::vec3 centerMax = centerMin;
+  for ( int i = _first + 1; i < _first + _count; i++ )
+  {
+    centerMin = glm::min( centerMin, _centers[ mItems[ i ] ] );
+    centerMax = glm::max( centerMax, _centers[ mItems[ i ] ] );
+  }
+
+  const glm::vec3 extent = centerMax - centerMin;
+  int axis = 0;
+  if ( extent.y > extent[ axis ] )
+  {
+    axis = 1;
+  }
+  if ( extent.z > extent[ axis ] )
+  {
+    axis = 2;
+  }
+
+  const int half = _count / 2;
+  std::nth_element( mItems.begin() + _first, mItems.begin() + _first + half, mItems.begin() + _first + _count,
+    [ &_centers, axis ]( int _a, int _b ) { return _centers[ _a ][ axis ] < _centers[ _b ][ axis ]; } );
+
+  BuildNode( _first, half, _min, _max, _centers );
+  const int rightChild = BuildNode( _first + half, _count - half, _min, _max, _centers );
+  mNodes[ index ].mRightChild = rightChild;
+
+  return index;
+}
+
+void BVH::Refit( const glm::vec3 * _min, const glm::vec3 * _max )
+{
+  mItemBounds.Resize( (int) mItems.size() );
+  for ( int i = 0; i < mItems.size(); i++ )
+  {
+    mItemBounds.Set( i, _min[ mItems[ i ] ], _max[ mItems[ i ] ] );
+  }
+
+  // Children always follow their parent
+  for ( int i = (int) mNodes.size() - 1; i >= 0; i-- )
+  {
+    UpdateNodeBounds( i );
+  }
+}
+
+void BVH::Clear()
+{
+  mNodes.clear();
+  mItems.clear();
+  mItemBounds.Resize( 0 );
+}
+
+void BVH::UpdateNodeBounds( int _node )
+{
+  Node & node = mNodes[ _node ];
+  if ( node.mRightChild >= 0 )
+  {
+    const Node & left = mNodes[ _node + 1 ];
+    const Node & right = mNodes[ node.mRightChild ];
+    node.mMin = glm::min( left.mMin, right.mMin );
+    node.mMax = glm::max( left.mMax, right.mMax );
+    return;
+  }
+
+  const Frustum::BoxList & bounds = mItemBounds;
+  for ( int i = node.mFirstItem; i < node.mFirstItem + node.mItemCount; i++ )
+  {
+    const glm::vec3 itemMin( bounds.mMinX[ i ], bounds.mMinY[ i ], bounds.mMinZ[ i ] );
+    const glm::vec3 itemMax( bounds.mMaxX[ i ], bounds.mMaxY[ i ], bounds.mMaxZ[ i ] );
+    node.mMin = i == node.mFirstItem ? itemMin : glm::min( node.mMin, itemMin );
+    node.mMax = i == node.mFirstItem ? itemMax : glm::max( node.mMax, itemMax );
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Frustum query
+
+void BVH::MarkVisible( const Node & _node, unsigned char * _visible, int & _visibleCount ) const
+{
+  for ( int i = _node.mFirstItem; i < _node.mFirstItem + _node.mItemCount; i++ )
+  {
+    _visible[ mItems[ i ] ] = 1;
+  }
+  _visibleCount += _node.mItemCount;
+}
+
+int BVH::QueryFrustum( const Frustum::Planes & _planes, unsigned char * _visible ) const
+{
+  memset( _visible, 0, mItems.size() );
+  if ( mNodes.empty() )
+  {
+    return 0;
+  }
+
+  // A node that is entirely on the inner side of a plane has all its children
+  // there as well, so the plane is dropped from the mask on the way down
+  struct Entry
+  {
+    int mNode;
+    int mPlaneMask;
+  };
+  Entry stack[ MAX_STACK_SIZE ];
+  int stackSize = 0;
+  stack[ stackSize ].mNode = 0;
+  stack[ stackSize ].mPlaneMask = ( 1 << 6 ) - 1;
+  stackSize++;
+
+  int visibleCount = 0;
+  unsigned char leafVisible[ LEAF_SIZE ];
+  while ( stackSize )
+  {
+    const Entry entry = stack[ --stackSize ];
+    const Node & node = mNodes[ entry.mNode ];
+
+    int planeMask = entry.mPlaneMask;
+    bool outside = false;
+    for ( int p = 0; p < 6 && !outside; p++ )
+    {
+      if ( !( planeMask & ( 1 << p ) ) )
+      {
+        continue;
+      }
+
+      const glm::vec4 & plane = _planes.mPlanes[ p ];
+      const glm::vec3 farCorner( plane.x >= 0.0f ? node.mMax.x : node.mMin.x, plane.y >= 0.0f ? node.mMax.y : node.mMin.y, plane.z >= 0.0f ? node.mMax.z : node.mMin.z );
+      const glm::vec3 nearCorner( plane.x >= 0.0f ? node.mMin.x : node.mMax.x, plane.y >= 0.0f ? node.mMin.y : node.mMax.y, plane.z >= 0.0f ? node.mMin.z : node.mMax.z );
+      if ( plane.x * farCorner.x + plane.y * farCorner.y + plane.z * farCorner.z + plane.w < 0.0f )
+      {
+        outside = true;
+      }
+      else if ( plane.x * nearCorner.x + plane.y * nearCorner.y + plane.z * nearCorner.z + plane.w >= 0.0f )
+      {
+        planeMask &= ~( 1 << p );
+      }
+    }
+    if ( outside )
+    {
+      continue;
+    }
+
+    if ( !planeMask )
+    {
+      MarkVisible( node, _visible, visibleCount );
+    }
+    else if ( node.mRightChild < 0 )
+    {
+      visibleCount += Frustum::TestBoxes( _planes, mItemBounds, node.mFirstItem, node.mItemCount, leafVisible );
+      for ( int i = 0; i < node.mItemCount; i++ )
+      {
+        _visible[ mItems[ node.mFirstItem + i ] ] = leafVisible[ i ];
+      }
+    }
+    else
+    {
+      stack[ stackSize ].mNode = node.mRightChild;
+      stack[ stackSize ].mPlaneMask = planeMask;
+      stackSize++;
+      stack[ stackSize ].mNode = entry.mNode + 1;
+      stack[ stackSize ].mPlaneMask = planeMask;
+      stackSize++;
+    }
+  }
+
+  return visibleCount;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Ray queries
+
+// Slab test; _entry is where the ray enters the box, or 0 if it starts inside
+bool IntersectRayBox( const glm::vec3 & _origin, const glm::vec3 & _inverseDirection, const glm::vec3 & _min, const glm::vec3 & _max, float _maxDistance, float & _entry )
+{
+  const glm::vec3 t0 = ( _min - _origin ) * _inverseDirection;
+  const glm::vec3 t1 = ( _max - _origin ) * _inverseDirection;
+  const glm::vec3 tNear = glm::min( t0, t1 );
+  const glm::vec3 tFar = glm::max( t0, t1 );
+
+  const float entry = std::max( std::max( tNear.x, tNear.y ), std::max( tNear.z, 0.0f ) );
+  const float exit = std::min( std::min( tFar.x, tFar.y ), std::min( tFar.z, _maxDistance ) );
+  _entry = entry;
+  return entry <= exit;
+}
+
+void BVH::QueryRay( const glm::vec3 & _origin, const glm::vec3 & _direction, float _maxDistance, std::vector<int> & _items ) const
+{
+  _items.clear();
+  if ( mNodes.empty() )
+  {
+    return;
+  }
+
+  const glm::vec3 inverseDirection = glm::vec3( 1.0f ) / _direction;
+
+  int stack[ MAX_STACK_SIZE ];
+  int stackSize = 0;
+  stack[ stackSize++ ] = 0;
+  while ( stackSize )
+  {
+    const Node & node = mNodes[ stack[ --stackSize ] ];
+
+    float entry = 0.0f;
+    if ( !IntersectRayBox( _origin, inverseDirection, node.mMin, node.mMax, _maxDistance, entry ) )
+    {
+      continue;
+    }
+
+    if ( node.mRightChild >= 0 )
+    {
+      stack[ stackSize++ ] = node.mRightChild;
+      stack[ stackSize++ ] = (int) ( &node - mNodes.data() ) + 1;
+      continue;
+    }
+
+    const Frustum::BoxList & bounds = mItemBounds;
+    for ( int i = node.mFirstItem; i < node.mFirstItem + node.mItemCount; i++ )
+    {
+      const glm::vec3 itemMin( bounds.mMinX[ i ], bounds.mMinY[ i ], bounds.mMinZ[ i ] );
+      const glm::vec3 itemMax( bounds.mMaxX[ i ], bounds.mMaxY[ i ], bounds.mMaxZ[ i ] );
+      if ( IntersectRayBox( _origin, inverseDirection, itemMin, itemMax, _maxDistance, entry ) )
+      {
+        _items.push_back( mItems[ i ] );
+      }
+    }
+  }
+}
+
+int BVH::QueryNearestHit( const glm::vec3 & _origin, const glm::vec3 & _direction, float _maxDistance, float & _distance, const RayItemTest & _itemTest /*= RayItemTest()*/ ) const
+{
+  if ( mNodes.empty() )
+  {
+    return -1;
+  }
+
+  const glm::vec3 inverseDirection = glm::vec3( 1.0f ) / _direction;
+
+  struct Entry
+  {
+    int mNode;
+    float mEntry;
+  };
+  Entry stack[ MAX_STACK_SIZE ];
+  int stackSize = 0;
+
+  float entry = 0.0f;
+  if ( !IntersectRayBox( _origin, inverseDirection, mNodes[ 0 ].mMin, mNodes[ 0 ].mMax, _maxDistance, entry ) )
+  {
+    return -1;
+  }
+  stack[ stackSize ].mNode = 0;
+  stack[ stackSize ].mEntry = entry;
+  stackSize++;
+
+  int nearestItem = -1;
+  float nearestDistance = _maxDistance;
+  while ( stackSize )
+  {
+    const Entry current = stack[ --stackSize ];
+    if ( current.mEntry > nearestDistance )
+    {
+      continue;
+    }
+
+    const Node & node = mNodes[ current.mNode ];
+    if ( node.mRightChild >= 0 )
+    {
+      // Push the farther child first so the nearer one is visited first
+      Entry children[ 2 ];
+      int childCount = 0;
+      const int childIndices[ 2 ] = { current.mNode + 1, node.mRightChild };
+      for ( int i = 0; i < 2; i++ )
+      {
+        const Node & child = mNodes[ childIndices[ i ] ];
+        if ( IntersectRayBox( _origin, inverseDirection, child.mMin, child.mMax, nearestDistance, entry ) )
+        {
+          children[ childCount ].mNode = childIndices[ i ];
+          children[ childCount ].mEntry = entry;
+          childCount++;
+        }
+      }
+      if ( childCount == 2 && children[ 0 ].mEntry < children[ 1 ].mEntry )
+      {
+        std::swap( children[ 0 ], children[ 1 ] );
+      }
+      for ( int i = 0; i < childCount; i++ )
+      {
+        stack[ stackSize++ ] = children[ i ];
+      }
+      continue;
+    }
+
+    const Frustum::BoxList & bounds = mItemBounds;
+    for ( int i = node.mFirstItem; i < node.mFirstItem + node.mItemCount; i++ )
+    {
+      const glm::vec3 itemMin( bounds.mMinX[ i ], bounds.mMinY[ i ], bounds.mMinZ[ i ] );
+      const glm::vec3 itemMax( bounds.mMaxX[ i ], bounds.mMaxY[ i ], bounds.mMaxZ[ i ] );
+      if ( !IntersectRayBox( _origin, inverseDirection, itemMin, itemMax, nearestDistance, entry ) )
+      {
+        continue;
+      }
+
+      float distance = entry;
+      if ( _itemTest && ( !_itemTest( mItems[ i ], distance ) || distance > nearestDistance ) )
+      {
+        continue;
+      }
+      nearestItem = mItems[ i ];
+      nearestDistance = distance;
+    }
+  }
+
+  _distance = nearestDistance;
+  return nearestItem;
+}
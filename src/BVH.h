@@ -0,0 +1,55 @@
+#include <functional>
+
+#include "Frustum.h"
+
+// Bounding volume hierarchy over a set of boxes ("items"), e.g. the meshes of
+// every node of a model. It's a binary tree split at the median along the
+// longest axis, stored depth first so parents always precede their children
+// and every node covers a contiguous range of the reordered items. Item
+// bounds can change without touching the topology through Refit().
+class BVH
+{
+public:
+  struct Node
+  {
+    glm::vec3 mMin;
+    glm::vec3 mMax;
+    int mFirstItem; // into mItems
+    int mItemCount;
+    int mRightChild; // the left child directly follows its parent; -1 for leaves
+  };
+
+  // Called for the items whose box a ray reaches; _distance comes in as where
+  // the ray enters the box and can be refined. Returns whether the item is hit.
+  typedef std::function<bool( int _item, float & _distance )> RayItemTest;
+
+  static const int LEAF_SIZE = Frustum::BATCH_SIZE;
+
+  BVH();
+
+  void Build( int _itemCount, const glm::vec3 * _min, const glm::vec3 * _max );
+  void Refit( const glm::vec3 * _min, const glm::vec3 * _max ); // same items as in Build, new bounds
+  void Clear();
+
+  bool IsEmpty() const { return mNodes.empty(); }
+  int GetItemCount() const { return (int) mItems.size(); }
+
+  // _visible is indexed by item and gets 1 for every item at least partially inside; returns the visible count
+  int QueryFrustum( const Frustum::Planes & _planes, unsigned char * _visible ) const;
+
+  // Every item whose box the ray crosses within _maxDistance, in no particular order
+  void QueryRay( const glm::vec3 & _origin, const glm::vec3 & _direction, float _maxDistance, std::vector<int> & _items ) const;
+
+  // Nearest item hit by the ray, visiting nodes front to back; without an item
+  // test the item boxes themselves are hit. Returns -1 if nothing is hit.
+  int QueryNearestHit( const glm::vec3 & _origin, const glm::vec3 & _direction, float _maxDistance, float & _distance, const RayItemTest & _itemTest = RayItemTest() ) const;
+
+  std::vector<Node> mNodes;
+  std::vector<int> mItems; // item indices in tree order
+  Frustum::BoxList mItemBounds; // in tree order, so leaves are tested as a batch
+
+private:
+  int BuildNode( int _first, int _count, const glm::vec3 * _min, const glm::vec3 * _max, std::vector<glm::vec3> & _centers );
+  void UpdateNodeBounds( int _node );
+  void MarkVisible( const Node & _node, unsigned char * _visible, int & _visibleCount ) const;
+};
@@ -0,0 +1,138 @@
+#include "Frustum.h"
+
+#include <cfloat>
+#include <algorithm>
+
+#if defined( __AVX__ )
+#include <immintrin.h>
+#elif defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define FRUSTUM_SSE
+#endif
+
+namespace Frustum
+{
+
+void BoxList::Resize( int _count )
+{
+  mCount = _count;
+
+  // Padding boxes are inverted (min > max); their results are never written
+  const size_t paddedCount = (size_t) _count + BATCH_SIZE - 1;
+  mMinX.assign( paddedCount, FLT_MAX );
+  mMinY.assign( paddedCount, FLT_MAX );
+  mMinZ.assign( paddedCount, FLT_MAX );
+  mMaxX.assign( paddedCount, -FLT_MAX );
+  mMaxY.assign( paddedCount, -FLT_MAX );
+  mMaxZ.assign( paddedCount, -FLT_MAX );
+}
+
+void BoxList::Set( int _index, const glm::vec3 & _min, const glm::vec3 & _max )
+{
+  mMinX[ _index ] = _min.x;
+  mMinY[ _index ] = _min.y;
+  mMinZ[ _index ] = _min.z;
+  mMaxX[ _index ] = _max.x;
+  mMaxY[ _index ] = _max.y;
+  mMaxZ[ _index ] = _max.z;
+}
+
+void ExtractPlanes( const glm::mat4x4 & _viewProjection, Planes & _planes )
+{
+  // Gribb / Hartmann: clip space is -w <= x, y, z <= w; glm is column major
+  const glm::vec4 row0( _viewProjection[ 0 ][ 0 ], _viewProjection[ 1 ][ 0 ], _viewProjection[ 2 ][ 0 ], _viewProjection[ 3 ][ 0 ] );
+  const glm::vec4 row1( _viewProjection[ 0 ][ 1 ], _viewProjection[ 1 ][ 1 ], _viewProjection[ 2 ][ 1 ], _viewProjection[ 3 ][ 1 ] );
+  const glm::vec4 row2( _viewProjection[ 0 ][ 2 ], _viewProjection[ 1 ][ 2 ], _viewProjection[ 2 ][ 2 ], _viewProjection[ 3 ][ 2 ] );
+  const glm::vec4 row3( _viewProjection[ 0 ][ 3 ], _viewProjection[ 1 ][ 3 ], _viewProjection[ 2 ][ 3 ], _viewProjection[ 3 ][ 3 ] );
+
+  _planes.mPlanes[ 0 ] = row3 + row0; // left
+  _planes.mPlanes[ 1 ] = row3 - row0; // right
+  _planes.mPlanes[ 2 ] = row3 + row1; // bottom
+  _planes.mPlanes[ 3 ] = row3 - row1; // top
+  _planes.mPlanes[ 4 ] = row3 + row2; // near
+  _planes.mPlanes[ 5 ] = row3 - row2; // far
+}
+
+int TestBoxes( const Planes & _planes, const BoxList & _boxes, unsigned char * _visible )
+{
+  return TestBoxes( _planes, _boxes, 0, _boxes.mCount, _visible );
+}
+
+int TestBoxes( const Planes & _planes, const BoxList & _boxes, int _first, int _count, unsigned char * _visible )
+{
+  // The sign of the plane normal decides which corner is furthest along it,
+  // and that's the same for every box, so the arrays are picked per plane
+  const float * cornerX[ 6 ];
+  const float * cornerY[ 6 ];
+  const float * cornerZ[ 6 ];
+  for ( int p = 0; p < 6; p++ )
+  {
+    const glm::vec4 & plane = _planes.mPlanes[ p ];
+    cornerX[ p ] = ( plane.x >= 0.0f ? _boxes.mMaxX.data() : _boxes.mMinX.data() ) + _first;
+    cornerY[ p ] = ( plane.y >= 0.0f ? _boxes.mMaxY.data() : _boxes.mMinY.data() ) + _first;
+    cornerZ[ p ] = ( plane.z >= 0.0f ? _boxes.mMaxZ.data() : _boxes.mMinZ.data() ) + _first;
+  }
+
+  int visibleCount = 0;
+  int i = 0;
+
+#if defined( __AVX__ )
+  for ( ; i < _count; i += 8 )
+  {
+    __m256 outside = _mm256_setzero_ps();
+    for ( int p = 0; p < 6; p++ )
+    {
+      const glm::vec4 & plane = _planes.mPlanes[ p ];
+      __m256 distance = _mm256_set1_ps( plane.w );
+      distance = _mm256_add_ps( distance, _mm256_mul_ps( _mm256_set1_ps( plane.x ), _mm256_loadu_ps( cornerX[ p ] + i ) ) );
+      distance = _mm256_add_ps( distance, _mm256_mul_ps( _mm256_set1_ps( plane.y ), _mm256_loadu_ps( cornerY[ p ] + i ) ) );
+      distance = _mm256_add_ps( distance, _mm256_mul_ps( _mm256_set1_ps( plane.z ), _mm256_loadu_ps( cornerZ[ p ] + i ) ) );
+      outside = _mm256_or_ps( outside, _mm256_cmp_ps( distance, _mm256_setzero_ps(), _CMP_LT_OQ ) );
+    }
+    const int mask = _mm256_movemask_ps( outside );
+    const int count = std::min( 8, _count - i );
+    for ( int j = 0; j < count; j++ )
+    {
+      _visible[ i + j ] = ( mask >> j ) & 1 ? 0 : 1;
+      visibleCount += _visible[ i + j ];
+    }
+  }
+#elif defined( FRUSTUM_SSE )
+  for ( ; i < _count; i += 4 )
+  {
+    __m128 outside = _mm_setzero_ps();
+    for ( int p = 0; p < 6; p++ )
+    {
+      const glm::vec4 & plane = _planes.mPlanes[ p ];
+      __m128 distance = _mm_set1_ps( plane.w );
+      distance = _mm_add_ps( distance, _mm_mul_ps( _mm_set1_ps( plane.x ), _mm_loadu_ps( cornerX[ p ] + i ) ) );
+      distance = _mm_add_ps( distance, _mm_mul_ps( _mm_set1_ps( plane.y ), _mm_loadu_ps( cornerY[ p ] + i ) ) );
+      distance = _mm_add_ps( distance, _mm_mul_ps( _mm_set1_ps( plane.z ), _mm_loadu_ps( cornerZ[ p ] + i ) ) );
+      outside = _mm_or_ps( outside, _mm_cmplt_ps( distance, _mm_setzero_ps() ) );
+    }
+    const int mask = _mm_movemask_ps( outside );
+    const int count = std::min( 4, _count - i );
+    for ( int j = 0; j < count; j++ )
+    {
+      _visible[ i + j ] = ( mask >> j ) & 1 ? 0 : 1;
+      visibleCount += _visible[ i + j ];
+    }
+  }
+#endif
+
+  for ( ; i < _count; i++ )
+  {
+    bool outside = false;
+    for ( int p = 0; p < 6 && !outside; p++ )
+    {
+      const glm::vec4 & plane = _planes.mPlanes[ p ];
+      outside = plane.x * cornerX[ p ][ i ] + plane.y * cornerY[ p ][ i ] + plane.z * cornerZ[ p ][ i ] + plane.w < 0.0f;
+    }
+    _visible[ i ] = outside ? 0 : 1;
+    visibleCount += _visible[ i ];
+  }
+
+  return visibleCount;
+}
+
+} // namespace
@@ -0,0 +1,40 @@
+#include <vector>
+#include <glm.hpp>
+
+// View frustum tests against batches of axis aligned boxes. Boxes are kept as
+// structure-of-arrays so they can be tested eight (AVX) or four (SSE) at a
+// time; other targets fall back to one box at a time.
+namespace Frustum
+{
+struct Planes
+{
+  glm::vec4 mPlanes[ 6 ]; // ax + by + cz + d >= 0 inside; not normalized
+};
+
+// Padded with BATCH_SIZE - 1 boxes so a batch starting at any box can load full width
+struct BoxList
+{
+  BoxList() : mCount( 0 ) {}
+
+  void Resize( int _count );
+  void Set( int _index, const glm::vec3 & _min, const glm::vec3 & _max );
+
+  int mCount;
+  std::vector<float> mMinX;
+  std::vector<float> mMinY;
+  std::vector<float> mMinZ;
+  std::vector<float> mMaxX;
+  std::vector<float> mMaxY;
+  std::vector<float> mMaxZ;
+};
+
+const int BATCH_SIZE = 8;
+
+// Planes in the space the matrix transforms from, e.g. world space for a view-projection matrix
+void ExtractPlanes( const glm::mat4x4 & _viewProjection, Planes & _planes );
+
+// Writes 1 for every box that is at least partially inside, 0 otherwise, and returns the visible count
+int TestBoxes( const Planes & _planes, const BoxList & _boxes, unsigned char * _visible );
+// Same for _count boxes starting at _first; _visible[ 0 ] is the result of box _first
+int TestBoxes( const Planes & _planes, const BoxList & _boxes, int _first, int _count, unsigned char * _visible );
+} // namespace
@@ -1,4 +1,9 @@
 #include "Geometry.h"
+#include "MeshCache.h"
+#include "ThreadPool.h"
+#include "Profiler.h"
+#include "Simplifier.h"
+#include "MeshOptimizer.h"
 
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
@@ -10,8 +15,14 @@
 #include <assimp/DefaultLogger.hpp>
 #include <assimp/Exporter.hpp>
 #include <iostream>
+#include <chrono>
+#include <unordered_map>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
 #include <glm.hpp>
 #include <common.hpp>
+#include <gtc/packing.hpp>
 
 #ifdef min
 #undef min
@@ -20,8 +31,6 @@
 #undef max
 #endif
 
-Assimp::Importer gImporter;
-
 #pragma pack(1)
 struct Vertex
 {
@@ -31,66 +40,185 @@ struct Vertex
   glm::vec3 v3Binormal;
   glm::vec2 fTexcoord;
 };
+
+// Positions are quantized relative to the mesh AABB, normal and tangent are
+// octahedral encoded, with the bitangent sign in the lowest bit of the
+// tangent's second component, and UVs are half floats.
+struct CompactVertex
+{
+  uint16_t nPosition[ 3 ];
+  uint16_t nPadding; // keeps the following attributes 4-byte aligned
+  int16_t nNormal[ 2 ];
+  int16_t nTangent[ 2 ];
+  uint16_t nTexcoord[ 2 ];
+};
 #pragma pack()
 
+// std140 layout of the MaterialConstants uniform block in the shaders
+struct ColorMapConstants
+{
+  glm::vec4 mColor;
+  int32_t mHasTex;
+  int32_t mPadding[ 3 ];
+};
+struct MaterialConstants
+{
+  ColorMapConstants mMapAlbedo;
+  ColorMapConstants mMapDiffuse;
+  ColorMapConstants mMapSpecular;
+  ColorMapConstants mMapNormals;
+  ColorMapConstants mMapRoughness;
+  ColorMapConstants mMapMetallic;
+  ColorMapConstants mMapAO;
+  ColorMapConstants mMapAmbient;
+  ColorMapConstants mMapEmissive;
+  float mSpecularShininess;
+  float mPadding[ 3 ];
+};
+
+void FillColorMapConstants( ColorMapConstants & _constants, const Geometry::ColorMap & _colorMap )
+{
+  _constants.mColor = _colorMap.mColor;
+  _constants.mHasTex = _colorMap.mTexture != NULL;
+  _constants.mPadding[ 0 ] = _constants.mPadding[ 1 ] = _constants.mPadding[ 2 ] = 0;
+}
+
+void FillMaterialConstants( MaterialConstants & _constants, const Geometry::Material & _material )
+{
+  FillColorMapConstants( _constants.mMapAlbedo, _material.mColorMapAlbedo );
+  FillColorMapConstants( _constants.mMapDiffuse, _material.mColorMapDiffuse );
+  FillColorMapConstants( _constants.mMapSpecular, _material.mColorMapSpecular );
+  FillColorMapConstants( _constants.mMapNormals, _material.mColorMapNormals );
+  FillColorMapConstants( _constants.mMapRoughness, _material.mColorMapRoughness );
+  FillColorMapConstants( _constants.mMapMetallic, _material.mColorMapMetallic );
+  FillColorMapConstants( _constants.mMapAO, _material.mColorMapAO );
+  FillColorMapConstants( _constants.mMapAmbient, _material.mColorMapAmbient );
+  FillColorMapConstants( _constants.mMapEmissive, _material.mColorMapEmissive );
+  _constants.mSpecularShininess = _material.mSpecularShininess;
+  _constants.mPadding[ 0 ] = _constants.mPadding[ 1 ] = _constants.mPadding[ 2 ] = 0.0f;
+}
+
+unsigned int GetVertexSize( Geometry::VERTEXFORMAT _format )
+{
+  return _format == Geometry::VERTEXFORMAT_COMPACT ? sizeof( CompactVertex ) : sizeof( Vertex );
+}
+
 // Transform an AABB into an OBB, and return its AABB
 void TransformBoundingBox( const glm::vec3 & inMin, const glm::vec3 & inMax, const glm::mat4x4 & m, glm::vec3 & outMin, glm::vec3 & outMax )
 {
-  static glm::vec3 xa; xa = glm::vec3( m[ 1 - 1 ][ 1 - 1 ], m[ 1 - 1 ][ 2 - 1 ], m[ 1 - 1 ][ 3 - 1 ] ) * inMin.x;
-  static glm::vec3 xb; xb = glm::vec3( m[ 1 - 1 ][ 1 - 1 ], m[ 1 - 1 ][ 2 - 1 ], m[ 1 - 1 ][ 3 - 1 ] ) * inMax.x;
+  const glm::vec3 xa = glm::vec3( m[ 1 - 1 ][ 1 - 1 ], m[ 1 - 1 ][ 2 - 1 ], m[ 1 - 1 ][ 3 - 1 ] ) * inMin.x;
+  const glm::vec3 xb = glm::vec3( m[ 1 - 1 ][ 1 - 1 ], m[ 1 - 1 ][ 2 - 1 ], m[ 1 - 1 ][ 3 - 1 ] ) * inMax.x;
 
-  static glm::vec3 ya; ya = glm::vec3( m[ 2 - 1 ][ 1 - 1 ], m[ 2 - 1 ][ 2 - 1 ], m[ 2 - 1 ][ 3 - 1 ] ) * inMin.y;
-  static glm::vec3 yb; yb = glm::vec3( m[ 2 - 1 ][ 1 - 1 ], m[ 2 - 1 ][ 2 - 1 ], m[ 2 - 1 ][ 3 - 1 ] ) * inMax.y;
+  const glm::vec3 ya = glm::vec3( m[ 2 - 1 ][ 1 - 1 ], m[ 2 - 1 ][ 2 - 1 ], m[ 2 - 1 ][ 3 - 1 ] ) * inMin.y;
+  const glm::vec3 yb = glm::vec3( m[ 2 - 1 ][ 1 - 1 ], m[ 2 - 1 ][ 2 - 1 ], m[ 2 - 1 ][ 3 - 1 ] ) * inMax.y;
 
-  static glm::vec3 za; za = glm::vec3( m[ 3 - 1 ][ 1 - 1 ], m[ 3 - 1 ][ 2 - 1 ], m[ 3 - 1 ][ 3 - 1 ] ) * inMin.z;
-  static glm::vec3 zb; zb = glm::vec3( m[ 3 - 1 ][ 1 - 1 ], m[ 3 - 1 ][ 2 - 1 ], m[ 3 - 1 ][ 3 - 1 ] ) * inMax.z;
+  const glm::vec3 za = glm::vec3( m[ 3 - 1 ][ 1 - 1 ], m[ 3 - 1 ][ 2 - 1 ], m[ 3 - 1 ][ 3 - 1 ] ) * inMin.z;
+  const glm::vec3 zb = glm::vec3( m[ 3 - 1 ][ 1 - 1 ], m[ 3 - 1 ][ 2 - 1 ], m[ 3 - 1 ][ 3 - 1 ] ) * inMax.z;
 
   outMin = glm::min( xa, xb ) + glm::min( ya, yb ) + glm::min( za, zb ) + glm::vec3( m[ 4 - 1 ][ 1 - 1 ], m[ 4 - 1 ][ 2 - 1 ], m[ 4 - 1 ][ 3 - 1 ] );
   outMax = glm::max( xa, xb ) + glm::max( ya, yb ) + glm::max( za, zb ) + glm::vec3( m[ 4 - 1 ][ 1 - 1 ], m[ 4 - 1 ][ 2 - 1 ], m[ 4 - 1 ][ 3 - 1 ] );
 }
 
-Renderer::Texture * LoadTexture( Geometry * _geometry, const char * _type, const aiString & _path, const std::string & _folder, const bool _loadAsSRGB = false )
+//////////////////////////////////////////////////////////////////////////
+// Texture loading
+//
+// Every texture a model references is gathered first, then the unique ones
+// are decoded in parallel, and finally they're handed out to the color maps.
+
+struct TextureRequest
 {
-  std::string filename( _path.data, _path.length );
+  std::string mFilename;
+  std::string mFolder;
+  const char * mType;
+  bool mSRGB;
+  const unsigned char * mData; // compressed image in memory, for embedded textures
+  unsigned int mDataSize;
+  int mEmbeddedIndex;
+  Renderer::Texture * mTexture;
+  bool mCacheHit; // the texture was already loaded, e.g. by a previous model
+  std::vector<Geometry::ColorMap *> mColorMaps;
+};
 
-  if ( filename[ 0 ] == '*' )
-  {
-    int index = 0;
-    sscanf( filename.c_str(), "*%d", &index );
+class TextureBatch
+{
+public:
+  void AddEmbedded( int _index, const unsigned char * _data, unsigned int _size, const std::string & _filename );
+  void AddEmbeddedReference( Geometry::ColorMap * _colorMap, int _index );
+  void AddFile( Geometry::ColorMap * _colorMap, const char * _type, const std::string & _filename, const std::string & _folder, bool _loadAsSRGB );
 
-    printf( "[geometry] Using embedded texture %d: '%s'\n", index, filename.c_str() );
+  void Load( Geometry::Staging & _staging, float _progressStart, float _progressEnd );
 
-    if ( _geometry->mEmbeddedTextures[ index ] )
-    {
-      _geometry->mEmbeddedTextures[ index ]->mRefCount++;
-      return _geometry->mEmbeddedTextures[ index ];
-    }
-    return NULL;
-  }
+private:
+  std::vector<TextureRequest> mRequests;
+  std::map<std::string, int> mFileRequests;
+  std::vector<std::pair<Geometry::ColorMap *, int>> mEmbeddedReferences;
+};
 
-  if ( filename.find( '\\' ) != -1 )
+void TextureBatch::AddEmbedded( int _index, const unsigned char * _data, unsigned int _size, const std::string & _filename )
+{
+  TextureRequest request;
+  request.mFilename = _filename;
+  request.mType = "embedded";
+  request.mSRGB = true; // TODO: currently forced to sRGB (problematic)
+  request.mData = _data;
+  request.mDataSize = _size;
+  request.mEmbeddedIndex = _index;
+  request.mTexture = NULL;
+  request.mCacheHit = false;
+  mRequests.push_back( request );
+}
+
+void TextureBatch::AddEmbeddedReference( Geometry::ColorMap * _colorMap, int _index )
+{
+  mEmbeddedReferences.push_back( { _colorMap, _index } );
+}
+
+void TextureBatch::AddFile( Geometry::ColorMap * _colorMap, const char * _type, const std::string & _filename, const std::string & _folder, bool _loadAsSRGB )
+{
+  const std::string key = _folder + _filename + ( _loadAsSRGB ? "|srgb" : "|linear" );
+  std::map<std::string, int>::iterator it = mFileRequests.find( key );
+  if ( it != mFileRequests.end() )
   {
-    filename = filename.substr( filename.find_last_of( '\\' ) + 1 );
+    mRequests[ it->second ].mColorMaps.push_back( _colorMap );
+    return;
   }
-  if ( filename.find( '/' ) != -1 )
+
+  TextureRequest request;
+  request.mFilename = _filename;
+  request.mFolder = _folder;
+  request.mType = _type;
+  request.mSRGB = _loadAsSRGB;
+  request.mData = NULL;
+  request.mDataSize = 0;
+  request.mEmbeddedIndex = -1;
+  request.mTexture = NULL;
+  request.mCacheHit = false;
+  request.mColorMaps.push_back( _colorMap );
+  mFileRequests.insert( { key, (int) mRequests.size() } );
+  mRequests.push_back( request );
+}
+
+// Runs on the thread pool; mustn't touch anything but the request itself
+void DecodeTexture( TextureRequest & _request )
+{
+  if ( _request.mData )
   {
-    filename = filename.substr( filename.find_last_of( '/' ) + 1 );
+    _request.mTexture = Renderer::StageRGBA8TextureFromMemory( _request.mData, _request.mDataSize, _request.mSRGB );
+    return;
   }
 
-  printf( "[geometry] Loading %s texture: '%s'\n", _type, filename.c_str() );
-
-  Renderer::Texture * texture = Renderer::CreateRGBA8TextureFromFile( filename.c_str(), _loadAsSRGB );
-  if ( texture )
+  _request.mTexture = Renderer::StageRGBA8TextureFromFile( _request.mFilename.c_str(), _request.mSRGB, &_request.mCacheHit );
+  if ( _request.mTexture || _request.mFolder.empty() )
   {
-    return texture;
+    return;
   }
 
-  std::string filenameWithPath = _folder + filename;
+  std::string filenameWithPath = _request.mFolder + _request.mFilename;
 
-  texture = Renderer::CreateRGBA8TextureFromFile( filenameWithPath.c_str(), _loadAsSRGB );
-  if ( texture )
+  _request.mTexture = Renderer::StageRGBA8TextureFromFile( filenameWithPath.c_str(), _request.mSRGB, &_request.mCacheHit );
+  if ( _request.mTexture )
   {
-    return texture;
+    return;
   }
 
   std::string extless = filenameWithPath.substr( 0, filenameWithPath.find_last_of( '.' ) );
@@ -99,30 +227,157 @@ Renderer::Texture * LoadTexture( Geometry * _geometry, const char * _type, const
   for ( int i = 0; extensions[ i ]; i++ )
   {
     std::string replacementFilename = extless + extensions[ i ];
-    texture = Renderer::CreateRGBA8TextureFromFile( replacementFilename.c_str(), _loadAsSRGB );
-    if ( texture )
+    _request.mTexture = Renderer::StageRGBA8TextureFromFile( replacementFilename.c_str(), _request.mSRGB, &_request.mCacheHit );
+    if ( _request.mTexture )
+    {
+      printf( "[geometry] Replacement %s texture found: '%s'\n", _request.mType, replacementFilename.c_str() );
+      return;
+    }
+  }
+}
+
+void TextureBatch::Load( Geometry::Staging & _staging, float _progressStart, float _progressEnd )
+{
+  std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+  ThreadPool & threadPool = ThreadPool::Get();
+  std::atomic<int> decodedCount( 0 );
+  const int requestCount = (int) mRequests.size();
+  threadPool.ParallelFor( requestCount, [ & ]( int _index )
+  {
+    DecodeTexture( mRequests[ _index ] );
+    _staging.mProgress = _progressStart + ( _progressEnd - _progressStart ) * ++decodedCount / requestCount;
+  } );
+
+  _staging.mTextureDecodeTime = std::chrono::duration<float, std::milli>( std::chrono::high_resolution_clock::now() - start ).count();
+  _staging.mTextureDecodeThreads = threadPool.GetThreadCount();
+
+  // Embedded textures first, file references may fall back to them
+  std::unordered_map<std::string, int> embeddedTextureIndices;
+  for ( int i = 0; i < mRequests.size(); i++ )
+  {
+    TextureRequest & request = mRequests[ i ];
+    if ( request.mEmbeddedIndex < 0 )
+    {
+      continue;
+    }
+    if ( request.mTexture )
+    {
+      request.mTexture->mFilename = request.mFilename;
+      _staging.mTextureDecodeCount++;
+    }
+    else
+    {
+      printf( "[geometry] WARNING: Embedded texture loading failed: '%s'\n", request.mFilename.c_str() );
+    }
+    _staging.mEmbeddedTextures[ request.mEmbeddedIndex ] = request.mTexture;
+  }
+  for ( int i = 0; i < _staging.mEmbeddedTextures.size(); i++ )
+  {
+    if ( _staging.mEmbeddedTextures[ i ] )
+    {
+      embeddedTextureIndices.insert( { _staging.mEmbeddedTextures[ i ]->mFilename, i } );
+    }
+  }
+
+  for ( int i = 0; i < mEmbeddedReferences.size(); i++ )
+  {
+    Geometry::ColorMap * colorMap = mEmbeddedReferences[ i ].first;
+    const int index = mEmbeddedReferences[ i ].second;
+    colorMap->mTexture = NULL;
+    if ( index >= 0 && index < _staging.mEmbeddedTextures.size() && _staging.mEmbeddedTextures[ index ] )
     {
-      printf( "[geometry] Replacement %s texture found: '%s'\n", _type, replacementFilename.c_str() );
-      return texture;
+      colorMap->mTexture = _staging.mEmbeddedTextures[ index ];
+      Renderer::AddTextureRef( colorMap->mTexture );
     }
   }
 
-  for ( int i = 0; i < _geometry->mEmbeddedTextures.size(); i++ )
+  for ( int i = 0; i < mRequests.size(); i++ )
   {
-    if ( _geometry->mEmbeddedTextures[ i ] && filename == _geometry->mEmbeddedTextures[ i ]->mFilename )
+    TextureRequest & request = mRequests[ i ];
+    if ( request.mEmbeddedIndex >= 0 )
+    {
+      continue;
+    }
+
+    Renderer::Texture * texture = request.mTexture;
+    if ( texture && request.mCacheHit )
+    {
+      _staging.mTextureCacheHits++;
+      _staging.mTextureCacheBytesSaved += Renderer::GetTextureSize( texture );
+    }
+    else if ( texture )
+    {
+      _staging.mTextureDecodeCount++;
+    }
+    else
+    {
+      std::unordered_map<std::string, int>::const_iterator it = embeddedTextureIndices.find( request.mFilename );
+      if ( it != embeddedTextureIndices.end() )
+      {
+        printf( "[geometry] Using embedded texture: '%s'\n", request.mFilename.c_str() );
+
+        texture = _staging.mEmbeddedTextures[ it->second ];
+        Renderer::AddTextureRef( texture );
+      }
+    }
+
+    if ( !texture )
     {
-      printf( "[geometry] Using embedded texture: '%s'\n", filename.c_str() );
+      printf( "[geometry] WARNING: Texture loading (%s) failed: '%s'\n", request.mType, request.mFilename.c_str() );
+    }
 
-      _geometry->mEmbeddedTextures[ i ]->mRefCount++;
-      return _geometry->mEmbeddedTextures[ i ];
+    // The decode (or the embedded lookup above) holds the first reference;
+    // every other color map using the same file shares it
+    for ( int j = 0; j < request.mColorMaps.size(); j++ )
+    {
+      request.mColorMaps[ j ]->mTexture = texture;
+      if ( texture && j > 0 )
+      {
+        Renderer::AddTextureRef( texture );
+        _staging.mTextureCacheHits++;
+        _staging.mTextureCacheBytesSaved += Renderer::GetTextureSize( texture );
+      }
     }
   }
 
-  printf( "[geometry] WARNING: Texture loading (%s) failed: '%s'\n", _type, filename.c_str() );
-  return NULL;
+  printf( "[geometry] Decoded %d textures in %.2f ms using %d threads, %d cache hits\n", _staging.mTextureDecodeCount, _staging.mTextureDecodeTime, _staging.mTextureDecodeThreads, _staging.mTextureCacheHits );
+
+  mRequests.clear();
+  mFileRequests.clear();
+  mEmbeddedReferences.clear();
+}
+
+void LoadTexture( TextureBatch & _textures, Geometry::ColorMap & _colorMap, const char * _type, const aiString & _path, const std::string & _folder, const bool _loadAsSRGB = false )
+{
+  std::string filename( _path.data, _path.length );
+
+  if ( filename[ 0 ] == '*' )
+  {
+    int index = 0;
+    sscanf( filename.c_str(), "*%d", &index );
+
+    printf( "[geometry] Using embedded texture %d: '%s'\n", index, filename.c_str() );
+
+    _textures.AddEmbeddedReference( &_colorMap, index );
+    return;
+  }
+
+  if ( filename.find( '\\' ) != -1 )
+  {
+    filename = filename.substr( filename.find_last_of( '\\' ) + 1 );
+  }
+  if ( filename.find( '/' ) != -1 )
+  {
+    filename = filename.substr( filename.find_last_of( '/' ) + 1 );
+  }
+
+  printf( "[geometry] Loading %s texture: '%s'\n", _type, filename.c_str() );
+
+  _textures.AddFile( &_colorMap, _type, filename, _folder, _loadAsSRGB );
 }
 
-bool LoadColorMap( Geometry * _geometry, aiMaterial * _material, Geometry::ColorMap & _colorMap, aiTextureType _semantic, const char * _semanticText, const std::string & _folder, bool _loadAsSRGB = false )
+bool LoadColorMap( TextureBatch & _textures, aiMaterial * _material, Geometry::ColorMap & _colorMap, aiTextureType _semantic, const char * _semanticText, const std::string & _folder, bool _loadAsSRGB = false )
 {
   bool success = false;
   _colorMap.mTexture = NULL;
@@ -130,7 +385,7 @@ bool LoadColorMap( Geometry * _geometry, aiMaterial * _material, Geometry::Color
   aiString str;
   if ( aiGetMaterialString( _material, AI_MATKEY_TEXTURE( _semantic, 0 ), &str ) == AI_SUCCESS )
   {
-    _colorMap.mTexture = LoadTexture( _geometry, _semanticText, str, _folder, _loadAsSRGB );
+    LoadTexture( _textures, _colorMap, _semanticText, str, _folder, _loadAsSRGB );
     _colorMap.mValid = true;
     success = true;
   }
@@ -166,27 +421,19 @@ bool LoadColorMap( Geometry * _geometry, aiMaterial * _material, Geometry::Color
   return success;
 }
 
-int gNodeCount = 0;
-void ParseNode( Geometry * _geometry, const aiScene * scene, aiNode * sceneNode, int nParentIndex )
+void ParseNode( Geometry::Staging * _staging, const aiScene * scene, aiNode * sceneNode, int nParentIndex )
 {
   Geometry::Node node;
-  node.mID = gNodeCount++;
-  node.mParentID = nParentIndex;
   node.mName = std::string( sceneNode->mName.data, sceneNode->mName.length );
 
-  for ( unsigned int i = 0; i < sceneNode->mNumMeshes; i++ )
-  {
-    node.mMeshes.push_back( sceneNode->mMeshes[ i ] );
-  }
-
   aiMatrix4x4 m = sceneNode->mTransformation.Transpose();
   memcpy( &node.mTransformation, &m.a1, sizeof( float ) * 16 );
 
-  _geometry->mNodes.insert( { node.mID, node } );
+  _staging->AddNode( node, nParentIndex, sceneNode->mMeshes, sceneNode->mNumMeshes );
 
   for ( unsigned int i = 0; i < sceneNode->mNumChildren; i++ )
   {
-    ParseNode( _geometry, scene, sceneNode->mChildren[ i ], node.mID );
+    ParseNode( _staging, scene, sceneNode->mChildren[ i ], node.mID );
   }
 }
 
@@ -199,190 +446,532 @@ public:
   }
 };
 
-Geometry::Geometry()
-  : mMatrices( NULL )
-  , mAABBMin( 0.0f )
-  , mAABBMax( 0.0f )
-  , mModelDiagonal( 0.0f )
-{
-}
-
-Geometry::~Geometry()
+// Assimp's default logger is global, so it only lives for one import and is
+// gone again however the import ends
+class ScopedImportLogger
 {
-  UnloadMesh();
-}
+public:
+  ScopedImportLogger()
+  {
+    Assimp::DefaultLogger::create( "", Assimp::Logger::DEBUGGING );
+    Assimp::DefaultLogger::get()->attachStream( new GeometryLogging(), Assimp::Logger::Info | Assimp::Logger::Err | Assimp::Logger::Warn );
+  }
+  ~ScopedImportLogger()
+  {
+    Assimp::DefaultLogger::kill();
+  }
+};
 
-bool Geometry::LoadMesh( const char * _path )
+// Maps Assimp's import progress into a sub-range of the staging progress
+class GeometryProgress : public Assimp::ProgressHandler
 {
-  UnloadMesh();
-
-  std::string path = _path;
-  std::string folder;
-  if ( path.find( '\\' ) != -1 )
+public:
+  GeometryProgress( std::atomic<float> & _progress, float _start, float _end )
+    : mProgress( _progress )
+    , mStart( _start )
+    , mEnd( _end )
   {
-    folder = path.substr( 0, path.find_last_of( '\\' ) + 1 );
   }
-  if ( path.find( '/' ) != -1 )
+  bool Update( float percentage )
   {
-    folder = path.substr( 0, path.find_last_of( '/' ) + 1 );
+    if ( percentage >= 0.0f )
+    {
+      mProgress = mStart + ( mEnd - mStart ) * glm::clamp( percentage, 0.0f, 1.0f );
+    }
+    return true;
   }
 
-  gImporter.SetPropertyInteger( AI_CONFIG_PP_SBBC_MAX_BONES, 24 );
-
-  unsigned int loadFlags =
-    aiProcess_CalcTangentSpace |
-    aiProcess_Triangulate |
-    aiProcess_JoinIdenticalVertices |
-    aiProcess_SortByPType |
-    aiProcess_FlipWindingOrder |
-    aiProcess_TransformUVCoords |
-    aiProcess_FlipUVs |
-    aiProcess_SplitByBoneCount |
-    0;
-
-  Assimp::DefaultLogger::create( "", Assimp::Logger::DEBUGGING );
-  Assimp::DefaultLogger::get()->attachStream( new GeometryLogging(), Assimp::Logger::Info | Assimp::Logger::Err | Assimp::Logger::Warn );
+private:
+  std::atomic<float> & mProgress;
+  float mStart;
+  float mEnd;
+};
 
-  const aiScene * scene = gImporter.ReadFile( _path, loadFlags );
-  if ( !scene )
+// Textures with a GL object can only be deleted on the render thread; with
+// _deferUploaded they are collected there instead of being released
+void ReleaseStagedTexture( Renderer::Texture * _texture, std::vector<Renderer::Texture *> * _deferUploaded )
+{
+  if ( _deferUploaded && _texture->mGLTextureID )
   {
-    return false;
+    _deferUploaded->push_back( _texture );
+    return;
   }
+  Renderer::ReleaseTexture( _texture );
+}
 
-  Assimp::DefaultLogger::kill();
-
-  gNodeCount = 0;
-  ParseNode( this, scene, scene->mRootNode, -1 );
-
-  mMatrices = mNodes.size() ? new glm::mat4x4[ mNodes.size() ] : nullptr;
-
-  //////////////////////////////////////////////////////////////////////////
-  // Load embedded textures, if any
-  for ( unsigned int i = 0; i < scene->mNumTextures; i++ )
+void ReleaseMaterialTextures( std::vector<Geometry::Material> & _materials, std::vector<Renderer::Texture *> * _deferUploaded = NULL )
+{
+  for ( std::vector<Geometry::Material>::iterator it = _materials.begin(); it != _materials.end(); it++ )
   {
-    aiTexture * texture = scene->mTextures[ i ];
-    Renderer::Texture * renderTexture = NULL;
-    printf( "[geometry] Loading embedded texture #%d: %s\n", i, texture->mFilename.C_Str() );
-    if ( texture->mHeight == 0 )
+    if ( it->mColorMapDiffuse.mTexture )
     {
-      // Data is a file
-      renderTexture = Renderer::CreateRGBA8TextureFromMemory( (unsigned char *) texture->pcData, texture->mWidth, true ); // TODO: currently forced to sRGB (problematic)
-      renderTexture->mFilename = texture->mFilename.C_Str();
+      ReleaseStagedTexture( it->mColorMapDiffuse.mTexture, _deferUploaded );
     }
-    else
+    if ( it->mColorMapNormals.mTexture )
     {
-      // Data is a set of pixels
-      unsigned int * rgba = new unsigned int[ texture->mWidth * texture->mHeight ];
-      for ( unsigned int j = 0; j < texture->mWidth * texture->mHeight; j++ )
-      {
-        rgba[ j ] = 
-          texture->pcData[ j ].r | 
-          ( texture->pcData[ j ].g << 8 ) |
-          ( texture->pcData[ j ].b << 16 ) |
-          ( texture->pcData[ j ].a << 24 );
-      }
-      renderTexture = Renderer::CreateRGBA8TextureFromRawData( rgba, texture->mWidth, texture->mHeight );
-      renderTexture->mFilename = texture->mFilename.C_Str();
-      delete[] rgba;
+      ReleaseStagedTexture( it->mColorMapNormals.mTexture, _deferUploaded );
     }
-    mEmbeddedTextures.push_back( renderTexture );
-  }
-
-  //////////////////////////////////////////////////////////////////////////
-  // Calculate node transforms
-  if ( mMatrices )
-  {
-    for ( std::map<int, Geometry::Node>::iterator it = mNodes.begin(); it != mNodes.end(); it++ )
+    if ( it->mColorMapSpecular.mTexture )
     {
-      const Geometry::Node & node = it->second;
-
-      glm::mat4x4 matParent;
-      if ( node.mParentID == -1 || !mMatrices )
-      {
-        matParent = glm::mat4x4( 1.0f );
-      }
-      else
-      {
-        matParent = mMatrices[ node.mParentID ];
-      }
-
-      mMatrices[ node.mID ] = matParent * node.mTransformation;
+      ReleaseStagedTexture( it->mColorMapSpecular.mTexture, _deferUploaded );
     }
-  }
-
-  printf( "[geometry] Loading %d materials\n", scene->mNumMaterials );
-  for ( unsigned int i = 0; i < scene->mNumMaterials; i++ )
-  {
-    Material material;
-
-    aiString str = scene->mMaterials[ i ]->GetName();
-    material.mName = std::string( str.data, str.length );
-    printf( "[geometry] Loading material #%d: '%s'\n", i + 1, material.mName.c_str() );
-
-    material.mColorMapDiffuse.mColor = glm::vec4( 0.5f );
-    material.mColorMapNormals.mColor = glm::vec4( 0.0f );
-    material.mColorMapSpecular.mColor = glm::vec4( 0.0f );
-    material.mColorMapAlbedo.mColor = glm::vec4( 0.5f );
-    material.mColorMapRoughness.mColor = glm::vec4( 1.0f );
-    material.mColorMapMetallic.mColor = glm::vec4( 0.0f );
-    material.mColorMapAO.mColor = glm::vec4( 1.0f );
-    material.mColorMapAmbient.mColor = glm::vec4( 1.0f );
-    material.mColorMapEmissive.mColor = glm::vec4( 0.0f );
-
-    LoadColorMap( this, scene->mMaterials[ i ], material.mColorMapDiffuse, aiTextureType_DIFFUSE, "diffuse", folder, true );
-    if ( !LoadColorMap( this, scene->mMaterials[ i ], material.mColorMapNormals, aiTextureType_NORMAL_CAMERA, "normals", folder ) )
+    if ( it->mColorMapAlbedo.mTexture )
     {
-      LoadColorMap( this, scene->mMaterials[ i ], material.mColorMapNormals, aiTextureType_NORMALS, "normals", folder );
+      ReleaseStagedTexture( it->mColorMapAlbedo.mTexture, _deferUploaded );
     }
-    LoadColorMap( this, scene->mMaterials[ i ], material.mColorMapAlbedo, aiTextureType_BASE_COLOR, "albedo", folder );
-    LoadColorMap( this, scene->mMaterials[ i ], material.mColorMapSpecular, aiTextureType_SPECULAR, "specular", folder );
-    if ( !LoadColorMap( this, scene->mMaterials[ i ], material.mColorMapRoughness, aiTextureType_DIFFUSE_ROUGHNESS, "roughness", folder ) )
+    if ( it->mColorMapRoughness.mTexture )
     {
-      LoadColorMap( this, scene->mMaterials[ i ], material.mColorMapRoughness, aiTextureType_SHININESS, "roughness (from shininess)", folder );
+      ReleaseStagedTexture( it->mColorMapRoughness.mTexture, _deferUploaded );
     }
-    LoadColorMap( this, scene->mMaterials[ i ], material.mColorMapMetallic, aiTextureType_METALNESS, "metallic", folder );
-    LoadColorMap( this, scene->mMaterials[ i ], material.mColorMapAO, aiTextureType_AMBIENT_OCCLUSION, "AO", folder );
-    LoadColorMap( this, scene->mMaterials[ i ], material.mColorMapAmbient, aiTextureType_AMBIENT, "ambient", folder );
-    LoadColorMap( this, scene->mMaterials[ i ], material.mColorMapEmissive, aiTextureType_EMISSIVE, "emissive", folder, true );
-
-    float f = 0.0f;
-
-    material.mSpecularShininess = 1.0f;
-    if ( aiGetMaterialFloat( scene->mMaterials[ i ], AI_MATKEY_SHININESS, &f ) == AI_SUCCESS )
+    if ( it->mColorMapMetallic.mTexture )
     {
-      material.mSpecularShininess = f;
+      ReleaseStagedTexture( it->mColorMapMetallic.mTexture, _deferUploaded );
     }
-
-    mMaterials.insert( { i, material } );
-  }
-
-  printf( "[geometry] Loading %d meshes\n", scene->mNumMeshes );
-  for ( unsigned int i = 0; i < scene->mNumMeshes; i++ )
-  {
-    aiMesh * sceneMesh = scene->mMeshes[ i ];
-
-    if ( !sceneMesh->mNumVertices || !sceneMesh->mNumFaces )
+    if ( it->mColorMapAO.mTexture )
     {
-      continue;
+      ReleaseStagedTexture( it->mColorMapAO.mTexture, _deferUploaded );
+    }
+    if ( it->mColorMapAmbient.mTexture )
+    {
+      ReleaseStagedTexture( it->mColorMapAmbient.mTexture, _deferUploaded );
     }
+    if ( it->mColorMapEmissive.mTexture )
+    {
+      ReleaseStagedTexture( it->mColorMapEmissive.mTexture, _deferUploaded );
+    }
+  }
+  _materials.clear();
+}
 
-    Mesh mesh;
+Geometry::Staging::Staging()
+  : mMatrices( NULL )
+  , mAABBMin( 0.0f )
+  , mAABBMax( 0.0f )
+  , mModelDiagonal( 0.0f )
+  , mGlobalAmbient( 0.0f )
+  , mCacheFile( NULL )
+  , mProgress( 0.0f )
+  , mTextureDecodeCount( 0 )
+  , mTextureDecodeThreads( 0 )
+  , mTextureDecodeTime( 0.0f )
+  , mTextureCacheHits( 0 )
+  , mTextureCacheBytesSaved( 0 )
+  , mVertexFormat( VERTEXFORMAT_FULL )
+  , mUseCache( true )
+  , mGenerateLODs( false )
+  , mOptimizeMeshes( false )
+  , mBuildMeshlets( false )
+{
+}
 
-    glGenVertexArrays( 1, &mesh.mVertexArrayObject );
-    glGenBuffers( 1, &mesh.mVertexBufferObject );
-    glGenBuffers( 1, &mesh.mIndexBufferObject );
+Geometry::Staging::~Staging()
+{
+  Clear();
+  ReleaseDeferredTextures();
+}
 
-    glBindVertexArray( mesh.mVertexArrayObject );
-    glBindBuffer( GL_ARRAY_BUFFER, mesh.mVertexBufferObject );
-    glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, mesh.mIndexBufferObject );
+void Geometry::Staging::ReleaseDeferredTextures()
+{
+  for ( unsigned int i = 0; i < mDeferredTextureReleases.size(); i++ )
+  {
+    Renderer::ReleaseTexture( mDeferredTextureReleases[ i ] );
+  }
+  mDeferredTextureReleases.clear();
+}
 
-    mesh.mVertexCount = sceneMesh->mNumVertices;
+void Geometry::Staging::AddNode( Node & _node, int _parentID, const unsigned int * _meshes, unsigned int _meshCount )
+{
+  if ( mNodeMeshOffsets.empty() )
+  {
+    mNodeMeshOffsets.push_back( 0 );
+  }
 
-    Vertex * vertices = new Vertex[ mesh.mVertexCount ];
-    for ( unsigned int j = 0; j < sceneMesh->mNumVertices; j++ )
-    {
-      vertices[ j ].v3Vector.x = sceneMesh->mVertices[ j ].x;
-      vertices[ j ].v3Vector.y = sceneMesh->mVertices[ j ].y;
+  _node.mID = (unsigned int) mNodes.size();
+  mNodes.push_back( _node );
+  mNodeParents.push_back( _parentID );
+  mNodeMatrixSlots.push_back( _node.mID );
+  mNodeMeshes.insert( mNodeMeshes.end(), _meshes, _meshes + _meshCount );
+  mNodeMeshOffsets.push_back( (unsigned int) mNodeMeshes.size() );
+}
+
+void Geometry::Staging::Clear()
+{
+  if ( mMatrices )
+  {
+    delete[] mMatrices;
+    mMatrices = NULL;
+  }
+
+  mNodes.clear();
+  mNodeParents.clear();
+  mNodeMatrixSlots.clear();
+  mNodeMeshOffsets.clear();
+  mNodeMeshes.clear();
+  mMeshes.clear();
+  mBVH.Clear();
+
+  // This also runs on the loading thread. Staged textures have no GL objects
+  // yet and are released right away, but texture cache hits come back already
+  // uploaded and wait for ReleaseDeferredTextures() on the render thread.
+  for ( unsigned int i = 0; i < mEmbeddedTextures.size(); i++ )
+  {
+    if ( mEmbeddedTextures[ i ] )
+    {
+      ReleaseStagedTexture( mEmbeddedTextures[ i ], &mDeferredTextureReleases );
+    }
+  }
+  mEmbeddedTextures.clear();
+
+  ReleaseMaterialTextures( mMaterials, &mDeferredTextureReleases );
+
+  if ( mCacheFile )
+  {
+    delete mCacheFile;
+    mCacheFile = NULL;
+  }
+
+  mTextureDecodeCount = 0;
+  mTextureDecodeThreads = 0;
+  mTextureDecodeTime = 0.0f;
+  mTextureCacheHits = 0;
+  mTextureCacheBytesSaved = 0;
+}
+
+Geometry::Geometry()
+  : mBoundsRootMatrix( 1.0f )
+  , mBoundsValid( false )
+  , mVertexArrayObject( 0 )
+  , mVertexBufferObject( 0 )
+  , mIndexBufferObject( 0 )
+  , mInstanceBufferObject( 0 )
+  , mMaterialBufferObject( 0 )
+  , mMaterialBlockStride( 0 )
+  , mMatrices( NULL )
+  , mAABBMin( 0.0f )
+  , mAABBMax( 0.0f )
+  , mModelDiagonal( 0.0f )
+  , mTextureCount( 0 )
+  , mTextureDecodeThreads( 0 )
+  , mTextureDecodeTime( 0.0f )
+  , mTextureUploadTime( 0.0f )
+  , mTextureCacheHits( 0 )
+  , mTextureCacheBytesSaved( 0 )
+  , mVertexFormat( VERTEXFORMAT_FULL )
+  , mVertexBufferSize( 0 )
+  , mFullVertexBufferSize( 0 )
+  , mIndexBufferSize( 0 )
+{
+  mUniforms.mShader = NULL;
+  memset( &mCullStats, 0, sizeof( CullStats ) );
+  memset( &mDrawStats, 0, sizeof( DrawStats ) );
+}
+
+Geometry::~Geometry()
+{
+  UnloadMesh();
+}
+
+const int gImportMaxBones = 24;
+const unsigned int gImportFlags =
+  aiProcess_CalcTangentSpace |
+  aiProcess_Triangulate |
+  aiProcess_JoinIdenticalVertices |
+  aiProcess_SortByPType |
+  aiProcess_FlipWindingOrder |
+  aiProcess_TransformUVCoords |
+  aiProcess_FlipUVs |
+  aiProcess_SplitByBoneCount |
+  0;
+
+enum CACHED_TEXTURE_SOURCE
+{
+  CACHED_TEXTURE_NONE = 0,
+  CACHED_TEXTURE_FILE,
+  CACHED_TEXTURE_EMBEDDED,
+};
+
+#pragma pack(1)
+struct CachedEmbeddedTexture
+{
+  uint32_t mWidth;
+  uint32_t mHeight; // 0 if the blob is a compressed image file
+  uint64_t mOffset;
+  uint64_t mSize;
+};
+struct CachedMesh
+{
+  uint32_t mIndex;
+  uint32_t mVertexCount;
+  uint32_t mTriangleCount;
+  uint32_t mMaterialIndex;
+  glm::vec3 mAABBMin;
+  glm::vec3 mAABBMax;
+  uint64_t mVertexOffset;
+  uint64_t mIndexOffset;
+};
+#pragma pack()
+
+void WriteColorMap( MeshCache::Writer & _writer, const Geometry::Staging * _staging, const Geometry::ColorMap & _colorMap )
+{
+  _writer.Write( (uint8_t) _colorMap.mValid );
+  _writer.Write( _colorMap.mColor );
+
+  if ( !_colorMap.mTexture )
+  {
+    _writer.Write( (uint8_t) CACHED_TEXTURE_NONE );
+    return;
+  }
+
+  for ( uint32_t i = 0; i < _staging->mEmbeddedTextures.size(); i++ )
+  {
+    if ( _staging->mEmbeddedTextures[ i ] == _colorMap.mTexture )
+    {
+      _writer.Write( (uint8_t) CACHED_TEXTURE_EMBEDDED );
+      _writer.Write( i );
+      return;
+    }
+  }
+
+  _writer.Write( (uint8_t) CACHED_TEXTURE_FILE );
+  _writer.Write( (uint8_t) _colorMap.mTexture->mSRGB );
+  _writer.WriteString( _colorMap.mTexture->mFilename );
+}
+
+bool ReadColorMap( MeshCache::Reader & _reader, TextureBatch & _textures, Geometry::ColorMap & _colorMap )
+{
+  uint8_t valid = 0;
+  uint8_t source = CACHED_TEXTURE_NONE;
+  _reader.Read( valid );
+  _reader.Read( _colorMap.mColor );
+  _reader.Read( source );
+  _colorMap.mValid = valid != 0;
+  _colorMap.mTexture = NULL;
+
+  switch ( source )
+  {
+    case CACHED_TEXTURE_NONE:
+      break;
+    case CACHED_TEXTURE_EMBEDDED:
+      {
+        uint32_t index = 0;
+        if ( _reader.Read( index ) )
+        {
+          _textures.AddEmbeddedReference( &_colorMap, (int) index );
+        }
+      } break;
+    case CACHED_TEXTURE_FILE:
+      {
+        uint8_t srgb = 0;
+        std::string filename;
+        if ( _reader.Read( srgb ) && _reader.ReadString( filename ) )
+        {
+          // The path is the one the import resolved, so it's used as is
+          _textures.AddFile( &_colorMap, "cached", filename, std::string(), srgb != 0 );
+        }
+      } break;
+    default:
+      return false;
+  }
+
+  return _reader.IsValid();
+}
+
+unsigned int GetIndexSize( GLenum _indexType )
+{
+  return _indexType == GL_UNSIGNED_SHORT ? sizeof( unsigned short ) : sizeof( unsigned int );
+}
+
+void ReportLoadStage( Geometry::Staging & _staging, Geometry::LOADSTAGE _stage, bool _begin )
+{
+  if ( _staging.mStageCallback )
+  {
+    _staging.mStageCallback( _stage, _begin );
+  }
+}
+
+bool IsMaterialTransparent( const Geometry::Material & _material )
+{
+  bool transparent = false;
+  transparent |= ( _material.mColorMapAlbedo.mTexture != nullptr ) ? ( _material.mColorMapAlbedo.mTexture->mTransparent ) : ( _material.mColorMapAlbedo.mColor.a != 1.0f );
+  transparent |= ( _material.mColorMapDiffuse.mTexture != nullptr ) ? ( _material.mColorMapDiffuse.mTexture->mTransparent ) : ( _material.mColorMapDiffuse.mColor.a != 1.0f );
+  return transparent;
+}
+
+bool ImportMesh( const char * _path, const char * _cachePath, Geometry::Staging & _staging )
+{
+  std::string path = _path;
+  std::string folder;
+  if ( path.find( '\\' ) != -1 )
+  {
+    folder = path.substr( 0, path.find_last_of( '\\' ) + 1 );
+  }
+  if ( path.find( '/' ) != -1 )
+  {
+    folder = path.substr( 0, path.find_last_of( '/' ) + 1 );
+  }
+
+  Assimp::Importer importer;
+  importer.SetPropertyInteger( AI_CONFIG_PP_SBBC_MAX_BONES, gImportMaxBones );
+  importer.SetProgressHandler( new GeometryProgress( _staging.mProgress, 0.0f, 0.5f ) );
+
+  // Post-processing is applied separately so the two can be told apart when profiling
+  const aiScene * scene = NULL;
+  {
+    ScopedImportLogger logger;
+    ReportLoadStage( _staging, Geometry::LOADSTAGE_READ, true );
+    scene = importer.ReadFile( _path, 0 );
+    ReportLoadStage( _staging, Geometry::LOADSTAGE_READ, false );
+    if ( scene )
+    {
+      ReportLoadStage( _staging, Geometry::LOADSTAGE_POSTPROCESS, true );
+      scene = importer.ApplyPostProcessing( gImportFlags );
+      ReportLoadStage( _staging, Geometry::LOADSTAGE_POSTPROCESS, false );
+    }
+  }
+  if ( !scene )
+  {
+    return false;
+  }
+
+  // The cache is written alongside the import; blobs go out as soon as they're
+  // packed, the table describing them is assembled once everything is loaded.
+  MeshCache::Writer cacheWriter;
+  uint64_t sourceSize = 0;
+  int64_t sourceModifiedTime = 0;
+  if ( _cachePath && MeshCache::GetSourceStamp( _path, sourceSize, sourceModifiedTime ) )
+  {
+    cacheWriter.Open( _cachePath );
+  }
+  std::vector<CachedEmbeddedTexture> cachedEmbeddedTextures;
+  std::vector<CachedMesh> cachedMeshes;
+
+  ParseNode( &_staging, scene, scene->mRootNode, -1 );
+
+  TextureBatch textures;
+
+  ReportLoadStage( _staging, Geometry::LOADSTAGE_MATERIALS, true );
+
+  //////////////////////////////////////////////////////////////////////////
+  // Load embedded textures, if any
+  for ( unsigned int i = 0; i < scene->mNumTextures; i++ )
+  {
+    aiTexture * texture = scene->mTextures[ i ];
+    CachedEmbeddedTexture cachedTexture;
+    cachedTexture.mWidth = texture->mWidth;
+    cachedTexture.mHeight = texture->mHeight;
+    printf( "[geometry] Loading embedded texture #%d: %s\n", i, texture->mFilename.C_Str() );
+    _staging.mEmbeddedTextures.push_back( NULL );
+    if ( texture->mHeight == 0 )
+    {
+      // Data is a file; it's decoded along with the material textures
+      textures.AddEmbedded( i, (const unsigned char *) texture->pcData, texture->mWidth, texture->mFilename.C_Str() );
+
+      cachedTexture.mSize = texture->mWidth;
+      cachedTexture.mOffset = cacheWriter.WriteBlob( texture->pcData, cachedTexture.mSize );
+    }
+    else
+    {
+      // Data is a set of pixels
+      unsigned int * rgba = new unsigned int[ texture->mWidth * texture->mHeight ];
+      for ( unsigned int j = 0; j < texture->mWidth * texture->mHeight; j++ )
+      {
+        rgba[ j ] = 
+          texture->pcData[ j ].r | 
+          ( texture->pcData[ j ].g << 8 ) |
+          ( texture->pcData[ j ].b << 16 ) |
+          ( texture->pcData[ j ].a << 24 );
+      }
+      Renderer::Texture * renderTexture = Renderer::StageRGBA8TextureFromRawData( rgba, texture->mWidth, texture->mHeight );
+      if ( renderTexture )
+      {
+        renderTexture->mFilename = texture->mFilename.C_Str();
+      }
+      _staging.mEmbeddedTextures.back() = renderTexture;
+
+      cachedTexture.mSize = sizeof( unsigned int ) * texture->mWidth * texture->mHeight;
+      cachedTexture.mOffset = cacheWriter.WriteBlob( rgba, cachedTexture.mSize );
+      delete[] rgba;
+    }
+    cachedEmbeddedTextures.push_back( cachedTexture );
+  }
+
+  printf( "[geometry] Loading %d materials\n", scene->mNumMaterials );
+
+  // Allocated up front so the texture batch can point at the color maps
+  _staging.mMaterials.resize( scene->mNumMaterials );
+  for ( unsigned int i = 0; i < scene->mNumMaterials; i++ )
+  {
+    Geometry::Material & material = _staging.mMaterials[ i ];
+
+    aiString str = scene->mMaterials[ i ]->GetName();
+    material.mName = std::string( str.data, str.length );
+    printf( "[geometry] Loading material #%d: '%s'\n", i + 1, material.mName.c_str() );
+
+    material.mColorMapDiffuse.mColor = glm::vec4( 0.5f );
+    material.mColorMapNormals.mColor = glm::vec4( 0.0f );
+    material.mColorMapSpecular.mColor = glm::vec4( 0.0f );
+    material.mColorMapAlbedo.mColor = glm::vec4( 0.5f );
+    material.mColorMapRoughness.mColor = glm::vec4( 1.0f );
+    material.mColorMapMetallic.mColor = glm::vec4( 0.0f );
+    material.mColorMapAO.mColor = glm::vec4( 1.0f );
+    material.mColorMapAmbient.mColor = glm::vec4( 1.0f );
+    material.mColorMapEmissive.mColor = glm::vec4( 0.0f );
+
+    LoadColorMap( textures, scene->mMaterials[ i ], material.mColorMapDiffuse, aiTextureType_DIFFUSE, "diffuse", folder, true );
+    if ( !LoadColorMap( textures, scene->mMaterials[ i ], material.mColorMapNormals, aiTextureType_NORMAL_CAMERA, "normals", folder ) )
+    {
+      LoadColorMap( textures, scene->mMaterials[ i ], material.mColorMapNormals, aiTextureType_NORMALS, "normals", folder );
+    }
+    LoadColorMap( textures, scene->mMaterials[ i ], material.mColorMapAlbedo, aiTextureType_BASE_COLOR, "albedo", folder );
+    LoadColorMap( textures, scene->mMaterials[ i ], material.mColorMapSpecular, aiTextureType_SPECULAR, "specular", folder );
+    if ( !LoadColorMap( textures, scene->mMaterials[ i ], material.mColorMapRoughness, aiTextureType_DIFFUSE_ROUGHNESS, "roughness", folder ) )
+    {
+      LoadColorMap( textures, scene->mMaterials[ i ], material.mColorMapRoughness, aiTextureType_SHININESS, "roughness (from shininess)", folder );
+    }
+    LoadColorMap( textures, scene->mMaterials[ i ], material.mColorMapMetallic, aiTextureType_METALNESS, "metallic", folder );
+    LoadColorMap( textures, scene->mMaterials[ i ], material.mColorMapAO, aiTextureType_AMBIENT_OCCLUSION, "AO", folder );
+    LoadColorMap( textures, scene->mMaterials[ i ], material.mColorMapAmbient, aiTextureType_AMBIENT, "ambient", folder );
+    LoadColorMap( textures, scene->mMaterials[ i ], material.mColorMapEmissive, aiTextureType_EMISSIVE, "emissive", folder, true );
+
+    float f = 0.0f;
+
+    material.mSpecularShininess = 1.0f;
+    if ( aiGetMaterialFloat( scene->mMaterials[ i ], AI_MATKEY_SHININESS, &f ) == AI_SUCCESS )
+    {
+      material.mSpecularShininess = f;
+    }
+  }
+
+  textures.Load( _staging, 0.5f, 0.8f );
+
+  ReportLoadStage( _staging, Geometry::LOADSTAGE_MATERIALS, false );
+  ReportLoadStage( _staging, Geometry::LOADSTAGE_VERTICES, true );
+
+  printf( "[geometry] Loading %d meshes\n", scene->mNumMeshes );
+  for ( unsigned int i = 0; i < scene->mNumMeshes; i++ )
+  {
+    aiMesh * sceneMesh = scene->mMeshes[ i ];
+
+    if ( !sceneMesh->mNumVertices || !sceneMesh->mNumFaces )
+    {
+      continue;
+    }
+
+    _staging.mProgress = 0.8f + 0.2f * i / scene->mNumMeshes;
+
+    _staging.mMeshes.push_back( Geometry::StagedMesh() );
+    Geometry::StagedMesh & stagedMesh = _staging.mMeshes.back();
+    Geometry::Mesh & mesh = stagedMesh.mMesh;
+    stagedMesh.mIndex = i;
+
+    mesh.mVertexCount = sceneMesh->mNumVertices;
+
+    stagedMesh.mVertexStorage.resize( sizeof( Vertex ) * mesh.mVertexCount );
+    Vertex * vertices = (Vertex *) stagedMesh.mVertexStorage.data();
+    for ( unsigned int j = 0; j < sceneMesh->mNumVertices; j++ )
+    {
+      vertices[ j ].v3Vector.x = sceneMesh->mVertices[ j ].x;
+      vertices[ j ].v3Vector.y = sceneMesh->mVertices[ j ].y;
       vertices[ j ].v3Vector.z = sceneMesh->mVertices[ j ].z;
       vertices[ j ].v3Normal.x = 0.0f;
       vertices[ j ].v3Normal.y = 0.0f;
@@ -433,80 +1022,1554 @@ bool Geometry::LoadMesh( const char * _path )
       }
     }
 
-    glBufferData( GL_ARRAY_BUFFER, sizeof( Vertex ) * mesh.mVertexCount, vertices, GL_STATIC_DRAW );
+    mesh.mTriangleCount = sceneMesh->mNumFaces;
+
+    stagedMesh.mFaceStorage.resize( sceneMesh->mNumFaces * 3 );
+    unsigned int * faces = stagedMesh.mFaceStorage.data();
+
+    for ( unsigned int j = 0; j < sceneMesh->mNumFaces; j++ )
+    {
+      faces[ j * 3 + 0 ] = sceneMesh->mFaces[ j ].mIndices[ 0 ];
+      faces[ j * 3 + 1 ] = sceneMesh->mFaces[ j ].mIndices[ 1 ];
+      faces[ j * 3 + 2 ] = sceneMesh->mFaces[ j ].mIndices[ 2 ];
+    }
+
+    CachedMesh cachedMesh;
+    cachedMesh.mIndex = i;
+    cachedMesh.mVertexCount = mesh.mVertexCount;
+    cachedMesh.mTriangleCount = mesh.mTriangleCount;
+    cachedMesh.mMaterialIndex = sceneMesh->mMaterialIndex;
+    cachedMesh.mAABBMin = mesh.mAABBMin;
+    cachedMesh.mAABBMax = mesh.mAABBMax;
+    cachedMesh.mVertexOffset = cacheWriter.WriteBlob( vertices, sizeof( Vertex ) * mesh.mVertexCount );
+    cachedMesh.mIndexOffset = cacheWriter.WriteBlob( faces, sizeof( unsigned int ) * mesh.mTriangleCount * 3 );
+    cachedMeshes.push_back( cachedMesh );
+
+    mesh.mMaterialIndex = sceneMesh->mMaterialIndex;
+
+    // By importing materials before meshes we can investigate whether a mesh is transparent and flag it as such.
+    mesh.mTransparent = IsMaterialTransparent( _staging.mMaterials[ mesh.mMaterialIndex ] );
+    mesh.mLODCount = 0;
+    mesh.mFirstMeshlet = 0;
+    mesh.mMeshletCount = 0;
+    mesh.mImportedACMR = 0.0f;
+    mesh.mImportedATVR = 0.0f;
+    mesh.mACMR = 0.0f;
+    mesh.mATVR = 0.0f;
+  }
+
+  _staging.mGlobalAmbient = glm::vec4( 0.3f );
+  for ( unsigned int i = 0; i < scene->mNumLights; i++ )
+  {
+    switch ( scene->mLights[ i ]->mType )
+    {
+      case aiLightSource_AMBIENT:
+        {
+          memcpy( &_staging.mGlobalAmbient, &scene->mLights[ i ]->mColorAmbient.r, sizeof( float ) * 4 );
+        } break;
+      default:
+        {
+          // todo
+        } break;
+    }
+  }
+
+  //////////////////////////////////////////////////////////////////////////
+  // Finish the cache table
+  if ( cacheWriter.IsOpen() )
+  {
+    cacheWriter.Write( _staging.mGlobalAmbient );
+
+    cacheWriter.Write( (uint32_t) _staging.mNodes.size() );
+    for ( int i = 0; i < _staging.mNodes.size(); i++ )
+    {
+      const Geometry::Node & node = _staging.mNodes[ i ];
+      cacheWriter.Write( (uint32_t) node.mID );
+      cacheWriter.Write( (uint32_t) _staging.mNodeParents[ i ] );
+      cacheWriter.WriteString( node.mName );
+      cacheWriter.Write( node.mTransformation );
+      cacheWriter.Write( (uint32_t) ( _staging.mNodeMeshOffsets[ i + 1 ] - _staging.mNodeMeshOffsets[ i ] ) );
+      for ( unsigned int j = _staging.mNodeMeshOffsets[ i ]; j < _staging.mNodeMeshOffsets[ i + 1 ]; j++ )
+      {
+        cacheWriter.Write( (uint32_t) _staging.mNodeMeshes[ j ] );
+      }
+    }
+
+    cacheWriter.Write( (uint32_t) cachedEmbeddedTextures.size() );
+    for ( int i = 0; i < cachedEmbeddedTextures.size(); i++ )
+    {
+      cacheWriter.Write( cachedEmbeddedTextures[ i ] );
+      cacheWriter.WriteString( _staging.mEmbeddedTextures[ i ] ? _staging.mEmbeddedTextures[ i ]->mFilename : std::string() );
+    }
+
+    cacheWriter.Write( (uint32_t) _staging.mMaterials.size() );
+    for ( int i = 0; i < _staging.mMaterials.size(); i++ )
+    {
+      const Geometry::Material & material = _staging.mMaterials[ i ];
+      cacheWriter.Write( (uint32_t) i );
+      cacheWriter.WriteString( material.mName );
+      cacheWriter.Write( material.mSpecularShininess );
+      WriteColorMap( cacheWriter, &_staging, material.mColorMapDiffuse );
+      WriteColorMap( cacheWriter, &_staging, material.mColorMapNormals );
+      WriteColorMap( cacheWriter, &_staging, material.mColorMapSpecular );
+      WriteColorMap( cacheWriter, &_staging, material.mColorMapAlbedo );
+      WriteColorMap( cacheWriter, &_staging, material.mColorMapRoughness );
+      WriteColorMap( cacheWriter, &_staging, material.mColorMapMetallic );
+      WriteColorMap( cacheWriter, &_staging, material.mColorMapAO );
+      WriteColorMap( cacheWriter, &_staging, material.mColorMapAmbient );
+      WriteColorMap( cacheWriter, &_staging, material.mColorMapEmissive );
+    }
+
+    cacheWriter.Write( (uint32_t) cachedMeshes.size() );
+    for ( int i = 0; i < cachedMeshes.size(); i++ )
+    {
+      cacheWriter.Write( cachedMeshes[ i ] );
+    }
+
+    MeshCache::Header header;
+    MeshCache::InitHeader( header );
+    header.mImportFlags = gImportFlags;
+    header.mImportMaxBones = gImportMaxBones;
+    header.mVertexSize = sizeof( Vertex );
+    header.mSourceSize = sourceSize;
+    header.mSourceModifiedTime = sourceModifiedTime;
+    if ( cacheWriter.Close( header ) )
+    {
+      printf( "[geometry] Wrote mesh cache '%s'\n", _cachePath );
+    }
+  }
+
+  ReportLoadStage( _staging, Geometry::LOADSTAGE_VERTICES, false );
+
+  return true;
+}
+
+// Whether a cache file was written for the source as it is now, with the
+// current import settings, and its table is inside the file
+bool IsCacheHeaderCurrent( const MeshCache::Header & _header, uint64_t _fileSize, uint64_t _sourceSize, int64_t _sourceModifiedTime )
+{
+  MeshCache::Header expected;
+  MeshCache::InitHeader( expected );
+  return memcmp( _header.mMagic, expected.mMagic, sizeof( _header.mMagic ) ) == 0
+    && _header.mVersion == expected.mVersion
+    && _header.mImportFlags == gImportFlags
+    && _header.mImportMaxBones == gImportMaxBones
+    && _header.mVertexSize == sizeof( Vertex )
+    && _header.mSourceSize == _sourceSize
+    && _header.mSourceModifiedTime == _sourceModifiedTime
+    && _header.mTableOffset <= _fileSize
+    && _header.mTableSize <= _fileSize - _header.mTableOffset;
+}
+
+// A header can be current while the data after it was truncated or damaged;
+// every index has to name a vertex and every vertex has to be finite, or
+// everything downstream of the load reads out of bounds or produces NaNs
+bool AreCachedMeshContentsValid( const Geometry::StagedMesh & _stagedMesh )
+{
+  const Geometry::Mesh & mesh = _stagedMesh.mMesh;
+  const unsigned int * faces = (const unsigned int *) _stagedMesh.mCachedFaces;
+  unsigned int maxIndex = 0;
+  for ( size_t i = 0; i < (size_t) mesh.mTriangleCount * 3; i++ )
+  {
+    maxIndex = std::max( maxIndex, faces[ i ] );
+  }
+  if ( mesh.mTriangleCount && maxIndex >= (unsigned int) mesh.mVertexCount )
+  {
+    return false;
+  }
+
+  const float * values = (const float *) _stagedMesh.mCachedVertices;
+  for ( size_t i = 0; i < (size_t) mesh.mVertexCount * ( sizeof( Vertex ) / sizeof( float ) ); i++ )
+  {
+    if ( !std::isfinite( values[ i ] ) )
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool LoadMeshCache( const char * _path, const char * _cachePath, Geometry::Staging & _staging )
+{
+  uint64_t sourceSize = 0;
+  int64_t sourceModifiedTime = 0;
+  if ( !MeshCache::GetSourceStamp( _path, sourceSize, sourceModifiedTime ) )
+  {
+    return false;
+  }
+
+  MeshCache::MappedFile * file = new MeshCache::MappedFile();
+  if ( !file->Open( _cachePath ) || file->GetSize() < sizeof( MeshCache::Header ) )
+  {
+    delete file;
+    return false;
+  }
+
+  MeshCache::Header header;
+  memcpy( &header, file->GetData(), sizeof( MeshCache::Header ) );
+  if ( !IsCacheHeaderCurrent( header, file->GetSize(), sourceSize, sourceModifiedTime ) )
+  {
+    printf( "[geometry] Mesh cache '%s' is stale, reimporting\n", _cachePath );
+    delete file;
+    return false;
+  }
+
+  printf( "[geometry] Loading mesh cache '%s'\n", _cachePath );
+
+  MeshCache::Reader reader( file->GetData(), header.mTableOffset + header.mTableSize, header.mTableOffset );
+  bool corrupt = false;
+  TextureBatch textures;
+
+  reader.Read( _staging.mGlobalAmbient );
+
+  uint32_t nodeCount = 0;
+  reader.Read( nodeCount );
+  std::vector<unsigned int> nodeMeshes;
+  for ( uint32_t i = 0; i < nodeCount && reader.IsValid(); i++ )
+  {
+    Geometry::Node node;
+    uint32_t id = 0;
+    uint32_t parentID = 0;
+    uint32_t meshCount = 0;
+    reader.Read( id );
+    reader.Read( parentID );
+    reader.ReadString( node.mName );
+    reader.Read( node.mTransformation );
+    reader.Read( meshCount );
+    nodeMeshes.clear();
+    for ( uint32_t j = 0; j < meshCount && reader.IsValid(); j++ )
+    {
+      uint32_t meshIndex = 0;
+      reader.Read( meshIndex );
+      nodeMeshes.push_back( meshIndex );
+    }
+
+    // Nodes are stored depth first, parents before children
+    if ( id != i || ( (int) parentID != -1 && parentID >= id ) )
+    {
+      corrupt = true;
+      break;
+    }
+    _staging.AddNode( node, (int) parentID, nodeMeshes.data(), (unsigned int) nodeMeshes.size() );
+  }
+
+  uint32_t embeddedTextureCount = 0;
+  reader.Read( embeddedTextureCount );
+  for ( uint32_t i = 0; i < embeddedTextureCount && reader.IsValid(); i++ )
+  {
+    CachedEmbeddedTexture cachedTexture;
+    std::string filename;
+    if ( !reader.Read( cachedTexture ) || !reader.ReadString( filename ) )
+    {
+      break;
+    }
+
+    const void * data = reader.GetBlob( cachedTexture.mOffset, cachedTexture.mSize );
+    if ( !data )
+    {
+      break;
+    }
+
+    _staging.mEmbeddedTextures.push_back( NULL );
+    if ( cachedTexture.mHeight == 0 )
+    {
+      textures.AddEmbedded( i, (const unsigned char *) data, (unsigned int) cachedTexture.mSize, filename );
+    }
+    else if ( cachedTexture.mSize == sizeof( unsigned int ) * cachedTexture.mWidth * cachedTexture.mHeight )
+    {
+      Renderer::Texture * renderTexture = Renderer::StageRGBA8TextureFromRawData( (const unsigned int *) data, cachedTexture.mWidth, cachedTexture.mHeight );
+      if ( renderTexture )
+      {
+        renderTexture->mFilename = filename;
+      }
+      _staging.mEmbeddedTextures.back() = renderTexture;
+    }
+  }
+
+  uint32_t materialCount = 0;
+  reader.Read( materialCount );
+
+  // Allocated up front so the texture batch can point at the color maps
+  if ( !corrupt && reader.IsValid() && materialCount <= header.mTableSize )
+  {
+    _staging.mMaterials.resize( materialCount );
+  }
+  for ( uint32_t i = 0; i < _staging.mMaterials.size() && !corrupt && reader.IsValid(); i++ )
+  {
+    uint32_t index = 0;
+    if ( !reader.Read( index ) || index != i )
+    {
+      corrupt = true;
+      break;
+    }
+
+    Geometry::Material & material = _staging.mMaterials[ index ];
+    reader.ReadString( material.mName );
+    reader.Read( material.mSpecularShininess );
+    bool colorMapsValid = true;
+    colorMapsValid &= ReadColorMap( reader, textures, material.mColorMapDiffuse );
+    colorMapsValid &= ReadColorMap( reader, textures, material.mColorMapNormals );
+    colorMapsValid &= ReadColorMap( reader, textures, material.mColorMapSpecular );
+    colorMapsValid &= ReadColorMap( reader, textures, material.mColorMapAlbedo );
+    colorMapsValid &= ReadColorMap( reader, textures, material.mColorMapRoughness );
+    colorMapsValid &= ReadColorMap( reader, textures, material.mColorMapMetallic );
+    colorMapsValid &= ReadColorMap( reader, textures, material.mColorMapAO );
+    colorMapsValid &= ReadColorMap( reader, textures, material.mColorMapAmbient );
+    colorMapsValid &= ReadColorMap( reader, textures, material.mColorMapEmissive );
+    if ( !colorMapsValid )
+    {
+      corrupt = true;
+      break;
+    }
+  }
+
+  if ( corrupt || !reader.IsValid() )
+  {
+    printf( "[geometry] Mesh cache '%s' is corrupt, reimporting\n", _cachePath );
+    delete file;
+    _staging.Clear();
+    return false;
+  }
+
+  textures.Load( _staging, 0.0f, 0.8f );
+
+  uint32_t meshCount = 0;
+  reader.Read( meshCount );
+  for ( uint32_t i = 0; i < meshCount && reader.IsValid(); i++ )
+  {
+    CachedMesh cachedMesh;
+    if ( !reader.Read( cachedMesh ) )
+    {
+      break;
+    }
+
+    // Upload straight from the mapping
+    const void * vertices = reader.GetBlob( cachedMesh.mVertexOffset, sizeof( Vertex ) * (uint64_t) cachedMesh.mVertexCount );
+    const void * faces = reader.GetBlob( cachedMesh.mIndexOffset, sizeof( unsigned int ) * 3 * (uint64_t) cachedMesh.mTriangleCount );
+    if ( !vertices || !faces || cachedMesh.mMaterialIndex >= _staging.mMaterials.size() )
+    {
+      corrupt = true;
+      break;
+    }
+
+    _staging.mMeshes.push_back( Geometry::StagedMesh() );
+    Geometry::StagedMesh & stagedMesh = _staging.mMeshes.back();
+    stagedMesh.mIndex = cachedMesh.mIndex;
+    stagedMesh.mCachedVertices = vertices;
+    stagedMesh.mCachedFaces = faces;
+
+    Geometry::Mesh & mesh = stagedMesh.mMesh;
+    mesh.mVertexCount = cachedMesh.mVertexCount;
+    mesh.mTriangleCount = cachedMesh.mTriangleCount;
+    mesh.mMaterialIndex = cachedMesh.mMaterialIndex;
+    mesh.mAABBMin = cachedMesh.mAABBMin;
+    mesh.mAABBMax = cachedMesh.mAABBMax;
+    mesh.mTransparent = IsMaterialTransparent( _staging.mMaterials[ mesh.mMaterialIndex ] );
+    mesh.mLODCount = 0;
+    mesh.mFirstMeshlet = 0;
+    mesh.mMeshletCount = 0;
+    mesh.mImportedACMR = 0.0f;
+    mesh.mImportedATVR = 0.0f;
+    mesh.mACMR = 0.0f;
+    mesh.mATVR = 0.0f;
+  }
+
+  if ( !corrupt && reader.IsValid() )
+  {
+    std::vector<unsigned char> meshValid( _staging.mMeshes.size(), 0 );
+    ThreadPool::Get().ParallelFor( (int) _staging.mMeshes.size(), [ &_staging, &meshValid ]( int _index )
+    {
+      meshValid[ _index ] = AreCachedMeshContentsValid( _staging.mMeshes[ _index ] ) ? 1 : 0;
+    } );
+    corrupt = std::find( meshValid.begin(), meshValid.end(), 0 ) != meshValid.end();
+  }
+
+  if ( corrupt || !reader.IsValid() )
+  {
+    printf( "[geometry] Mesh cache '%s' is corrupt, reimporting\n", _cachePath );
+    delete file;
+    _staging.Clear();
+    return false;
+  }
+
+  // Keep the mapping around; the vertex and index data is uploaded from it directly
+  _staging.mCacheFile = file;
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Level of detail
+
+// Saved LODs are regenerated when this changes, e.g. with the simplifier
+const uint32_t LOD_FORMAT_VERSION = 1;
+// Smaller meshes are always drawn at full detail
+const int LOD_MIN_TRIANGLES = 1024;
+
+#pragma pack(1)
+struct CachedLOD
+{
+  uint32_t mTriangleCount;
+  float mError;
+  uint64_t mIndexOffset;
+};
+#pragma pack()
+
+float GetMeshRadius( const Geometry::Mesh & _mesh )
+{
+  return glm::length( _mesh.mAABBMax - _mesh.mAABBMin ) * 0.5f;
+}
+
+void GenerateMeshLODs( Geometry::StagedMesh & _stagedMesh )
+{
+  Geometry::Mesh & mesh = _stagedMesh.mMesh;
+  const Vertex * vertices = (const Vertex *) ( _stagedMesh.mVertexStorage.empty() ? _stagedMesh.mCachedVertices : _stagedMesh.mVertexStorage.data() );
+  const unsigned int * faces = (const unsigned int *) ( _stagedMesh.mFaceStorage.empty() ? _stagedMesh.mCachedFaces : _stagedMesh.mFaceStorage.data() );
+
+  std::vector<Simplifier::Level> levels;
+  Simplifier::Simplify( &vertices[ 0 ].v3Vector.x, sizeof( Vertex ), mesh.mVertexCount, faces, mesh.mTriangleCount, Geometry::MAX_LODS, levels );
+
+  const float radius = GetMeshRadius( mesh );
+  mesh.mLODCount = 0;
+  _stagedMesh.mLODFaceStorage.clear();
+  for ( int i = 0; i < levels.size(); i++ )
+  {
+    Geometry::LOD & lod = mesh.mLODs[ mesh.mLODCount++ ];
+    lod.mTriangleCount = (int) levels[ i ].mIndices.size() / 3;
+    lod.mIndexOffset = 0;
+    lod.mError = radius > 0.0f ? levels[ i ].mError / radius : 0.0f;
+    _stagedMesh.mLODFaceStorage.insert( _stagedMesh.mLODFaceStorage.end(), levels[ i ].mIndices.begin(), levels[ i ].mIndices.end() );
+  }
+}
+
+void ClearMeshLODs( Geometry::Staging & _staging )
+{
+  for ( int i = 0; i < _staging.mMeshes.size(); i++ )
+  {
+    _staging.mMeshes[ i ].mMesh.mLODCount = 0;
+    std::vector<unsigned int>().swap( _staging.mMeshes[ i ].mLODFaceStorage );
+  }
+}
+
+// The LOD file shares the header of the mesh cache, so it goes stale the same
+// way; the table holds the LODs of every staged mesh in order
+bool LoadMeshLODs( const char * _path, const char * _lodPath, Geometry::Staging & _staging )
+{
+  uint64_t sourceSize = 0;
+  int64_t sourceModifiedTime = 0;
+  if ( !MeshCache::GetSourceStamp( _path, sourceSize, sourceModifiedTime ) )
+  {
+    return false;
+  }
+
+  MeshCache::MappedFile file;
+  if ( !file.Open( _lodPath ) || file.GetSize() < sizeof( MeshCache::Header ) )
+  {
+    return false;
+  }
+
+  MeshCache::Header header;
+  memcpy( &header, file.GetData(), sizeof( MeshCache::Header ) );
+  MeshCache::Reader reader( file.GetData(), header.mTableOffset + header.mTableSize, header.mTableOffset );
+  uint32_t version = 0;
+  uint32_t meshCount = 0;
+  if ( !IsCacheHeaderCurrent( header, file.GetSize(), sourceSize, sourceModifiedTime )
+    || !reader.Read( version ) || version != LOD_FORMAT_VERSION
+    || !reader.Read( meshCount ) || meshCount != _staging.mMeshes.size() )
+  {
+    printf( "[geometry] LOD file '%s' is stale, regenerating\n", _lodPath );
+    return false;
+  }
+
+  bool corrupt = false;
+  for ( uint32_t i = 0; i < meshCount && !corrupt; i++ )
+  {
+    Geometry::StagedMesh & stagedMesh = _staging.mMeshes[ i ];
+    Geometry::Mesh & mesh = stagedMesh.mMesh;
+
+    uint32_t vertexCount = 0;
+    uint32_t triangleCount = 0;
+    uint32_t lodCount = 0;
+    reader.Read( vertexCount );
+    reader.Read( triangleCount );
+    reader.Read( lodCount );
+    if ( !reader.IsValid() || vertexCount != mesh.mVertexCount || triangleCount != mesh.mTriangleCount || lodCount > Geometry::MAX_LODS )
+    {
+      corrupt = true;
+      break;
+    }
+
+    const float radius = GetMeshRadius( mesh );
+    for ( uint32_t j = 0; j < lodCount; j++ )
+    {
+      CachedLOD cachedLOD;
+      const unsigned int * faces = reader.Read( cachedLOD ) ? (const unsigned int *) reader.GetBlob( cachedLOD.mIndexOffset, sizeof( unsigned int ) * 3 * (uint64_t) cachedLOD.mTriangleCount ) : NULL;
+      if ( !faces )
+      {
+        corrupt = true;
+        break;
+      }
+
+      Geometry::LOD & lod = mesh.mLODs[ mesh.mLODCount++ ];
+      lod.mTriangleCount = cachedLOD.mTriangleCount;
+      lod.mIndexOffset = 0;
+      lod.mError = radius > 0.0f ? cachedLOD.mError / radius : 0.0f;
+      stagedMesh.mLODFaceStorage.insert( stagedMesh.mLODFaceStorage.end(), faces, faces + cachedLOD.mTriangleCount * 3 );
+    }
+  }
+
+  if ( corrupt || !reader.IsValid() )
+  {
+    printf( "[geometry] LOD file '%s' is corrupt, regenerating\n", _lodPath );
+    ClearMeshLODs( _staging );
+    return false;
+  }
+
+  printf( "[geometry] Loaded LODs from '%s'\n", _lodPath );
+  return true;
+}
+
+void WriteMeshLODs( const char * _path, const char * _lodPath, const Geometry::Staging & _staging )
+{
+  uint64_t sourceSize = 0;
+  int64_t sourceModifiedTime = 0;
+  MeshCache::Writer writer;
+  if ( !MeshCache::GetSourceStamp( _path, sourceSize, sourceModifiedTime ) || !writer.Open( _lodPath ) )
+  {
+    return;
+  }
+
+  writer.Write( LOD_FORMAT_VERSION );
+  writer.Write( (uint32_t) _staging.mMeshes.size() );
+  for ( int i = 0; i < _staging.mMeshes.size(); i++ )
+  {
+    const Geometry::StagedMesh & stagedMesh = _staging.mMeshes[ i ];
+    const Geometry::Mesh & mesh = stagedMesh.mMesh;
+    writer.Write( (uint32_t) mesh.mVertexCount );
+    writer.Write( (uint32_t) mesh.mTriangleCount );
+    writer.Write( (uint32_t) mesh.mLODCount );
+
+    // Errors are stored in mesh units, like the bounds they are relative to
+    const float radius = GetMeshRadius( mesh );
+    const unsigned int * faces = stagedMesh.mLODFaceStorage.data();
+    for ( int j = 0; j < mesh.mLODCount; j++ )
+    {
+      CachedLOD cachedLOD;
+      cachedLOD.mTriangleCount = mesh.mLODs[ j ].mTriangleCount;
+      cachedLOD.mError = mesh.mLODs[ j ].mError * radius;
+      cachedLOD.mIndexOffset = writer.WriteBlob( faces, sizeof( unsigned int ) * 3 * (uint64_t) cachedLOD.mTriangleCount );
+      writer.Write( cachedLOD );
+      faces += cachedLOD.mTriangleCount * 3;
+    }
+  }
+
+  MeshCache::Header header;
+  MeshCache::InitHeader( header );
+  header.mImportFlags = gImportFlags;
+  header.mImportMaxBones = gImportMaxBones;
+  header.mVertexSize = sizeof( Vertex );
+  header.mSourceSize = sourceSize;
+  header.mSourceModifiedTime = sourceModifiedTime;
+  if ( writer.Close( header ) )
+  {
+    printf( "[geometry] Wrote LOD file '%s'\n", _lodPath );
+  }
+}
+
+// Loads the LODs saved next to the model, or simplifies every large enough
+// mesh, in parallel across meshes, and saves them for the next load
+void StageMeshLODs( const char * _path, Geometry::Staging & _staging )
+{
+  const std::string lodPath = std::string( _path ) + ".foxolod";
+  if ( _staging.mUseCache && LoadMeshLODs( _path, lodPath.c_str(), _staging ) )
+  {
+    return;
+  }
+
+  printf( "[geometry] Generating LODs\n" );
+  std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+  ThreadPool::Get().ParallelFor( (int) _staging.mMeshes.size(), [ &_staging ]( int _index )
+  {
+    if ( _staging.mMeshes[ _index ].mMesh.mTriangleCount >= LOD_MIN_TRIANGLES )
+    {
+      GenerateMeshLODs( _staging.mMeshes[ _index ] );
+    }
+  } );
+  printf( "[geometry] Generated LODs in %.2f ms\n", std::chrono::duration<float, std::milli>( std::chrono::high_resolution_clock::now() - start ).count() );
+
+  if ( _staging.mUseCache )
+  {
+    WriteMeshLODs( _path, lodPath.c_str(), _staging );
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Vertex order
+
+void AnalyzeMeshVertexCache( const Geometry::StagedMesh & _stagedMesh, float & _acmr, float & _atvr )
+{
+  const unsigned int * faces = (const unsigned int *) ( _stagedMesh.mFaceStorage.empty() ? _stagedMesh.mCachedFaces : _stagedMesh.mFaceStorage.data() );
+  MeshOptimizer::AnalyzeVertexCache( faces, _stagedMesh.mMesh.mTriangleCount, _stagedMesh.mMesh.mVertexCount, _acmr, _atvr );
+}
+
+// Triangle order of the mesh and its LODs
+void OptimizeMeshTriangles( Geometry::StagedMesh & _stagedMesh )
+{
+  Geometry::Mesh & mesh = _stagedMesh.mMesh;
+
+  // Both get rewritten, so cached data is copied out of the mapping first
+  if ( _stagedMesh.mVertexStorage.empty() )
+  {
+    const unsigned char * vertices = (const unsigned char *) _stagedMesh.mCachedVertices;
+    _stagedMesh.mVertexStorage.assign( vertices, vertices + sizeof( Vertex ) * mesh.mVertexCount );
+  }
+  if ( _stagedMesh.mFaceStorage.empty() )
+  {
+    const unsigned int * faces = (const unsigned int *) _stagedMesh.mCachedFaces;
+    _stagedMesh.mFaceStorage.assign( faces, faces + mesh.mTriangleCount * 3 );
+  }
+  const Vertex * vertices = (const Vertex *) _stagedMesh.mVertexStorage.data();
+
+  std::vector<unsigned int> clusters;
+  MeshOptimizer::OptimizeVertexCache( _stagedMesh.mFaceStorage.data(), mesh.mTriangleCount, mesh.mVertexCount, &clusters );
+  MeshOptimizer::OptimizeOverdraw( _stagedMesh.mFaceStorage.data(), mesh.mTriangleCount, &vertices[ 0 ].v3Vector.x, sizeof( Vertex ), mesh.mVertexCount, clusters );
+
+  unsigned int * lodFaces = _stagedMesh.mLODFaceStorage.data();
+  for ( int i = 0; i < mesh.mLODCount; i++ )
+  {
+    MeshOptimizer::OptimizeVertexCache( lodFaces, mesh.mLODs[ i ].mTriangleCount, mesh.mVertexCount );
+    lodFaces += mesh.mLODs[ i ].mTriangleCount * 3;
+  }
+}
+
+// Building meshlets throws the triangle order away again, but a meshlet has
+// few enough vertices to be optimized on its own with local indices
+void OptimizeMeshletTriangles( Geometry::StagedMesh & _stagedMesh )
+{
+  std::vector<unsigned int> localToMesh;
+  std::vector<unsigned int> localFaces;
+  std::unordered_map<unsigned int, unsigned int> meshToLocal;
+  for ( size_t i = 0; i < _stagedMesh.mMeshlets.size(); i++ )
+  {
+    const Geometry::Meshlet & meshlet = _stagedMesh.mMeshlets[ i ];
+    unsigned int * faces = _stagedMesh.mFaceStorage.data() + meshlet.mFirstTriangle * 3;
+
+    localToMesh.clear();
+    localFaces.resize( meshlet.mTriangleCount * 3 );
+    meshToLocal.clear();
+    for ( int j = 0; j < meshlet.mTriangleCount * 3; j++ )
+    {
+      std::unordered_map<unsigned int, unsigned int>::iterator it = meshToLocal.find( faces[ j ] );
+      if ( it == meshToLocal.end() )
+      {
+        it = meshToLocal.insert( std::make_pair( faces[ j ], (unsigned int) localToMesh.size() ) ).first;
+        localToMesh.push_back( faces[ j ] );
+      }
+      localFaces[ j ] = it->second;
+    }
+
+    MeshOptimizer::OptimizeVertexCache( localFaces.data(), meshlet.mTriangleCount, (int) localToMesh.size() );
+    for ( int j = 0; j < meshlet.mTriangleCount * 3; j++ )
+    {
+      faces[ j ] = localToMesh[ localFaces[ j ] ];
+    }
+  }
+}
+
+// Vertex order, once the triangle order is final; LODs draw from the same
+// vertices, so they follow the renumbering
+void OptimizeMeshVertexFetch( Geometry::StagedMesh & _stagedMesh )
+{
+  Geometry::Mesh & mesh = _stagedMesh.mMesh;
+  std::vector<unsigned int> remap;
+  MeshOptimizer::OptimizeVertexFetch( _stagedMesh.mFaceStorage.data(), _stagedMesh.mFaceStorage.size(), _stagedMesh.mVertexStorage.data(), sizeof( Vertex ), mesh.mVertexCount, remap );
+  for ( size_t i = 0; i < _stagedMesh.mLODFaceStorage.size(); i++ )
+  {
+    _stagedMesh.mLODFaceStorage[ i ] = remap[ _stagedMesh.mLODFaceStorage[ i ] ];
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Meshlets
+
+const int MESHLET_MAX_VERTICES = 64;
+const int MESHLET_MAX_TRIANGLES = 128;
+// Smaller meshes are only culled as a whole
+const int MESHLET_MIN_TRIANGLES = MESHLET_MAX_TRIANGLES * 4;
+
+void ComputeMeshletBounds( const Vertex * _vertices, const unsigned int * _faces, Geometry::Meshlet & _meshlet )
+{
+  const unsigned int * faces = _faces + _meshlet.mFirstTriangle * 3;
+  const int indexCount = _meshlet.mTriangleCount * 3;
+
+  glm::vec3 aabbMin = _vertices[ faces[ 0 ] ].v3Vector;
+  glm::vec3 aabbMax = aabbMin;
+  for ( int i = 1; i < indexCount; i++ )
+  {
+    aabbMin = glm::min( aabbMin, _vertices[ faces[ i ] ].v3Vector );
+    aabbMax = glm::max( aabbMax, _vertices[ faces[ i ] ].v3Vector );
+  }
+  _meshlet.mCenter = ( aabbMin + aabbMax ) * 0.5f;
+  _meshlet.mRadius = 0.0f;
+  for ( int i = 0; i < indexCount; i++ )
+  {
+    _meshlet.mRadius = std::max( _meshlet.mRadius, glm::length( _vertices[ faces[ i ] ].v3Vector - _meshlet.mCenter ) );
+  }
+
+  // The cone around the average face normal that contains every face normal;
+  // degenerate triangles have no facing and are left out. Import flips the
+  // winding, so front faces are clockwise and the normal is ( c - a ) x ( b - a ).
+  glm::vec3 normals[ MESHLET_MAX_TRIANGLES ];
+  int normalCount = 0;
+  glm::vec3 axis( 0.0f );
+  for ( int i = 0; i < indexCount; i += 3 )
+  {
+    const glm::vec3 & a = _vertices[ faces[ i ] ].v3Vector;
+    const glm::vec3 normal = glm::cross( _vertices[ faces[ i + 2 ] ].v3Vector - a, _vertices[ faces[ i + 1 ] ].v3Vector - a );
+    const float length = glm::length( normal );
+    if ( length > 0.0f )
+    {
+      normals[ normalCount ] = normal / length;
+      axis += normals[ normalCount++ ];
+    }
+  }
+
+  const float axisLength = glm::length( axis );
+  _meshlet.mConeAxis = axisLength > 0.0f ? axis / axisLength : glm::vec3( 0.0f, 0.0f, 1.0f );
+  float minDot = axisLength > 0.0f ? 1.0f : -1.0f;
+  for ( int i = 0; i < normalCount; i++ )
+  {
+    minDot = std::min( minDot, glm::dot( normals[ i ], _meshlet.mConeAxis ) );
+  }
+  _meshlet.mConeCutoff = minDot <= 0.0f ? 1.0f : sqrtf( 1.0f - minDot * minDot );
+}
+
+// Reorders the triangles of a mesh into meshlets, growing each one from the
+// neighbours of its last triangle and preferring triangles that add the
+// fewest new vertices, so meshlets stay compact and share few vertices
+void BuildMeshlets( Geometry::StagedMesh & _stagedMesh )
+{
+  const Geometry::Mesh & mesh = _stagedMesh.mMesh;
+  const Vertex * vertices = (const Vertex *) ( _stagedMesh.mVertexStorage.empty() ? _stagedMesh.mCachedVertices : _stagedMesh.mVertexStorage.data() );
+  const unsigned int * faces = (const unsigned int *) ( _stagedMesh.mFaceStorage.empty() ? _stagedMesh.mCachedFaces : _stagedMesh.mFaceStorage.data() );
+  const int triangleCount = mesh.mTriangleCount;
+
+  // Triangles around each vertex
+  std::vector<unsigned int> adjacencyOffsets( mesh.mVertexCount + 1, 0 );
+  for ( int i = 0; i < triangleCount * 3; i++ )
+  {
+    adjacencyOffsets[ faces[ i ] + 1 ]++;
+  }
+  for ( int i = 0; i < mesh.mVertexCount; i++ )
+  {
+    adjacencyOffsets[ i + 1 ] += adjacencyOffsets[ i ];
+  }
+  std::vector<unsigned int> adjacency( triangleCount * 3 );
+  std::vector<unsigned int> adjacencyFill( adjacencyOffsets.begin(), adjacencyOffsets.end() - 1 );
+  for ( int i = 0; i < triangleCount * 3; i++ )
+  {
+    adjacency[ adjacencyFill[ faces[ i ] ]++ ] = i / 3;
+  }
+
+  std::vector<unsigned char> emitted( triangleCount, 0 );
+  std::vector<int> vertexMeshlet( mesh.mVertexCount, -1 ); // the last meshlet using each vertex
+  std::vector<unsigned int> reordered;
+  reordered.reserve( triangleCount * 3 );
+  std::vector<Geometry::Meshlet> meshlets;
+
+  Geometry::Meshlet meshlet;
+  meshlet.mFirstTriangle = 0;
+  meshlet.mTriangleCount = 0;
+  unsigned int meshletVertices[ MESHLET_MAX_VERTICES ];
+  int meshletVertexCount = 0;
+  int lastTriangle = -1;
+  int scan = 0;
+
+  auto countNewVertices = [ & ]( int _triangle )
+  {
+    const int meshletIndex = (int) meshlets.size();
+    return ( vertexMeshlet[ faces[ _triangle * 3 + 0 ] ] != meshletIndex ? 1 : 0 )
+      + ( vertexMeshlet[ faces[ _triangle * 3 + 1 ] ] != meshletIndex ? 1 : 0 )
+      + ( vertexMeshlet[ faces[ _triangle * 3 + 2 ] ] != meshletIndex ? 1 : 0 );
+  };
+  // Fewest new vertices first, then closest to the meshlet's center
+  glm::vec3 meshletSum( 0.0f );
+  auto findAround = [ & ]( unsigned int _vertex, int & _best, int & _bestNew, float & _bestDistance )
+  {
+    const glm::vec3 center = meshletVertexCount ? meshletSum / (float) meshletVertexCount : glm::vec3( 0.0f );
+    for ( unsigned int i = adjacencyOffsets[ _vertex ]; i < adjacencyOffsets[ _vertex + 1 ]; i++ )
+    {
+      const int triangle = adjacency[ i ];
+      if ( emitted[ triangle ] )
+      {
+        continue;
+      }
+      const int newVertices = countNewVertices( triangle );
+      if ( newVertices > _bestNew )
+      {
+        continue;
+      }
+      const float distance = glm::length( vertices[ faces[ triangle * 3 + 0 ] ].v3Vector + vertices[ faces[ triangle * 3 + 1 ] ].v3Vector + vertices[ faces[ triangle * 3 + 2 ] ].v3Vector - center * 3.0f );
+      if ( newVertices < _bestNew || distance < _bestDistance )
+      {
+        _best = triangle;
+        _bestNew = newVertices;
+        _bestDistance = distance;
+      }
+    }
+  };
+
+  int emittedCount = 0;
+  while ( emittedCount < triangleCount )
+  {
+    // Around the last triangle first, then anywhere around the meshlet (or
+    // the previous one, when starting a new meshlet), then the next triangle
+    // in the original order
+    int best = -1;
+    int bestNew = 4;
+    float bestDistance = FLT_MAX;
+    for ( int k = 0; lastTriangle >= 0 && k < 3; k++ )
+    {
+      findAround( faces[ lastTriangle * 3 + k ], best, bestNew, bestDistance );
+    }
+    for ( int k = 0; best < 0 && k < meshletVertexCount; k++ )
+    {
+      findAround( meshletVertices[ k ], best, bestNew, bestDistance );
+    }
+    if ( best < 0 )
+    {
+      while ( emitted[ scan ] )
+      {
+        scan++;
+      }
+      best = scan;
+      bestNew = countNewVertices( best );
+    }
+
+    if ( meshlet.mTriangleCount && ( meshlet.mTriangleCount == MESHLET_MAX_TRIANGLES || meshletVertexCount + bestNew > MESHLET_MAX_VERTICES ) )
+    {
+      ComputeMeshletBounds( vertices, reordered.data(), meshlet );
+      meshlets.push_back( meshlet );
+      meshlet.mFirstTriangle += meshlet.mTriangleCount;
+      meshlet.mTriangleCount = 0;
+      lastTriangle = -1;
+      continue;
+    }
+
+    if ( !meshlet.mTriangleCount )
+    {
+      meshletVertexCount = 0;
+      meshletSum = glm::vec3( 0.0f );
+    }
+    for ( int k = 0; k < 3; k++ )
+    {
+      const unsigned int vertex = faces[ best * 3 + k ];
+      if ( vertexMeshlet[ vertex ] != (int) meshlets.size() )
+      {
+        vertexMeshlet[ vertex ] = (int) meshlets.size();
+        meshletVertices[ meshletVertexCount++ ] = vertex;
+        meshletSum += vertices[ vertex ].v3Vector;
+      }
+      reordered.push_back( vertex );
+    }
+    emitted[ best ] = 1;
+    emittedCount++;
+    meshlet.mTriangleCount++;
+    lastTriangle = best;
+  }
+  if ( meshlet.mTriangleCount )
+  {
+    ComputeMeshletBounds( vertices, reordered.data(), meshlet );
+    meshlets.push_back( meshlet );
+  }
+
+  _stagedMesh.mFaceStorage.swap( reordered );
+  _stagedMesh.mMeshlets.swap( meshlets );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Compact vertices
+
+glm::vec2 EncodeOctahedral( const glm::vec3 & _vector )
+{
+  const float sum = fabsf( _vector.x ) + fabsf( _vector.y ) + fabsf( _vector.z );
+  if ( sum <= 0.0f )
+  {
+    return glm::vec2( 0.0f );
+  }
+
+  glm::vec2 result( _vector.x / sum, _vector.y / sum );
+  if ( _vector.z < 0.0f )
+  {
+    result = glm::vec2(
+      ( 1.0f - fabsf( result.y ) ) * ( result.x >= 0.0f ? 1.0f : -1.0f ),
+      ( 1.0f - fabsf( result.x ) ) * ( result.y >= 0.0f ? 1.0f : -1.0f ) );
+  }
+  return result;
+}
+
+int16_t QuantizeSigned( float _value, float _maximum )
+{
+  return (int16_t) roundf( glm::clamp( _value, -1.0f, 1.0f ) * _maximum );
+}
+
+void CompactMeshVertices( Geometry::StagedMesh & _stagedMesh )
+{
+  const Geometry::Mesh & mesh = _stagedMesh.mMesh;
+  const Vertex * vertices = (const Vertex *) ( _stagedMesh.mVertexStorage.empty() ? _stagedMesh.mCachedVertices : _stagedMesh.mVertexStorage.data() );
+
+  const glm::vec3 extent = mesh.mAABBMax - mesh.mAABBMin;
+  const glm::vec3 scale(
+    extent.x > 0.0f ? 65535.0f / extent.x : 0.0f,
+    extent.y > 0.0f ? 65535.0f / extent.y : 0.0f,
+    extent.z > 0.0f ? 65535.0f / extent.z : 0.0f );
+
+  std::vector<unsigned char> compactStorage( sizeof( CompactVertex ) * mesh.mVertexCount );
+  CompactVertex * compactVertices = (CompactVertex *) compactStorage.data();
+  for ( int i = 0; i < mesh.mVertexCount; i++ )
+  {
+    const Vertex & vertex = vertices[ i ];
+    CompactVertex & compactVertex = compactVertices[ i ];
+
+    const glm::vec3 position = glm::clamp( ( vertex.v3Vector - mesh.mAABBMin ) * scale, glm::vec3( 0.0f ), glm::vec3( 65535.0f ) );
+    compactVertex.nPosition[ 0 ] = (uint16_t) roundf( position.x );
+    compactVertex.nPosition[ 1 ] = (uint16_t) roundf( position.y );
+    compactVertex.nPosition[ 2 ] = (uint16_t) roundf( position.z );
+    compactVertex.nPadding = 0;
+
+    const glm::vec2 normal = EncodeOctahedral( vertex.v3Normal );
+    compactVertex.nNormal[ 0 ] = QuantizeSigned( normal.x, 32767.0f );
+    compactVertex.nNormal[ 1 ] = QuantizeSigned( normal.y, 32767.0f );
+
+    const bool bitangentFlipped = glm::dot( glm::cross( vertex.v3Normal, vertex.v3Tangent ), vertex.v3Binormal ) < 0.0f;
+    const glm::vec2 tangent = EncodeOctahedral( vertex.v3Tangent );
+    compactVertex.nTangent[ 0 ] = QuantizeSigned( tangent.x, 32767.0f );
+    compactVertex.nTangent[ 1 ] = (int16_t) ( QuantizeSigned( tangent.y, 16383.0f ) * 2 + ( bitangentFlipped ? 1 : 0 ) );
+
+    compactVertex.nTexcoord[ 0 ] = glm::packHalf1x16( vertex.fTexcoord.x );
+    compactVertex.nTexcoord[ 1 ] = glm::packHalf1x16( vertex.fTexcoord.y );
+  }
+
+  _stagedMesh.mVertexStorage.swap( compactStorage );
+}
+
+// Small meshes get 16-bit indices, LODs included. The mesh cache stores
+// 32-bit ones, and faces still in its mapping are uploaded from it as they
+// are rather than copied out to be repacked on every load.
+void PackMeshIndices( Geometry::StagedMesh & _stagedMesh )
+{
+  Geometry::Mesh & mesh = _stagedMesh.mMesh;
+  mesh.mIndexType = GL_UNSIGNED_INT;
+  if ( mesh.mVertexCount > 65536 || _stagedMesh.mFaceStorage.empty() )
+  {
+    return;
+  }
+
+  const unsigned int * faces = _stagedMesh.mFaceStorage.data();
+  const size_t indexCount = (size_t) mesh.mTriangleCount * 3;
+  _stagedMesh.mShortFaceStorage.resize( indexCount + _stagedMesh.mLODFaceStorage.size() );
+  for ( size_t i = 0; i < indexCount; i++ )
+  {
+    _stagedMesh.mShortFaceStorage[ i ] = (unsigned short) faces[ i ];
+  }
+  for ( size_t i = 0; i < _stagedMesh.mLODFaceStorage.size(); i++ )
+  {
+    _stagedMesh.mShortFaceStorage[ indexCount + i ] = (unsigned short) _stagedMesh.mLODFaceStorage[ i ];
+  }
+  mesh.mIndexType = GL_UNSIGNED_SHORT;
+
+  std::vector<unsigned int>().swap( _stagedMesh.mFaceStorage );
+  std::vector<unsigned int>().swap( _stagedMesh.mLODFaceStorage );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Optimized mesh file
+
+// Saved optimized meshes are rebuilt when this changes, e.g. with the
+// optimizer, the meshlet builder or the vertex formats
+const uint32_t OPTIMIZED_FORMAT_VERSION = 1;
+
+#pragma pack(1)
+struct OptimizedMesh
+{
+  uint32_t mVertexCount;
+  uint32_t mTriangleCount;
+  uint32_t mIndexType;
+  uint32_t mLODCount;
+  uint32_t mMeshletCount;
+  float mImportedACMR;
+  float mImportedATVR;
+  float mACMR;
+  float mATVR;
+  uint64_t mVertexOffset;
+  uint64_t mIndexOffset; // in mIndexType, the LOD indices follow the mesh's
+  uint64_t mMeshletOffset;
+};
+struct OptimizedLOD
+{
+  uint32_t mTriangleCount;
+  float mError;
+};
+#pragma pack()
+
+// Everything the saved data depends on besides the import
+uint32_t GetOptimizedMeshOptions( const Geometry::Staging & _staging )
+{
+  return ( _staging.mOptimizeMeshes ? 1u : 0u )
+    | ( _staging.mBuildMeshlets ? 2u : 0u )
+    | ( _staging.mGenerateLODs ? 4u : 0u )
+    | ( (uint32_t) _staging.mVertexFormat << 8 );
+}
+
+// Like the LOD file, the optimized mesh file shares the header of the mesh
+// cache; its table starts with the load options it was built with. On a hit
+// the mapping replaces the mesh cache's and is uploaded from directly.
+bool LoadOptimizedMeshes( const char * _path, const char * _optimizedPath, Geometry::Staging & _staging )
+{
+  uint64_t sourceSize = 0;
+  int64_t sourceModifiedTime = 0;
+  if ( !MeshCache::GetSourceStamp( _path, sourceSize, sourceModifiedTime ) )
+  {
+    return false;
+  }
+
+  MeshCache::MappedFile * file = new MeshCache::MappedFile();
+  if ( !file->Open( _optimizedPath ) || file->GetSize() < sizeof( MeshCache::Header ) )
+  {
+    delete file;
+    return false;
+  }
+
+  MeshCache::Header header;
+  memcpy( &header, file->GetData(), sizeof( MeshCache::Header ) );
+  MeshCache::Reader reader( file->GetData(), header.mTableOffset + header.mTableSize, header.mTableOffset );
+  uint32_t version = 0;
+  uint32_t options = 0;
+  uint32_t meshCount = 0;
+  if ( !IsCacheHeaderCurrent( header, file->GetSize(), sourceSize, sourceModifiedTime )
+    || !reader.Read( version ) || version != OPTIMIZED_FORMAT_VERSION
+    || !reader.Read( options ) || options != GetOptimizedMeshOptions( _staging )
+    || !reader.Read( meshCount ) || meshCount != _staging.mMeshes.size() )
+  {
+    printf( "[geometry] Optimized mesh file '%s' is stale, rebuilding\n", _optimizedPath );
+    delete file;
+    return false;
+  }
+
+  // Everything is checked before any staged mesh is touched, so a corrupt
+  // file still leaves the imported data to rebuild from
+  struct LoadedMesh
+  {
+    OptimizedMesh mOptimized;
+    Geometry::LOD mLODs[ Geometry::MAX_LODS ];
+    const void * mVertices;
+    const void * mFaces;
+    const Geometry::Meshlet * mMeshlets;
+  };
+  std::vector<LoadedMesh> loadedMeshes( meshCount );
+  const unsigned int vertexSize = GetVertexSize( _staging.mVertexFormat );
+  bool corrupt = false;
+  for ( uint32_t i = 0; i < meshCount && !corrupt; i++ )
+  {
+    LoadedMesh & loaded = loadedMeshes[ i ];
+    OptimizedMesh & optimized = loaded.mOptimized;
+    const Geometry::Mesh & mesh = _staging.mMeshes[ i ].mMesh;
+    if ( !reader.Read( optimized ) || optimized.mVertexCount != mesh.mVertexCount || optimized.mTriangleCount != mesh.mTriangleCount
+      || ( optimized.mIndexType != GL_UNSIGNED_SHORT && optimized.mIndexType != GL_UNSIGNED_INT ) || optimized.mLODCount > Geometry::MAX_LODS )
+    {
+      corrupt = true;
+      break;
+    }
+
+    uint64_t indexCount = (uint64_t) optimized.mTriangleCount * 3;
+    for ( uint32_t j = 0; j < optimized.mLODCount; j++ )
+    {
+      OptimizedLOD optimizedLOD;
+      if ( !reader.Read( optimizedLOD ) )
+      {
+        corrupt = true;
+        break;
+      }
+      loaded.mLODs[ j ].mTriangleCount = optimizedLOD.mTriangleCount;
+      loaded.mLODs[ j ].mIndexOffset = 0;
+      loaded.mLODs[ j ].mError = optimizedLOD.mError;
+      indexCount += (uint64_t) optimizedLOD.mTriangleCount * 3;
+    }
+
+    loaded.mVertices = reader.GetBlob( optimized.mVertexOffset, (uint64_t) vertexSize * optimized.mVertexCount );
+    loaded.mFaces = reader.GetBlob( optimized.mIndexOffset, GetIndexSize( optimized.mIndexType ) * indexCount );
+    loaded.mMeshlets = (const Geometry::Meshlet *) reader.GetBlob( optimized.mMeshletOffset, sizeof( Geometry::Meshlet ) * (uint64_t) optimized.mMeshletCount );
+    if ( !loaded.mVertices || !loaded.mFaces || ( optimized.mMeshletCount && !loaded.mMeshlets ) )
+    {
+      corrupt = true;
+    }
+  }
+
+  if ( corrupt || !reader.IsValid() )
+  {
+    printf( "[geometry] Optimized mesh file '%s' is corrupt, rebuilding\n", _optimizedPath );
+    delete file;
+    return false;
+  }
+
+  for ( uint32_t i = 0; i < meshCount; i++ )
+  {
+    const LoadedMesh & loaded = loadedMeshes[ i ];
+    Geometry::StagedMesh & stagedMesh = _staging.mMeshes[ i ];
+    stagedMesh.mCachedVertices = loaded.mVertices;
+    stagedMesh.mCachedFaces = loaded.mFaces;
+    std::vector<unsigned char>().swap( stagedMesh.mVertexStorage );
+    std::vector<unsigned int>().swap( stagedMesh.mFaceStorage );
+    std::vector<unsigned short>().swap( stagedMesh.mShortFaceStorage );
+    std::vector<unsigned int>().swap( stagedMesh.mLODFaceStorage );
+    stagedMesh.mMeshlets.assign( loaded.mMeshlets, loaded.mMeshlets + loaded.mOptimized.mMeshletCount );
+
+    Geometry::Mesh & mesh = stagedMesh.mMesh;
+    mesh.mIndexType = loaded.mOptimized.mIndexType;
+    mesh.mLODCount = (int) loaded.mOptimized.mLODCount;
+    for ( int j = 0; j < mesh.mLODCount; j++ )
+    {
+      mesh.mLODs[ j ] = loaded.mLODs[ j ];
+    }
+    mesh.mImportedACMR = loaded.mOptimized.mImportedACMR;
+    mesh.mImportedATVR = loaded.mOptimized.mImportedATVR;
+    mesh.mACMR = loaded.mOptimized.mACMR;
+    mesh.mATVR = loaded.mOptimized.mATVR;
+  }
+
+  // Nothing points into the mesh cache anymore
+  delete _staging.mCacheFile;
+  _staging.mCacheFile = file;
+
+  printf( "[geometry] Loaded optimized meshes from '%s'\n", _optimizedPath );
+  return true;
+}
+
+void WriteOptimizedMeshes( const char * _path, const char * _optimizedPath, const Geometry::Staging & _staging )
+{
+  uint64_t sourceSize = 0;
+  int64_t sourceModifiedTime = 0;
+  MeshCache::Writer writer;
+  if ( !MeshCache::GetSourceStamp( _path, sourceSize, sourceModifiedTime ) || !writer.Open( _optimizedPath ) )
+  {
+    return;
+  }
+
+  writer.Write( OPTIMIZED_FORMAT_VERSION );
+  writer.Write( GetOptimizedMeshOptions( _staging ) );
+  writer.Write( (uint32_t) _staging.mMeshes.size() );
+  const unsigned int vertexSize = GetVertexSize( _staging.mVertexFormat );
+  std::vector<unsigned int> faceStorage;
+  for ( int i = 0; i < _staging.mMeshes.size(); i++ )
+  {
+    const Geometry::StagedMesh & stagedMesh = _staging.mMeshes[ i ];
+    const Geometry::Mesh & mesh = stagedMesh.mMesh;
+
+    // Indices go out as they'll be uploaded, LODs appended
+    const void * faces = NULL;
+    uint64_t indexCount = (uint64_t) mesh.mTriangleCount * 3;
+    for ( int j = 0; j < mesh.mLODCount; j++ )
+    {
+      indexCount += (uint64_t) mesh.mLODs[ j ].mTriangleCount * 3;
+    }
+    if ( mesh.mIndexType == GL_UNSIGNED_SHORT )
+    {
+      faces = stagedMesh.mShortFaceStorage.data();
+    }
+    else
+    {
+      const unsigned int * meshFaces = (const unsigned int *) ( stagedMesh.mFaceStorage.empty() ? stagedMesh.mCachedFaces : stagedMesh.mFaceStorage.data() );
+      faceStorage.assign( meshFaces, meshFaces + mesh.mTriangleCount * 3 );
+      faceStorage.insert( faceStorage.end(), stagedMesh.mLODFaceStorage.begin(), stagedMesh.mLODFaceStorage.end() );
+      faces = faceStorage.data();
+    }
+
+    OptimizedMesh optimized;
+    optimized.mVertexCount = (uint32_t) mesh.mVertexCount;
+    optimized.mTriangleCount = (uint32_t) mesh.mTriangleCount;
+    optimized.mIndexType = (uint32_t) mesh.mIndexType;
+    optimized.mLODCount = (uint32_t) mesh.mLODCount;
+    optimized.mMeshletCount = (uint32_t) stagedMesh.mMeshlets.size();
+    optimized.mImportedACMR = mesh.mImportedACMR;
+    optimized.mImportedATVR = mesh.mImportedATVR;
+    optimized.mACMR = mesh.mACMR;
+    optimized.mATVR = mesh.mATVR;
+    optimized.mVertexOffset = writer.WriteBlob( stagedMesh.mVertexStorage.empty() ? stagedMesh.mCachedVertices : stagedMesh.mVertexStorage.data(), (uint64_t) vertexSize * mesh.mVertexCount );
+    optimized.mIndexOffset = writer.WriteBlob( faces, GetIndexSize( mesh.mIndexType ) * indexCount );
+    optimized.mMeshletOffset = writer.WriteBlob( stagedMesh.mMeshlets.data(), sizeof( Geometry::Meshlet ) * stagedMesh.mMeshlets.size() );
+    writer.Write( optimized );
+    for ( int j = 0; j < mesh.mLODCount; j++ )
+    {
+      OptimizedLOD optimizedLOD;
+      optimizedLOD.mTriangleCount = (uint32_t) mesh.mLODs[ j ].mTriangleCount;
+      optimizedLOD.mError = mesh.mLODs[ j ].mError;
+      writer.Write( optimizedLOD );
+    }
+  }
+
+  MeshCache::Header header;
+  MeshCache::InitHeader( header );
+  header.mImportFlags = gImportFlags;
+  header.mImportMaxBones = gImportMaxBones;
+  header.mVertexSize = sizeof( Vertex );
+  header.mSourceSize = sourceSize;
+  header.mSourceModifiedTime = sourceModifiedTime;
+  if ( writer.Close( header ) )
+  {
+    printf( "[geometry] Wrote optimized mesh file '%s'\n", _optimizedPath );
+  }
+}
+
+bool Geometry::LoadMesh( const char * _path )
+{
+  Staging staging;
+  if ( !StageMesh( _path, staging ) )
+  {
+    return false;
+  }
+
+  UploadStagedMesh( staging );
+
+  return true;
+}
+
+bool Geometry::StageMesh( const char * _path, Staging & _staging )
+{
+  std::string cachePath = std::string( _path ) + ".foxocache";
+  if ( !_staging.mUseCache || !LoadMeshCache( _path, cachePath.c_str(), _staging ) )
+  {
+    if ( !ImportMesh( _path, _staging.mUseCache ? cachePath.c_str() : NULL, _staging ) )
+    {
+      return false;
+    }
+  }
+
+  ReportLoadStage( _staging, Geometry::LOADSTAGE_VERTICES, true );
+
+  //////////////////////////////////////////////////////////////////////////
+  // Meshes without geometry were skipped, so map the scene's mesh indices to
+  // positions in the staged mesh array and drop references to missing ones
+  std::vector<int> meshRemap;
+  for ( int i = 0; i < _staging.mMeshes.size(); i++ )
+  {
+    const int index = _staging.mMeshes[ i ].mIndex;
+    if ( index >= meshRemap.size() )
+    {
+      meshRemap.resize( index + 1, -1 );
+    }
+    meshRemap[ index ] = i;
+    _staging.mMeshes[ i ].mIndex = i;
+  }
+
+  unsigned int nodeMeshCount = 0;
+  for ( int i = 0; i < _staging.mNodes.size(); i++ )
+  {
+    const unsigned int first = _staging.mNodeMeshOffsets[ i ];
+    const unsigned int last = _staging.mNodeMeshOffsets[ i + 1 ];
+    _staging.mNodeMeshOffsets[ i ] = nodeMeshCount;
+    for ( unsigned int j = first; j < last; j++ )
+    {
+      const unsigned int index = _staging.mNodeMeshes[ j ];
+      if ( index < meshRemap.size() && meshRemap[ index ] >= 0 )
+      {
+        _staging.mNodeMeshes[ nodeMeshCount++ ] = meshRemap[ index ];
+      }
+    }
+  }
+  if ( !_staging.mNodes.empty() )
+  {
+    _staging.mNodeMeshOffsets[ _staging.mNodes.size() ] = nodeMeshCount;
+  }
+  _staging.mNodeMeshes.resize( nodeMeshCount );
+
+  //////////////////////////////////////////////////////////////////////////
+  // Calculate node transforms
+  _staging.mMatrices = _staging.mNodes.size() ? new glm::mat4x4[ _staging.mNodes.size() ] : nullptr;
+  for ( int i = 0; i < _staging.mNodes.size(); i++ )
+  {
+    const int parentID = _staging.mNodeParents[ i ];
+
+    glm::mat4x4 matParent;
+    if ( parentID == -1 )
+    {
+      matParent = glm::mat4x4( 1.0f );
+    }
+    else
+    {
+      matParent = _staging.mMatrices[ _staging.mNodeMatrixSlots[ parentID ] ];
+    }
+
+    _staging.mMatrices[ _staging.mNodeMatrixSlots[ i ] ] = matParent * _staging.mNodes[ i ].mTransformation;
+  }
+
+  printf( "[geometry] Calculating AABB\n" );
+  std::vector<glm::vec3> nodeMeshMin( _staging.mNodeMeshes.size() );
+  std::vector<glm::vec3> nodeMeshMax( _staging.mNodeMeshes.size() );
+  bool aabbSet = false;
+  for ( int i = 0; i < _staging.mNodes.size(); i++ )
+  {
+    const glm::mat4x4 & matWorld = _staging.mMatrices[ _staging.mNodeMatrixSlots[ i ] ];
+    for ( unsigned int j = _staging.mNodeMeshOffsets[ i ]; j < _staging.mNodeMeshOffsets[ i + 1 ]; j++ )
+    {
+      const Geometry::Mesh & mesh = _staging.mMeshes[ _staging.mNodeMeshes[ j ] ].mMesh;
+
+      glm::vec3 & aabbMin = nodeMeshMin[ j ];
+      glm::vec3 & aabbMax = nodeMeshMax[ j ];
+      TransformBoundingBox( mesh.mAABBMin, mesh.mAABBMax, matWorld, aabbMin, aabbMax );
+
+      if ( !aabbSet )
+      {
+        _staging.mAABBMin = aabbMin;
+        _staging.mAABBMax = aabbMax;
+        aabbSet = true;
+      }
+      _staging.mAABBMin = glm::min( aabbMin, _staging.mAABBMin );
+      _staging.mAABBMax = glm::max( aabbMax, _staging.mAABBMax );
+    }
+  }
+  printf( "[geometry] Calculated AABB: (%.3f, %.3f, %.3f), (%.3f, %.3f, %.3f)\n", _staging.mAABBMin.x, _staging.mAABBMin.y, _staging.mAABBMin.z, _staging.mAABBMax.x, _staging.mAABBMax.y, _staging.mAABBMax.z );
+
+  _staging.mBVH.Build( (int) nodeMeshMin.size(), nodeMeshMin.data(), nodeMeshMax.data() );
+  printf( "[geometry] Built BVH: %d nodes over %d meshes\n", (int) _staging.mBVH.mNodes.size(), _staging.mBVH.GetItemCount() );
+
+  _staging.mModelDiagonal = glm::length( _staging.mAABBMax - _staging.mAABBMin );
+
+  // Whatever the options do to the meshes is saved next to the model, so
+  // with the same options it only happens on the first load
+  const bool optimized = _staging.mOptimizeMeshes || _staging.mBuildMeshlets || _staging.mVertexFormat == VERTEXFORMAT_COMPACT;
+  const std::string optimizedPath = std::string( _path ) + ".foxoopt";
+  if ( optimized && _staging.mUseCache && LoadOptimizedMeshes( _path, optimizedPath.c_str(), _staging ) )
+  {
+    ReportLoadStage( _staging, Geometry::LOADSTAGE_VERTICES, false );
+    _staging.mProgress = 1.0f;
+    return true;
+  }
+
+  // LODs are simplified from the full vertices, so before they get compacted
+  if ( _staging.mGenerateLODs )
+  {
+    StageMeshLODs( _path, _staging );
+  }
+
+  // The cache always holds full vertices, so the format can be picked per load
+  if ( _staging.mVertexFormat == VERTEXFORMAT_COMPACT )
+  {
+    printf( "[geometry] Compacting vertices\n" );
+  }
+  if ( _staging.mOptimizeMeshes )
+  {
+    printf( "[geometry] Optimizing vertex order\n" );
+  }
+  if ( _staging.mBuildMeshlets )
+  {
+    printf( "[geometry] Building meshlets\n" );
+  }
+  ThreadPool::Get().ParallelFor( (int) _staging.mMeshes.size(), [ &_staging ]( int _index )
+  {
+    StagedMesh & stagedMesh = _staging.mMeshes[ _index ];
+
+    // The cache simulation is only worth its time to show what optimizing gained
+    if ( _staging.mOptimizeMeshes )
+    {
+      AnalyzeMeshVertexCache( stagedMesh, stagedMesh.mMesh.mImportedACMR, stagedMesh.mMesh.mImportedATVR );
+      OptimizeMeshTriangles( stagedMesh );
+    }
+    if ( _staging.mBuildMeshlets && stagedMesh.mMesh.mTriangleCount >= MESHLET_MIN_TRIANGLES )
+    {
+      BuildMeshlets( stagedMesh );
+      if ( _staging.mOptimizeMeshes )
+      {
+        OptimizeMeshletTriangles( stagedMesh );
+      }
+    }
+    if ( _staging.mOptimizeMeshes )
+    {
+      OptimizeMeshVertexFetch( stagedMesh );
+      AnalyzeMeshVertexCache( stagedMesh, stagedMesh.mMesh.mACMR, stagedMesh.mMesh.mATVR );
+    }
+    if ( _staging.mVertexFormat == VERTEXFORMAT_COMPACT )
+    {
+      CompactMeshVertices( stagedMesh );
+    }
+    PackMeshIndices( stagedMesh );
+  } );
+
+  if ( optimized && _staging.mUseCache )
+  {
+    WriteOptimizedMeshes( _path, optimizedPath.c_str(), _staging );
+  }
+
+  ReportLoadStage( _staging, Geometry::LOADSTAGE_VERTICES, false );
+
+  _staging.mProgress = 1.0f;
+
+  return true;
+}
+
+void Geometry::UploadStagedMesh( Staging & _staging )
+{
+  UnloadMesh();
+  _staging.ReleaseDeferredTextures();
+
+  std::swap( mNodes, _staging.mNodes );
+  std::swap( mNodeParents, _staging.mNodeParents );
+  std::swap( mNodeMatrixSlots, _staging.mNodeMatrixSlots );
+  std::swap( mNodeMeshOffsets, _staging.mNodeMeshOffsets );
+  std::swap( mNodeMeshes, _staging.mNodeMeshes );
+  std::swap( mMaterials, _staging.mMaterials );
+  std::swap( mEmbeddedTextures, _staging.mEmbeddedTextures );
+  std::swap( mMatrices, _staging.mMatrices );
+  std::swap( mBVH, _staging.mBVH );
+  mBoundsValid = false; // the bounding spheres get fitted along with the first refit
+  mAABBMin = _staging.mAABBMin;
+  mAABBMax = _staging.mAABBMax;
+  mModelDiagonal = _staging.mModelDiagonal;
+  mGlobalAmbient = _staging.mGlobalAmbient;
+  mVertexFormat = _staging.mVertexFormat;
+
+  ReportLoadStage( _staging, LOADSTAGE_UPLOAD, true );
+
+  std::chrono::high_resolution_clock::time_point uploadStart = std::chrono::high_resolution_clock::now();
+
+  for ( unsigned int i = 0; i < mEmbeddedTextures.size(); i++ )
+  {
+    Renderer::UploadTexture( mEmbeddedTextures[ i ] );
+  }
+
+  for ( std::vector<Material>::iterator it = mMaterials.begin(); it != mMaterials.end(); it++ )
+  {
+    Renderer::UploadTexture( it->mColorMapDiffuse.mTexture );
+    Renderer::UploadTexture( it->mColorMapNormals.mTexture );
+    Renderer::UploadTexture( it->mColorMapSpecular.mTexture );
+    Renderer::UploadTexture( it->mColorMapAlbedo.mTexture );
+    Renderer::UploadTexture( it->mColorMapRoughness.mTexture );
+    Renderer::UploadTexture( it->mColorMapMetallic.mTexture );
+    Renderer::UploadTexture( it->mColorMapAO.mTexture );
+    Renderer::UploadTexture( it->mColorMapAmbient.mTexture );
+    Renderer::UploadTexture( it->mColorMapEmissive.mTexture );
+  }
+
+  mTextureCount = _staging.mTextureDecodeCount;
+  mTextureDecodeThreads = _staging.mTextureDecodeThreads;
+  mTextureDecodeTime = _staging.mTextureDecodeTime;
+  mTextureCacheHits = _staging.mTextureCacheHits;
+  mTextureCacheBytesSaved = _staging.mTextureCacheBytesSaved;
+  mTextureUploadTime = std::chrono::duration<float, std::milli>( std::chrono::high_resolution_clock::now() - uploadStart ).count();
+  printf( "[geometry] Textures: %d decoded in %.2f ms on %d threads, uploaded in %.2f ms\n", mTextureCount, mTextureDecodeTime, mTextureDecodeThreads, mTextureUploadTime );
 
-    delete[] vertices;
+  //////////////////////////////////////////////////////////////////////////
+  // Lay out every mesh in one vertex and one index buffer
+  const unsigned int vertexSize = GetVertexSize( mVertexFormat );
+  mVertexBufferSize = 0;
+  mFullVertexBufferSize = 0;
+  mIndexBufferSize = 0;
+  int vertexCount = 0;
+  for ( int i = 0; i < _staging.mMeshes.size(); i++ )
+  {
+    Mesh & mesh = _staging.mMeshes[ i ].mMesh;
 
-    mesh.mTriangleCount = sceneMesh->mNumFaces;
+    mesh.mBaseVertex = vertexCount;
+    vertexCount += mesh.mVertexCount;
 
-    unsigned int * faces = new unsigned int[ sceneMesh->mNumFaces * 3 ];
+    // Keep 32-bit indices aligned when they follow 16-bit ones
+    mIndexBufferSize = ( mIndexBufferSize + 3 ) & ~3ull;
+    mesh.mIndexOffset = (size_t) mIndexBufferSize;
+    mIndexBufferSize += (uint64_t) GetIndexSize( mesh.mIndexType ) * mesh.mTriangleCount * 3;
 
-    for ( unsigned int j = 0; j < sceneMesh->mNumFaces; j++ )
+    // LODs reuse the mesh's vertices and follow its indices
+    for ( int j = 0; j < mesh.mLODCount; j++ )
     {
-      faces[ j * 3 + 0 ] = sceneMesh->mFaces[ j ].mIndices[ 0 ];
-      faces[ j * 3 + 1 ] = sceneMesh->mFaces[ j ].mIndices[ 1 ];
-      faces[ j * 3 + 2 ] = sceneMesh->mFaces[ j ].mIndices[ 2 ];
+      mesh.mLODs[ j ].mIndexOffset = (size_t) mIndexBufferSize;
+      mIndexBufferSize += (uint64_t) GetIndexSize( mesh.mIndexType ) * mesh.mLODs[ j ].mTriangleCount * 3;
     }
+  }
+  mVertexBufferSize = (uint64_t) vertexSize * vertexCount;
+  mFullVertexBufferSize = (uint64_t) sizeof( Vertex ) * vertexCount;
 
-    glBufferData( GL_ELEMENT_ARRAY_BUFFER, sizeof( unsigned int ) * sceneMesh->mNumFaces * 3, faces, GL_STATIC_DRAW );
-
-    delete[] faces;
-
-    mesh.mMaterialIndex = sceneMesh->mMaterialIndex;
+  if ( vertexCount )
+  {
+    glGenVertexArrays( 1, &mVertexArrayObject );
+    glGenBuffers( 1, &mVertexBufferObject );
+    glGenBuffers( 1, &mIndexBufferObject );
+    glGenBuffers( 1, &mInstanceBufferObject );
 
-    // By importing materials before meshes we can investigate whether a mesh is transparent and flag it as such.
-    const Geometry::Material & mtl = mMaterials[ mesh.mMaterialIndex ];
-    mesh.mTransparent = false;
-    mesh.mTransparent |= ( mtl.mColorMapAlbedo.mTexture != nullptr ) ? ( mtl.mColorMapAlbedo.mTexture->mTransparent ) : ( mtl.mColorMapAlbedo.mColor.a != 1.0f );
-    mesh.mTransparent |= ( mtl.mColorMapDiffuse.mTexture != nullptr ) ? ( mtl.mColorMapDiffuse.mTexture->mTransparent ) : ( mtl.mColorMapDiffuse.mColor.a != 1.0f );
+    Renderer::BindVertexArray( mVertexArrayObject );
+    glBindBuffer( GL_ARRAY_BUFFER, mVertexBufferObject );
+    glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, mIndexBufferObject );
 
-    mMeshes.insert( { i, mesh } );
+    glBufferData( GL_ARRAY_BUFFER, (GLsizeiptr) mVertexBufferSize, NULL, GL_STATIC_DRAW );
+    glBufferData( GL_ELEMENT_ARRAY_BUFFER, (GLsizeiptr) mIndexBufferSize, NULL, GL_STATIC_DRAW );
   }
 
-  printf( "[geometry] Calculating AABB\n" );
-  bool aabbSet = false;
-  for ( std::map<int, Geometry::Node>::iterator it = mNodes.begin(); it != mNodes.end(); it++ )
+  for ( int i = 0; i < _staging.mMeshes.size(); i++ )
   {
-    const Geometry::Node & node = it->second;
-    for ( int i = 0; i < it->second.mMeshes.size(); i++ )
+    StagedMesh & stagedMesh = _staging.mMeshes[ i ];
+    const Mesh & mesh = stagedMesh.mMesh;
+
+    // Cached meshes are uploaded straight from the mapping
+    const void * vertices = stagedMesh.mVertexStorage.empty() ? stagedMesh.mCachedVertices : stagedMesh.mVertexStorage.data();
+    const void * faces = stagedMesh.mFaceStorage.empty() ? stagedMesh.mCachedFaces : stagedMesh.mFaceStorage.data();
+    glBufferSubData( GL_ARRAY_BUFFER, (GLintptr) vertexSize * mesh.mBaseVertex, (GLsizeiptr) vertexSize * mesh.mVertexCount, vertices );
+    if ( !stagedMesh.mShortFaceStorage.empty() )
     {
-      const Geometry::Mesh & mesh = mMeshes[ it->second.mMeshes[ i ] ];
-
-      glm::vec3 aabbMin;
-      glm::vec3 aabbMax;
-      TransformBoundingBox( mesh.mAABBMin, mesh.mAABBMax, mMatrices[ node.mID ], aabbMin, aabbMax );
-
-      if ( !aabbSet )
+      glBufferSubData( GL_ELEMENT_ARRAY_BUFFER, (GLintptr) mesh.mIndexOffset, (GLsizeiptr) sizeof( unsigned short ) * stagedMesh.mShortFaceStorage.size(), stagedMesh.mShortFaceStorage.data() );
+    }
+    else if ( !stagedMesh.mLODFaceStorage.empty() )
+    {
+      glBufferSubData( GL_ELEMENT_ARRAY_BUFFER, (GLintptr) mesh.mIndexOffset, (GLsizeiptr) sizeof( unsigned int ) * mesh.mTriangleCount * 3, faces );
+      glBufferSubData( GL_ELEMENT_ARRAY_BUFFER, (GLintptr) mesh.mLODs[ 0 ].mIndexOffset, (GLsizeiptr) sizeof( unsigned int ) * stagedMesh.mLODFaceStorage.size(), stagedMesh.mLODFaceStorage.data() );
+    }
+    else
+    {
+      // Optimized meshes come with their LOD indices, in the final index type
+      uint64_t indexCount = (uint64_t) mesh.mTriangleCount * 3;
+      for ( int j = 0; j < mesh.mLODCount; j++ )
       {
-        mAABBMin = aabbMin;
-        mAABBMax = aabbMax;
-        aabbSet = true;
+        indexCount += (uint64_t) mesh.mLODs[ j ].mTriangleCount * 3;
       }
-      mAABBMin = glm::min( aabbMin, mAABBMin );
-      mAABBMax = glm::max( aabbMax, mAABBMax );
+      glBufferSubData( GL_ELEMENT_ARRAY_BUFFER, (GLintptr) mesh.mIndexOffset, (GLsizeiptr) ( GetIndexSize( mesh.mIndexType ) * indexCount ), faces );
     }
-  }
-  printf( "[geometry] Calculated AABB: (%.3f, %.3f, %.3f), (%.3f, %.3f, %.3f)\n", mAABBMin.x, mAABBMin.y, mAABBMin.z, mAABBMax.x, mAABBMax.y, mAABBMax.z );
 
-  mModelDiagonal = glm::length( mAABBMax - mAABBMin );
+    mMeshes.push_back( mesh );
+    mMeshes.back().mFirstMeshlet = (int) mMeshlets.size();
+    mMeshes.back().mMeshletCount = (int) stagedMesh.mMeshlets.size();
+    mMeshlets.insert( mMeshlets.end(), stagedMesh.mMeshlets.begin(), stagedMesh.mMeshlets.end() );
+  }
+  _staging.mMeshes.clear();
+  if ( !mMeshlets.empty() )
+  {
+    printf( "[geometry] %d meshlets\n", (int) mMeshlets.size() );
+  }
 
-  mGlobalAmbient = glm::vec4( 0.3f );
-  for ( unsigned int i = 0; i < scene->mNumLights; i++ )
+  //////////////////////////////////////////////////////////////////////////
+  // Material uniform blocks; offsets have to respect the bind alignment
+  if ( mMaterials.size() )
   {
-    switch ( scene->mLights[ i ]->mType )
+    GLint alignment = 0;
+    glGetIntegerv( GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment );
+    alignment = std::max( alignment, 16 );
+    mMaterialBlockStride = (unsigned int) ( ( sizeof( MaterialConstants ) + alignment - 1 ) / alignment * alignment );
+
+    std::vector<unsigned char> blocks( mMaterialBlockStride * mMaterials.size(), 0 );
+    for ( int i = 0; i < mMaterials.size(); i++ )
     {
-      case aiLightSource_AMBIENT:
-        {
-          memcpy( &mGlobalAmbient, &scene->mLights[ i ]->mColorAmbient.r, sizeof( float ) * 4 );
-        } break;
-      default:
-        {
-          // todo
-        } break;
+      FillMaterialConstants( *(MaterialConstants *) ( blocks.data() + mMaterialBlockStride * i ), mMaterials[ i ] );
     }
+
+    glGenBuffers( 1, &mMaterialBufferObject );
+    glBindBuffer( GL_UNIFORM_BUFFER, mMaterialBufferObject );
+    glBufferData( GL_UNIFORM_BUFFER, (GLsizeiptr) blocks.size(), blocks.data(), GL_STATIC_DRAW );
+    glBindBuffer( GL_UNIFORM_BUFFER, 0 );
   }
 
-  return true;
+  BuildDrawLists();
+
+  ReportLoadStage( _staging, LOADSTAGE_UPLOAD, false );
+
+  if ( _staging.mCacheFile )
+  {
+    delete _staging.mCacheFile;
+    _staging.mCacheFile = NULL;
+  }
 }
 
 void Geometry::UnloadMesh()
@@ -518,6 +2581,31 @@ void Geometry::UnloadMesh()
   }
 
   mNodes.clear();
+  mNodeParents.clear();
+  mNodeMatrixSlots.clear();
+  mNodeMeshOffsets.clear();
+  mNodeMeshes.clear();
+  mDrawItems.clear();
+  mOpaqueQueue.clear();
+  mTransparentQueue.clear();
+  mQueueScratch.clear();
+  mDrawItemMatrices.clear();
+  mMeshDraws.clear();
+  mOpaqueDraws.clear();
+  mTransparentDraws.clear();
+  mInstanceMatrices.clear();
+  mNodeMeshVisible.clear();
+  mNodeMeshLODs.clear();
+  mNodeMeshSpheres.clear();
+  mMeshlets.clear();
+  mNodeMeshDrawRanges.clear();
+  mMeshletDrawCounts.clear();
+  mMeshletDrawOffsets.clear();
+  mMeshletDrawBaseVertices.clear();
+  mBVH.Clear();
+  mBoundsValid = false;
+  memset( &mCullStats, 0, sizeof( CullStats ) );
+  memset( &mDrawStats, 0, sizeof( DrawStats ) );
 
   for ( unsigned int i = 0; i < mEmbeddedTextures.size(); i++ )
   {
@@ -525,167 +2613,695 @@ void Geometry::UnloadMesh()
   }
   mEmbeddedTextures.clear();
 
-  for ( std::map<int, Material>::iterator it = mMaterials.begin(); it != mMaterials.end(); it++ )
+  ReleaseMaterialTextures( mMaterials );
+
+  mMeshes.clear();
+
+  if ( mVertexArrayObject )
+  {
+    glDeleteBuffers( 1, &mInstanceBufferObject );
+    glDeleteBuffers( 1, &mIndexBufferObject );
+    glDeleteBuffers( 1, &mVertexBufferObject );
+    glDeleteVertexArrays( 1, &mVertexArrayObject );
+    Renderer::InvalidateRenderState(); // the names may be reused
+    mInstanceBufferObject = 0;
+    mIndexBufferObject = 0;
+    mVertexBufferObject = 0;
+    mVertexArrayObject = 0;
+  }
+
+  if ( mMaterialBufferObject )
+  {
+    glDeleteBuffers( 1, &mMaterialBufferObject );
+    mMaterialBufferObject = 0;
+    Renderer::InvalidateRenderState();
+  }
+}
+
+void Geometry::UpdateMaterialConstants( int _materialIndex )
+{
+  if ( !mMaterialBufferObject || _materialIndex < 0 || _materialIndex >= mMaterials.size() )
+  {
+    return;
+  }
+
+  MaterialConstants constants;
+  FillMaterialConstants( constants, mMaterials[ _materialIndex ] );
+  glBindBuffer( GL_UNIFORM_BUFFER, mMaterialBufferObject );
+  glBufferSubData( GL_UNIFORM_BUFFER, (GLintptr) mMaterialBlockStride * _materialIndex, sizeof( MaterialConstants ), &constants );
+  glBindBuffer( GL_UNIFORM_BUFFER, 0 );
+}
+
+bool DrawItemLess( const Geometry::DrawItem & _a, const Geometry::DrawItem & _b )
+{
+  return _a.mSortKey < _b.mSortKey;
+}
+
+// Instances of a mesh can still differ in LOD and, when backfaces are
+// culled, in winding; each combination needs a draw of its own
+const int INSTANCE_DRAW_KINDS = ( Geometry::MAX_LODS + 1 ) * 2;
+
+void Geometry::BuildDrawLists()
+{
+  mDrawItems.clear();
+
+  for ( int k = 0; k < mNodes.size(); k++ )
+  {
+    for ( unsigned int i = mNodeMeshOffsets[ k ]; i < mNodeMeshOffsets[ k + 1 ]; i++ )
+    {
+      const Mesh & mesh = mMeshes[ mNodeMeshes[ i ] ];
+
+      DrawItem item;
+      item.mMatrixSlot = mNodeMatrixSlots[ k ];
+      item.mMeshIndex = mNodeMeshes[ i ];
+      item.mMaterialIndex = mesh.mMaterialIndex;
+      item.mNodeMeshIndex = i;
+
+      // All meshes share one shader and one vertex array, so what's left to
+      // group by is the material; meshes are laid out in order in the
+      // buffers, so the mesh index keeps vertex fetches sequential. The
+      // render queues are sorted by depth, and stably, so this only orders
+      // items at the same depth, or all of them without a view.
+      item.mSortKey = ( (uint64_t) item.mMaterialIndex << 32 ) | (uint64_t) item.mMeshIndex;
+
+      mDrawItems.push_back( item );
+    }
+  }
+
+  std::stable_sort( mDrawItems.begin(), mDrawItems.end(), DrawItemLess );
+  mMeshDraws.assign( mMeshes.size() * INSTANCE_DRAW_KINDS, -1 );
+
+  // Nothing is culled or reduced until the first Cull()
+  mNodeMeshVisible.assign( mNodeMeshes.size(), 1 );
+  mNodeMeshLODs.assign( mNodeMeshes.size(), 0 );
+  const DrawRanges wholeMesh = { 0, -1 };
+  mNodeMeshDrawRanges.assign( mNodeMeshes.size(), wholeMesh );
+}
+
+void Geometry::RefitBVH( const glm::mat4x4 & _worldRootMatrix )
+{
+  std::vector<glm::vec3> nodeMeshMin( mNodeMeshes.size() );
+  std::vector<glm::vec3> nodeMeshMax( mNodeMeshes.size() );
+  mNodeMeshSpheres.resize( mNodeMeshes.size() );
+  for ( int k = 0; k < mNodes.size(); k++ )
+  {
+    const glm::mat4x4 matWorld = mMatrices[ mNodeMatrixSlots[ k ] ] * _worldRootMatrix;
+    for ( unsigned int i = mNodeMeshOffsets[ k ]; i < mNodeMeshOffsets[ k + 1 ]; i++ )
+    {
+      const Mesh & mesh = mMeshes[ mNodeMeshes[ i ] ];
+      TransformBoundingBox( mesh.mAABBMin, mesh.mAABBMax, matWorld, nodeMeshMin[ i ], nodeMeshMax[ i ] );
+      mNodeMeshSpheres[ i ] = glm::vec4( ( nodeMeshMin[ i ] + nodeMeshMax[ i ] ) * 0.5f, glm::length( nodeMeshMax[ i ] - nodeMeshMin[ i ] ) * 0.5f );
+    }
+  }
+
+  mBVH.Refit( nodeMeshMin.data(), nodeMeshMax.data() );
+  mBoundsRootMatrix = _worldRootMatrix;
+  mBoundsValid = true;
+}
+
+void Geometry::Cull( const glm::mat4x4 & _worldRootMatrix, const View & _view )
+{
+  // The BVH is built without a root matrix; refitting is enough when it changes
+  if ( !mBoundsValid || mBoundsRootMatrix != _worldRootMatrix )
+  {
+    RefitBVH( _worldRootMatrix );
+  }
+
+  Frustum::Planes planes;
+  Frustum::ExtractPlanes( _view.mViewProjection, planes );
+  if ( _view.mCullFrustum )
+  {
+    mCullStats.mVisibleMeshes = mBVH.QueryFrustum( planes, mNodeMeshVisible.data() );
+  }
+  else
+  {
+    std::fill( mNodeMeshVisible.begin(), mNodeMeshVisible.end(), 1 );
+    mCullStats.mVisibleMeshes = (int) mNodeMeshes.size();
+  }
+
+  mCullStats.mTotalMeshes = (int) mNodeMeshes.size();
+  mCullStats.mVisibleTriangles = 0;
+  mCullStats.mTotalTriangles = 0;
+  mCullStats.mReducedMeshes = 0;
+  for ( int i = 0; i < mNodeMeshes.size(); i++ )
+  {
+    const Mesh & mesh = mMeshes[ mNodeMeshes[ i ] ];
+    mCullStats.mTotalTriangles += mesh.mTriangleCount;
+
+    // The LOD errors are relative to the mesh radius, so they scale with the
+    // projected size of the bounding sphere; take the coarsest LOD that
+    // stays within a pixel, and full detail when the camera is inside
+    int lodIndex = 0;
+    if ( mNodeMeshVisible[ i ] && mesh.mLODCount && _view.mPixelScale > 0.0f )
+    {
+      const glm::vec4 & sphere = mNodeMeshSpheres[ i ];
+      const float distance = glm::length( glm::vec3( sphere ) - _view.mCameraPosition );
+      if ( distance > sphere.w )
+      {
+        const float projectedRadius = sphere.w * _view.mPixelScale / distance;
+        while ( lodIndex < mesh.mLODCount && mesh.mLODs[ lodIndex ].mError * projectedRadius <= 1.0f )
+        {
+          lodIndex++;
+        }
+      }
+    }
+    mNodeMeshLODs[ i ] = (unsigned char) lodIndex;
+
+    if ( mNodeMeshVisible[ i ] )
+    {
+      mCullStats.mVisibleTriangles += lodIndex ? mesh.mLODs[ lodIndex - 1 ].mTriangleCount : mesh.mTriangleCount;
+      mCullStats.mReducedMeshes += lodIndex ? 1 : 0;
+    }
+  }
+
+  CullMeshlets( _worldRootMatrix, _view, planes );
+}
+
+void Geometry::CullMeshlets( const glm::mat4x4 & _worldRootMatrix, const View & _view, const Frustum::Planes & _planes )
+{
+  mCullStats.mTotalMeshlets = 0;
+  mCullStats.mFrustumCulledMeshlets = 0;
+  mCullStats.mBackfaceCulledMeshlets = 0;
+  mMeshletDrawCounts.clear();
+  mMeshletDrawOffsets.clear();
+  mMeshletDrawBaseVertices.clear();
+
+  const bool cullMeshlets = !mMeshlets.empty() && ( _view.mCullFrustum || _view.mCullBackfaces );
+  for ( int k = 0; k < mNodes.size(); k++ )
+  {
+    for ( unsigned int i = mNodeMeshOffsets[ k ]; i < mNodeMeshOffsets[ k + 1 ]; i++ )
+    {
+      DrawRanges & ranges = mNodeMeshDrawRanges[ i ];
+      ranges.mFirst = (int) mMeshletDrawCounts.size();
+      ranges.mCount = -1;
+
+      const Mesh & mesh = mMeshes[ mNodeMeshes[ i ] ];
+      if ( !cullMeshlets || !mesh.mMeshletCount || !mNodeMeshVisible[ i ] || mNodeMeshLODs[ i ] )
+      {
+        continue;
+      }
+
+      // Meshlet bounds stay in mesh space: the planes move there with the
+      // transposed world matrix, and normalizing them keeps distances in
+      // mesh units. Facing doesn't change under the transform unless it
+      // mirrors, which flips the winding.
+      const glm::mat4x4 matWorld = mMatrices[ mNodeMatrixSlots[ k ] ] * _worldRootMatrix;
+      const glm::mat4x4 matWorldTransposed = glm::transpose( matWorld );
+      glm::vec4 planes[ 6 ];
+      for ( int p = 0; p < 6; p++ )
+      {
+        planes[ p ] = matWorldTransposed * _planes.mPlanes[ p ];
+        planes[ p ] /= glm::length( glm::vec3( planes[ p ] ) );
+      }
+      const glm::vec3 cameraPosition = glm::vec3( glm::inverse( matWorld ) * glm::vec4( _view.mCameraPosition, 1.0f ) );
+      const bool cullBackfaces = _view.mCullBackfaces && !mesh.mTransparent && glm::determinant( matWorld ) > 0.0f;
+
+      const unsigned int indexSize = GetIndexSize( mesh.mIndexType );
+      int rangeEnd = -1;
+      ranges.mCount = 0;
+      for ( int m = 0; m < mesh.mMeshletCount; m++ )
+      {
+        const Meshlet & meshlet = mMeshlets[ mesh.mFirstMeshlet + m ];
+        mCullStats.mTotalMeshlets++;
+
+        bool outside = false;
+        for ( int p = 0; p < 6 && _view.mCullFrustum && !outside; p++ )
+        {
+          outside = glm::dot( glm::vec3( planes[ p ] ), meshlet.mCenter ) + planes[ p ].w < -meshlet.mRadius;
+        }
+        if ( outside )
+        {
+          mCullStats.mFrustumCulledMeshlets++;
+          mCullStats.mVisibleTriangles -= meshlet.mTriangleCount;
+          continue;
+        }
+
+        const glm::vec3 toCenter = meshlet.mCenter - cameraPosition;
+        if ( cullBackfaces && glm::dot( toCenter, meshlet.mConeAxis ) >= meshlet.mConeCutoff * glm::length( toCenter ) + meshlet.mRadius )
+        {
+          mCullStats.mBackfaceCulledMeshlets++;
+          mCullStats.mVisibleTriangles -= meshlet.mTriangleCount;
+          continue;
+        }
+
+        // Consecutive meshlets that survive are drawn as one range
+        if ( meshlet.mFirstTriangle == rangeEnd )
+        {
+          mMeshletDrawCounts.back() += meshlet.mTriangleCount * 3;
+        }
+        else
+        {
+          mMeshletDrawCounts.push_back( meshlet.mTriangleCount * 3 );
+          mMeshletDrawOffsets.push_back( (const GLvoid *) ( mesh.mIndexOffset + (size_t) indexSize * 3 * meshlet.mFirstTriangle ) );
+          mMeshletDrawBaseVertices.push_back( mesh.mBaseVertex );
+          ranges.mCount++;
+        }
+        rangeEnd = meshlet.mFirstTriangle + meshlet.mTriangleCount;
+      }
+    }
+  }
+}
+
+int Geometry::RayCast( const glm::vec3 & _origin, const glm::vec3 & _direction, float & _distance ) const
+{
+  // A ray entering a box at 0 starts inside it
+  return mBVH.QueryNearestHit( _origin, _direction, FLT_MAX, _distance, []( int _item, float & _itemDistance ) { return _itemDistance > 0.0f; } );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Render queues
+
+// Maps a float to bits that compare as unsigned integers in the same order
+unsigned int FloatToSortKey( float _value )
+{
+  unsigned int bits;
+  memcpy( &bits, &_value, sizeof( bits ) );
+  return ( bits & 0x80000000 ) ? ~bits : ( bits | 0x80000000 );
+}
+
+// LSD radix sort by 11 bit digits, so three passes cover the 32 bit key;
+// passes where every key has the same digit are skipped. Stable, so items at
+// the same depth keep their material order.
+void RadixSortQueue( std::vector<Geometry::QueueItem> & _queue, std::vector<Geometry::QueueItem> & _scratch )
+{
+  const int DIGIT_BITS = 11;
+  const unsigned int DIGIT_MASK = ( 1 << DIGIT_BITS ) - 1;
+
+  _scratch.resize( _queue.size() );
+  for ( int shift = 0; shift < 32; shift += DIGIT_BITS )
+  {
+    unsigned int offsets[ DIGIT_MASK + 1 ] = { 0 };
+    for ( size_t i = 0; i < _queue.size(); i++ )
+    {
+      offsets[ ( _queue[ i ].mSortKey >> shift ) & DIGIT_MASK ]++;
+    }
+    if ( offsets[ ( _queue[ 0 ].mSortKey >> shift ) & DIGIT_MASK ] == _queue.size() )
+    {
+      continue;
+    }
+
+    unsigned int sum = 0;
+    for ( unsigned int d = 0; d <= DIGIT_MASK; d++ )
+    {
+      const unsigned int count = offsets[ d ];
+      offsets[ d ] = sum;
+      sum += count;
+    }
+    for ( size_t i = 0; i < _queue.size(); i++ )
+    {
+      _scratch[ offsets[ ( _queue[ i ].mSortKey >> shift ) & DIGIT_MASK ]++ ] = _queue[ i ];
+    }
+    _queue.swap( _scratch );
+  }
+}
+
+void Geometry::BuildRenderQueues( const glm::mat4x4 & _worldRootMatrix, const View * _view, bool _sortTransparent )
+{
+  mOpaqueQueue.clear();
+  mTransparentQueue.clear();
+  mDrawItemMatrices.resize( mDrawItems.size() );
+
+  for ( unsigned int i = 0; i < mDrawItems.size(); i++ )
   {
-    if ( it->second.mColorMapDiffuse.mTexture )
+    const DrawItem & item = mDrawItems[ i ];
+    if ( _view && ( !mNodeMeshVisible[ item.mNodeMeshIndex ] || mNodeMeshDrawRanges[ item.mNodeMeshIndex ].mCount == 0 ) )
+    {
+      continue;
+    }
+
+    mDrawItemMatrices[ i ] = mMatrices[ item.mMatrixSlot ] * _worldRootMatrix;
+
+    // The clip space w of the bounding sphere center is its view depth
+    unsigned int depthKey = 0;
+    if ( _view )
+    {
+      const glm::vec4 & sphere = mNodeMeshSpheres[ item.mNodeMeshIndex ];
+      const glm::mat4x4 & viewProjection = _view->mViewProjection;
+      const float depth = viewProjection[ 0 ][ 3 ] * sphere.x + viewProjection[ 1 ][ 3 ] * sphere.y + viewProjection[ 2 ][ 3 ] * sphere.z + viewProjection[ 3 ][ 3 ];
+      depthKey = FloatToSortKey( depth );
+    }
+
+    QueueItem queueItem;
+    queueItem.mDrawItem = i;
+    if ( mMeshes[ item.mMeshIndex ].mTransparent )
     {
-      Renderer::ReleaseTexture( it->second.mColorMapDiffuse.mTexture );
+      queueItem.mSortKey = ~depthKey;
+      mTransparentQueue.push_back( queueItem );
     }
-    if ( it->second.mColorMapNormals.mTexture )
+    else
     {
-      Renderer::ReleaseTexture( it->second.mColorMapNormals.mTexture );
+      queueItem.mSortKey = depthKey;
+      mOpaqueQueue.push_back( queueItem );
     }
-    if ( it->second.mColorMapSpecular.mTexture )
+  }
+
+  if ( _view )
+  {
+    if ( !mOpaqueQueue.empty() )
     {
-      Renderer::ReleaseTexture( it->second.mColorMapSpecular.mTexture );
+      RadixSortQueue( mOpaqueQueue, mQueueScratch );
     }
-    if ( it->second.mColorMapAlbedo.mTexture )
+    if ( _sortTransparent && !mTransparentQueue.empty() )
     {
-      Renderer::ReleaseTexture( it->second.mColorMapAlbedo.mTexture );
+      RadixSortQueue( mTransparentQueue, mQueueScratch );
     }
-    if ( it->second.mColorMapRoughness.mTexture )
+  }
+}
+
+void Geometry::BuildInstanceDraws( const std::vector<QueueItem> & _queue, const View * _view, bool _keepOrder, bool _cullBackfaces, std::vector<InstanceDraw> & _draws )
+{
+  // Draws are opened in queue order, so without _keepOrder each one comes
+  // where its nearest instance would have; instances stay in queue order
+  _draws.clear();
+  mQueueDraws.resize( _queue.size() );
+  for ( unsigned int q = 0; q < _queue.size(); q++ )
+  {
+    const DrawItem & item = mDrawItems[ _queue[ q ].mDrawItem ];
+    const bool mirrored = _cullBackfaces && glm::determinant( mDrawItemMatrices[ _queue[ q ].mDrawItem ] ) < 0.0f;
+
+    InstanceDraw draw;
+    draw.mMeshIndex = item.mMeshIndex;
+    draw.mMaterialIndex = item.mMaterialIndex;
+    draw.mLOD = _view ? mNodeMeshLODs[ item.mNodeMeshIndex ] : 0;
+    draw.mNodeMeshIndex = -1;
+    draw.mMirrored = mirrored;
+    draw.mFirstInstance = 0;
+    draw.mInstanceCount = 0;
+
+    // Meshlet ranges are per node, so those instances get a draw each
+    int drawIndex = -1;
+    if ( _view && mNodeMeshDrawRanges[ item.mNodeMeshIndex ].mCount > 0 )
     {
-      Renderer::ReleaseTexture( it->second.mColorMapRoughness.mTexture );
+      draw.mNodeMeshIndex = item.mNodeMeshIndex;
     }
-    if ( it->second.mColorMapMetallic.mTexture )
+    else if ( _keepOrder )
     {
-      Renderer::ReleaseTexture( it->second.mColorMapMetallic.mTexture );
+      if ( !_draws.empty() )
+      {
+        const InstanceDraw & last = _draws.back();
+        if ( last.mNodeMeshIndex < 0 && last.mMeshIndex == draw.mMeshIndex && last.mLOD == draw.mLOD && last.mMirrored == draw.mMirrored )
+        {
+          drawIndex = (int) _draws.size() - 1;
+        }
+      }
     }
-    if ( it->second.mColorMapAO.mTexture )
+    else
     {
-      Renderer::ReleaseTexture( it->second.mColorMapAO.mTexture );
+      drawIndex = mMeshDraws[ item.mMeshIndex * INSTANCE_DRAW_KINDS + draw.mLOD * 2 + ( mirrored ? 1 : 0 ) ];
     }
-    if ( it->second.mColorMapAmbient.mTexture )
+
+    if ( drawIndex < 0 )
     {
-      Renderer::ReleaseTexture( it->second.mColorMapAmbient.mTexture );
+      drawIndex = (int) _draws.size();
+      _draws.push_back( draw );
+      if ( !_keepOrder && draw.mNodeMeshIndex < 0 )
+      {
+        mMeshDraws[ item.mMeshIndex * INSTANCE_DRAW_KINDS + draw.mLOD * 2 + ( mirrored ? 1 : 0 ) ] = drawIndex;
+      }
     }
+    _draws[ drawIndex ].mInstanceCount++;
+    mQueueDraws[ q ] = drawIndex;
   }
-  mMaterials.clear();
 
-  for ( std::map<int, Mesh>::iterator it = mMeshes.begin(); it != mMeshes.end(); it++ )
+  unsigned int firstInstance = (unsigned int) mInstanceMatrices.size();
+  for ( int i = 0; i < _draws.size(); i++ )
   {
-    glDeleteBuffers( 1, &it->second.mIndexBufferObject );
-    glDeleteBuffers( 1, &it->second.mVertexBufferObject );
-    glDeleteVertexArrays( 1, &it->second.mVertexArrayObject );
+    InstanceDraw & draw = _draws[ i ];
+    if ( !_keepOrder && draw.mNodeMeshIndex < 0 )
+    {
+      mMeshDraws[ draw.mMeshIndex * INSTANCE_DRAW_KINDS + draw.mLOD * 2 + ( draw.mMirrored ? 1 : 0 ) ] = -1;
+    }
+    draw.mFirstInstance = firstInstance;
+    firstInstance += draw.mInstanceCount;
+    draw.mInstanceCount = 0;
   }
-  mMeshes.clear();
 
-  gImporter.FreeScene();
+  mInstanceMatrices.resize( firstInstance );
+  for ( unsigned int q = 0; q < _queue.size(); q++ )
+  {
+    InstanceDraw & draw = _draws[ mQueueDraws[ q ] ];
+    mInstanceMatrices[ draw.mFirstInstance + draw.mInstanceCount++ ] = mDrawItemMatrices[ _queue[ q ].mDrawItem ];
+  }
 }
 
-void Geometry::Render( const glm::mat4x4 & _worldRootMatrix, Renderer::Shader * _shader )
+void Geometry::Render( const glm::mat4x4 & _worldRootMatrix, Renderer::Shader * _shader, const View * _view /*= NULL*/, Renderer::Shader * _transparencyCompositeShader /*= NULL*/ )
 {
+  if ( _view )
+  {
+    Cull( _worldRootMatrix, *_view );
+  }
+
   Renderer::SetShader( _shader );
 
-  _shader->SetConstant( "global_ambient", mGlobalAmbient );
+  if ( mUniforms.mShader != _shader )
+  {
+    ResolveUniforms( _shader );
+  }
+
+  _shader->SetConstant( mUniforms.mGlobalAmbient, mGlobalAmbient );
+  _shader->SetConstant( mUniforms.mCompactVertices, mVertexFormat == VERTEXFORMAT_COMPACT );
+
+  Renderer::BindVertexArray( mVertexArrayObject );
+
+  // Opaque instances are grouped as much as possible, transparent ones only
+  // where that doesn't break the back-to-front order; weighted blending
+  // doesn't depend on the order, so there they're treated like opaque ones.
+  // The world matrices of everything drawn go into one buffer; each draw
+  // points the instanced attribute at its own range of it. Shaders with a
+  // plain mat_world uniform instead get one draw per instance.
+  const bool cullBackfaces = _view && _view->mCullBackfaces;
+  const bool weightedBlended = _transparencyCompositeShader != NULL;
+  BuildRenderQueues( _worldRootMatrix, _view, !weightedBlended );
+  mInstanceMatrices.clear();
+  BuildInstanceDraws( mOpaqueQueue, _view, false, cullBackfaces, mOpaqueDraws );
+  BuildInstanceDraws( mTransparentQueue, _view, !weightedBlended, false, mTransparentDraws );
+  const bool instanced = mUniforms.mMatWorldAttribute >= 0 && mInstanceBufferObject && !mInstanceMatrices.empty();
+  if ( instanced )
+  {
+    glBindBuffer( GL_ARRAY_BUFFER, mInstanceBufferObject );
+    glBufferData( GL_ARRAY_BUFFER, (GLsizeiptr) ( sizeof( glm::mat4x4 ) * mInstanceMatrices.size() ), mInstanceMatrices.data(), GL_STREAM_DRAW );
+  }
+  const bool uniformPerInstance = !instanced && mUniforms.mMatWorld >= 0;
 
-  // TODO: Maybe we can cache the world matrices & 2 queues for opaque and transparent in LoadMesh
-  // but that depends if we want to add animation support (in which case we can't).
+  mDrawStats.mDrawCalls = 0;
+  mDrawStats.mInstances = 0;
+
+  // Uniforms stay with the program, so they only need setting when they
+  // change between consecutive draws
+  int lastMeshIndex = -1;
+  int lastMaterialIndex = -1;
   for ( int j = 0; j < 3; ++j ) // opaque, transparent backface, transparent frontface
   {
     bool transparentPass = j > 0;
+
+    // Weighted blending draws both faces in one pass, and only if there's anything to composite
+    if ( weightedBlended && ( j == 2 || ( transparentPass && mTransparentDraws.empty() ) ) )
+    {
+      break;
+    }
+
+    const Profiler::STAGE stage = weightedBlended && transparentPass ? Profiler::STAGE_TRANSPARENT_WEIGHTED : (Profiler::STAGE) ( Profiler::STAGE_OPAQUE + j );
+    Profiler::BeginStage( stage );
+
+    // Sorted transparency draws the queue's back faces, then its front faces;
+    // weighted blending draws both sides at once
+    const bool cullFaces = transparentPass ? !weightedBlended : cullBackfaces;
+    Renderer::SetEnabled( GL_CULL_FACE, cullFaces );
+    const bool accumulate = weightedBlended && transparentPass && Renderer::BeginTransparencyAccumulation();
     if ( transparentPass )
     {
-      glEnable( GL_BLEND );
-      glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
-      glCullFace( j == 1 ? GL_FRONT : GL_BACK );
+      Renderer::SetEnabled( GL_BLEND, true );
+      if ( !accumulate )
+      {
+        Renderer::SetBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
+      }
     }
-    for ( std::map<int, Geometry::Node>::iterator it = mNodes.begin(); it != mNodes.end(); it++ )
+    _shader->SetConstant( mUniforms.mTransparencyAccumulation, accumulate );
+    const std::vector<InstanceDraw> & draws = transparentPass ? mTransparentDraws : mOpaqueDraws;
+    for ( int i = 0; i < draws.size(); i++ )
     {
-      const Geometry::Node & node = it->second;
+      const InstanceDraw & draw = draws[ i ];
+      const Geometry::Mesh & mesh = mMeshes[ draw.mMeshIndex ];
 
-      _shader->SetConstant( "mat_world", mMatrices[ node.mID ] * _worldRootMatrix );
+      // Import flips the winding to clockwise while GL keeps counter-clockwise
+      // front faces, so back faces are GL_FRONT; mirroring transforms flip it
+      // back. The first transparent sub-pass keeps only the back faces.
+      if ( cullFaces )
+      {
+        Renderer::SetCullFace( ( j == 1 ) != draw.mMirrored ? GL_BACK : GL_FRONT );
+      }
 
-      for ( int i = 0; i < it->second.mMeshes.size(); i++ )
+      if ( (int) draw.mMaterialIndex != lastMaterialIndex )
       {
-        const Geometry::Mesh & mesh = mMeshes[ it->second.mMeshes[ i ] ];
-        // Postpone rendering transparent meshes
-        if ( mesh.mTransparent != transparentPass )
-        {
-          continue;
-        }
-        const Geometry::Material & material = mMaterials[ mesh.mMaterialIndex ];
+        const Geometry::Material & material = mMaterials[ draw.mMaterialIndex ];
+
+        Renderer::BindUniformBuffer( Renderer::UNIFORMBLOCK_MATERIAL, mMaterialBufferObject, (size_t) mMaterialBlockStride * draw.mMaterialIndex, sizeof( MaterialConstants ) );
+
+        SetColorMap( _shader, mUniforms.mMapDiffuseTex, material.mColorMapDiffuse );
+        SetColorMap( _shader, mUniforms.mMapNormalsTex, material.mColorMapNormals );
+        SetColorMap( _shader, mUniforms.mMapSpecularTex, material.mColorMapSpecular );
+        SetColorMap( _shader, mUniforms.mMapAlbedoTex, material.mColorMapAlbedo );
+        SetColorMap( _shader, mUniforms.mMapRoughnessTex, material.mColorMapRoughness );
+        SetColorMap( _shader, mUniforms.mMapMetallicTex, material.mColorMapMetallic );
+        SetColorMap( _shader, mUniforms.mMapAOTex, material.mColorMapAO );
+        SetColorMap( _shader, mUniforms.mMapAmbientTex, material.mColorMapAmbient );
+        SetColorMap( _shader, mUniforms.mMapEmissiveTex, material.mColorMapEmissive );
+        lastMaterialIndex = (int) draw.mMaterialIndex;
+      }
 
-        _shader->SetConstant( "specular_shininess", material.mSpecularShininess );
+      if ( mVertexFormat == VERTEXFORMAT_COMPACT && (int) draw.mMeshIndex != lastMeshIndex )
+      {
+        _shader->SetConstant( mUniforms.mPosDecodeOffset, mesh.mAABBMin );
+        _shader->SetConstant( mUniforms.mPosDecodeScale, mesh.mAABBMax - mesh.mAABBMin );
+      }
+      lastMeshIndex = (int) draw.mMeshIndex;
 
-        SetColorMap( _shader, "map_diffuse", material.mColorMapDiffuse );
-        SetColorMap( _shader, "map_normals", material.mColorMapNormals );
-        SetColorMap( _shader, "map_specular", material.mColorMapSpecular );
-        SetColorMap( _shader, "map_albedo", material.mColorMapAlbedo );
-        SetColorMap( _shader, "map_roughness", material.mColorMapRoughness );
-        SetColorMap( _shader, "map_metallic", material.mColorMapMetallic );
-        SetColorMap( _shader, "map_ao", material.mColorMapAO );
-        SetColorMap( _shader, "map_ambient", material.mColorMapAmbient );
-        SetColorMap( _shader, "map_emissive", material.mColorMapEmissive );
+      // GL 4.1 has no base instance, so the attribute is re-pointed instead
+      if ( instanced )
+      {
+        for ( int c = 0; c < 4; c++ )
+        {
+          glVertexAttribPointer( mUniforms.mMatWorldAttribute + c, 4, GL_FLOAT, GL_FALSE, sizeof( glm::mat4x4 ), (GLvoid *) ( sizeof( glm::mat4x4 ) * draw.mFirstInstance + sizeof( glm::vec4 ) * c ) );
+        }
+      }
 
-        glBindVertexArray( mesh.mVertexArrayObject );
+      const unsigned int drawCount = uniformPerInstance ? draw.mInstanceCount : 1;
+      const unsigned int instanceCount = uniformPerInstance ? 1 : draw.mInstanceCount;
+      for ( unsigned int k = 0; k < drawCount; k++ )
+      {
+        if ( uniformPerInstance )
+        {
+          _shader->SetConstant( mUniforms.mMatWorld, mInstanceMatrices[ draw.mFirstInstance + k ] );
+        }
 
-        glDrawElements( GL_TRIANGLES, mesh.mTriangleCount * 3, GL_UNSIGNED_INT, NULL );
+        if ( draw.mNodeMeshIndex >= 0 )
+        {
+          const DrawRanges & ranges = mNodeMeshDrawRanges[ draw.mNodeMeshIndex ];
+          glMultiDrawElementsBaseVertex( GL_TRIANGLES, &mMeshletDrawCounts[ ranges.mFirst ], mesh.mIndexType, &mMeshletDrawOffsets[ ranges.mFirst ], ranges.mCount, &mMeshletDrawBaseVertices[ ranges.mFirst ] );
+        }
+        else if ( draw.mLOD )
+        {
+          const LOD & lod = mesh.mLODs[ draw.mLOD - 1 ];
+          glDrawElementsInstancedBaseVertex( GL_TRIANGLES, lod.mTriangleCount * 3, mesh.mIndexType, (GLvoid *) lod.mIndexOffset, instanceCount, mesh.mBaseVertex );
+        }
+        else
+        {
+          glDrawElementsInstancedBaseVertex( GL_TRIANGLES, mesh.mTriangleCount * 3, mesh.mIndexType, (GLvoid *) mesh.mIndexOffset, instanceCount, mesh.mBaseVertex );
+        }
+        mDrawStats.mDrawCalls++;
       }
+      mDrawStats.mInstances += draw.mInstanceCount;
+    }
+    if ( accumulate )
+    {
+      Renderer::CompositeTransparency( _transparencyCompositeShader );
     }
     if ( transparentPass )
     {
-      glDisable( GL_BLEND );
-      glDepthMask( GL_TRUE );
+      Renderer::SetEnabled( GL_BLEND, false );
+      Renderer::SetDepthMask( true );
     }
+
+    Profiler::EndStage( stage );
   }
+  Renderer::SetEnabled( GL_CULL_FACE, false );
 }
 
-void Geometry::__SetupVertexArray( Renderer::Shader * _shader, const char * name, int sizeInFloats, int & offsetInFloats )
+void Geometry::__SetupVertexArray( Renderer::Shader * _shader, const char * name, int components, GLenum type, GLboolean normalized, bool integer, int offsetInBytes )
 {
-  unsigned int stride = sizeof( float ) * 14;
+  const unsigned int stride = GetVertexSize( mVertexFormat );
 
   GLint location = glGetAttribLocation( _shader->mProgram, name );
   if ( location >= 0 )
   {
-    glVertexAttribPointer( location, sizeInFloats, GL_FLOAT, GL_FALSE, stride, (GLvoid *) ( offsetInFloats * sizeof( GLfloat ) ) );
+    if ( integer )
+    {
+      glVertexAttribIPointer( location, components, type, stride, (GLvoid *) (size_t) offsetInBytes );
+    }
+    else
+    {
+      glVertexAttribPointer( location, components, type, normalized, stride, (GLvoid *) (size_t) offsetInBytes );
+    }
+    glVertexAttribDivisor( location, 0 ); // the location may have held the instanced matrix of another shader
     glEnableVertexAttribArray( location );
   }
-
-  offsetInFloats += sizeInFloats;
 }
 
 void Geometry::RebindVertexArray( Renderer::Shader * _shader )
 {
-  for ( int i = 0; i < mMeshes.size(); i++ )
+  // The shader may have been recreated at the same address
+  mUniforms.mShader = NULL;
+
+  if ( mVertexArrayObject )
   {
-    const Geometry::Mesh & mesh = mMeshes[ i ];
+    Renderer::BindVertexArray( mVertexArrayObject );
+    glBindBuffer( GL_ARRAY_BUFFER, mVertexBufferObject );
+    glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, mIndexBufferObject );
 
-    glBindVertexArray( mesh.mVertexArrayObject );
-    glBindBuffer( GL_ARRAY_BUFFER, mesh.mVertexBufferObject );
-    glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, mesh.mIndexBufferObject );
+    if ( mVertexFormat == VERTEXFORMAT_COMPACT )
+    {
+      __SetupVertexArray( _shader, "in_pos", 3, GL_UNSIGNED_SHORT, GL_TRUE, false, offsetof( CompactVertex, nPosition ) );
+      __SetupVertexArray( _shader, "in_normal_oct", 2, GL_SHORT, GL_TRUE, false, offsetof( CompactVertex, nNormal ) );
+      __SetupVertexArray( _shader, "in_tangent_oct", 2, GL_SHORT, GL_FALSE, true, offsetof( CompactVertex, nTangent ) );
+      __SetupVertexArray( _shader, "in_texcoord", 2, GL_HALF_FLOAT, GL_FALSE, false, offsetof( CompactVertex, nTexcoord ) );
+    }
+    else
+    {
+      __SetupVertexArray( _shader, "in_pos", 3, GL_FLOAT, GL_FALSE, false, offsetof( Vertex, v3Vector ) );
+      __SetupVertexArray( _shader, "in_normal", 3, GL_FLOAT, GL_FALSE, false, offsetof( Vertex, v3Normal ) );
+      __SetupVertexArray( _shader, "in_tangent", 3, GL_FLOAT, GL_FALSE, false, offsetof( Vertex, v3Tangent ) );
+      __SetupVertexArray( _shader, "in_binormal", 3, GL_FLOAT, GL_FALSE, false, offsetof( Vertex, v3Binormal ) );
+      __SetupVertexArray( _shader, "in_texcoord", 2, GL_FLOAT, GL_FALSE, false, offsetof( Vertex, fTexcoord ) );
+    }
 
-    int offset = 0;
-    __SetupVertexArray( _shader, "in_pos", 3, offset );
-    __SetupVertexArray( _shader, "in_normal", 3, offset );
-    __SetupVertexArray( _shader, "in_tangent", 3, offset );
-    __SetupVertexArray( _shader, "in_binormal", 3, offset );
-    __SetupVertexArray( _shader, "in_texcoord", 2, offset );
+    // One mat4 per instance, over four vec4 locations; Render() points them
+    // into the instance buffer before every draw
+    GLint location = glGetAttribLocation( _shader->mProgram, "in_mat_world" );
+    if ( location >= 0 )
+    {
+      for ( int c = 0; c < 4; c++ )
+      {
+        glEnableVertexAttribArray( location + c );
+        glVertexAttribDivisor( location + c, 1 );
+      }
+    }
   }
 }
 
-void Geometry::SetColorMap( Renderer::Shader * _shader, const char * _name, const ColorMap & _colorMap )
+void Geometry::ResolveUniforms( Renderer::Shader * _shader )
 {
-  char sz[ 64 ];
-
-  snprintf( sz, 64, "%s.color", _name );
-  _shader->SetConstant( sz, _colorMap.mColor );
-
-  snprintf( sz, 64, "%s.has_tex", _name );
-  _shader->SetConstant( sz, _colorMap.mTexture != NULL );
+  mUniforms.mShader = _shader;
+  mUniforms.mGlobalAmbient = _shader->GetUniform( "global_ambient" );
+  mUniforms.mCompactVertices = _shader->GetUniform( "compact_vertices" );
+  mUniforms.mMatWorldAttribute = glGetAttribLocation( _shader->mProgram, "in_mat_world" );
+  mUniforms.mMatWorld = _shader->GetUniform( "mat_world" );
+  mUniforms.mPosDecodeOffset = _shader->GetUniform( "pos_decode_offset" );
+  mUniforms.mPosDecodeScale = _shader->GetUniform( "pos_decode_scale" );
+  mUniforms.mTransparencyAccumulation = _shader->GetUniform( "transparency_accumulation" );
+  mUniforms.mMapDiffuseTex = _shader->GetUniform( "map_diffuse_tex" );
+  mUniforms.mMapNormalsTex = _shader->GetUniform( "map_normals_tex" );
+  mUniforms.mMapSpecularTex = _shader->GetUniform( "map_specular_tex" );
+  mUniforms.mMapAlbedoTex = _shader->GetUniform( "map_albedo_tex" );
+  mUniforms.mMapRoughnessTex = _shader->GetUniform( "map_roughness_tex" );
+  mUniforms.mMapMetallicTex = _shader->GetUniform( "map_metallic_tex" );
+  mUniforms.mMapAOTex = _shader->GetUniform( "map_ao_tex" );
+  mUniforms.mMapAmbientTex = _shader->GetUniform( "map_ambient_tex" );
+  mUniforms.mMapEmissiveTex = _shader->GetUniform( "map_emissive_tex" );
+}
 
+void Geometry::SetColorMap( Renderer::Shader * _shader, int _texture, const ColorMap & _colorMap )
+{
   if ( _colorMap.mTexture )
   {
-    snprintf( sz, 64, "%s.tex", _name );
-    _shader->SetTexture( sz, _colorMap.mTexture );
+    _shader->SetTexture( _texture, _colorMap.mTexture );
   }
-
 }
 
 std::string Geometry::GetSupportedExtensions()
 {
+  Assimp::Importer importer;
   std::string out;
-  gImporter.GetExtensionList( out );
+  importer.GetExtensionList( out );
   std::cout << out << std::endl;
 
   for ( int i = 0; i < out.length(); i++ )
@@ -1,8 +1,11 @@
 #include <map>
 #include <vector>
 #include <string>
+#include <atomic>
+#include <functional>
 
 #include "Renderer.h"
+#include "BVH.h"
 
 #define GLEW_NO_GLU
 #include "GL/glew.h"
@@ -10,30 +13,88 @@
 #include <GL/wGLew.h>
 #endif
 
+namespace MeshCache
+{
+class MappedFile;
+}
+
 class Geometry
 {
 public:
+  enum VERTEXFORMAT
+  {
+    VERTEXFORMAT_FULL = 0, // 56 bytes: float position, normal, tangent, binormal, UV
+    VERTEXFORMAT_COMPACT,  // 20 bytes: quantized position, octahedral normal / tangent, half UV
+  };
+
+  // Stages of a model load, reported through Staging::mStageCallback. A stage
+  // can be reported more than once per load; loads from the mesh cache skip
+  // the Assimp and material stages.
+  enum LOADSTAGE
+  {
+    LOADSTAGE_READ = 0,    // Assimp reading the file
+    LOADSTAGE_POSTPROCESS, // Assimp post-processing steps
+    LOADSTAGE_MATERIALS,   // materials and texture decoding
+    LOADSTAGE_VERTICES,    // vertex and index packing
+    LOADSTAGE_UPLOAD,      // creating the GL objects
+    LOADSTAGE_COUNT,
+  };
+
+  // Only the data that isn't needed for drawing; the hierarchy and mesh
+  // lists live in the mNode* arrays below
   struct Node
   {
     unsigned int mID;
     std::string mName;
-    std::vector<unsigned int> mMeshes;
-    unsigned int mParentID;
     glm::mat4x4 mTransformation;
   };
+  // A simplified version of a mesh, drawn with the mesh's vertices
+  struct LOD
+  {
+    int mTriangleCount;
+    size_t mIndexOffset; // in bytes, into the model's index buffer
+    float mError; // geometric error relative to the radius of the mesh bounds
+  };
+  static const int MAX_LODS = 4;
+
   struct Mesh
   {
     int mVertexCount;
-    GLuint mVertexBufferObject;
+    int mBaseVertex; // first vertex in the model's vertex buffer
     int mTriangleCount;
-    GLuint mIndexBufferObject;
+    size_t mIndexOffset; // in bytes, into the model's index buffer
+    GLenum mIndexType; // GL_UNSIGNED_SHORT if the mesh has at most 65536 vertices, GL_UNSIGNED_INT otherwise
     int mMaterialIndex;
-    GLuint mVertexArrayObject;
 
     glm::vec3 mAABBMin;
     glm::vec3 mAABBMax;
 
     bool mTransparent;
+
+    LOD mLODs[ MAX_LODS ]; // from fine to coarse
+    int mLODCount;
+
+    int mFirstMeshlet; // into the model's mMeshlets
+    int mMeshletCount; // 0 if the mesh is only culled as a whole
+
+    // Simulated post-transform cache misses per triangle and per vertex, for
+    // the triangle order of the source file and the one that is drawn; 0 unless
+    // the vertex order was optimized
+    float mImportedACMR;
+    float mImportedATVR;
+    float mACMR;
+    float mATVR;
+  };
+  // A cluster of neighbouring triangles, culled on its own when its mesh is
+  // drawn at full detail; triangles are reordered so it's one index range
+  struct Meshlet
+  {
+    glm::vec3 mCenter; // bounding sphere in mesh space
+    float mRadius;
+    glm::vec3 mConeAxis; // average normal, in mesh space
+    float mConeCutoff; // sine of the normal cone's half angle; 1 if it always has front faces
+    int mFirstTriangle; // within the mesh
+    int mTriangleCount;
   };
   struct ColorMap
   {
@@ -58,28 +119,261 @@ public:
     float mSpecularShininess;
   };
 
+  // One mesh of one node, built once at load. Items refer to their world
+  // matrix by slot, so animating the hierarchy only has to rewrite mMatrices.
+  struct DrawItem
+  {
+    uint64_t mSortKey; // material, then vertex range; decides the order of equally deep items
+    int mMatrixSlot;
+    unsigned int mMeshIndex;
+    unsigned int mMaterialIndex;
+    unsigned int mNodeMeshIndex; // into mNodeMeshes; also the item in the BVH
+  };
+
+  // What Render() culls against and how it picks mesh LODs
+  struct View
+  {
+    glm::mat4x4 mViewProjection;
+    bool mCullFrustum;
+    bool mCullBackfaces; // enables face culling for opaque meshes, so meshlets can be culled by their normal cone
+    glm::vec3 mCameraPosition; // in world space
+    float mPixelScale; // projected size in pixels of one unit at distance one; 0 always draws full detail
+  };
+
+  // A visible draw item in one of the render queues Render() builds every
+  // frame, keyed by its view depth
+  struct QueueItem
+  {
+    unsigned int mSortKey; // the depth as bits that sort like the float, inverted for back-to-front
+    unsigned int mDrawItem; // into mDrawItems
+  };
+
+  // One draw call of Render(): visible instances of a mesh that share a LOD
+  // and winding, or a single instance drawn with its meshlet ranges
+  struct InstanceDraw
+  {
+    unsigned int mMeshIndex;
+    unsigned int mMaterialIndex;
+    int mLOD; // 0 for full detail, otherwise one past the index into Mesh::mLODs
+    int mNodeMeshIndex; // for meshlet ranges, -1 otherwise
+    bool mMirrored;
+    unsigned int mFirstInstance; // into mInstanceMatrices
+    unsigned int mInstanceCount;
+  };
+
+  // What the last Render() issued
+  struct DrawStats
+  {
+    int mDrawCalls;
+    int mInstances;
+  };
+
+  // What the last culled Render() drew, counting each mesh of each node once
+  struct CullStats
+  {
+    int mVisibleMeshes;
+    int mTotalMeshes;
+    int mVisibleTriangles; // at the LOD that was picked
+    int mTotalTriangles;
+    int mReducedMeshes; // drawn with a LOD rather than at full detail
+    int mTotalMeshlets; // in the visible meshes drawn at full detail
+    int mFrustumCulledMeshlets;
+    int mBackfaceCulledMeshlets;
+  };
+
+  // What's left to draw of a node mesh after meshlet culling, as a range of
+  // mMeshletDrawCounts / mMeshletDrawOffsets; a count of -1 draws it whole
+  struct DrawRanges
+  {
+    int mFirst;
+    int mCount;
+  };
+
+  // Uniform handles Render() needs, resolved once per shader; the material
+  // colors themselves live in the MaterialConstants uniform block
+  struct ShaderUniforms
+  {
+    Renderer::Shader * mShader;
+    int mGlobalAmbient;
+    int mCompactVertices;
+    int mMatWorldAttribute; // the instanced world matrix takes this location and the next three
+    int mMatWorld; // set per instance for shaders without the attribute
+    int mPosDecodeOffset;
+    int mPosDecodeScale;
+    int mTransparencyAccumulation;
+    int mMapDiffuseTex;
+    int mMapNormalsTex;
+    int mMapSpecularTex;
+    int mMapAlbedoTex;
+    int mMapRoughnessTex;
+    int mMapMetallicTex;
+    int mMapAOTex;
+    int mMapAmbientTex;
+    int mMapEmissiveTex;
+  };
+
+  // A mesh whose GPU buffers haven't been created yet; the data either lives
+  // in the storage vectors (after an import) or in the mapped mesh cache.
+  // Faces mapped from the optimized mesh file are in the mesh's index type,
+  // with the LOD indices appended.
+  struct StagedMesh
+  {
+    int mIndex;
+    Mesh mMesh;
+    const void * mCachedVertices;
+    const void * mCachedFaces;
+    std::vector<unsigned char> mVertexStorage;
+    std::vector<unsigned int> mFaceStorage;
+    std::vector<unsigned short> mShortFaceStorage; // with the LOD indices appended
+    std::vector<unsigned int> mLODFaceStorage; // every LOD of the mesh, one after the other
+    std::vector<Meshlet> mMeshlets;
+  };
+  // Everything LoadMesh needs, built without touching GL so it can be filled
+  // in on a worker thread and handed to UploadStagedMesh on the render thread.
+  struct Staging
+  {
+    Staging();
+    ~Staging();
+
+    void Clear(); // safe on the loading thread
+    void ReleaseDeferredTextures(); // on the render thread, like the destructor
+
+    void AddNode( Node & _node, int _parentID, const unsigned int * _meshes, unsigned int _meshCount );
+
+    std::vector<Node> mNodes;
+    std::vector<int> mNodeParents;
+    std::vector<int> mNodeMatrixSlots;
+    std::vector<unsigned int> mNodeMeshOffsets;
+    std::vector<unsigned int> mNodeMeshes;
+    std::vector<Material> mMaterials;
+    std::vector<Renderer::Texture *> mEmbeddedTextures;
+    std::vector<StagedMesh> mMeshes;
+    glm::mat4x4 * mMatrices;
+    glm::vec3 mAABBMin;
+    glm::vec3 mAABBMax;
+    float mModelDiagonal;
+    glm::vec4 mGlobalAmbient;
+    BVH mBVH; // over the world space bounds of mNodeMeshes
+    MeshCache::MappedFile * mCacheFile;
+    std::vector<Renderer::Texture *> mDeferredTextureReleases; // uploaded textures dropped by Clear()
+    std::atomic<float> mProgress;
+
+    int mTextureDecodeCount;
+    int mTextureDecodeThreads;
+    float mTextureDecodeTime;
+    int mTextureCacheHits;
+    uint64_t mTextureCacheBytesSaved;
+
+    VERTEXFORMAT mVertexFormat; // set by the caller before staging
+    bool mUseCache; // read and write the .foxocache, .foxolod and .foxoopt next to the model
+    bool mGenerateLODs; // simplify large meshes, or load the LODs saved with the model
+    bool mOptimizeMeshes; // reorder triangles and vertices for the vertex cache, overdraw and vertex fetch
+    bool mBuildMeshlets; // split large meshes into meshlets
+    std::function<void( LOADSTAGE _stage, bool _begin )> mStageCallback; // optional, called on the loading thread
+  };
+
   Geometry();
   ~Geometry();
 
   bool LoadMesh( const char * _path );
+  static bool StageMesh( const char * _path, Staging & _staging );
+  void UploadStagedMesh( Staging & _staging );
   void UnloadMesh();
+  void BuildDrawLists();
 
-  void Render( const glm::mat4x4 & _worldRootMatrix, Renderer::Shader * _shader );
+  // With a view, draw items outside the view frustum are skipped, meshes are
+  // drawn at the coarsest LOD whose error stays below a pixel on screen and
+  // meshlets facing away or outside the frustum are left out. With a
+  // composite shader, transparent meshes are drawn unsorted in one pass with
+  // weighted blended transparency and composited with it.
+  void Render( const glm::mat4x4 & _worldRootMatrix, Renderer::Shader * _shader, const View * _view = NULL, Renderer::Shader * _transparencyCompositeShader = NULL );
+  void Cull( const glm::mat4x4 & _worldRootMatrix, const View & _view );
+  void CullMeshlets( const glm::mat4x4 & _worldRootMatrix, const View & _view, const Frustum::Planes & _planes );
+  // One pass over the draw items: the visible ones go into the opaque queue
+  // front-to-back and the transparent queue back-to-front, or unsorted
+  // without _sortTransparent
+  void BuildRenderQueues( const glm::mat4x4 & _worldRootMatrix, const View * _view, bool _sortTransparent );
+  // Turns a sorted queue into draws, appending their world matrices to
+  // mInstanceMatrices; with _keepOrder only neighbouring items share a draw
+  void BuildInstanceDraws( const std::vector<QueueItem> & _queue, const View * _view, bool _keepOrder, bool _cullBackfaces, std::vector<InstanceDraw> & _draws );
+  // Fits the BVH and bounding spheres to the current node matrices under the given root
+  void RefitBVH( const glm::mat4x4 & _worldRootMatrix );
+  // Nearest mesh whose bounds the ray hits, in the space of the last Cull();
+  // rays starting inside a mesh's bounds ignore that mesh. Returns an index
+  // into mNodeMeshes or -1.
+  int RayCast( const glm::vec3 & _origin, const glm::vec3 & _direction, float & _distance ) const;
 
-  void __SetupVertexArray( Renderer::Shader * _shader, const char * name, int sizeInFloats, int & offsetInFloats);
+  void __SetupVertexArray( Renderer::Shader * _shader, const char * name, int components, GLenum type, GLboolean normalized, bool integer, int offsetInBytes );
   void RebindVertexArray( Renderer::Shader * _shader );
 
-  void SetColorMap( Renderer::Shader * _shader, const char * _name, const ColorMap & _colorMap );
+  void ResolveUniforms( Renderer::Shader * _shader );
+  void SetColorMap( Renderer::Shader * _shader, int _texture, const ColorMap & _colorMap );
+
+  // Rewrites the uniform block of a material after it was edited
+  void UpdateMaterialConstants( int _materialIndex );
 
   static std::string GetSupportedExtensions();
 
-  std::map<int, Node> mNodes;
-  std::map<int, Mesh> mMeshes;
-  std::map<int, Material> mMaterials;
+  // Node data is stored as structure-of-arrays, indexed by node ID. IDs are
+  // assigned depth first, so parents always precede their children.
+  std::vector<Node> mNodes;
+  std::vector<int> mNodeParents; // -1 for the root
+  std::vector<int> mNodeMatrixSlots; // index into mMatrices
+  std::vector<unsigned int> mNodeMeshOffsets; // node i draws mNodeMeshes[ mNodeMeshOffsets[ i ] ] up to mNodeMeshOffsets[ i + 1 ]
+  std::vector<unsigned int> mNodeMeshes; // indices into mMeshes
+  std::vector<Mesh> mMeshes;
+  std::vector<Material> mMaterials;
   std::vector<Renderer::Texture *> mEmbeddedTextures;
+  std::vector<DrawItem> mDrawItems;
+  // Rebuilt by every Render()
+  std::vector<QueueItem> mOpaqueQueue;
+  std::vector<QueueItem> mTransparentQueue;
+  std::vector<QueueItem> mQueueScratch; // radix sort ping-pong
+  std::vector<glm::mat4x4> mDrawItemMatrices; // world matrix of each visible item in mDrawItems
+  std::vector<int> mQueueDraws; // the draw of each queue item
+  std::vector<int> mMeshDraws; // the open draw of each mesh, LOD and winding; -1 between frames
+  std::vector<InstanceDraw> mOpaqueDraws;
+  std::vector<InstanceDraw> mTransparentDraws;
+  std::vector<glm::mat4x4> mInstanceMatrices;
+  DrawStats mDrawStats;
+  // Over the world space bounds of mNodeMeshes; refitted when the root matrix changes
+  BVH mBVH;
+  glm::mat4x4 mBoundsRootMatrix;
+  bool mBoundsValid;
+  std::vector<unsigned char> mNodeMeshVisible; // indexed like mNodeMeshes
+  std::vector<unsigned char> mNodeMeshLODs; // 0 for full detail, otherwise one past the index into Mesh::mLODs
+  std::vector<glm::vec4> mNodeMeshSpheres; // world space center and radius, fitted with the BVH
+  std::vector<Meshlet> mMeshlets;
+  std::vector<DrawRanges> mNodeMeshDrawRanges; // indexed like mNodeMeshes
+  std::vector<GLsizei> mMeshletDrawCounts; // index count, byte offset and base vertex of each range, rebuilt by Cull()
+  std::vector<const GLvoid *> mMeshletDrawOffsets;
+  std::vector<GLint> mMeshletDrawBaseVertices;
+  CullStats mCullStats;
+  ShaderUniforms mUniforms;
+  // All meshes share one vertex and one index buffer, drawn with a base vertex
+  GLuint mVertexArrayObject;
+  GLuint mVertexBufferObject;
+  GLuint mIndexBufferObject;
+  GLuint mInstanceBufferObject; // mInstanceMatrices, refilled every Render()
+  // One uniform block per material, mMaterialBlockStride bytes apart
+  GLuint mMaterialBufferObject;
+  unsigned int mMaterialBlockStride;
   glm::mat4x4 * mMatrices;
   glm::vec3 mAABBMin;
   glm::vec3 mAABBMax;
   float mModelDiagonal;
   glm::vec4 mGlobalAmbient;
+
+  // Load statistics of the texture pipeline, in milliseconds
+  int mTextureCount;
+  int mTextureDecodeThreads;
+  float mTextureDecodeTime;
+  float mTextureUploadTime;
+  int mTextureCacheHits;
+  uint64_t mTextureCacheBytesSaved;
+
+  VERTEXFORMAT mVertexFormat;
+  uint64_t mVertexBufferSize;
+  uint64_t mFullVertexBufferSize; // what the vertices would take in VERTEXFORMAT_FULL
+  uint64_t mIndexBufferSize;
 };
\ No newline at end of file
@@ -0,0 +1,27 @@
+#include "ImageWriter.h"
+
+#include <cstdio>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+namespace ImageWriter
+{
+
+bool WritePNG( const char * _path, const unsigned char * _pixels, int _width, int _height )
+{
+  if ( _width <= 0 || _height <= 0 )
+  {
+    return false;
+  }
+
+  if ( !stbi_write_png( _path, _width, _height, 4, _pixels, _width * 4 ) )
+  {
+    printf( "[imagewriter] Writing '%s' failed\n", _path );
+    remove( _path );
+    return false;
+  }
+  return true;
+}
+
+} // namespace
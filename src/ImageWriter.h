@@ -0,0 +1,8 @@
+#include <stdint.h>
+
+// Image output for offscreen renders, through stb_image_write
+namespace ImageWriter
+{
+// _pixels is top-down RGBA8, _width * _height * 4 bytes
+bool WritePNG( const char * _path, const unsigned char * _pixels, int _width, int _height );
+} // namespace
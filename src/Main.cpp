@@ -2,9 +2,15 @@
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 #include "Geometry.h"
 #include "SetupDialog.h"
+#include "ImageWriter.h"
+#include "Profiler.h"
+#include "MeshOptimizer.h"
 
 #define IMGUI_IMPL_OPENGL_LOADER_GLEW
 #include <imgui.h>
@@ -19,6 +25,13 @@
 
 #include <jsonxx.h>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
 Renderer::Shader * LoadShader( const char * vsPath, const char * fsPath )
 {
   char vertexShader[ 16 * 1024 ] = { 0 };
@@ -90,6 +103,34 @@ float gSkysphereBlur = 0.0f;
 glm::vec4 gClearColor( 0.5f, 0.5f, 0.5f, 1.0f );
 void LoadSkyImageConfig( const jsonxx::Object & obj );
 
+const jsonxx::Object * FindShaderConfig( const std::string & _name )
+{
+  const int shaderCount = gOptions.get<jsonxx::Array>( "shaders" ).size();
+  for ( int i = 0; i < shaderCount; i++ )
+  {
+    const jsonxx::Object & shaderConfig = gOptions.get<jsonxx::Array>( "shaders" ).get<jsonxx::Object>( i );
+    if ( shaderConfig.get<jsonxx::String>( "name" ) == _name )
+    {
+      return &shaderConfig;
+    }
+  }
+  return NULL;
+}
+
+const jsonxx::Object * FindSkyImageConfig( const std::string & _reflection )
+{
+  const int skyImageCount = gOptions.get<jsonxx::Array>( "skyImages" ).size();
+  for ( int i = 0; i < skyImageCount; i++ )
+  {
+    const jsonxx::Object & skyImageConfig = gOptions.get<jsonxx::Array>( "skyImages" ).get<jsonxx::Object>( i );
+    if ( skyImageConfig.get<jsonxx::String>( "reflection" ) == _reflection )
+    {
+      return &skyImageConfig;
+    }
+  }
+  return NULL;
+}
+
 void LoadMeshConfig( const char * path )
 {
   FILE * configFile = fopen( path, "rb" );
@@ -116,31 +157,19 @@ void LoadMeshConfig( const char * path )
   const jsonxx::Object & meshconfig = meshconfigRoot.get<jsonxx::Object>( "config" );
   if ( meshconfig.has<jsonxx::String>( "shader" ) )
   {
-    const std::string & shaderName = meshconfig.get<jsonxx::String>( "shader" );
-    const int shaderCount = gOptions.get<jsonxx::Array>( "shaders" ).size();
-    for ( int i = 0; i < shaderCount; i++ )
+    const jsonxx::Object * shaderConfig = FindShaderConfig( meshconfig.get<jsonxx::String>( "shader" ) );
+    if ( shaderConfig )
     {
-      const jsonxx::Object & shaderConfig = gOptions.get<jsonxx::Array>( "shaders" ).get<jsonxx::Object>( i );
-      if ( shaderConfig.get<jsonxx::String>( "name" ) == shaderName )
-      {
-        LoadShaderConfig( &shaderConfig );
-        gModel.RebindVertexArray( gCurrentShader );
-        break;
-      }
+      LoadShaderConfig( shaderConfig );
+      gModel.RebindVertexArray( gCurrentShader );
     }
   }
   if ( meshconfig.has<jsonxx::String>( "skyImage" ) )
   {
-    const std::string & skyImageName = meshconfig.get<jsonxx::String>( "skyImage" );
-    const int skyImageCount = gOptions.get<jsonxx::Array>( "skyImages" ).size();
-    for ( int i = 0; i < skyImageCount; i++ )
+    const jsonxx::Object * skyImageConfig = FindSkyImageConfig( meshconfig.get<jsonxx::String>( "skyImage" ) );
+    if ( skyImageConfig )
     {
-      const jsonxx::Object & skyImageConfig = gOptions.get<jsonxx::Array>( "skyImages" ).get<jsonxx::Object>( i );
-      if ( skyImageConfig.get<jsonxx::String>( "reflection" ) == skyImageName )
-      {
-        LoadSkyImageConfig( skyImageConfig );
-        break;
-      }
+      LoadSkyImageConfig( *skyImageConfig );
     }
   }
   if ( meshconfig.has<jsonxx::Number>( "cameraDistance" ) )
@@ -235,15 +264,76 @@ void SaveMeshConfig( const char * path )
   printf( "Saved mesh config file to '%s'\n", path );
 }
 
+//////////////////////////////////////////////////////////////////////////
+// Background mesh loading
+
+// The import runs on a worker thread into a staging area; the GL objects are
+// created on the main thread once the worker is done.
+struct MeshLoadJob
+{
+  std::string mPath;
+  Geometry::Staging mStaging;
+  std::thread mThread;
+  std::atomic<bool> mFinished;
+  bool mSuccess;
+  float mStageTime; // in milliseconds, valid once finished
+};
+
 std::string gMeshPath;
-bool LoadMesh( const char * path )
+MeshLoadJob * gMeshLoadJob = NULL;
+std::string gQueuedMeshPath;
+bool gCompactVertices = false;
+bool gGenerateLODs = false;
+bool gBuildMeshlets = false;
+bool gOptimizeMeshes = false;
+
+MeshLoadJob * StartMeshLoadJob( const char * path )
 {
-  if ( !gModel.LoadMesh( path ) )
+  MeshLoadJob * job = new MeshLoadJob();
+  job->mPath = path;
+  job->mFinished = false;
+  job->mSuccess = false;
+  job->mStageTime = 0.0f;
+  job->mStaging.mVertexFormat = gCompactVertices ? Geometry::VERTEXFORMAT_COMPACT : Geometry::VERTEXFORMAT_FULL;
+  job->mStaging.mGenerateLODs = gGenerateLODs;
+  job->mStaging.mBuildMeshlets = gBuildMeshlets;
+  job->mStaging.mOptimizeMeshes = gOptimizeMeshes;
+  job->mThread = std::thread( []( MeshLoadJob * job )
   {
-    return false;
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    job->mSuccess = Geometry::StageMesh( job->mPath.c_str(), job->mStaging );
+    job->mStageTime = std::chrono::duration<float, std::milli>( std::chrono::high_resolution_clock::now() - start ).count();
+    job->mFinished = true;
+  }, job );
+  return job;
+}
+
+void LoadMesh( const char * path )
+{
+  if ( gMeshLoadJob )
+  {
+    // Only the most recently requested model is worth loading next
+    gQueuedMeshPath = path;
+    return;
+  }
+
+  gMeshLoadJob = StartMeshLoadJob( path );
+}
+
+void WaitForMeshLoad()
+{
+  if ( gMeshLoadJob )
+  {
+    gMeshLoadJob->mThread.join();
+    delete gMeshLoadJob;
+    gMeshLoadJob = NULL;
   }
+  gQueuedMeshPath.clear();
+}
 
-  gMeshPath = path;
+// Frames the freshly loaded model, then applies its saved config on top
+void SetupLoadedMesh()
+{
   gModel.RebindVertexArray( gCurrentShader );
 
   gCameraTarget = ( gModel.mAABBMin + gModel.mAABBMax ) / 2.0f;
@@ -252,42 +342,91 @@ bool LoadMesh( const char * path )
   char meshConfigPath[ 512 ];
   snprintf( meshConfigPath, 512, "%s.foxocfg", gMeshPath.c_str() );
   LoadMeshConfig( meshConfigPath );
+}
+
+bool FinishMeshLoad()
+{
+  if ( !gMeshLoadJob || !gMeshLoadJob->mFinished )
+  {
+    return false;
+  }
+
+  gMeshLoadJob->mThread.join();
+
+  MeshLoadJob * job = gMeshLoadJob;
+  gMeshLoadJob = NULL;
+
+  const bool success = job->mSuccess;
+  if ( success )
+  {
+    gModel.UploadStagedMesh( job->mStaging );
+    gMeshPath = job->mPath;
+  }
+  delete job;
+
+  if ( !gQueuedMeshPath.empty() )
+  {
+    std::string path = gQueuedMeshPath;
+    gQueuedMeshPath.clear();
+    LoadMesh( path.c_str() );
+  }
+
+  if ( !success )
+  {
+    return false;
+  }
+
+  SetupLoadedMesh();
 
   return true;
 }
 
+// Ratios are left at 0 for meshes that weren't analyzed
+void ShowCacheMissRatio( float _ratio )
+{
+  if ( _ratio > 0.0f )
+  {
+    ImGui::Text( "%.3f", _ratio );
+  }
+  else
+  {
+    ImGui::TextDisabled( "-" );
+  }
+}
+
 void ShowNodeInImGui( int _parentID )
 {
-  for ( std::map<int, Geometry::Node>::iterator it = gModel.mNodes.begin(); it != gModel.mNodes.end(); it++ )
+  for ( int k = 0; k < gModel.mNodes.size(); k++ )
   {
-    if ( it->second.mParentID == _parentID )
+    if ( gModel.mNodeParents[ k ] == _parentID )
     {
-      ImGui::Text( "%s", it->second.mName.c_str() );
+      ImGui::Text( "%s", gModel.mNodes[ k ].mName.c_str() );
       ImGui::Indent();
-      for ( int i = 0; i < it->second.mMeshes.size(); i++ )
+      for ( unsigned int i = gModel.mNodeMeshOffsets[ k ]; i < gModel.mNodeMeshOffsets[ k + 1 ]; i++ )
       {
-        const Geometry::Mesh & mesh = gModel.mMeshes[ it->second.mMeshes[ i ] ];
-        ImGui::TextColored( ImVec4( 1.0f, 0.5f, 1.0f, 1.0f ), "Mesh %d: %d vertices, %d triangles", i + 1, mesh.mVertexCount, mesh.mTriangleCount );
+        const Geometry::Mesh & mesh = gModel.mMeshes[ gModel.mNodeMeshes[ i ] ];
+        ImGui::TextColored( ImVec4( 1.0f, 0.5f, 1.0f, 1.0f ), "Mesh %d: %d vertices, %d triangles", i - gModel.mNodeMeshOffsets[ k ] + 1, mesh.mVertexCount, mesh.mTriangleCount );
         ImGui::SameLine();
         ImGui::TextColored( ImVec4( 1.0f, 0.75f, 1.0f, 1.0f ), "Material: %s", gModel.mMaterials[ mesh.mMaterialIndex ].mName.c_str() );        
       }
 
-      ShowNodeInImGui( it->second.mID );
+      ShowNodeInImGui( k );
       ImGui::Unindent();
     }
   }
 }
 
-void ShowColorMapInImGui( const char * _channel, Geometry::ColorMap & _colorMap )
+bool ShowColorMapInImGui( const char * _channel, Geometry::ColorMap & _colorMap )
 {
   if ( !_colorMap.mValid )
   {
-    return;
+    return false;
   }
 
+  bool changed = false;
   if ( ImGui::BeginTabItem( _channel ) )
   {
-    ImGui::ColorEdit4( "Color", (float *) &_colorMap.mColor, ImGuiColorEditFlags_AlphaPreviewHalf );
+    changed = ImGui::ColorEdit4( "Color", (float *) &_colorMap.mColor, ImGuiColorEditFlags_AlphaPreviewHalf );
     if ( _colorMap.mTexture )
     {
       ImGui::Text( "Texture: %s", _colorMap.mTexture->mFilename.c_str() );
@@ -298,8 +437,39 @@ void ShowColorMapInImGui( const char * _channel, Geometry::ColorMap & _colorMap
     }
     ImGui::EndTabItem();
   }
+  return changed;
 }
 
+// std140 layout of the FrameConstants uniform block in the shaders
+struct FrameConstants
+{
+  struct Light
+  {
+    glm::vec3 mDirection;
+    float mPadding0;
+    glm::vec3 mColor;
+    float mPadding1;
+  };
+
+  glm::mat4x4 mProjection;
+  glm::mat4x4 mView;
+  glm::mat4x4 mViewInverse;
+  glm::mat4x4 mSkyProjection;
+  glm::mat4x4 mSkyView;
+  glm::vec4 mBackgroundColor;
+  glm::vec3 mCameraPosition;
+  float mExposure;
+  Light mLights[ 3 ];
+  float mSkysphereRotation;
+  float mSkysphereMipCount;
+  float mSkysphereBlur;
+  float mSkysphereOpacity;
+  uint32_t mFrameCount;
+  int32_t mHasTexSkysphere;
+  int32_t mHasTexSkyenv;
+  int32_t mPadding;
+};
+
 Renderer::Texture* gBrdfLookupTable = NULL;
 
 void loadBrdfLookupTable()
@@ -372,6 +542,11 @@ SkyImages gCurrentSkyImage;
 
 void LoadSkyImageConfig( const jsonxx::Object & obj )
 {
+  // Reselecting the current sky doesn't need another decode
+  if ( gCurrentSkyImageConfig == &obj && gCurrentSkyImage.reflection )
+  {
+    return;
+  }
   gCurrentSkyImageConfig = &obj;
 
   const char* reflectionPath = obj.get<jsonxx::String>( "reflection" ).c_str();
@@ -387,7 +562,7 @@ void LoadSkyImageConfig( const jsonxx::Object & obj )
 
   if ( gCurrentSkyImage.reflection )
   {
-      glBindTexture( GL_TEXTURE_2D, gCurrentSkyImage.reflection->mGLTextureID );
+      Renderer::BindTexture( 0, gCurrentSkyImage.reflection );
 
       glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
       glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP );
@@ -408,7 +583,7 @@ void LoadSkyImageConfig( const jsonxx::Object & obj )
 
     if ( gCurrentSkyImage.env )
     {
-      glBindTexture( GL_TEXTURE_2D, gCurrentSkyImage.env->mGLTextureID );
+      Renderer::BindTexture( 0, gCurrentSkyImage.env );
 
       glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
       glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP );
@@ -436,6 +611,722 @@ void LoadSkyImageConfig( const jsonxx::Object & obj )
   }
 }
 
+//////////////////////////////////////////////////////////////////////////
+// Scene rendering
+
+Geometry gSkysphere;
+Renderer::Shader * gSkysphereShader = NULL;
+Renderer::Shader * gTransparencyCompositeShader = NULL; // NULL if it failed to load, which leaves only sorted transparency
+FrameConstants gFrameConstants;
+GLuint gFrameConstantBuffer = 0;
+bool gFrustumCulling = true;
+bool gLODSelection = true;
+bool gBackfaceCulling = false;
+bool gWeightedBlendedTransparency = false;
+
+const glm::mat4x4 gXZYMatrix(
+  1.0f, 0.0f, 0.0f, 0.0f,
+  0.0f, 0.0f, 1.0f, 0.0f,
+  0.0f,-1.0f, 0.0f, 0.0f,
+  0.0f, 0.0f, 0.0f, 1.0f );
+
+bool InitSceneRendering()
+{
+  loadBrdfLookupTable();
+
+  memset( &gFrameConstants, 0, sizeof( FrameConstants ) );
+  glGenBuffers( 1, &gFrameConstantBuffer );
+  glBindBuffer( GL_UNIFORM_BUFFER, gFrameConstantBuffer );
+  glBufferData( GL_UNIFORM_BUFFER, sizeof( FrameConstants ), NULL, GL_DYNAMIC_DRAW );
+  glBindBuffer( GL_UNIFORM_BUFFER, 0 );
+
+  gSkysphere.LoadMesh( "Skyboxes/skysphere.fbx" );
+
+  gSkysphereShader = LoadShader( "Skyboxes/skysphere.vs", "Skyboxes/skysphere.fs" );
+  if ( !gSkysphereShader )
+  {
+    return false;
+  }
+  gSkysphere.RebindVertexArray( gSkysphereShader );
+
+  gTransparencyCompositeShader = LoadShader( "Shaders/transparency_composite.vs", "Shaders/transparency_composite.fs" );
+
+  return true;
+}
+
+void ReleaseSceneRendering()
+{
+  if ( gCurrentShader )
+  {
+    Renderer::ReleaseShader( gCurrentShader );
+    delete gCurrentShader;
+    gCurrentShader = NULL;
+  }
+  glDeleteBuffers( 1, &gFrameConstantBuffer );
+  gFrameConstantBuffer = 0;
+  if ( gSkysphereShader )
+  {
+    Renderer::ReleaseShader( gSkysphereShader );
+    delete gSkysphereShader;
+    gSkysphereShader = NULL;
+  }
+  if ( gTransparencyCompositeShader )
+  {
+    Renderer::ReleaseShader( gTransparencyCompositeShader );
+    delete gTransparencyCompositeShader;
+    gTransparencyCompositeShader = NULL;
+  }
+  gSkysphere.UnloadMesh();
+  if ( gCurrentSkyImage.reflection )
+  {
+    Renderer::ReleaseTexture( gCurrentSkyImage.reflection );
+    gCurrentSkyImage.reflection = NULL;
+  }
+  if ( gCurrentSkyImage.env )
+  {
+    Renderer::ReleaseTexture( gCurrentSkyImage.env );
+    gCurrentSkyImage.env = NULL;
+  }
+}
+
+// Draws the sky and the model with the current camera, light and sky settings
+// into whatever framebuffer is bound; shared by the viewer and headless mode.
+void RenderScene( int _width, int _height, uint32_t _frameCount, bool _xzySpace, bool _edgedFaces )
+{
+  //////////////////////////////////////////////////////////////////////////
+  // Per-frame constants, uploaded once for the skysphere and the mesh
+
+  glm::vec3 cameraPosition( 0.0f, 0.0f, -1.0f );
+  cameraPosition = glm::rotateX( cameraPosition, gCameraPitch );
+  cameraPosition = glm::rotateY( cameraPosition, gCameraYaw );
+
+  const float verticalFovInRadian = 0.5f;
+  gFrameConstants.mSkyProjection = glm::perspective( verticalFovInRadian, _width / (float) _height, 0.001f, 2.0f );
+  gFrameConstants.mSkyView = glm::lookAtRH( cameraPosition * 0.15f, glm::vec3( 0.0f, 0.0f, 0.0f ), glm::vec3( 0.0f, 1.0f, 0.0f ) );
+
+  const float nearPlane = std::max( gModel.mModelDiagonal / 10000.0f, gCameraDistance / 1000.0f );
+  const float farPlane = std::max( gModel.mModelDiagonal, gCameraDistance + gModel.mModelDiagonal );
+  const glm::mat4x4 projectionMatrix = glm::perspective( verticalFovInRadian, _width / (float) _height, nearPlane, farPlane );
+  gFrameConstants.mProjection = projectionMatrix;
+
+  cameraPosition *= gCameraDistance;
+  gFrameConstants.mCameraPosition = cameraPosition;
+
+  const glm::mat4x4 viewMatrix = glm::lookAtRH( cameraPosition + gCameraTarget, gCameraTarget, glm::vec3( 0.0f, 1.0f, 0.0f ) );
+  gFrameConstants.mView = viewMatrix;
+  gFrameConstants.mViewInverse = glm::inverse( viewMatrix );
+
+  glm::vec3 lightDirection( 0.0f, 0.0f, 1.0f );
+  lightDirection = glm::rotateX( lightDirection, gLightPitch );
+  lightDirection = glm::rotateY( lightDirection, gLightYaw );
+
+  glm::vec3 fillLightDirection( 0.0f, 0.0f, 1.0f );
+  fillLightDirection = glm::rotateX( fillLightDirection, gLightPitch - 0.4f );
+  fillLightDirection = glm::rotateY( fillLightDirection, gLightYaw + 0.8f );
+
+  gFrameConstants.mLights[ 0 ].mDirection = lightDirection;
+  gFrameConstants.mLights[ 0 ].mColor = gCurrentSkyImage.sunColor;
+  gFrameConstants.mLights[ 1 ].mDirection = fillLightDirection;
+  gFrameConstants.mLights[ 1 ].mColor = glm::vec3( 0.5f );
+  gFrameConstants.mLights[ 2 ].mDirection = -fillLightDirection;
+  gFrameConstants.mLights[ 2 ].mColor = glm::vec3( 0.25f );
+
+  gFrameConstants.mBackgroundColor = gClearColor;
+  gFrameConstants.mExposure = exposure;
+  gFrameConstants.mSkysphereRotation = gLightYaw - gCurrentSkyImage.sunYaw;
+  gFrameConstants.mSkysphereMipCount = gCurrentSkyImage.reflection ? floor( log2( gCurrentSkyImage.reflection->mHeight ) ) : 0.0f;
+  gFrameConstants.mSkysphereBlur = gSkysphereBlur;
+  gFrameConstants.mSkysphereOpacity = gSkysphereOpacity;
+  gFrameConstants.mFrameCount = _frameCount;
+  gFrameConstants.mHasTexSkysphere = gCurrentSkyImage.reflection != NULL;
+  gFrameConstants.mHasTexSkyenv = gCurrentSkyImage.env != NULL;
+
+  glBindBuffer( GL_UNIFORM_BUFFER, gFrameConstantBuffer );
+  glBufferSubData( GL_UNIFORM_BUFFER, 0, sizeof( FrameConstants ), &gFrameConstants );
+  glBindBuffer( GL_UNIFORM_BUFFER, 0 );
+  Renderer::BindUniformBuffer( Renderer::UNIFORMBLOCK_FRAME, gFrameConstantBuffer );
+
+  //////////////////////////////////////////////////////////////////////////
+  // Skysphere render
+
+  static glm::mat4x4 worldRootXYZ( 1.0f );
+  if ( gCurrentShaderConfig->get<jsonxx::Boolean>( "showSkybox" ) )
+  {
+    if ( gCurrentSkyImage.reflection )
+    {
+      gSkysphereShader->SetTexture( "tex_skysphere", gCurrentSkyImage.reflection );
+    }
+
+    if ( gCurrentSkyImage.env )
+    {
+      gSkysphereShader->SetTexture( "tex_skyenv", gCurrentSkyImage.env );
+    }
+
+    Profiler::BeginStage( Profiler::STAGE_SKYSPHERE );
+    gSkysphere.Render( worldRootXYZ, gSkysphereShader );
+    Profiler::EndStage( Profiler::STAGE_SKYSPHERE );
+
+    glClear( GL_DEPTH_BUFFER_BIT );
+  }
+
+  //////////////////////////////////////////////////////////////////////////
+  // Mesh render
+
+  if ( gCurrentSkyImage.reflection )
+  {
+    gCurrentShader->SetTexture( "tex_skysphere", gCurrentSkyImage.reflection );
+  }
+  if ( gCurrentSkyImage.env )
+  {
+    gCurrentShader->SetTexture( "tex_skyenv", gCurrentSkyImage.env );
+  }
+  gCurrentShader->SetTexture( "tex_brdf_lut", gBrdfLookupTable );
+
+  Geometry::View view;
+  view.mViewProjection = projectionMatrix * viewMatrix;
+  view.mCullFrustum = gFrustumCulling;
+  view.mCullBackfaces = gBackfaceCulling;
+  view.mCameraPosition = cameraPosition + gCameraTarget;
+  view.mPixelScale = gLODSelection ? _height / ( 2.0f * tanf( verticalFovInRadian * 0.5f ) ) : 0.0f;
+  const Geometry::View * cullView = gFrustumCulling || gBackfaceCulling || gLODSelection ? &view : NULL;
+  Renderer::Shader * transparencyCompositeShader = gWeightedBlendedTransparency ? gTransparencyCompositeShader : NULL;
+
+  gModel.Render( _xzySpace ? gXZYMatrix : worldRootXYZ, gCurrentShader, cullView, transparencyCompositeShader );
+
+  if ( _edgedFaces )
+  {
+    Profiler::ScopedStage stage( Profiler::STAGE_WIREFRAME );
+
+    Renderer::SetPolygonMode( GL_LINE );
+    Renderer::SetDepthFunc( GL_LEQUAL );
+
+    // Only the exposure differs for the wireframe pass
+    const float wireframeExposure = 100.0f;
+    glBindBuffer( GL_UNIFORM_BUFFER, gFrameConstantBuffer );
+    glBufferSubData( GL_UNIFORM_BUFFER, offsetof( FrameConstants, mExposure ), sizeof( float ), &wireframeExposure );
+    glBindBuffer( GL_UNIFORM_BUFFER, 0 );
+    gModel.Render( _xzySpace ? gXZYMatrix : worldRootXYZ, gCurrentShader, cullView, transparencyCompositeShader );
+
+    Renderer::SetPolygonMode( GL_FILL );
+    Renderer::SetDepthFunc( GL_LESS );
+  }
+}
+
+// Moves the camera target to where a ray through the cursor (in 0..1 window
+// coordinates) hits the nearest mesh bounds, using last frame's camera
+void FocusCameraOnMesh( float _x, float _y, bool _xzySpace )
+{
+  const glm::mat4x4 worldRootMatrix = _xzySpace ? gXZYMatrix : glm::mat4x4( 1.0f );
+  if ( !gModel.mBoundsValid || gModel.mBoundsRootMatrix != worldRootMatrix )
+  {
+    gModel.RefitBVH( worldRootMatrix );
+  }
+
+  const glm::mat4x4 inverseViewProjection = glm::inverse( gFrameConstants.mProjection * gFrameConstants.mView );
+  const glm::vec2 clipPosition( _x * 2.0f - 1.0f, 1.0f - _y * 2.0f );
+  const glm::vec4 nearPoint = inverseViewProjection * glm::vec4( clipPosition.x, clipPosition.y, -1.0f, 1.0f );
+  const glm::vec4 farPoint = inverseViewProjection * glm::vec4( clipPosition.x, clipPosition.y, 1.0f, 1.0f );
+  const glm::vec3 origin = glm::vec3( nearPoint ) / nearPoint.w;
+  const glm::vec3 direction = glm::normalize( glm::vec3( farPoint ) / farPoint.w - origin );
+
+  float distance = 0.0f;
+  if ( gModel.RayCast( origin, direction, distance ) >= 0 )
+  {
+    gCameraTarget = origin + direction * distance;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Headless mode
+
+// Renders models into images without a window or ImGui, e.g. on a server:
+//   foxotron --headless model.fbx --output model.png
+//   foxotron --headless --batch models/ --output previews/ --frames 36
+// The environment (shaders, sky, BRDF table) is set up once; in batch mode
+// the next model is imported on a worker thread while the current one renders.
+// Each model's .foxocfg is applied first, command line options override it.
+struct HeadlessOptions
+{
+  std::string mModelPath;
+  std::string mBatchFolder;
+  std::string mOutputPath;
+  std::string mSummaryPath;
+  const jsonxx::Object * mShaderConfig; // NULL if not given
+  const jsonxx::Object * mSkyImageConfig; // NULL if not given
+  int mFrameCount;
+  bool mXZYSpace;
+  bool mEdgedFaces;
+  bool mHasCameraYaw;
+  bool mHasCameraPitch;
+  bool mHasCameraDistance;
+  bool mHasExposure;
+  float mCameraYaw;
+  float mCameraPitch;
+  float mCameraDistance;
+  float mExposure;
+};
+
+void PrintHeadlessUsage()
+{
+  printf( "Usage: foxotron --headless <model> [options]\n" );
+  printf( "       foxotron --headless --batch <folder> [options]\n" );
+  printf( "  --output <path>           PNG to write, or the output folder in batch mode\n" );
+  printf( "  --summary <path>          timing summary JSON (default: <output folder>/summary.json in batch mode)\n" );
+  printf( "  --frames <count>          turntable frames per model, evenly spaced around the model (default: 1)\n" );
+  printf( "  --width <pixels>          image width (default: 1280)\n" );
+  printf( "  --height <pixels>         image height (default: 720)\n" );
+  printf( "  --shader <name>           shader name from config.json\n" );
+  printf( "  --sky <reflection>        sky image from config.json, by its reflection path\n" );
+  printf( "  --camera-yaw <radians>\n" );
+  printf( "  --camera-pitch <radians>\n" );
+  printf( "  --camera-distance <units>\n" );
+  printf( "  --exposure <value>\n" );
+  printf( "  --xzy                     treat the models as Z-up\n" );
+  printf( "  --wireframe               draw edged faces\n" );
+  printf( "  --no-multisampling\n" );
+}
+
+bool ParseHeadlessOptions( int argc, const char * argv[], HeadlessOptions & _options, RENDERER_SETTINGS & _settings )
+{
+  _options.mShaderConfig = NULL;
+  _options.mSkyImageConfig = NULL;
+  _options.mFrameCount = 1;
+  _options.mXZYSpace = false;
+  _options.mEdgedFaces = false;
+  _options.mHasCameraYaw = false;
+  _options.mHasCameraPitch = false;
+  _options.mHasCameraDistance = false;
+  _options.mHasExposure = false;
+
+  _settings.mVsync = false;
+  _settings.mWidth = 1280;
+  _settings.mHeight = 720;
+  _settings.mWindowMode = RENDERER_WINDOWMODE_WINDOWED;
+  _settings.mMultisampling = true;
+
+  for ( int i = 1; i < argc; i++ )
+  {
+    const std::string arg = argv[ i ];
+    const bool hasValue = i + 1 < argc;
+    if ( arg == "--headless" )
+    {
+      continue;
+    }
+    else if ( arg == "--xzy" )
+    {
+      _options.mXZYSpace = true;
+    }
+    else if ( arg == "--wireframe" )
+    {
+      _options.mEdgedFaces = true;
+    }
+    else if ( arg == "--no-multisampling" )
+    {
+      _settings.mMultisampling = false;
+    }
+    else if ( arg == "--batch" && hasValue )
+    {
+      _options.mBatchFolder = argv[ ++i ];
+    }
+    else if ( arg == "--output" && hasValue )
+    {
+      _options.mOutputPath = argv[ ++i ];
+    }
+    else if ( arg == "--summary" && hasValue )
+    {
+      _options.mSummaryPath = argv[ ++i ];
+    }
+    else if ( arg == "--frames" && hasValue )
+    {
+      _options.mFrameCount = atoi( argv[ ++i ] );
+    }
+    else if ( arg == "--width" && hasValue )
+    {
+      _settings.mWidth = atoi( argv[ ++i ] );
+    }
+    else if ( arg == "--height" && hasValue )
+    {
+      _settings.mHeight = atoi( argv[ ++i ] );
+    }
+    else if ( arg == "--shader" && hasValue )
+    {
+      const char * shaderName = argv[ ++i ];
+      _options.mShaderConfig = FindShaderConfig( shaderName );
+      if ( !_options.mShaderConfig )
+      {
+        printf( "Shader '%s' not found in config.json\n", shaderName );
+        return false;
+      }
+    }
+    else if ( arg == "--sky" && hasValue )
+    {
+      const char * skyImageName = argv[ ++i ];
+      _options.mSkyImageConfig = FindSkyImageConfig( skyImageName );
+      if ( !_options.mSkyImageConfig )
+      {
+        printf( "Sky image '%s' not found in config.json\n", skyImageName );
+        return false;
+      }
+    }
+    else if ( arg == "--camera-yaw" && hasValue )
+    {
+      _options.mCameraYaw = (float) atof( argv[ ++i ] );
+      _options.mHasCameraYaw = true;
+    }
+    else if ( arg == "--camera-pitch" && hasValue )
+    {
+      _options.mCameraPitch = (float) atof( argv[ ++i ] );
+      _options.mHasCameraPitch = true;
+    }
+    else if ( arg == "--camera-distance" && hasValue )
+    {
+      _options.mCameraDistance = (float) atof( argv[ ++i ] );
+      _options.mHasCameraDistance = true;
+    }
+    else if ( arg == "--exposure" && hasValue )
+    {
+      _options.mExposure = (float) atof( argv[ ++i ] );
+      _options.mHasExposure = true;
+    }
+    else if ( arg.compare( 0, 2, "--" ) != 0 && _options.mModelPath.empty() )
+    {
+      _options.mModelPath = arg;
+    }
+    else
+    {
+      printf( "Unknown or incomplete argument '%s'\n", arg.c_str() );
+      return false;
+    }
+  }
+
+  if ( _options.mModelPath.empty() == _options.mBatchFolder.empty() )
+  {
+    return false;
+  }
+  if ( _settings.mWidth <= 0 || _settings.mHeight <= 0 || _options.mFrameCount <= 0 )
+  {
+    return false;
+  }
+
+  if ( !_options.mBatchFolder.empty() )
+  {
+    if ( _options.mOutputPath.empty() )
+    {
+      _options.mOutputPath = ".";
+    }
+    if ( _options.mSummaryPath.empty() )
+    {
+      _options.mSummaryPath = _options.mOutputPath + "/summary.json";
+    }
+  }
+  else if ( _options.mOutputPath.empty() )
+  {
+    _options.mOutputPath = "foxotron.png";
+  }
+
+  return true;
+}
+
+// Lists the files of a folder that Assimp can import, sorted by name
+void ListModelFiles( const std::string & _folder, std::vector<std::string> & _paths )
+{
+  std::string extensions = Geometry::GetSupportedExtensions() + ",";
+  std::transform( extensions.begin(), extensions.end(), extensions.begin(), ::tolower );
+
+  std::vector<std::string> filenames;
+#ifdef _WIN32
+  _finddata_t fileInfo;
+  intptr_t handle = _findfirst( ( _folder + "/*" ).c_str(), &fileInfo );
+  if ( handle != -1 )
+  {
+    do
+    {
+      if ( !( fileInfo.attrib & _A_SUBDIR ) )
+      {
+        filenames.push_back( fileInfo.name );
+      }
+    } while ( _findnext( handle, &fileInfo ) == 0 );
+    _findclose( handle );
+  }
+#else
+  DIR * dir = opendir( _folder.c_str() );
+  if ( dir )
+  {
+    while ( dirent * entry = readdir( dir ) )
+    {
+      struct stat st;
+      if ( stat( ( _folder + "/" + entry->d_name ).c_str(), &st ) == 0 && S_ISREG( st.st_mode ) )
+      {
+        filenames.push_back( entry->d_name );
+      }
+    }
+    closedir( dir );
+  }
+#endif
+  std::sort( filenames.begin(), filenames.end() );
+
+  for ( int i = 0; i < filenames.size(); i++ )
+  {
+    const size_t dot = filenames[ i ].find_last_of( '.' );
+    if ( dot == std::string::npos )
+    {
+      continue;
+    }
+    std::string extension = filenames[ i ].substr( dot ) + ",";
+    std::transform( extension.begin(), extension.end(), extension.begin(), ::tolower );
+    if ( extensions.find( extension ) != std::string::npos )
+    {
+      _paths.push_back( _folder + "/" + filenames[ i ] );
+    }
+  }
+}
+
+float MillisecondsSince( const std::chrono::high_resolution_clock::time_point & _start )
+{
+  return std::chrono::duration<float, std::milli>( std::chrono::high_resolution_clock::now() - _start ).count();
+}
+
+int RunHeadless( int argc, const char * argv[] )
+{
+  HeadlessOptions options;
+  RENDERER_SETTINGS settings;
+  if ( !ParseHeadlessOptions( argc, argv, options, settings ) )
+  {
+    PrintHeadlessUsage();
+    return -20;
+  }
+
+  const bool batch = !options.mBatchFolder.empty();
+  std::vector<std::string> modelPaths;
+  if ( batch )
+  {
+    ListModelFiles( options.mBatchFolder, modelPaths );
+    if ( modelPaths.empty() )
+    {
+      printf( "No models found in '%s'\n", options.mBatchFolder.c_str() );
+      return -21;
+    }
+  }
+  else
+  {
+    modelPaths.push_back( options.mModelPath );
+  }
+
+  std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
+
+  if ( !Renderer::OpenHeadless( &settings ) )
+  {
+    printf( "Renderer::OpenHeadless failed\n" );
+    return -1;
+  }
+
+  const jsonxx::Object * baseShaderConfig = options.mShaderConfig ? options.mShaderConfig : &gOptions.get<jsonxx::Array>( "shaders" ).get<jsonxx::Object>( 0 );
+  const jsonxx::Object * baseSkyImageConfig = options.mSkyImageConfig ? options.mSkyImageConfig : &gOptions.get<jsonxx::Array>( "skyImages" ).get<jsonxx::Object>( 0 );
+  if ( !LoadShaderConfig( baseShaderConfig ) )
+  {
+    Renderer::Close();
+    return -4;
+  }
+  if ( !InitSceneRendering() )
+  {
+    ReleaseSceneRendering();
+    Renderer::Close();
+    return -8;
+  }
+  LoadSkyImageConfig( *baseSkyImageConfig );
+
+  // Every model starts from the same view before its own config is applied
+  const float defaultCameraYaw = gCameraYaw;
+  const float defaultCameraPitch = gCameraPitch;
+  const float defaultExposure = exposure;
+  const float defaultSkysphereOpacity = gSkysphereOpacity;
+  const float defaultSkysphereBlur = gSkysphereBlur;
+  const glm::vec4 defaultClearColor = gClearColor;
+
+  const float environmentTime = MillisecondsSince( startTime );
+  printf( "Environment set up in %.2f ms\n", environmentTime );
+
+  std::vector<unsigned char> pixels( (size_t) Renderer::nWidth * Renderer::nHeight * 4 );
+  jsonxx::Array modelSummaries;
+  int failedCount = 0;
+
+  MeshLoadJob * job = StartMeshLoadJob( modelPaths[ 0 ].c_str() );
+  for ( int i = 0; i < modelPaths.size(); i++ )
+  {
+    const std::string & modelPath = modelPaths[ i ];
+
+    std::chrono::high_resolution_clock::time_point waitStart = std::chrono::high_resolution_clock::now();
+    job->mThread.join();
+    const float waitTime = MillisecondsSince( waitStart );
+
+    std::chrono::high_resolution_clock::time_point uploadStart = std::chrono::high_resolution_clock::now();
+    const bool loaded = job->mSuccess;
+    const float stageTime = job->mStageTime;
+    if ( loaded )
+    {
+      gModel.UploadStagedMesh( job->mStaging );
+    }
+    delete job;
+    job = NULL;
+
+    // The next import runs while this model renders
+    if ( i + 1 < modelPaths.size() )
+    {
+      job = StartMeshLoadJob( modelPaths[ i + 1 ].c_str() );
+    }
+
+    jsonxx::Object summary;
+    summary << "path" << modelPath;
+    summary << "importMs" << stageTime;
+    summary << "waitMs" << waitTime;
+    if ( !loaded )
+    {
+      printf( "Unable to load model '%s'\n", modelPath.c_str() );
+      summary << "success" << false;
+      modelSummaries << summary;
+      failedCount++;
+      continue;
+    }
+
+    gCameraYaw = defaultCameraYaw;
+    gCameraPitch = defaultCameraPitch;
+    exposure = defaultExposure;
+    gSkysphereOpacity = defaultSkysphereOpacity;
+    gSkysphereBlur = defaultSkysphereBlur;
+    gClearColor = defaultClearColor;
+    if ( gCurrentShaderConfig != baseShaderConfig )
+    {
+      LoadShaderConfig( baseShaderConfig );
+    }
+    LoadSkyImageConfig( *baseSkyImageConfig );
+    gLightYaw = gCurrentSkyImage.sunYaw;
+    gLightPitch = gCurrentSkyImage.sunPitch;
+
+    gMeshPath = modelPath;
+    SetupLoadedMesh();
+
+    if ( options.mShaderConfig && gCurrentShaderConfig != options.mShaderConfig && LoadShaderConfig( options.mShaderConfig ) )
+    {
+      gModel.RebindVertexArray( gCurrentShader );
+    }
+    if ( options.mSkyImageConfig && gCurrentSkyImageConfig != options.mSkyImageConfig )
+    {
+      LoadSkyImageConfig( *options.mSkyImageConfig );
+      gLightYaw = gCurrentSkyImage.sunYaw;
+      gLightPitch = gCurrentSkyImage.sunPitch;
+    }
+    if ( options.mHasCameraYaw )
+    {
+      gCameraYaw = options.mCameraYaw;
+    }
+    if ( options.mHasCameraPitch )
+    {
+      gCameraPitch = options.mCameraPitch;
+    }
+    if ( options.mHasCameraDistance )
+    {
+      gCameraDistance = options.mCameraDistance;
+    }
+    if ( options.mHasExposure )
+    {
+      exposure = options.mExposure;
+    }
+    const float uploadTime = MillisecondsSince( uploadStart );
+
+    // Single images go exactly where asked, everything else is numbered
+    std::string outputBase = options.mOutputPath;
+    if ( batch )
+    {
+      const size_t slash = modelPath.find_last_of( "/\\" );
+      outputBase = options.mOutputPath + "/" + ( slash == std::string::npos ? modelPath : modelPath.substr( slash + 1 ) );
+    }
+    else if ( outputBase.size() > 4 && outputBase.compare( outputBase.size() - 4, 4, ".png" ) == 0 )
+    {
+      outputBase = outputBase.substr( 0, outputBase.size() - 4 );
+    }
+
+    const float startYaw = gCameraYaw;
+    float renderTime = 0.0f;
+    float writeTime = 0.0f;
+    int writtenCount = 0;
+    for ( int frame = 0; frame < options.mFrameCount; frame++ )
+    {
+      std::chrono::high_resolution_clock::time_point renderStart = std::chrono::high_resolution_clock::now();
+      gCameraYaw = startYaw + frame * 2.0f * glm::pi<float>() / options.mFrameCount;
+      Renderer::StartFrame( gClearColor );
+      RenderScene( Renderer::nWidth, Renderer::nHeight, frame, options.mXZYSpace, options.mEdgedFaces );
+      const bool read = Renderer::ReadFramebuffer( pixels.data() );
+      Renderer::EndFrame();
+      renderTime += MillisecondsSince( renderStart );
+      if ( !read )
+      {
+        printf( "Reading back the framebuffer failed\n" );
+        continue;
+      }
+
+      std::chrono::high_resolution_clock::time_point writeStart = std::chrono::high_resolution_clock::now();
+      std::string imagePath = options.mOutputPath;
+      if ( batch || options.mFrameCount > 1 )
+      {
+        char suffix[ 32 ];
+        snprintf( suffix, 32, options.mFrameCount > 1 ? "_%03d.png" : ".png", frame );
+        imagePath = outputBase + suffix;
+      }
+      if ( ImageWriter::WritePNG( imagePath.c_str(), pixels.data(), Renderer::nWidth, Renderer::nHeight ) )
+      {
+        writtenCount++;
+      }
+      writeTime += MillisecondsSince( writeStart );
+    }
+
+    const bool success = writtenCount == options.mFrameCount;
+    if ( !success )
+    {
+      failedCount++;
+    }
+    printf( "Rendered '%s': %d/%d images, import %.2f ms (waited %.2f ms), upload %.2f ms, render %.2f ms, write %.2f ms\n",
+      modelPath.c_str(), writtenCount, options.mFrameCount, stageTime, waitTime, uploadTime, renderTime, writeTime );
+
+    summary << "success" << success;
+    summary << "uploadMs" << uploadTime;
+    summary << "renderMs" << renderTime;
+    summary << "writeMs" << writeTime;
+    summary << "images" << (jsonxx::Number) writtenCount;
+    modelSummaries << summary;
+  }
+
+  if ( !options.mSummaryPath.empty() )
+  {
+    jsonxx::Object summaryRoot;
+    summaryRoot << "width" << (jsonxx::Number) Renderer::nWidth;
+    summaryRoot << "height" << (jsonxx::Number) Renderer::nHeight;
+    summaryRoot << "frames" << (jsonxx::Number) options.mFrameCount;
+    summaryRoot << "environmentMs" << environmentTime;
+    summaryRoot << "totalMs" << MillisecondsSince( startTime );
+    summaryRoot << "failed" << (jsonxx::Number) failedCount;
+    summaryRoot << "models" << modelSummaries;
+
+    FILE * summaryFile = fopen( options.mSummaryPath.c_str(), "wb" );
+    if ( summaryFile )
+    {
+      std::string summaryString = summaryRoot.json();
+      fwrite( summaryString.c_str(), 1, summaryString.length(), summaryFile );
+      fclose( summaryFile );
+      printf( "Saved summary to '%s'\n", options.mSummaryPath.c_str() );
+    }
+    else
+    {
+      printf( "Unable to write summary file '%s'\n", options.mSummaryPath.c_str() );
+    }
+  }
+
+  ReleaseSceneRendering();
+  gModel.UnloadMesh();
+  Renderer::Close();
+
+  return failedCount ? -22 : 0;
+}
+
 int main( int argc, const char * argv[] )
 {
   FILE * configFile = fopen( "config.json", "rb" );
@@ -457,6 +1348,14 @@ int main( int argc, const char * argv[] )
     return -11;
   }
 
+  for ( int i = 1; i < argc; i++ )
+  {
+    if ( !strcmp( argv[ i ], "--headless" ) )
+    {
+      return RunHeadless( argc, argv );
+    }
+  }
+
   //////////////////////////////////////////////////////////////////////////
   // Init renderer
   RENDERER_SETTINGS settings;
@@ -509,7 +1408,7 @@ int main( int argc, const char * argv[] )
 
   if ( argc >= 2 )
   {
-    LoadMesh( argv[ 1 ] );
+    gQueuedMeshPath = argv[ 1 ];
   }
 
   //////////////////////////////////////////////////////////////////////////
@@ -517,8 +1416,6 @@ int main( int argc, const char * argv[] )
   bool appWantsToQuit = false;
   bool automaticCamera = false;
   uint32_t frameCount = 0;
-  glm::mat4x4 viewMatrix;
-  glm::mat4x4 projectionMatrix;
   bool rotatingCamera = false;
   bool movingCamera = false;
   bool movingLight = false;
@@ -529,29 +1426,31 @@ int main( int argc, const char * argv[] )
   bool edgedFaces = false;
   float hideCursorTimer = 0.0f;
   bool showModelInfo = false;
+  bool showFrameTimings = false;
   bool xzySpace = false;
-  const glm::mat4x4 xzyMatrix(
-    1.0f, 0.0f, 0.0f, 0.0f,
-    0.0f, 0.0f, 1.0f, 0.0f,
-    0.0f,-1.0f, 0.0f, 0.0f,
-    0.0f, 0.0f, 0.0f, 1.0f );
 
-  loadBrdfLookupTable();
-
-  Geometry skysphere;
-  skysphere.LoadMesh( "Skyboxes/skysphere.fbx" );
-
-  Renderer::Shader * skysphereShader = LoadShader( "Skyboxes/skysphere.vs", "Skyboxes/skysphere.fs" );
-  if ( !skysphereShader )
+  if ( !InitSceneRendering() )
   {
     return -8;
   }
-  skysphere.RebindVertexArray( skysphereShader );
+  Profiler::Init();
+
+  // The skysphere is loaded synchronously, so don't start importing the
+  // command line model until it's done; Assimp's logger is global.
+  if ( !gQueuedMeshPath.empty() )
+  {
+    std::string path = gQueuedMeshPath;
+    gQueuedMeshPath.clear();
+    LoadMesh( path.c_str() );
+  }
 
   while ( !Renderer::WantsToQuit() && !appWantsToQuit )
   {
+    Profiler::BeginFrame();
     Renderer::StartFrame( gClearColor );
 
+    FinishMeshLoad();
+
     //////////////////////////////////////////////////////////////////////////
     // ImGui windows etc.
     ImGui_ImplOpenGL3_NewFrame();
@@ -667,6 +1566,24 @@ int main( int argc, const char * argv[] )
             xzySpace = !xzySpace;
           }
           ImGui::MenuItem( "XZY space", NULL, &xzySpace );
+          ImGui::Separator();
+
+          if ( ImGui::MenuItem( "Compact vertices", NULL, &gCompactVertices ) && !gMeshPath.empty() )
+          {
+            LoadMesh( gMeshPath.c_str() );
+          }
+          if ( ImGui::MenuItem( "Generate LODs", NULL, &gGenerateLODs ) && !gMeshPath.empty() )
+          {
+            LoadMesh( gMeshPath.c_str() );
+          }
+          if ( ImGui::MenuItem( "Build meshlets", NULL, &gBuildMeshlets ) && !gMeshPath.empty() )
+          {
+            LoadMesh( gMeshPath.c_str() );
+          }
+          if ( ImGui::MenuItem( "Optimize vertex order", NULL, &gOptimizeMeshes ) && !gMeshPath.empty() )
+          {
+            LoadMesh( gMeshPath.c_str() );
+          }
           ImGui::EndMenu();
         }
         if ( ImGui::BeginMenu( "View" ) )
@@ -682,9 +1599,20 @@ int main( int argc, const char * argv[] )
           ImGui::Separator();
 
           ImGui::MenuItem( "Wireframe / Edged faces", "W", &edgedFaces );
+          ImGui::MenuItem( "Frustum culling", NULL, &gFrustumCulling );
+          ImGui::MenuItem( "Backface culling", NULL, &gBackfaceCulling );
+          ImGui::MenuItem( "Level of detail", NULL, &gLODSelection );
+          ImGui::MenuItem( "Weighted blended transparency", NULL, &gWeightedBlendedTransparency, gTransparencyCompositeShader != NULL );
           ImGui::MenuItem( "Show menu", "F11", &showImGui );
           ImGui::Separator();
 
+          ImGui::MenuItem( "Show frame timings", NULL, &showFrameTimings );
+          if ( ImGui::MenuItem( "Export frame timings to CSV" ) )
+          {
+            Profiler::ExportCSV( "frametimings.csv" );
+          }
+          ImGui::Separator();
+
           ImGui::MenuItem( "Enable idle camera", "C", &automaticCamera );
           if ( ImGui::MenuItem( "Re-center camera", "F" ) )
           {
@@ -771,6 +1699,48 @@ int main( int argc, const char * argv[] )
       LoadMesh( file_dialog.selected_path.c_str() );
     }
 
+    if ( showFrameTimings )
+    {
+      ImGui::Begin( "Frame timings", &showFrameTimings, ImGuiWindowFlags_AlwaysAutoResize );
+      ImGui::Text( "Last %d frames, in milliseconds", Profiler::HISTORY_SIZE );
+      if ( ImGui::BeginTable( "timings", 7, ImGuiTableFlags_Borders | ImGuiTableFlags_SizingFixedFit ) )
+      {
+        ImGui::TableSetupColumn( "Stage" );
+        ImGui::TableSetupColumn( "CPU min" );
+        ImGui::TableSetupColumn( "CPU avg" );
+        ImGui::TableSetupColumn( "CPU p99" );
+        ImGui::TableSetupColumn( "GPU min" );
+        ImGui::TableSetupColumn( "GPU avg" );
+        ImGui::TableSetupColumn( "GPU p99" );
+        ImGui::TableHeadersRow();
+        for ( int i = 0; i < Profiler::STAGE_COUNT; i++ )
+        {
+          Profiler::Statistics cpu;
+          Profiler::Statistics gpu;
+          Profiler::GetStatistics( (Profiler::STAGE) i, false, cpu );
+          Profiler::GetStatistics( (Profiler::STAGE) i, true, gpu );
+
+          ImGui::TableNextRow();
+          ImGui::TableNextColumn();
+          ImGui::Text( "%s", Profiler::GetStageName( (Profiler::STAGE) i ) );
+          ImGui::TableNextColumn();
+          ImGui::Text( "%.3f", cpu.mMin );
+          ImGui::TableNextColumn();
+          ImGui::Text( "%.3f", cpu.mAverage );
+          ImGui::TableNextColumn();
+          ImGui::Text( "%.3f", cpu.mP99 );
+          ImGui::TableNextColumn();
+          ImGui::Text( "%.3f", gpu.mMin );
+          ImGui::TableNextColumn();
+          ImGui::Text( "%.3f", gpu.mAverage );
+          ImGui::TableNextColumn();
+          ImGui::Text( "%.3f", gpu.mP99 );
+        }
+        ImGui::EndTable();
+      }
+      ImGui::End();
+    }
+
     if ( showModelInfo )
     {
       ImGui::Begin( "Model info", &showModelInfo );
@@ -778,13 +1748,36 @@ int main( int argc, const char * argv[] )
       if ( ImGui::BeginTabItem( "Summary" ) )
       {
         int triCount = 0;
-        for ( std::map<int, Geometry::Mesh>::iterator it = gModel.mMeshes.begin(); it != gModel.mMeshes.end(); it++ )
+        for ( std::vector<Geometry::Mesh>::iterator it = gModel.mMeshes.begin(); it != gModel.mMeshes.end(); it++ )
         {
-          triCount += it->second.mTriangleCount;
+          triCount += it->mTriangleCount;
         }
 
         ImGui::Text( "Triangle count: %d", triCount );
         ImGui::Text( "Mesh count: %ld", gModel.mMeshes.size() );
+        ImGui::Text( "Vertex format: %s", gModel.mVertexFormat == Geometry::VERTEXFORMAT_COMPACT ? "compact" : "full" );
+        ImGui::Text( "Vertex buffers: %.2f MB (%.2f MB in full format)", gModel.mVertexBufferSize / ( 1024.0f * 1024.0f ), gModel.mFullVertexBufferSize / ( 1024.0f * 1024.0f ) );
+        ImGui::Text( "Index buffers: %.2f MB", gModel.mIndexBufferSize / ( 1024.0f * 1024.0f ) );
+        ImGui::Text( "Texture count: %d", gModel.mTextureCount );
+        ImGui::Text( "Texture decode: %.2f ms (%d threads)", gModel.mTextureDecodeTime, gModel.mTextureDecodeThreads );
+        ImGui::Text( "Texture upload: %.2f ms", gModel.mTextureUploadTime );
+        ImGui::Text( "Texture cache hits: %d (%.2f MB saved)", gModel.mTextureCacheHits, gModel.mTextureCacheBytesSaved / ( 1024.0f * 1024.0f ) );
+        ImGui::Text( "Texture binds: %u issued, %u skipped", Renderer::GetTextureBindStats().mIssued, Renderer::GetTextureBindStats().mSkipped );
+        ImGui::Text( "State changes: %u issued, %u filtered", Renderer::GetRenderStateStats().mIssued, Renderer::GetRenderStateStats().mFiltered );
+        ImGui::Text( "Draw calls: %d (%d instances)", gModel.mDrawStats.mDrawCalls, gModel.mDrawStats.mInstances );
+        if ( gFrustumCulling || gBackfaceCulling || gLODSelection )
+        {
+          const Geometry::CullStats & cullStats = gModel.mCullStats;
+          ImGui::Text( "Visible meshes: %d / %d (%d at reduced detail)", cullStats.mVisibleMeshes, cullStats.mTotalMeshes, cullStats.mReducedMeshes );
+          ImGui::Text( "Visible triangles: %d / %d", cullStats.mVisibleTriangles, cullStats.mTotalTriangles );
+          if ( !gModel.mMeshlets.empty() )
+          {
+            const float meshletScale = cullStats.mTotalMeshlets ? 100.0f / cullStats.mTotalMeshlets : 0.0f;
+            ImGui::Text( "Meshlets: %d total, %d tested", (int) gModel.mMeshlets.size(), cullStats.mTotalMeshlets );
+            ImGui::Text( "Meshlets culled: %.1f%% frustum, %.1f%% backface",
+              cullStats.mFrustumCulledMeshlets * meshletScale, cullStats.mBackfaceCulledMeshlets * meshletScale );
+          }
+        }
 
         ImGui::EndTabItem();
       }
@@ -794,28 +1787,73 @@ int main( int argc, const char * argv[] )
 
         ImGui::EndTabItem();
       }
+      if ( ImGui::BeginTabItem( "Meshes" ) )
+      {
+        ImGui::Text( "Vertex cache misses per triangle (ACMR) and per vertex (ATVR), %d entry FIFO", MeshOptimizer::CACHE_SIZE );
+        ImGui::Text( "Only measured when the vertex order is optimized" );
+        if ( ImGui::BeginTable( "meshes", 7, ImGuiTableFlags_Borders | ImGuiTableFlags_SizingFixedFit ) )
+        {
+          ImGui::TableSetupColumn( "Mesh" );
+          ImGui::TableSetupColumn( "Vertices" );
+          ImGui::TableSetupColumn( "Triangles" );
+          ImGui::TableSetupColumn( "ACMR imported" );
+          ImGui::TableSetupColumn( "ACMR drawn" );
+          ImGui::TableSetupColumn( "ATVR imported" );
+          ImGui::TableSetupColumn( "ATVR drawn" );
+          ImGui::TableHeadersRow();
+          for ( int i = 0; i < gModel.mMeshes.size(); i++ )
+          {
+            const Geometry::Mesh & mesh = gModel.mMeshes[ i ];
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text( "%d", i + 1 );
+            ImGui::TableNextColumn();
+            ImGui::Text( "%d", mesh.mVertexCount );
+            ImGui::TableNextColumn();
+            ImGui::Text( "%d", mesh.mTriangleCount );
+            ImGui::TableNextColumn();
+            ShowCacheMissRatio( mesh.mImportedACMR );
+            ImGui::TableNextColumn();
+            ShowCacheMissRatio( mesh.mACMR );
+            ImGui::TableNextColumn();
+            ShowCacheMissRatio( mesh.mImportedATVR );
+            ImGui::TableNextColumn();
+            ShowCacheMissRatio( mesh.mATVR );
+          }
+          ImGui::EndTable();
+        }
+
+        ImGui::EndTabItem();
+      }
       if ( ImGui::BeginTabItem( "Textures / Materials" ) )
       {
         ImGui::Text( "Material count: %ld", gModel.mMaterials.size() );
 
-        for ( std::map<int, Geometry::Material>::iterator it = gModel.mMaterials.begin(); it != gModel.mMaterials.end(); it++ )
+        for ( int i = 0; i < gModel.mMaterials.size(); i++ )
         {
-          if ( ImGui::CollapsingHeader( it->second.mName.c_str() ) )
+          Geometry::Material * it = &gModel.mMaterials[ i ];
+          if ( ImGui::CollapsingHeader( it->mName.c_str() ) )
           {
             ImGui::Indent();
-            ImGui::Text( "Specular shininess: %g", it->second.mSpecularShininess );
-            if ( ImGui::BeginTabBar( it->second.mName.c_str() ) )
+            ImGui::Text( "Specular shininess: %g", it->mSpecularShininess );
+            if ( ImGui::BeginTabBar( it->mName.c_str() ) )
             {
-              ShowColorMapInImGui( "Ambient", it->second.mColorMapAmbient );
-              ShowColorMapInImGui( "Diffuse", it->second.mColorMapDiffuse );
-              ShowColorMapInImGui( "Normals", it->second.mColorMapNormals );
-              ShowColorMapInImGui( "Specular", it->second.mColorMapSpecular );
-              ShowColorMapInImGui( "Albedo", it->second.mColorMapAlbedo );
-              ShowColorMapInImGui( "Metallic", it->second.mColorMapMetallic );
-              ShowColorMapInImGui( "Roughness", it->second.mColorMapRoughness );
-              ShowColorMapInImGui( "AO", it->second.mColorMapAO );
-              ShowColorMapInImGui( "Emissive", it->second.mColorMapEmissive );
+              bool changed = false;
+              changed |= ShowColorMapInImGui( "Ambient", it->mColorMapAmbient );
+              changed |= ShowColorMapInImGui( "Diffuse", it->mColorMapDiffuse );
+              changed |= ShowColorMapInImGui( "Normals", it->mColorMapNormals );
+              changed |= ShowColorMapInImGui( "Specular", it->mColorMapSpecular );
+              changed |= ShowColorMapInImGui( "Albedo", it->mColorMapAlbedo );
+              changed |= ShowColorMapInImGui( "Metallic", it->mColorMapMetallic );
+              changed |= ShowColorMapInImGui( "Roughness", it->mColorMapRoughness );
+              changed |= ShowColorMapInImGui( "AO", it->mColorMapAO );
+              changed |= ShowColorMapInImGui( "Emissive", it->mColorMapEmissive );
               ImGui::EndTabBar();
+
+              if ( changed )
+              {
+                gModel.UpdateMaterialConstants( i );
+              }
             }
             ImGui::Unindent();
           }
@@ -827,7 +1865,19 @@ int main( int argc, const char * argv[] )
       ImGui::End();
     }
 
-    bool showHelpText = ( gModel.mNodes.size() == 0 );
+    if ( gMeshLoadJob )
+    {
+      ImGui::SetNextWindowPos( ImVec2( io.DisplaySize.x * 0.5f, io.DisplaySize.y - 40.0f ), ImGuiCond_Always, ImVec2( 0.5f, 1.0f ) );
+      ImGui::SetNextWindowSize( ImVec2( 380.0f, 0.0f ) );
+      ImGui::SetNextWindowBgAlpha( 0.5f );
+
+      ImGui::Begin( "Loading", NULL, ImGuiWindowFlags_NoTitleBar | ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoInputs );
+      ImGui::Text( "Loading %s", gMeshLoadJob->mPath.c_str() );
+      ImGui::ProgressBar( gMeshLoadJob->mStaging.mProgress.load() );
+      ImGui::End();
+    }
+
+    bool showHelpText = ( gModel.mNodes.empty() && !gMeshLoadJob );
     if ( showHelpText )
     {
       ImGui::SetNextWindowPos( ImVec2( io.DisplaySize.x * 0.5f, io.DisplaySize.y * 0.5f ), ImGuiCond_Appearing, ImVec2( 0.5f, 0.5f ) );
@@ -845,6 +1895,7 @@ int main( int argc, const char * argv[] )
       ImGui::BulletText( "Left mouse button to rotate" );
       ImGui::BulletText( "Right mouse button to move light / rotate sky" );
       ImGui::BulletText( "Middle mouse button to pan camera" );
+      ImGui::BulletText( "Double click to focus on a mesh" );
       ImGui::End();
     }
 
@@ -872,6 +1923,10 @@ int main( int argc, const char * argv[] )
         mouseClickPosX = mouseEvent.x;
         mouseClickPosY = mouseEvent.y;
       }
+      if ( ImGui::IsMouseDoubleClicked( ImGuiMouseButton_Left ) )
+      {
+        FocusCameraOnMesh( mouseEvent.x / io.DisplaySize.x, mouseEvent.y / io.DisplaySize.y, xzySpace );
+      }
       if ( !ImGui::IsMouseDown( ImGuiMouseButton_Left ) )
       {
         rotatingCamera = false;
@@ -972,151 +2027,31 @@ int main( int argc, const char * argv[] )
       gCameraYaw += io.DeltaTime * 0.3f;
     }
 
-    //////////////////////////////////////////////////////////////////////////
-    // Skysphere render
-
-    glm::vec3 cameraPosition( 0.0f, 0.0f, -1.0f );
-    cameraPosition = glm::rotateX( cameraPosition, gCameraPitch );
-    cameraPosition = glm::rotateY( cameraPosition, gCameraYaw );
-
-    static glm::mat4x4 worldRootXYZ( 1.0f );
-    if ( gCurrentShaderConfig->get<jsonxx::Boolean>( "showSkybox" ) )
-    {
-      float verticalFovInRadian = 0.5f;
-      projectionMatrix = glm::perspective( verticalFovInRadian, settings.mWidth / (float) settings.mHeight, 0.001f, 2.0f );
-      skysphereShader->SetConstant( "mat_projection", projectionMatrix );
-
-      viewMatrix = glm::lookAtRH( cameraPosition * 0.15f, glm::vec3( 0.0f, 0.0f, 0.0f ), glm::vec3( 0.0f, 1.0f, 0.0f ) );
-      skysphereShader->SetConstant( "mat_view", viewMatrix );
-
-      skysphereShader->SetConstant( "has_tex_skysphere", gCurrentSkyImage.reflection != NULL );
-      skysphereShader->SetConstant( "has_tex_skyenv", gCurrentSkyImage.env != NULL );
-
-      if ( gCurrentSkyImage.reflection )
-      {
-        const float mipCount = floor( log2( gCurrentSkyImage.reflection->mHeight ) );
-        skysphereShader->SetTexture( "tex_skysphere", gCurrentSkyImage.reflection );
-        skysphereShader->SetConstant( "skysphere_mip_count", mipCount );
-      }
-
-      if ( gCurrentSkyImage.env )
-      {
-        skysphereShader->SetTexture( "tex_skyenv", gCurrentSkyImage.env );
-      }
-
-      skysphereShader->SetConstant( "background_color", gClearColor );
-      skysphereShader->SetConstant( "skysphere_blur", gSkysphereBlur );
-      skysphereShader->SetConstant( "skysphere_opacity", gSkysphereOpacity );
-      skysphereShader->SetConstant( "skysphere_rotation", gLightYaw - gCurrentSkyImage.sunYaw  );
-      skysphereShader->SetConstant( "exposure", exposure );
-      skysphereShader->SetConstant( "frame_count", frameCount );
-
-      skysphere.Render( worldRootXYZ, skysphereShader );
-
-      glClear( GL_DEPTH_BUFFER_BIT );
-    }
-
-    //////////////////////////////////////////////////////////////////////////
-    // Mesh render
-
-    const float verticalFovInRadian = 0.5f;
-    const float nearPlane = std::max( gModel.mModelDiagonal / 10000.0f, gCameraDistance / 1000.0f );
-    const float farPlane = std::max( gModel.mModelDiagonal, gCameraDistance + gModel.mModelDiagonal );
-    projectionMatrix = glm::perspective( verticalFovInRadian, settings.mWidth / (float) settings.mHeight, nearPlane, farPlane );
-    gCurrentShader->SetConstant( "mat_projection", projectionMatrix );
-
-    cameraPosition *= gCameraDistance;
-    gCurrentShader->SetConstant( "camera_position", cameraPosition );
-
-    glm::vec3 lightDirection( 0.0f, 0.0f, 1.0f );
-    lightDirection = glm::rotateX( lightDirection, gLightPitch );
-    lightDirection = glm::rotateY( lightDirection, gLightYaw );
-
-    glm::vec3 fillLightDirection( 0.0f, 0.0f, 1.0f );
-    fillLightDirection = glm::rotateX( fillLightDirection, gLightPitch - 0.4f );
-    fillLightDirection = glm::rotateY( fillLightDirection, gLightYaw + 0.8f );
-
-    gCurrentShader->SetConstant( "lights[0].direction", lightDirection );
-    gCurrentShader->SetConstant( "lights[0].color", gCurrentSkyImage.sunColor );
-    gCurrentShader->SetConstant( "lights[1].direction", fillLightDirection );
-    gCurrentShader->SetConstant( "lights[1].color", glm::vec3( 0.5f ) );
-    gCurrentShader->SetConstant( "lights[2].direction", -fillLightDirection );
-    gCurrentShader->SetConstant( "lights[2].color", glm::vec3( 0.25f ) );
-
-    gCurrentShader->SetConstant( "skysphere_rotation", gLightYaw - gCurrentSkyImage.sunYaw );
-
-    viewMatrix = glm::lookAtRH( cameraPosition + gCameraTarget, gCameraTarget, glm::vec3( 0.0f, 1.0f, 0.0f ) );
-    gCurrentShader->SetConstant( "mat_view", viewMatrix );
-    gCurrentShader->SetConstant( "mat_view_inverse", glm::inverse( viewMatrix ) );
-
-    gCurrentShader->SetConstant( "has_tex_skysphere", gCurrentSkyImage.reflection != NULL );
-    gCurrentShader->SetConstant( "has_tex_skyenv", gCurrentSkyImage.env != NULL );
-    if ( gCurrentSkyImage.reflection )
-    {
-      float mipCount = floor( log2( gCurrentSkyImage.reflection->mHeight ) );
-      gCurrentShader->SetTexture( "tex_skysphere", gCurrentSkyImage.reflection );
-      gCurrentShader->SetConstant( "skysphere_mip_count", mipCount );
-    }
-    if ( gCurrentSkyImage.env )
-    {
-      gCurrentShader->SetTexture( "tex_skyenv", gCurrentSkyImage.env );
-    }
-    gCurrentShader->SetTexture( "tex_brdf_lut", gBrdfLookupTable );
-    gCurrentShader->SetConstant( "exposure", exposure );
-    gCurrentShader->SetConstant( "frame_count", frameCount );
-
-    //////////////////////////////////////////////////////////////////////////
-    // Mesh render
-
-    gModel.Render( xzySpace ? xzyMatrix : worldRootXYZ, gCurrentShader );
-
-    if ( edgedFaces )
-    {
-      glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
-      glDepthFunc( GL_LEQUAL );
-
-      gCurrentShader->SetConstant( "exposure", 100.0f );
-      gModel.Render( xzySpace ? xzyMatrix : worldRootXYZ, gCurrentShader );
-
-      glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
-      glDepthFunc( GL_LESS );
-    }
+    RenderScene( settings.mWidth, settings.mHeight, frameCount, xzySpace, edgedFaces );
 
     //////////////////////////////////////////////////////////////////////////
     // End frame
+    Profiler::BeginStage( Profiler::STAGE_IMGUI );
     ImGui_ImplOpenGL3_RenderDrawData( ImGui::GetDrawData() );
+    Profiler::EndStage( Profiler::STAGE_IMGUI );
+    Profiler::BeginStage( Profiler::STAGE_ENDFRAME );
     Renderer::EndFrame();
+    Profiler::EndStage( Profiler::STAGE_ENDFRAME );
+    Profiler::EndFrame();
     frameCount++;
   }
 
   //////////////////////////////////////////////////////////////////////////
   // Cleanup
 
-  if ( gCurrentShader )
-  {
-    Renderer::ReleaseShader( gCurrentShader );
-    delete gCurrentShader;
-  }
-  if ( skysphereShader )
-  {
-    Renderer::ReleaseShader( skysphereShader );
-    delete skysphereShader;
-  }
-  if ( gCurrentSkyImage.reflection )
-  {
-    Renderer::ReleaseTexture( gCurrentSkyImage.reflection );
-    gCurrentSkyImage.reflection = NULL;
-  }
-  if ( gCurrentSkyImage.env )
-  {
-    Renderer::ReleaseTexture( gCurrentSkyImage.env );
-    gCurrentSkyImage.env = NULL;
-  }
+  Profiler::Release();
+  ReleaseSceneRendering();
 
   ImGui_ImplOpenGL3_Shutdown();
   ImGui_ImplGlfw_Shutdown();
   ImGui::DestroyContext();
 
+  WaitForMeshLoad();
   gModel.UnloadMesh();
 
   Renderer::Close();
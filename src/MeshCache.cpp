@@ -0,0 +1,307 @@
+#include "MeshCache.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+namespace MeshCache
+{
+
+const char CACHE_MAGIC[ 8 ] = { 'F', 'O', 'X', 'O', 'C', 'A', 'C', 'H' };
+
+void InitHeader( Header & _header )
+{
+  memset( &_header, 0, sizeof( Header ) );
+  memcpy( _header.mMagic, CACHE_MAGIC, sizeof( CACHE_MAGIC ) );
+  _header.mVersion = CACHE_VERSION;
+}
+
+bool GetSourceStamp( const char * _path, uint64_t & _size, int64_t & _modifiedTime )
+{
+#ifdef _WIN32
+  struct _stat64 st;
+  if ( _stat64( _path, &st ) != 0 )
+  {
+    return false;
+  }
+#else
+  struct stat st;
+  if ( stat( _path, &st ) != 0 )
+  {
+    return false;
+  }
+#endif
+  _size = (uint64_t) st.st_size;
+  _modifiedTime = (int64_t) st.st_mtime;
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Writer
+
+Writer::Writer()
+  : mFile( NULL )
+  , mOffset( 0 )
+  , mFailed( false )
+{
+}
+
+Writer::~Writer()
+{
+  Abort();
+}
+
+bool Writer::Open( const char * _path )
+{
+  Abort();
+
+  mPath = _path;
+  mTempPath = mPath + ".tmp";
+  mFile = fopen( mTempPath.c_str(), "wb" );
+  if ( !mFile )
+  {
+    printf( "[meshcache] Unable to write cache file '%s'\n", mTempPath.c_str() );
+    return false;
+  }
+
+  // Reserve space for the header; it's filled in when closing
+  Header header;
+  InitHeader( header );
+  mOffset = 0;
+  mFailed = false;
+  mTable.clear();
+  mFailed |= fwrite( &header, sizeof( Header ), 1, mFile ) != 1;
+  mOffset += sizeof( Header );
+
+  return !mFailed;
+}
+
+void Writer::Abort()
+{
+  if ( mFile )
+  {
+    fclose( mFile );
+    mFile = NULL;
+    remove( mTempPath.c_str() );
+  }
+  mTable.clear();
+}
+
+uint64_t Writer::WriteBlob( const void * _data, uint64_t _size )
+{
+  if ( !mFile || mFailed )
+  {
+    return 0;
+  }
+
+  static const unsigned char padding[ BLOB_ALIGNMENT ] = { 0 };
+  const uint64_t paddingSize = ( BLOB_ALIGNMENT - ( mOffset % BLOB_ALIGNMENT ) ) % BLOB_ALIGNMENT;
+  if ( paddingSize )
+  {
+    mFailed |= fwrite( padding, 1, (size_t) paddingSize, mFile ) != paddingSize;
+    mOffset += paddingSize;
+  }
+
+  const uint64_t offset = mOffset;
+  if ( _size )
+  {
+    mFailed |= fwrite( _data, 1, (size_t) _size, mFile ) != _size;
+    mOffset += _size;
+  }
+  return offset;
+}
+
+void Writer::WriteString( const std::string & _string )
+{
+  const uint32_t length = (uint32_t) _string.length();
+  Write( length );
+  mTable.insert( mTable.end(), _string.begin(), _string.end() );
+}
+
+bool Writer::Close( Header & _header )
+{
+  if ( !mFile )
+  {
+    return false;
+  }
+
+  _header.mTableOffset = WriteBlob( mTable.data(), mTable.size() );
+  _header.mTableSize = mTable.size();
+
+  mFailed |= fseek( mFile, 0, SEEK_SET ) != 0;
+  mFailed |= fwrite( &_header, sizeof( Header ), 1, mFile ) != 1;
+  mFailed |= fclose( mFile ) != 0;
+  mFile = NULL;
+  mTable.clear();
+
+  if ( mFailed )
+  {
+    printf( "[meshcache] Writing cache file '%s' failed\n", mTempPath.c_str() );
+    remove( mTempPath.c_str() );
+    return false;
+  }
+
+  remove( mPath.c_str() );
+  if ( rename( mTempPath.c_str(), mPath.c_str() ) != 0 )
+  {
+    printf( "[meshcache] Unable to rename cache file to '%s'\n", mPath.c_str() );
+    remove( mTempPath.c_str() );
+    return false;
+  }
+
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Memory mapped file
+
+MappedFile::MappedFile()
+  : mData( NULL )
+  , mSize( 0 )
+#ifdef _WIN32
+  , mFileHandle( INVALID_HANDLE_VALUE )
+  , mMappingHandle( NULL )
+#else
+  , mFileDescriptor( -1 )
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+  Close();
+}
+
+bool MappedFile::Open( const char * _path )
+{
+  Close();
+
+#ifdef _WIN32
+  mFileHandle = CreateFileA( _path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+  if ( mFileHandle == INVALID_HANDLE_VALUE )
+  {
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if ( !GetFileSizeEx( mFileHandle, &size ) || size.QuadPart == 0 )
+  {
+    Close();
+    return false;
+  }
+  mSize = (uint64_t) size.QuadPart;
+
+  mMappingHandle = CreateFileMappingA( mFileHandle, NULL, PAGE_READONLY, 0, 0, NULL );
+  if ( !mMappingHandle )
+  {
+    Close();
+    return false;
+  }
+
+  mData = (const unsigned char *) MapViewOfFile( mMappingHandle, FILE_MAP_READ, 0, 0, 0 );
+  if ( !mData )
+  {
+    Close();
+    return false;
+  }
+#else
+  mFileDescriptor = open( _path, O_RDONLY );
+  if ( mFileDescriptor < 0 )
+  {
+    return false;
+  }
+
+  struct stat st;
+  if ( fstat( mFileDescriptor, &st ) != 0 || st.st_size == 0 )
+  {
+    Close();
+    return false;
+  }
+  mSize = (uint64_t) st.st_size;
+
+  void * data = mmap( NULL, (size_t) mSize, PROT_READ, MAP_PRIVATE, mFileDescriptor, 0 );
+  if ( data == MAP_FAILED )
+  {
+    Close();
+    return false;
+  }
+  mData = (const unsigned char *) data;
+#endif
+
+  return true;
+}
+
+void MappedFile::Close()
+{
+#ifdef _WIN32
+  if ( mData )
+  {
+    UnmapViewOfFile( mData );
+  }
+  if ( mMappingHandle )
+  {
+    CloseHandle( mMappingHandle );
+    mMappingHandle = NULL;
+  }
+  if ( mFileHandle != INVALID_HANDLE_VALUE )
+  {
+    CloseHandle( mFileHandle );
+    mFileHandle = INVALID_HANDLE_VALUE;
+  }
+#else
+  if ( mData )
+  {
+    munmap( (void *) mData, (size_t) mSize );
+  }
+  if ( mFileDescriptor >= 0 )
+  {
+    close( mFileDescriptor );
+    mFileDescriptor = -1;
+  }
+#endif
+  mData = NULL;
+  mSize = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Reader
+
+Reader::Reader( const unsigned char * _data, uint64_t _size, uint64_t _offset )
+  : mData( _data )
+  , mSize( _size )
+  , mOffset( _offset )
+  , mFailed( _offset > _size )
+{
+}
+
+bool Reader::ReadString( std::string & _string )
+{
+  uint32_t length = 0;
+  if ( !Read( length ) || mOffset + length > mSize )
+  {
+    mFailed = true;
+    return false;
+  }
+  _string.assign( (const char *) mData + mOffset, length );
+  mOffset += length;
+  return true;
+}
+
+const void * Reader::GetBlob( uint64_t _offset, uint64_t _size )
+{
+  if ( _offset > mSize || _size > mSize - _offset )
+  {
+    mFailed = true;
+    return NULL;
+  }
+  return mData + _offset;
+}
+
+} // namespace
@@ -0,0 +1,117 @@
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+
+// Binary cache of an already imported and packed model, stored next to the
+// source file as "<model>.foxocache". Blobs (vertex / index / texture data) are
+// written first and aligned, the table describing the model follows them, and
+// the header at the start of the file points at the table.
+namespace MeshCache
+{
+const uint32_t CACHE_VERSION = 1;
+const uint32_t BLOB_ALIGNMENT = 16;
+
+#pragma pack(1)
+struct Header
+{
+  char mMagic[ 8 ];
+  uint32_t mVersion;
+  uint32_t mImportFlags;
+  uint32_t mImportMaxBones;
+  uint32_t mVertexSize;
+  uint64_t mSourceSize;
+  int64_t mSourceModifiedTime;
+  uint64_t mTableOffset;
+  uint64_t mTableSize;
+};
+#pragma pack()
+
+void InitHeader( Header & _header );
+bool GetSourceStamp( const char * _path, uint64_t & _size, int64_t & _modifiedTime );
+
+class Writer
+{
+public:
+  Writer();
+  ~Writer();
+
+  bool Open( const char * _path );
+  void Abort();
+  bool Close( Header & _header );
+
+  // Returns the file offset of the blob
+  uint64_t WriteBlob( const void * _data, uint64_t _size );
+
+  template<typename T> void Write( const T & _value )
+  {
+    const unsigned char * bytes = (const unsigned char *) &_value;
+    mTable.insert( mTable.end(), bytes, bytes + sizeof( T ) );
+  }
+  void WriteString( const std::string & _string );
+
+  bool IsOpen() const { return mFile != NULL; }
+
+private:
+  FILE * mFile;
+  std::string mPath;
+  std::string mTempPath;
+  uint64_t mOffset;
+  bool mFailed;
+  std::vector<unsigned char> mTable;
+};
+
+class MappedFile
+{
+public:
+  MappedFile();
+  ~MappedFile();
+
+  bool Open( const char * _path );
+  void Close();
+
+  const unsigned char * GetData() const { return mData; }
+  uint64_t GetSize() const { return mSize; }
+
+private:
+  const unsigned char * mData;
+  uint64_t mSize;
+#ifdef _WIN32
+  void * mFileHandle;
+  void * mMappingHandle;
+#else
+  int mFileDescriptor;
+#endif
+};
+
+class Reader
+{
+public:
+  Reader( const unsigned char * _data, uint64_t _size, uint64_t _offset );
+
+  template<typename T> bool Read( T & _value )
+  {
+    if ( mFailed || mOffset + sizeof( T ) > mSize )
+    {
+      mFailed = true;
+      return false;
+    }
+    memcpy( &_value, mData + mOffset, sizeof( T ) );
+    mOffset += sizeof( T );
+    return true;
+  }
+  bool ReadString( std::string & _string );
+
+  // Returns a pointer into the mapped file or NULL if the range is out of bounds
+  const void * GetBlob( uint64_t _offset, uint64_t _size );
+
+  bool IsValid() const { return !mFailed; }
+
+private:
+  const unsigned char * mData;
+  uint64_t mSize;
+  uint64_t mOffset;
+  bool mFailed;
+};
+} // namespace
\ No newline at end of file
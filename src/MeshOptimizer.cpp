@@ -0,0 +1,345 @@
+#include "MeshOptimizer.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+namespace MeshOptimizer
+{
+
+const unsigned int INVALID = ~0u;
+
+//////////////////////////////////////////////////////////////////////////
+// Cache simulation
+
+// A FIFO cache only needs the time each vertex last entered it: the vertex is
+// still cached while fewer than CACHE_SIZE others entered after it
+struct CacheSimulation
+{
+  CacheSimulation( int _vertexCount )
+    : mEntryTimes( _vertexCount, 0 )
+    , mTime( CACHE_SIZE + 1 )
+  {
+  }
+
+  // Returns whether the vertex had to be transformed
+  bool Touch( unsigned int _vertex )
+  {
+    if ( mTime - mEntryTimes[ _vertex ] <= (unsigned int) CACHE_SIZE )
+    {
+      return false;
+    }
+    mEntryTimes[ _vertex ] = mTime++;
+    return true;
+  }
+
+  void Flush()
+  {
+    mTime += CACHE_SIZE + 1;
+  }
+
+  std::vector<unsigned int> mEntryTimes;
+  unsigned int mTime;
+};
+
+void AnalyzeVertexCache( const unsigned int * _indices, int _triangleCount, int _vertexCount, float & _acmr, float & _atvr )
+{
+  _acmr = 0.0f;
+  _atvr = 0.0f;
+  if ( _triangleCount <= 0 || _vertexCount <= 0 )
+  {
+    return;
+  }
+
+  CacheSimulation cache( _vertexCount );
+  size_t misses = 0;
+  for ( size_t i = 0; i < (size_t) _triangleCount * 3; i++ )
+  {
+    misses += cache.Touch( _indices[ i ] ) ? 1 : 0;
+  }
+  _acmr = misses / (float) _triangleCount;
+  _atvr = misses / (float) _vertexCount;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Vertex cache
+
+void OptimizeVertexCache( unsigned int * _indices, int _triangleCount, int _vertexCount, std::vector<unsigned int> * _clusters /*= NULL*/ )
+{
+  if ( _clusters )
+  {
+    _clusters->clear();
+  }
+  if ( _triangleCount <= 0 || _vertexCount <= 0 )
+  {
+    return;
+  }
+  const size_t indexCount = (size_t) _triangleCount * 3;
+
+  // Triangles around each vertex, and how many of them are still to be emitted
+  std::vector<unsigned int> adjacencyOffsets( _vertexCount + 1, 0 );
+  for ( size_t i = 0; i < indexCount; i++ )
+  {
+    adjacencyOffsets[ _indices[ i ] + 1 ]++;
+  }
+  std::vector<int> liveTriangles( _vertexCount );
+  for ( int i = 0; i < _vertexCount; i++ )
+  {
+    liveTriangles[ i ] = adjacencyOffsets[ i + 1 ];
+    adjacencyOffsets[ i + 1 ] += adjacencyOffsets[ i ];
+  }
+  std::vector<unsigned int> adjacency( indexCount );
+  std::vector<unsigned int> adjacencyFill( adjacencyOffsets.begin(), adjacencyOffsets.end() - 1 );
+  for ( size_t i = 0; i < indexCount; i++ )
+  {
+    adjacency[ adjacencyFill[ _indices[ i ] ]++ ] = (unsigned int) ( i / 3 );
+  }
+
+  std::vector<unsigned char> emitted( _triangleCount, 0 );
+  std::vector<unsigned int> output;
+  output.reserve( indexCount );
+  std::vector<unsigned int> deadEnds; // recently used vertices, to continue from when stuck
+  std::vector<unsigned int> candidates;
+  CacheSimulation cache( _vertexCount );
+
+  int scan = 0; // everything below has no live triangles left
+  unsigned int fan = _indices[ 0 ];
+  while ( fan != INVALID )
+  {
+    // Emit every remaining triangle around the fanning vertex
+    candidates.clear();
+    for ( unsigned int i = adjacencyOffsets[ fan ]; i < adjacencyOffsets[ fan + 1 ]; i++ )
+    {
+      const unsigned int triangle = adjacency[ i ];
+      if ( emitted[ triangle ] )
+      {
+        continue;
+      }
+      emitted[ triangle ] = 1;
+      for ( int k = 0; k < 3; k++ )
+      {
+        const unsigned int vertex = _indices[ triangle * 3 + k ];
+        output.push_back( vertex );
+        deadEnds.push_back( vertex );
+        candidates.push_back( vertex );
+        liveTriangles[ vertex ]--;
+        cache.Touch( vertex );
+      }
+    }
+
+    // Next, the candidate that is furthest along in the cache but will stay
+    // in it while its own triangles are emitted
+    unsigned int next = INVALID;
+    int bestPriority = -1;
+    for ( size_t i = 0; i < candidates.size(); i++ )
+    {
+      const unsigned int vertex = candidates[ i ];
+      if ( liveTriangles[ vertex ] <= 0 )
+      {
+        continue;
+      }
+      const int age = (int) ( cache.mTime - cache.mEntryTimes[ vertex ] );
+      const int priority = age + 2 * liveTriangles[ vertex ] <= CACHE_SIZE ? age : 0;
+      if ( priority > bestPriority )
+      {
+        bestPriority = priority;
+        next = vertex;
+      }
+    }
+
+    // Dead end: continue from a recent vertex, or the next unfinished one in
+    // order, with the cache effectively cold
+    if ( next == INVALID )
+    {
+      while ( !deadEnds.empty() && next == INVALID )
+      {
+        if ( liveTriangles[ deadEnds.back() ] > 0 )
+        {
+          next = deadEnds.back();
+        }
+        deadEnds.pop_back();
+      }
+      while ( next == INVALID && scan < _vertexCount )
+      {
+        if ( liveTriangles[ scan ] > 0 )
+        {
+          next = scan;
+        }
+        scan++;
+      }
+      if ( _clusters && next != INVALID )
+      {
+        _clusters->push_back( (unsigned int) ( output.size() / 3 ) );
+      }
+    }
+    fan = next;
+  }
+
+  if ( _clusters && ( _clusters->empty() || _clusters->front() != 0 ) )
+  {
+    _clusters->insert( _clusters->begin(), 0 );
+  }
+  memcpy( _indices, output.data(), indexCount * sizeof( unsigned int ) );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Overdraw
+
+struct Cluster
+{
+  unsigned int mFirstTriangle;
+  unsigned int mTriangleCount;
+  float mSortKey;
+};
+
+bool ClusterLess( const Cluster & _a, const Cluster & _b )
+{
+  return _a.mSortKey > _b.mSortKey;
+}
+
+void OptimizeOverdraw( unsigned int * _indices, int _triangleCount, const float * _positions, size_t _stride, int _vertexCount, const std::vector<unsigned int> & _clusters, float _threshold /*= 1.05f*/ )
+{
+  if ( _triangleCount <= 0 || _clusters.empty() )
+  {
+    return;
+  }
+
+  // Soft boundaries: within each run, start a new cluster (flushing the
+  // cache) as soon as the one so far is within the threshold of the run's ACMR
+  std::vector<Cluster> clusters;
+  CacheSimulation cache( _vertexCount );
+  for ( size_t c = 0; c < _clusters.size(); c++ )
+  {
+    const unsigned int first = _clusters[ c ];
+    const unsigned int last = c + 1 < _clusters.size() ? _clusters[ c + 1 ] : (unsigned int) _triangleCount;
+
+    cache.Flush();
+    unsigned int misses = 0;
+    for ( unsigned int i = first * 3; i < last * 3; i++ )
+    {
+      misses += cache.Touch( _indices[ i ] ) ? 1 : 0;
+    }
+    const float maxACMR = _threshold * misses / (float) ( last - first );
+
+    Cluster cluster;
+    cluster.mFirstTriangle = first;
+    cache.Flush();
+    misses = 0;
+    for ( unsigned int i = first; i < last; i++ )
+    {
+      for ( int k = 0; k < 3; k++ )
+      {
+        misses += cache.Touch( _indices[ i * 3 + k ] ) ? 1 : 0;
+      }
+      if ( i + 1 < last && misses <= maxACMR * ( i + 1 - cluster.mFirstTriangle ) )
+      {
+        cluster.mTriangleCount = i + 1 - cluster.mFirstTriangle;
+        clusters.push_back( cluster );
+        cluster.mFirstTriangle = i + 1;
+        cache.Flush();
+        misses = 0;
+      }
+    }
+    cluster.mTriangleCount = last - cluster.mFirstTriangle;
+    clusters.push_back( cluster );
+  }
+
+  // Clusters facing away from the center of the mesh are the outer ones,
+  // and more likely to occlude the rest than to be occluded
+  const unsigned char * positions = (const unsigned char *) _positions;
+  double meshCenter[ 3 ] = { 0.0, 0.0, 0.0 };
+  double meshArea = 0.0;
+  std::vector<float> clusterData( clusters.size() * 6 ); // area weighted center and normal
+  for ( size_t c = 0; c < clusters.size(); c++ )
+  {
+    float * data = &clusterData[ c * 6 ];
+    memset( data, 0, sizeof( float ) * 6 );
+    float clusterArea = 0.0f;
+    for ( unsigned int i = clusters[ c ].mFirstTriangle; i < clusters[ c ].mFirstTriangle + clusters[ c ].mTriangleCount; i++ )
+    {
+      const float * p0 = (const float *) ( positions + _stride * _indices[ i * 3 + 0 ] );
+      const float * p1 = (const float *) ( positions + _stride * _indices[ i * 3 + 1 ] );
+      const float * p2 = (const float *) ( positions + _stride * _indices[ i * 3 + 2 ] );
+      const float e0[ 3 ] = { p1[ 0 ] - p0[ 0 ], p1[ 1 ] - p0[ 1 ], p1[ 2 ] - p0[ 2 ] };
+      const float e1[ 3 ] = { p2[ 0 ] - p0[ 0 ], p2[ 1 ] - p0[ 1 ], p2[ 2 ] - p0[ 2 ] };
+      // e1 x e0: front faces are clockwise
+      const float normal[ 3 ] = { e1[ 1 ] * e0[ 2 ] - e1[ 2 ] * e0[ 1 ], e1[ 2 ] * e0[ 0 ] - e1[ 0 ] * e0[ 2 ], e1[ 0 ] * e0[ 1 ] - e1[ 1 ] * e0[ 0 ] };
+      const float area = sqrtf( normal[ 0 ] * normal[ 0 ] + normal[ 1 ] * normal[ 1 ] + normal[ 2 ] * normal[ 2 ] );
+      for ( int k = 0; k < 3; k++ )
+      {
+        data[ k ] += ( p0[ k ] + p1[ k ] + p2[ k ] ) * ( area / 3.0f );
+        data[ 3 + k ] += normal[ k ];
+      }
+      clusterArea += area;
+    }
+
+    for ( int k = 0; k < 3; k++ )
+    {
+      meshCenter[ k ] += data[ k ];
+      data[ k ] = clusterArea > 0.0f ? data[ k ] / clusterArea : 0.0f;
+    }
+    meshArea += clusterArea;
+
+    const float normalLength = sqrtf( data[ 3 ] * data[ 3 ] + data[ 4 ] * data[ 4 ] + data[ 5 ] * data[ 5 ] );
+    for ( int k = 3; k < 6; k++ )
+    {
+      data[ k ] = normalLength > 0.0f ? data[ k ] / normalLength : 0.0f;
+    }
+  }
+  for ( int k = 0; k < 3; k++ )
+  {
+    meshCenter[ k ] = meshArea > 0.0 ? meshCenter[ k ] / meshArea : 0.0;
+  }
+
+  for ( size_t c = 0; c < clusters.size(); c++ )
+  {
+    const float * data = &clusterData[ c * 6 ];
+    clusters[ c ].mSortKey = (float) ( ( data[ 0 ] - meshCenter[ 0 ] ) * data[ 3 ] + ( data[ 1 ] - meshCenter[ 1 ] ) * data[ 4 ] + ( data[ 2 ] - meshCenter[ 2 ] ) * data[ 5 ] );
+  }
+  std::stable_sort( clusters.begin(), clusters.end(), ClusterLess );
+
+  std::vector<unsigned int> output;
+  output.reserve( (size_t) _triangleCount * 3 );
+  for ( size_t c = 0; c < clusters.size(); c++ )
+  {
+    const unsigned int * first = _indices + clusters[ c ].mFirstTriangle * 3;
+    output.insert( output.end(), first, first + clusters[ c ].mTriangleCount * 3 );
+  }
+  memcpy( _indices, output.data(), output.size() * sizeof( unsigned int ) );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Vertex fetch
+
+void OptimizeVertexFetch( unsigned int * _indices, size_t _indexCount, void * _vertices, size_t _vertexSize, int _vertexCount, std::vector<unsigned int> & _remap )
+{
+  _remap.assign( _vertexCount, INVALID );
+  unsigned int nextVertex = 0;
+  for ( size_t i = 0; i < _indexCount; i++ )
+  {
+    unsigned int & remapped = _remap[ _indices[ i ] ];
+    if ( remapped == INVALID )
+    {
+      remapped = nextVertex++;
+    }
+    _indices[ i ] = remapped;
+  }
+
+  // Unused vertices keep their relative order at the end
+  for ( int i = 0; i < _vertexCount; i++ )
+  {
+    if ( _remap[ i ] == INVALID )
+    {
+      _remap[ i ] = nextVertex++;
+    }
+  }
+
+  std::vector<unsigned char> vertices( _vertexSize * _vertexCount );
+  for ( int i = 0; i < _vertexCount; i++ )
+  {
+    memcpy( vertices.data() + _vertexSize * _remap[ i ], (const unsigned char *) _vertices + _vertexSize * i, _vertexSize );
+  }
+  memcpy( _vertices, vertices.data(), vertices.size() );
+}
+
+} // namespace
@@ -0,0 +1,32 @@
+#include <vector>
+#include <stddef.h>
+
+// Triangle and vertex reordering for faster drawing, after "Fast Triangle
+// Reordering for Vertex Locality and Reduced Overdraw" (Sander, Nehab and
+// Barczak, 2007). Only the order changes: the same triangles are drawn from
+// the same vertex data.
+namespace MeshOptimizer
+{
+// Entries of the FIFO post-transform cache that the optimization and the
+// statistics simulate
+const int CACHE_SIZE = 16;
+
+// ACMR is the number of vertex shader runs per triangle (0.5 at best, 3 at
+// worst), ATVR the number per vertex (1 at best)
+void AnalyzeVertexCache( const unsigned int * _indices, int _triangleCount, int _vertexCount, float & _acmr, float & _atvr );
+
+// Tipsify: reorders triangles in place for vertex cache reuse. _clusters gets
+// the first triangle of every run that starts from an empty cache.
+void OptimizeVertexCache( unsigned int * _indices, int _triangleCount, int _vertexCount, std::vector<unsigned int> * _clusters = NULL );
+
+// Splits the clusters of a cache optimized mesh further wherever that costs
+// at most _threshold times its ACMR, then sorts them so the ones facing
+// outwards are drawn first and hide the rest. Front faces are taken to be
+// clockwise, as Geometry imports them. _positions are three floats, _stride
+// bytes apart.
+void OptimizeOverdraw( unsigned int * _indices, int _triangleCount, const float * _positions, size_t _stride, int _vertexCount, const std::vector<unsigned int> & _clusters, float _threshold = 1.05f );
+
+// Renumbers vertices in the order the indices first use them and moves the
+// vertex data to match; _remap gets the new index of every old vertex
+void OptimizeVertexFetch( unsigned int * _indices, size_t _indexCount, void * _vertices, size_t _vertexSize, int _vertexCount, std::vector<unsigned int> & _remap );
+} // namespace
@@ -0,0 +1,297 @@
+#include "Profiler.h"
+
+#include <cstdio>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#define GLEW_NO_GLU
+#include "GL/glew.h"
+
+namespace Profiler
+{
+
+const int QUERY_SETS = 3; // queries are read back this many frames after being issued
+
+const char * STAGE_NAMES[ STAGE_COUNT ] = {
+  "Skysphere",
+  "Opaque",
+  "Transparent backfaces",
+  "Transparent frontfaces",
+  "Transparent weighted blended",
+  "Wireframe",
+  "ImGui",
+  "EndFrame",
+};
+
+// Negative times mean the stage didn't run (or its query was lost)
+struct FrameRecord
+{
+  uint32_t mFrame;
+  float mCPUTime[ STAGE_COUNT ];
+  float mGPUTime[ STAGE_COUNT ];
+};
+
+struct QuerySet
+{
+  GLuint mQueries[ STAGE_COUNT ];
+  bool mIssued[ STAGE_COUNT ];
+  uint32_t mFrame;
+};
+
+bool initialized = false;
+uint32_t frameIndex = 0;
+FrameRecord history[ HISTORY_SIZE ];
+QuerySet querySets[ QUERY_SETS ];
+int activeStage = -1;
+bool activeQuery = false;
+std::chrono::high_resolution_clock::time_point stageStart;
+
+FrameRecord & GetRecord( uint32_t _frame )
+{
+  return history[ _frame % HISTORY_SIZE ];
+}
+
+void ResetRecord( uint32_t _frame )
+{
+  FrameRecord & record = GetRecord( _frame );
+  record.mFrame = _frame;
+  for ( int i = 0; i < STAGE_COUNT; i++ )
+  {
+    record.mCPUTime[ i ] = -1.0f;
+    record.mGPUTime[ i ] = -1.0f;
+  }
+}
+
+bool Init()
+{
+  if ( initialized )
+  {
+    return true;
+  }
+
+  for ( int i = 0; i < QUERY_SETS; i++ )
+  {
+    glGenQueries( STAGE_COUNT, querySets[ i ].mQueries );
+    for ( int j = 0; j < STAGE_COUNT; j++ )
+    {
+      querySets[ i ].mIssued[ j ] = false;
+    }
+    querySets[ i ].mFrame = 0;
+  }
+  for ( int i = 0; i < HISTORY_SIZE; i++ )
+  {
+    ResetRecord( i );
+    history[ i ].mFrame = UINT32_MAX;
+  }
+  frameIndex = 0;
+  activeStage = -1;
+  initialized = true;
+
+  return glGetError() == GL_NO_ERROR;
+}
+
+void Release()
+{
+  if ( !initialized )
+  {
+    return;
+  }
+
+  for ( int i = 0; i < QUERY_SETS; i++ )
+  {
+    glDeleteQueries( STAGE_COUNT, querySets[ i ].mQueries );
+  }
+  initialized = false;
+}
+
+bool IsInitialized()
+{
+  return initialized;
+}
+
+void BeginFrame()
+{
+  if ( !initialized )
+  {
+    return;
+  }
+
+  // The set about to be reused was issued QUERY_SETS frames ago; whatever
+  // isn't available yet is dropped instead of waited for
+  QuerySet & querySet = querySets[ frameIndex % QUERY_SETS ];
+  FrameRecord & record = GetRecord( querySet.mFrame );
+  for ( int i = 0; i < STAGE_COUNT; i++ )
+  {
+    if ( !querySet.mIssued[ i ] )
+    {
+      continue;
+    }
+    querySet.mIssued[ i ] = false;
+
+    GLint available = 0;
+    glGetQueryObjectiv( querySet.mQueries[ i ], GL_QUERY_RESULT_AVAILABLE, &available );
+    if ( available && record.mFrame == querySet.mFrame )
+    {
+      GLuint64 elapsed = 0;
+      glGetQueryObjectui64v( querySet.mQueries[ i ], GL_QUERY_RESULT, &elapsed );
+      record.mGPUTime[ i ] = elapsed / 1000000.0f;
+    }
+  }
+
+  querySet.mFrame = frameIndex;
+  ResetRecord( frameIndex );
+}
+
+void EndFrame()
+{
+  if ( !initialized )
+  {
+    return;
+  }
+
+  if ( activeStage >= 0 )
+  {
+    EndStage( (STAGE) activeStage );
+  }
+  frameIndex++;
+}
+
+void BeginStage( STAGE _stage )
+{
+  if ( !initialized || activeStage >= 0 )
+  {
+    return;
+  }
+
+  // A stage that runs again in the same frame only adds CPU time; its query
+  // object already holds the first run
+  activeStage = _stage;
+  QuerySet & querySet = querySets[ frameIndex % QUERY_SETS ];
+  activeQuery = !querySet.mIssued[ _stage ];
+  if ( activeQuery )
+  {
+    glBeginQuery( GL_TIME_ELAPSED, querySet.mQueries[ _stage ] );
+  }
+  stageStart = std::chrono::high_resolution_clock::now();
+}
+
+void EndStage( STAGE _stage )
+{
+  if ( !initialized || activeStage != _stage )
+  {
+    return;
+  }
+
+  const float elapsed = std::chrono::duration<float, std::milli>( std::chrono::high_resolution_clock::now() - stageStart ).count();
+  if ( activeQuery )
+  {
+    glEndQuery( GL_TIME_ELAPSED );
+    querySets[ frameIndex % QUERY_SETS ].mIssued[ _stage ] = true;
+  }
+
+  FrameRecord & record = GetRecord( frameIndex );
+  record.mCPUTime[ _stage ] = std::max( record.mCPUTime[ _stage ], 0.0f ) + elapsed;
+  activeStage = -1;
+}
+
+const char * GetStageName( STAGE _stage )
+{
+  return STAGE_NAMES[ _stage ];
+}
+
+void GetStatistics( STAGE _stage, bool _gpu, Statistics & _statistics )
+{
+  std::vector<float> samples;
+  samples.reserve( HISTORY_SIZE );
+  for ( int i = 0; i < HISTORY_SIZE; i++ )
+  {
+    // The current frame is still being recorded
+    if ( history[ i ].mFrame == UINT32_MAX || history[ i ].mFrame == frameIndex )
+    {
+      continue;
+    }
+    const float time = _gpu ? history[ i ].mGPUTime[ _stage ] : history[ i ].mCPUTime[ _stage ];
+    if ( time >= 0.0f )
+    {
+      samples.push_back( time );
+    }
+  }
+
+  _statistics.mSampleCount = (int) samples.size();
+  if ( samples.empty() )
+  {
+    _statistics.mMin = 0.0f;
+    _statistics.mAverage = 0.0f;
+    _statistics.mP99 = 0.0f;
+    return;
+  }
+
+  float sum = 0.0f;
+  _statistics.mMin = samples[ 0 ];
+  for ( int i = 0; i < samples.size(); i++ )
+  {
+    sum += samples[ i ];
+    _statistics.mMin = std::min( _statistics.mMin, samples[ i ] );
+  }
+  _statistics.mAverage = sum / samples.size();
+
+  const int p99Index = std::min( (int) samples.size() - 1, (int) ( samples.size() * 0.99f ) );
+  std::nth_element( samples.begin(), samples.begin() + p99Index, samples.end() );
+  _statistics.mP99 = samples[ p99Index ];
+}
+
+bool ExportCSV( const char * _path )
+{
+  FILE * file = fopen( _path, "wb" );
+  if ( !file )
+  {
+    printf( "[profiler] Unable to write '%s'\n", _path );
+    return false;
+  }
+
+  fprintf( file, "frame" );
+  for ( int i = 0; i < STAGE_COUNT; i++ )
+  {
+    fprintf( file, ",%s CPU ms,%s GPU ms", STAGE_NAMES[ i ], STAGE_NAMES[ i ] );
+  }
+  fprintf( file, "\n" );
+
+  // Oldest first; frames whose queries may still be pending are left out
+  const uint32_t firstFrame = frameIndex > HISTORY_SIZE ? frameIndex - HISTORY_SIZE : 0;
+  for ( uint32_t frame = firstFrame; frame + QUERY_SETS <= frameIndex; frame++ )
+  {
+    const FrameRecord & record = GetRecord( frame );
+    if ( record.mFrame != frame )
+    {
+      continue;
+    }
+    fprintf( file, "%u", frame );
+    for ( int i = 0; i < STAGE_COUNT; i++ )
+    {
+      if ( record.mCPUTime[ i ] >= 0.0f )
+      {
+        fprintf( file, ",%.4f", record.mCPUTime[ i ] );
+      }
+      else
+      {
+        fprintf( file, "," );
+      }
+      if ( record.mGPUTime[ i ] >= 0.0f )
+      {
+        fprintf( file, ",%.4f", record.mGPUTime[ i ] );
+      }
+      else
+      {
+        fprintf( file, "," );
+      }
+    }
+    fprintf( file, "\n" );
+  }
+
+  fclose( file );
+  printf( "[profiler] Saved frame timings to '%s'\n", _path );
+  return true;
+}
+
+} // namespace
@@ -0,0 +1,55 @@
+#include <stdint.h>
+
+// Per-frame CPU and GPU timings of the main render stages. Each stage gets a
+// CPU timer and a GL_TIME_ELAPSED query; queries are read back a few frames
+// later, and only if the results are already there, so reading them never
+// stalls. Stages don't nest: while one is running, others are ignored
+// (e.g. the opaque pass inside the wireframe re-render). Without Init() every
+// call is a no-op.
+namespace Profiler
+{
+enum STAGE
+{
+  STAGE_SKYSPHERE = 0,
+  STAGE_OPAQUE,
+  STAGE_TRANSPARENT_BACKFACE,
+  STAGE_TRANSPARENT_FRONTFACE,
+  STAGE_TRANSPARENT_WEIGHTED, // accumulation and composite
+  STAGE_WIREFRAME,
+  STAGE_IMGUI,
+  STAGE_ENDFRAME,
+  STAGE_COUNT,
+};
+
+const int HISTORY_SIZE = 300; // frames kept for the statistics and the CSV export
+
+struct Statistics
+{
+  float mMin;
+  float mAverage;
+  float mP99;
+  int mSampleCount;
+};
+
+bool Init();
+void Release();
+bool IsInitialized();
+
+void BeginFrame();
+void EndFrame();
+
+void BeginStage( STAGE _stage );
+void EndStage( STAGE _stage );
+
+struct ScopedStage
+{
+  ScopedStage( STAGE _stage ) : mStage( _stage ) { BeginStage( _stage ); }
+  ~ScopedStage() { EndStage( mStage ); }
+  STAGE mStage;
+};
+
+const char * GetStageName( STAGE _stage );
+// Over the frames in the history, in milliseconds
+void GetStatistics( STAGE _stage, bool _gpu, Statistics & _statistics );
+bool ExportCSV( const char * _path );
+} // namespace
@@ -1,6 +1,9 @@
 
 #include <cstdio>
 #include <string>
+#include <unordered_map>
+#include <mutex>
+#include <algorithm>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -12,9 +15,23 @@
 #include <GL/wGLew.h>
 #endif
 
+#ifdef FOXOTRON_HEADLESS_EGL
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
 #include "Renderer.h"
 #include <string.h>
 
+#ifdef FOXOTRON_COUNT_ALLOCATIONS
+// The import benchmark counts stb_image's heap allocations with its own
+void * CountedMalloc( size_t _size );
+void * CountedRealloc( void * _pointer, size_t _size );
+#define STBI_MALLOC( _size ) CountedMalloc( _size )
+#define STBI_REALLOC( _pointer, _size ) CountedRealloc( _pointer, _size )
+#define STBI_FREE( _pointer ) free( _pointer )
+#endif
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
@@ -24,6 +41,83 @@ namespace Renderer
 GLFWwindow * mWindow = NULL;
 bool run = true;
 
+// Headless mode renders into an offscreen framebuffer instead of a window;
+// with multisampling it's resolved into a second one before reading back
+bool headless = false;
+GLuint offscreenFramebuffer = 0;
+GLuint offscreenColorBuffer = 0;
+GLuint offscreenDepthBuffer = 0;
+GLuint resolveFramebuffer = 0;
+GLuint resolveColorBuffer = 0;
+
+// Weighted blended transparency targets, created on first use
+GLuint transparencyFramebuffer = 0;
+GLuint transparencyDepthBuffer = 0;
+Texture transparencyAccumulation;
+Texture transparencyRevealage;
+int transparencyWidth = 0;
+int transparencyHeight = 0;
+GLint transparencyTargetFramebuffer = 0; // bound before BeginTransparencyAccumulation()
+GLint transparencyTargetViewport[ 4 ] = { 0, 0, 0, 0 };
+GLuint transparencyVertexArray = 0; // the composite draws a triangle from gl_VertexID alone
+#ifdef FOXOTRON_HEADLESS_EGL
+EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+EGLContext eglContext = EGL_NO_CONTEXT;
+#endif
+
+const int MAX_TEXTURE_UNITS = 32;
+struct TextureBinding
+{
+  GLenum mTarget;
+  GLuint mTextureID;
+};
+TextureBinding boundTextures[ MAX_TEXTURE_UNITS ];
+int activeTextureUnit = -1;
+int textureUnitCount = 0;
+TextureBindStats textureBindStats = { 0, 0 };
+TextureBindStats lastFrameTextureBindStats = { 0, 0 };
+
+// Shadow of the GL state; UNKNOWN_STATE means the next change is always issued
+const unsigned int UNKNOWN_STATE = 0xFFFFFFFF;
+const unsigned int STATE_CAPABILITIES[] = { GL_BLEND, GL_DEPTH_TEST, GL_CULL_FACE, GL_SCISSOR_TEST, GL_POLYGON_OFFSET_FILL };
+const int STATE_CAPABILITY_COUNT = sizeof( STATE_CAPABILITIES ) / sizeof( STATE_CAPABILITIES[ 0 ] );
+const int MAX_UNIFORM_BUFFER_BINDINGS = 8;
+struct UniformBufferBinding
+{
+  unsigned int mBuffer;
+  size_t mOffset;
+  size_t mSize;
+};
+struct RenderState
+{
+  unsigned int mEnabled[ STATE_CAPABILITY_COUNT ];
+  unsigned int mBlendSource;
+  unsigned int mBlendDestination;
+  unsigned int mCullFace;
+  unsigned int mDepthMask;
+  unsigned int mDepthFunc;
+  unsigned int mPolygonMode;
+  unsigned int mProgram;
+  unsigned int mVertexArray;
+  UniformBufferBinding mUniformBuffers[ MAX_UNIFORM_BUFFER_BINDINGS ];
+};
+RenderState renderState;
+RenderStateStats renderStateStats = { 0, 0 };
+RenderStateStats lastFrameRenderStateStats = { 0, 0 };
+
+// Returns true if the change has to be issued
+bool UpdateState( unsigned int & _shadow, unsigned int _value )
+{
+  if ( _shadow == _value )
+  {
+    renderStateStats.mFiltered++;
+    return false;
+  }
+  _shadow = _value;
+  renderStateStats.mIssued++;
+  return true;
+}
+
 int nWidth = 0;
 int nHeight = 0;
 RENDERER_WINDOWMODE eMode = RENDERER_WINDOWMODE_FULLSCREEN;
@@ -156,9 +250,234 @@ bool Open( RENDERER_SETTINGS * _settings )
 
   glViewport( 0, 0, nWidth, nHeight );
 
+  GLint maxTextureUnits = 0;
+  glGetIntegerv( GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &maxTextureUnits );
+  textureUnitCount = std::min( (int) maxTextureUnits, MAX_TEXTURE_UNITS );
+  InvalidateTextureBindings();
+  InvalidateRenderState();
+
+  run = true;
+
+  return true;
+}
+
+bool CreateOffscreenFramebuffer( bool _multisampling )
+{
+  const GLsizei samples = _multisampling ? 4 : 0;
+
+  glGenRenderbuffers( 1, &offscreenColorBuffer );
+  glBindRenderbuffer( GL_RENDERBUFFER, offscreenColorBuffer );
+  glRenderbufferStorageMultisample( GL_RENDERBUFFER, samples, GL_RGBA8, nWidth, nHeight );
+  glGenRenderbuffers( 1, &offscreenDepthBuffer );
+  glBindRenderbuffer( GL_RENDERBUFFER, offscreenDepthBuffer );
+  glRenderbufferStorageMultisample( GL_RENDERBUFFER, samples, GL_DEPTH24_STENCIL8, nWidth, nHeight );
+
+  glGenFramebuffers( 1, &offscreenFramebuffer );
+  glBindFramebuffer( GL_FRAMEBUFFER, offscreenFramebuffer );
+  glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, offscreenColorBuffer );
+  glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, offscreenDepthBuffer );
+  if ( glCheckFramebufferStatus( GL_FRAMEBUFFER ) != GL_FRAMEBUFFER_COMPLETE )
+  {
+    printf( "[Renderer] Offscreen framebuffer is incomplete\n" );
+    return false;
+  }
+
+  if ( samples )
+  {
+    glGenRenderbuffers( 1, &resolveColorBuffer );
+    glBindRenderbuffer( GL_RENDERBUFFER, resolveColorBuffer );
+    glRenderbufferStorage( GL_RENDERBUFFER, GL_RGBA8, nWidth, nHeight );
+
+    glGenFramebuffers( 1, &resolveFramebuffer );
+    glBindFramebuffer( GL_FRAMEBUFFER, resolveFramebuffer );
+    glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, resolveColorBuffer );
+    if ( glCheckFramebufferStatus( GL_FRAMEBUFFER ) != GL_FRAMEBUFFER_COMPLETE )
+    {
+      printf( "[Renderer] Offscreen resolve framebuffer is incomplete\n" );
+      return false;
+    }
+  }
+
+  glBindRenderbuffer( GL_RENDERBUFFER, 0 );
+  glBindFramebuffer( GL_FRAMEBUFFER, offscreenFramebuffer );
+  return true;
+}
+
+void ReleaseTransparencyTargets()
+{
+  glDeleteFramebuffers( 1, &transparencyFramebuffer );
+  glDeleteRenderbuffers( 1, &transparencyDepthBuffer );
+  glDeleteTextures( 1, &transparencyAccumulation.mGLTextureID );
+  glDeleteTextures( 1, &transparencyRevealage.mGLTextureID );
+  transparencyFramebuffer = 0;
+  transparencyDepthBuffer = 0;
+  transparencyAccumulation.mGLTextureID = 0;
+  transparencyRevealage.mGLTextureID = 0;
+  transparencyWidth = 0;
+  transparencyHeight = 0;
+  InvalidateTextureBindings();
+}
+
+void ReleaseOffscreenFramebuffer()
+{
+  glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+  glDeleteFramebuffers( 1, &offscreenFramebuffer );
+  glDeleteFramebuffers( 1, &resolveFramebuffer );
+  glDeleteRenderbuffers( 1, &offscreenColorBuffer );
+  glDeleteRenderbuffers( 1, &offscreenDepthBuffer );
+  glDeleteRenderbuffers( 1, &resolveColorBuffer );
+  offscreenFramebuffer = 0;
+  resolveFramebuffer = 0;
+  offscreenColorBuffer = 0;
+  offscreenDepthBuffer = 0;
+  resolveColorBuffer = 0;
+}
+
+bool OpenHeadless( RENDERER_SETTINGS * _settings )
+{
+#ifdef FOXOTRON_HEADLESS_EGL
+  nWidth = _settings->mWidth;
+  nHeight = _settings->mHeight;
+
+  // Prefer a surfaceless display so neither X nor a DRM device is needed
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress( "eglGetPlatformDisplayEXT" );
+  if ( getPlatformDisplay )
+  {
+    eglDisplay = getPlatformDisplay( EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL );
+  }
+  if ( eglDisplay == EGL_NO_DISPLAY )
+  {
+    eglDisplay = eglGetDisplay( EGL_DEFAULT_DISPLAY );
+  }
+
+  EGLint major = 0;
+  EGLint minor = 0;
+  if ( eglDisplay == EGL_NO_DISPLAY || !eglInitialize( eglDisplay, &major, &minor ) )
+  {
+    printf( "[EGL] Unable to initialize a display\n" );
+    eglDisplay = EGL_NO_DISPLAY;
+    return false;
+  }
+  printf( "[EGL] Version %d.%d, vendor %s\n", major, minor, eglQueryString( eglDisplay, EGL_VENDOR ) );
+
+  if ( !eglBindAPI( EGL_OPENGL_API ) )
+  {
+    printf( "[EGL] Desktop OpenGL is not available\n" );
+    Close();
+    return false;
+  }
+
+  const EGLint configAttributes[] = {
+    EGL_SURFACE_TYPE, 0,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_NONE
+  };
+  EGLConfig config = NULL;
+  EGLint configCount = 0;
+  if ( !eglChooseConfig( eglDisplay, configAttributes, &config, 1, &configCount ) || configCount == 0 )
+  {
+    printf( "[EGL] No suitable config found\n" );
+    Close();
+    return false;
+  }
+
+  const EGLint contextAttributes[] = {
+    EGL_CONTEXT_MAJOR_VERSION_KHR, 4,
+    EGL_CONTEXT_MINOR_VERSION_KHR, 1,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+    EGL_NONE
+  };
+  eglContext = eglCreateContext( eglDisplay, config, EGL_NO_CONTEXT, contextAttributes );
+  if ( eglContext == EGL_NO_CONTEXT )
+  {
+    printf( "OpenGL 4.1 (the minimum requirement) is not available: EGL error 0x%04X\n", eglGetError() );
+    Close();
+    return false;
+  }
+
+  if ( !eglMakeCurrent( eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglContext ) )
+  {
+    printf( "[EGL] Unable to make the context current without a surface\n" );
+    Close();
+    return false;
+  }
+  headless = true;
+
+  // glewInit() would go on to glxewInit(), which queries the GLX version of
+  // the current X display; there's none with a surfaceless context
+  glewExperimental = GL_TRUE;
+  GLenum err = glewContextInit();
+  if ( GLEW_OK != err )
+  {
+    printf( "[EGL] glewContextInit failed: %s\n", glewGetErrorString( err ) );
+    Close();
+    return false;
+  }
+  printf( "[EGL] Using GLEW %s\n", glewGetString( GLEW_VERSION ) );
+  glGetError(); // reset glew error
+
+  printf( "[EGL] OpenGL Version %s, GLSL %s\n", glGetString( GL_VERSION ), glGetString( GL_SHADING_LANGUAGE_VERSION ) );
+
+  if ( !CreateOffscreenFramebuffer( _settings->mMultisampling ) )
+  {
+    Close();
+    return false;
+  }
+  printf( "[EGL] Offscreen framebuffer size: %d x %d\n", nWidth, nHeight );
+
+  glViewport( 0, 0, nWidth, nHeight );
+
+  GLint maxTextureUnits = 0;
+  glGetIntegerv( GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &maxTextureUnits );
+  textureUnitCount = std::min( (int) maxTextureUnits, MAX_TEXTURE_UNITS );
+  InvalidateTextureBindings();
+  InvalidateRenderState();
+
   run = true;
 
   return true;
+#else
+  printf( "[Renderer] Headless rendering isn't supported by this build\n" );
+  return false;
+#endif
+}
+
+bool ReadFramebuffer( unsigned char * _pixels )
+{
+  if ( !headless )
+  {
+    return false;
+  }
+
+  if ( resolveFramebuffer )
+  {
+    glBindFramebuffer( GL_READ_FRAMEBUFFER, offscreenFramebuffer );
+    glBindFramebuffer( GL_DRAW_FRAMEBUFFER, resolveFramebuffer );
+    glBlitFramebuffer( 0, 0, nWidth, nHeight, 0, 0, nWidth, nHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST );
+    glBindFramebuffer( GL_READ_FRAMEBUFFER, resolveFramebuffer );
+  }
+  else
+  {
+    glBindFramebuffer( GL_READ_FRAMEBUFFER, offscreenFramebuffer );
+  }
+
+  glPixelStorei( GL_PACK_ALIGNMENT, 1 );
+  glReadPixels( 0, 0, nWidth, nHeight, GL_RGBA, GL_UNSIGNED_BYTE, _pixels );
+  glBindFramebuffer( GL_FRAMEBUFFER, offscreenFramebuffer );
+
+  // GL rows start at the bottom
+  const size_t rowSize = (size_t) nWidth * 4;
+  std::vector<unsigned char> row( rowSize );
+  for ( int y = 0; y < nHeight / 2; y++ )
+  {
+    unsigned char * top = _pixels + rowSize * y;
+    unsigned char * bottom = _pixels + rowSize * ( nHeight - 1 - y );
+    memcpy( row.data(), top, rowSize );
+    memcpy( top, bottom, rowSize );
+    memcpy( bottom, row.data(), rowSize );
+  }
+
+  return glGetError() == GL_NO_ERROR;
 }
 
 void SwitchFullscreen( RENDERER_WINDOWMODE newMode )
@@ -218,27 +537,97 @@ void StartFrame( glm::vec4 & clearColor )
   glClearColor( clearColor.r, clearColor.g, clearColor.b, clearColor.a );
   glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT );
 
-  glEnable( GL_DEPTH_TEST );
+  // ImGui and the texture loaders change state behind our back
+  InvalidateTextureBindings();
+  InvalidateRenderState();
+
+  SetEnabled( GL_DEPTH_TEST, true );
 }
 
 void EndFrame()
 {
+  lastFrameTextureBindStats = textureBindStats;
+  textureBindStats.mIssued = 0;
+  textureBindStats.mSkipped = 0;
+  lastFrameRenderStateStats = renderStateStats;
+  renderStateStats.mIssued = 0;
+  renderStateStats.mFiltered = 0;
+
   dropEventBufferCount = 0;
+  if ( headless )
+  {
+    return;
+  }
   glfwSwapBuffers( mWindow );
   glfwPollEvents();
 }
 
 bool WantsToQuit()
 {
+  if ( headless )
+  {
+    return !run;
+  }
   return glfwWindowShouldClose( mWindow ) || !run;
 }
 
 void Close()
 {
+  if ( transparencyFramebuffer )
+  {
+    ReleaseTransparencyTargets();
+  }
+  if ( transparencyVertexArray )
+  {
+    glDeleteVertexArrays( 1, &transparencyVertexArray );
+    transparencyVertexArray = 0;
+  }
+
+#ifdef FOXOTRON_HEADLESS_EGL
+  if ( eglDisplay != EGL_NO_DISPLAY )
+  {
+    if ( offscreenFramebuffer )
+    {
+      ReleaseOffscreenFramebuffer();
+    }
+    eglMakeCurrent( eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT );
+    if ( eglContext != EGL_NO_CONTEXT )
+    {
+      eglDestroyContext( eglDisplay, eglContext );
+      eglContext = EGL_NO_CONTEXT;
+    }
+    eglTerminate( eglDisplay );
+    eglDisplay = EGL_NO_DISPLAY;
+    headless = false;
+    return;
+  }
+#endif
+
   glfwDestroyWindow( mWindow );
   glfwTerminate();
 }
 
+bool IsSamplerType( GLenum type )
+{
+  switch ( type )
+  {
+    case GL_SAMPLER_1D:
+    case GL_SAMPLER_2D:
+    case GL_SAMPLER_3D:
+    case GL_SAMPLER_CUBE:
+    case GL_SAMPLER_1D_SHADOW:
+    case GL_SAMPLER_2D_SHADOW:
+    case GL_SAMPLER_1D_ARRAY:
+    case GL_SAMPLER_2D_ARRAY:
+    case GL_SAMPLER_2D_MULTISAMPLE:
+    case GL_SAMPLER_BUFFER:
+    case GL_INT_SAMPLER_2D:
+    case GL_UNSIGNED_INT_SAMPLER_2D:
+      return true;
+  }
+  return false;
+}
+
 Shader * CreateShader( const char * szVertexShaderCode, int nVertexShaderCodeSize, const char * szFragmentShaderCode, int nFragmentShaderCodeSize, char * szErrorBuffer, int nErrorBufferSize )
 {
   Shader * shader = new Shader;
@@ -296,119 +685,194 @@ Shader * CreateShader( const char * szVertexShaderCode, int nVertexShaderCodeSiz
     return NULL;
   }
 
+  //////////////////////////////////////////////////////////////////////////
+  // Assign uniform block binding points
+  GLuint blockIndex = glGetUniformBlockIndex( shader->mProgram, "FrameConstants" );
+  if ( blockIndex != GL_INVALID_INDEX )
+  {
+    glUniformBlockBinding( shader->mProgram, blockIndex, UNIFORMBLOCK_FRAME );
+  }
+  blockIndex = glGetUniformBlockIndex( shader->mProgram, "MaterialConstants" );
+  if ( blockIndex != GL_INVALID_INDEX )
+  {
+    glUniformBlockBinding( shader->mProgram, blockIndex, UNIFORMBLOCK_MATERIAL );
+  }
+
+  //////////////////////////////////////////////////////////////////////////
+  // Enumerate uniforms
+  GLint uniformCount = 0;
+  GLint maxNameLength = 0;
+  glGetProgramiv( shader->mProgram, GL_ACTIVE_UNIFORMS, &uniformCount );
+  glGetProgramiv( shader->mProgram, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength );
+  std::vector<GLchar> name( maxNameLength + 1 );
+  int nextTextureUnit = 0;
+  for ( GLint i = 0; i < uniformCount; i++ )
+  {
+    GLsizei nameLength = 0;
+    GLint arraySize = 0;
+    GLenum type = 0;
+    glGetActiveUniform( shader->mProgram, i, (GLsizei) name.size(), &nameLength, &arraySize, &type, name.data() );
+
+    // Members of uniform blocks don't have a location
+    GLint location = glGetUniformLocation( shader->mProgram, name.data() );
+    if ( location == -1 )
+    {
+      continue;
+    }
+
+    // Arrays are reported as "name[0]"; every element gets a handle, and the
+    // first one is reachable by the plain name as well
+    std::string uniformName( name.data(), nameLength );
+    std::string baseName = uniformName;
+    if ( baseName.size() > 3 && baseName.compare( baseName.size() - 3, 3, "[0]" ) == 0 )
+    {
+      baseName.resize( baseName.size() - 3 );
+      shader->mUniformHandles[ baseName ] = (int) shader->mUniforms.size();
+    }
+    for ( GLint j = 0; j < arraySize; j++ )
+    {
+      Shader::Uniform uniform;
+      uniform.mLocation = location + j;
+      uniform.mTextureUnit = -1;
+      uniform.mValueSet = false;
+      memset( uniform.mValue, 0, sizeof( uniform.mValue ) );
+
+      if ( IsSamplerType( type ) )
+      {
+        if ( nextTextureUnit < textureUnitCount )
+        {
+          uniform.mTextureUnit = nextTextureUnit++;
+          glProgramUniform1i( shader->mProgram, uniform.mLocation, uniform.mTextureUnit );
+        }
+        else
+        {
+          printf( "[Renderer] Out of texture units for sampler '%s'\n", uniformName.c_str() );
+        }
+      }
+
+      if ( j > 0 )
+      {
+        uniformName = baseName + "[" + std::to_string( j ) + "]";
+      }
+      shader->mUniformHandles[ uniformName ] = (int) shader->mUniforms.size();
+      shader->mUniforms.push_back( uniform );
+    }
+  }
+
   return shader;
 }
 
 void ReleaseShader( Shader * _shader )
 {
+  if ( renderState.mProgram == _shader->mProgram )
+  {
+    renderState.mProgram = UNKNOWN_STATE;
+  }
   glDeleteShader( _shader->mVertexShader );
   glDeleteShader( _shader->mFragmentShader );
   glDeleteProgram( _shader->mProgram );
 }
 
-void Shader::SetConstant( const char * szConstName, bool x )
+int Shader::GetUniform( const char * szConstName ) const
 {
-  GLint location = glGetUniformLocation( mProgram, szConstName );
-  if ( location != -1 )
+  std::unordered_map<std::string, int>::const_iterator it = mUniformHandles.find( szConstName );
+  return it != mUniformHandles.end() ? it->second : -1;
+}
+
+bool Shader::UpdateUniform( int _uniform, const void * _value, unsigned int _size )
+{
+  if ( _uniform < 0 || _uniform >= (int) mUniforms.size() )
   {
-    glProgramUniform1i( mProgram, location, x ? 1 : 0 );
+    return false;
   }
+
+  Uniform & uniform = mUniforms[ _uniform ];
+  if ( uniform.mValueSet && memcmp( uniform.mValue, _value, _size ) == 0 )
+  {
+    return false;
+  }
+  memcpy( uniform.mValue, _value, _size );
+  uniform.mValueSet = true;
+  return true;
 }
 
-void Shader::SetConstant( const char * szConstName, uint32_t x )
+void Shader::SetConstant( int _uniform, bool x )
 {
-  GLint location = glGetUniformLocation( mProgram, szConstName );
-  if ( location != -1 )
+  const GLint value = x ? 1 : 0;
+  if ( UpdateUniform( _uniform, &value, sizeof( value ) ) )
   {
-    glProgramUniform1ui( mProgram, location, x );
+    glProgramUniform1i( mProgram, mUniforms[ _uniform ].mLocation, value );
   }
 }
 
-void Shader::SetConstant( const char * szConstName, float x )
+void Shader::SetConstant( int _uniform, uint32_t x )
 {
-  GLint location = glGetUniformLocation( mProgram, szConstName );
-  if ( location != -1 )
+  if ( UpdateUniform( _uniform, &x, sizeof( x ) ) )
   {
-    glProgramUniform1f( mProgram, location, x );
+    glProgramUniform1ui( mProgram, mUniforms[ _uniform ].mLocation, x );
   }
 }
 
-void Shader::SetConstant( const char * szConstName, float x, float y )
+void Shader::SetConstant( int _uniform, float x )
 {
-  GLint location = glGetUniformLocation( mProgram, szConstName );
-  if ( location != -1 )
+  if ( UpdateUniform( _uniform, &x, sizeof( x ) ) )
   {
-    glProgramUniform2f( mProgram, location, x, y );
+    glProgramUniform1f( mProgram, mUniforms[ _uniform ].mLocation, x );
   }
 }
 
-void Shader::SetConstant( const char * szConstName, const glm::vec3 & vector )
+void Shader::SetConstant( int _uniform, float x, float y )
 {
-  GLint location = glGetUniformLocation( mProgram, szConstName );
-  if ( location != -1 )
+  const float value[ 2 ] = { x, y };
+  if ( UpdateUniform( _uniform, value, sizeof( value ) ) )
   {
-    glProgramUniform3f( mProgram, location, vector.x, vector.y, vector.z );
+    glProgramUniform2f( mProgram, mUniforms[ _uniform ].mLocation, x, y );
   }
 }
 
-void Shader::SetConstant( const char * szConstName, const glm::vec4 & vector )
+void Shader::SetConstant( int _uniform, const glm::vec3 & vector )
 {
-  GLint location = glGetUniformLocation( mProgram, szConstName );
-  if ( location != -1 )
+  if ( UpdateUniform( _uniform, &vector, sizeof( vector ) ) )
   {
-    glProgramUniform4f( mProgram, location, vector.x, vector.y, vector.z, vector.w );
+    glProgramUniform3f( mProgram, mUniforms[ _uniform ].mLocation, vector.x, vector.y, vector.z );
   }
 }
 
-void Shader::SetConstant( const char * szConstName, const glm::mat4x4 & matrix )
+void Shader::SetConstant( int _uniform, const glm::vec4 & vector )
 {
-  GLint location = glGetUniformLocation( mProgram, szConstName );
-  if ( location != -1 )
+  if ( UpdateUniform( _uniform, &vector, sizeof( vector ) ) )
   {
-    glProgramUniformMatrix4fv( mProgram, location, 1, 0, (float*)&matrix );
+    glProgramUniform4f( mProgram, mUniforms[ _uniform ].mLocation, vector.x, vector.y, vector.z, vector.w );
   }
 }
 
-void Shader::SetTexture( const char * szTextureName, Texture * tex )
+void Shader::SetConstant( int _uniform, const glm::mat4x4 & matrix )
 {
-  if ( !tex )
-    return;
-
-  GLint location = glGetUniformLocation( mProgram, szTextureName );
-  if ( location != -1 )
+  if ( UpdateUniform( _uniform, &matrix, sizeof( matrix ) ) )
   {
-    glProgramUniform1i( mProgram, location, ( (Texture *) tex )->mGLTextureUnit );
-    glActiveTexture( GL_TEXTURE0 + ( (Texture *) tex )->mGLTextureUnit );
-    switch ( tex->mType )
-    {
-      case TEXTURETYPE_1D: glBindTexture( GL_TEXTURE_1D, ( (Texture *) tex )->mGLTextureID ); break;
-      case TEXTURETYPE_2D: glBindTexture( GL_TEXTURE_2D, ( (Texture *) tex )->mGLTextureID ); break;
-    }
+    glProgramUniformMatrix4fv( mProgram, mUniforms[ _uniform ].mLocation, 1, 0, (float*)&matrix );
   }
 }
 
-int textureUnit = 0;
+void Shader::SetTexture( int _uniform, Texture * tex )
+{
+  if ( !tex || _uniform < 0 || _uniform >= (int) mUniforms.size() || mUniforms[ _uniform ].mTextureUnit < 0 )
+    return;
+
+  BindTexture( mUniforms[ _uniform ].mTextureUnit, tex );
+}
 
-Texture * CreateRGBA8TextureFromFile( const char * szFilename, const bool _loadAsSRGB /*= false*/ )
+// Decoded pixels are kept on the texture until UploadTexture() is called;
+// the pixel buffer always comes from STBI_MALLOC, like stb_image's own.
+Texture * CreateStagedTexture( void * data, int width, int height, bool isFloat, const bool _loadAsSRGB )
 {
-  int comp = 0;
-  int width = 0;
-  int height = 0;
-  void * data = NULL;
-  GLenum internalFormat = _loadAsSRGB ? GL_SRGB8_ALPHA8 : GL_RGBA8;
-  GLenum srcFormat = GL_RGBA;
-  GLenum format = GL_UNSIGNED_BYTE;
   bool hasTransparentPixels = false;
-  if ( stbi_is_hdr( szFilename ) )
+  if ( isFloat )
   {
-    internalFormat = GL_RGBA32F;
-    format = GL_FLOAT;
-    data = stbi_loadf( szFilename, &width, &height, &comp, STBI_rgb_alpha );
-    if (!data) return NULL;
-    float* bytes = (float*)data;
-    for (int i = 3; i < width * height * 4; i += 4)
+    float * bytes = (float *) data;
+    for ( int i = 3; i < width * height * 4; i += 4 )
     {
-      if (bytes[i] != 1.0f)
+      if ( bytes[ i ] != 1.0f )
       {
         hasTransparentPixels = true;
         break;
@@ -417,12 +881,10 @@ Texture * CreateRGBA8TextureFromFile( const char * szFilename, const bool _loadA
   }
   else
   {
-    data = stbi_load( szFilename, &width, &height, &comp, STBI_rgb_alpha );
-    if (!data) return NULL;
-    unsigned char* bytes = (unsigned char*)data;
-    for(int i = 3 ; i < width * height * 4; i += 4)
+    unsigned char * bytes = (unsigned char *) data;
+    for ( int i = 3; i < width * height * 4; i += 4 )
     {
-      if (bytes[i] != 0xFF)
+      if ( bytes[ i ] != 0xFF )
       {
         hasTransparentPixels = true;
         break;
@@ -430,138 +892,198 @@ Texture * CreateRGBA8TextureFromFile( const char * szFilename, const bool _loadA
     }
   }
 
-  GLuint glTexId = 0;
-  glGenTextures( 1, &glTexId );
-  glBindTexture( GL_TEXTURE_2D, glTexId );
-
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR );
-
-  glTexImage2D( GL_TEXTURE_2D, 0, internalFormat, width, height, 0, srcFormat, format, data );
-  glGenerateMipmap( GL_TEXTURE_2D );
-
-  stbi_image_free( data );
-
   Texture * tex = new Texture();
   tex->mWidth = width;
   tex->mHeight = height;
   tex->mType = TEXTURETYPE_2D;
-  tex->mFilename = szFilename;
-  tex->mGLTextureID = glTexId;
-  tex->mGLTextureUnit = textureUnit++;
+  tex->mGLTextureID = 0;
   tex->mTransparent = hasTransparentPixels;
   tex->mSRGB = _loadAsSRGB;
   tex->mRefCount = 1;
+  tex->mStagingData = data;
+  tex->mStagingFloat = isFloat;
   return tex;
 }
 
-Texture * CreateRGBA8TextureFromMemory( const unsigned char * pMemory, unsigned int nMemorySize, const bool _loadAsSRGB /*= false */ )
+//////////////////////////////////////////////////////////////////////////
+// File texture cache
+//
+// Textures loaded from files are shared by resolved path and sRGB flag; every
+// lookup that finds one adds a reference, ReleaseTexture() drops it again.
+// The mutex also guards the reference counts, since staging runs on workers.
+
+std::mutex textureCacheMutex;
+std::unordered_map<std::string, Texture *> textureCache;
+
+std::string GetTextureCacheKey( const char * szFilename, const bool _loadAsSRGB )
 {
-  int comp = 0;
-  int width = 0;
-  int height = 0;
-  void * data = NULL;
-  GLenum internalFormat = _loadAsSRGB ? GL_SRGB8_ALPHA8 : GL_RGBA8;
-  GLenum srcFormat = GL_RGBA;
-  GLenum format = GL_UNSIGNED_BYTE;
-  bool hasTransparentPixels = false;
-  if ( stbi_is_hdr_from_memory( pMemory, nMemorySize ) )
+  return std::string( szFilename ) + ( _loadAsSRGB ? "|srgb" : "|linear" );
+}
+
+unsigned int GetTextureSize( const Texture * tex )
+{
+  return tex->mWidth * tex->mHeight * ( tex->mStagingFloat ? sizeof( float ) * 4 : sizeof( unsigned int ) );
+}
+
+void AddTextureRef( Texture * tex )
+{
+  std::lock_guard<std::mutex> lock( textureCacheMutex );
+  tex->mRefCount++;
+}
+
+Texture * StageRGBA8TextureFromFile( const char * szFilename, const bool _loadAsSRGB /*= false*/, bool * _cacheHit /*= NULL*/ )
+{
+  const std::string cacheKey = GetTextureCacheKey( szFilename, _loadAsSRGB );
+  if ( _cacheHit )
   {
-    internalFormat = GL_RGBA32F;
-    format = GL_FLOAT;
-    data = stbi_loadf_from_memory( pMemory, nMemorySize, &width, &height, &comp, STBI_rgb_alpha );
-    if ( !data ) return NULL;
-    float * bytes = (float *) data;
-    for ( int i = 3; i < width * height * 4; i += 4 )
+    *_cacheHit = false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock( textureCacheMutex );
+    std::unordered_map<std::string, Texture *>::iterator it = textureCache.find( cacheKey );
+    if ( it != textureCache.end() )
     {
-      if ( bytes[ i ] != 1.0f )
+      it->second->mRefCount++;
+      if ( _cacheHit )
       {
-        hasTransparentPixels = true;
-        break;
+        *_cacheHit = true;
       }
+      return it->second;
     }
   }
+
+  int comp = 0;
+  int width = 0;
+  int height = 0;
+  void * data = NULL;
+  bool isFloat = false;
+  if ( stbi_is_hdr( szFilename ) )
+  {
+    isFloat = true;
+    data = stbi_loadf( szFilename, &width, &height, &comp, STBI_rgb_alpha );
+  }
   else
   {
-    data = stbi_load_from_memory( pMemory, nMemorySize, &width, &height, &comp, STBI_rgb_alpha );
-    if ( !data ) return NULL;
-    unsigned char * bytes = (unsigned char *) data;
-    for ( int i = 3; i < width * height * 4; i += 4 )
+    data = stbi_load( szFilename, &width, &height, &comp, STBI_rgb_alpha );
+  }
+  if ( !data )
+  {
+    return NULL;
+  }
+
+  Texture * tex = CreateStagedTexture( data, width, height, isFloat, _loadAsSRGB );
+  tex->mFilename = szFilename;
+
+  std::lock_guard<std::mutex> lock( textureCacheMutex );
+  std::unordered_map<std::string, Texture *>::iterator it = textureCache.find( cacheKey );
+  if ( it != textureCache.end() )
+  {
+    // Another thread decoded the same file in the meantime
+    stbi_image_free( tex->mStagingData );
+    delete tex;
+    it->second->mRefCount++;
+    if ( _cacheHit )
     {
-      if ( bytes[ i ] != 0xFF )
-      {
-        hasTransparentPixels = true;
-        break;
-      }
+      *_cacheHit = true;
     }
+    return it->second;
   }
+  tex->mCacheKey = cacheKey;
+  textureCache.insert( { cacheKey, tex } );
+  return tex;
+}
 
-  GLuint glTexId = 0;
-  glGenTextures( 1, &glTexId );
-  glBindTexture( GL_TEXTURE_2D, glTexId );
-
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+Texture * StageRGBA8TextureFromMemory( const unsigned char * pMemory, unsigned int nMemorySize, const bool _loadAsSRGB /*= false */ )
+{
+  int comp = 0;
+  int width = 0;
+  int height = 0;
+  void * data = NULL;
+  bool isFloat = false;
+  if ( stbi_is_hdr_from_memory( pMemory, nMemorySize ) )
+  {
+    isFloat = true;
+    data = stbi_loadf_from_memory( pMemory, nMemorySize, &width, &height, &comp, STBI_rgb_alpha );
+  }
+  else
+  {
+    data = stbi_load_from_memory( pMemory, nMemorySize, &width, &height, &comp, STBI_rgb_alpha );
+  }
+  if ( !data )
+  {
+    return NULL;
+  }
 
-  glTexImage2D( GL_TEXTURE_2D, 0, internalFormat, width, height, 0, srcFormat, format, data );
-  glGenerateMipmap( GL_TEXTURE_2D );
+  return CreateStagedTexture( data, width, height, isFloat, _loadAsSRGB );
+}
 
-  stbi_image_free( data );
+Texture * StageRGBA8TextureFromRawData( const unsigned int * pRGBA, unsigned int nWidth, unsigned int nHeight, const bool _loadAsSRGB /*= false */ )
+{
+  void * data = STBI_MALLOC( nWidth * nHeight * sizeof( unsigned int ) );
+  if ( !data )
+  {
+    return NULL;
+  }
+  memcpy( data, pRGBA, nWidth * nHeight * sizeof( unsigned int ) );
 
-  Texture * tex = new Texture();
-  tex->mWidth = width;
-  tex->mHeight = height;
-  tex->mType = TEXTURETYPE_2D;
-  tex->mGLTextureID = glTexId;
-  tex->mGLTextureUnit = textureUnit++;
-  tex->mTransparent = hasTransparentPixels;
-  tex->mSRGB = _loadAsSRGB;
-  tex->mRefCount = 1;
-  return tex;
+  return CreateStagedTexture( data, nWidth, nHeight, false, _loadAsSRGB );
 }
 
-Texture * CreateRGBA8TextureFromRawData( const unsigned int * pRGBA, unsigned int nWidth, unsigned int nHeight, const bool _loadAsSRGB /*= false */ )
+bool UploadTexture( Texture * tex )
 {
-  GLenum internalFormat = _loadAsSRGB ? GL_SRGB8_ALPHA8 : GL_RGBA8;
+  if ( !tex || !tex->mStagingData )
+  {
+    return tex != NULL;
+  }
+
+  GLenum internalFormat = tex->mSRGB ? GL_SRGB8_ALPHA8 : GL_RGBA8;
   GLenum srcFormat = GL_RGBA;
   GLenum format = GL_UNSIGNED_BYTE;
-
-  bool hasTransparentPixels = false;
-  unsigned char * bytes = (unsigned char *) pRGBA;
-  for ( int i = 3; i < nWidth * nHeight * 4; i += 4 )
+  if ( tex->mStagingFloat )
   {
-    if ( bytes[ i ] != 0xFF )
-    {
-      hasTransparentPixels = true;
-      break;
-    }
+    internalFormat = GL_RGBA32F;
+    format = GL_FLOAT;
   }
 
   GLuint glTexId = 0;
   glGenTextures( 1, &glTexId );
   glBindTexture( GL_TEXTURE_2D, glTexId );
+  InvalidateTextureBindings();
 
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR );
 
-  glTexImage2D( GL_TEXTURE_2D, 0, internalFormat, nWidth, nHeight, 0, srcFormat, format, pRGBA );
+  glTexImage2D( GL_TEXTURE_2D, 0, internalFormat, tex->mWidth, tex->mHeight, 0, srcFormat, format, tex->mStagingData );
   glGenerateMipmap( GL_TEXTURE_2D );
 
-  Texture * tex = new Texture();
-  tex->mWidth = nWidth;
-  tex->mHeight = nHeight;
-  tex->mType = TEXTURETYPE_2D;
+  stbi_image_free( tex->mStagingData );
+  tex->mStagingData = NULL;
+
   tex->mGLTextureID = glTexId;
-  tex->mGLTextureUnit = textureUnit++;
-  tex->mTransparent = hasTransparentPixels;
-  tex->mSRGB = _loadAsSRGB;
-  tex->mRefCount = 1;
+  return true;
+}
+
+Texture * CreateRGBA8TextureFromFile( const char * szFilename, const bool _loadAsSRGB /*= false*/ )
+{
+  Texture * tex = StageRGBA8TextureFromFile( szFilename, _loadAsSRGB );
+  UploadTexture( tex );
+  return tex;
+}
+
+Texture * CreateRGBA8TextureFromMemory( const unsigned char * pMemory, unsigned int nMemorySize, const bool _loadAsSRGB /*= false */ )
+{
+  Texture * tex = StageRGBA8TextureFromMemory( pMemory, nMemorySize, _loadAsSRGB );
+  UploadTexture( tex );
+  return tex;
+}
+
+Texture * CreateRGBA8TextureFromRawData( const unsigned int * pRGBA, unsigned int nWidth, unsigned int nHeight, const bool _loadAsSRGB /*= false */ )
+{
+  Texture * tex = StageRGBA8TextureFromRawData( pRGBA, nWidth, nHeight, _loadAsSRGB );
+  UploadTexture( tex );
   return tex;
 }
 
@@ -593,6 +1115,7 @@ Texture * CreateRG32FTextureFromRawFile( const char * szFilename, int width, int
   GLuint glTexId = 0;
   glGenTextures( 1, &glTexId );
   glBindTexture( GL_TEXTURE_2D, glTexId );
+  InvalidateTextureBindings();
 
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP );
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP );
@@ -609,31 +1132,374 @@ Texture * CreateRG32FTextureFromRawFile( const char * szFilename, int width, int
   tex->mType = Renderer::TEXTURETYPE_2D;
   tex->mFilename = szFilename;
   tex->mGLTextureID = glTexId;
-  tex->mGLTextureUnit = textureUnit++;
+  tex->mTransparent = false;
+  tex->mSRGB = false;
   tex->mRefCount = 1;
+  tex->mStagingData = NULL;
+  tex->mStagingFloat = true;
   return tex;
 }
 
 void ReleaseTexture( Texture *& tex )
 {
-  tex->mRefCount--;
-  if ( tex->mRefCount == 0 )
   {
+    std::lock_guard<std::mutex> lock( textureCacheMutex );
+    tex->mRefCount--;
+    if ( tex->mRefCount > 0 )
+    {
+      return;
+    }
+    if ( !tex->mCacheKey.empty() )
+    {
+      textureCache.erase( tex->mCacheKey );
+    }
+  }
+
+  if ( tex->mGLTextureID )
+  {
+    // Deleting unbinds the texture, and the name may be reused
+    for ( int i = 0; i < MAX_TEXTURE_UNITS; i++ )
+    {
+      if ( boundTextures[ i ].mTextureID == tex->mGLTextureID )
+      {
+        boundTextures[ i ].mTarget = 0;
+        boundTextures[ i ].mTextureID = 0;
+      }
+    }
     glDeleteTextures( 1, &( (Texture *) tex )->mGLTextureID );
-    delete tex;
-    tex = NULL;
   }
+  if ( tex->mStagingData )
+  {
+    stbi_image_free( tex->mStagingData );
+  }
+  delete tex;
+  tex = NULL;
 }
 
 void SetShader( Shader * _shader )
 {
-  glUseProgram( _shader->mProgram );
+  if ( UpdateState( renderState.mProgram, _shader->mProgram ) )
+  {
+    glUseProgram( _shader->mProgram );
+  }
+}
+
+void SetEnabled( unsigned int _capability, bool _enabled )
+{
+  int index = -1;
+  for ( int i = 0; i < STATE_CAPABILITY_COUNT; i++ )
+  {
+    if ( STATE_CAPABILITIES[ i ] == _capability )
+    {
+      index = i;
+      break;
+    }
+  }
+
+  if ( index < 0 )
+  {
+    // Not shadowed, always issued
+    renderStateStats.mIssued++;
+  }
+  else if ( !UpdateState( renderState.mEnabled[ index ], _enabled ? 1 : 0 ) )
+  {
+    return;
+  }
+
+  if ( _enabled )
+  {
+    glEnable( _capability );
+  }
+  else
+  {
+    glDisable( _capability );
+  }
+}
+
+void SetBlendFunc( unsigned int _source, unsigned int _destination )
+{
+  // Both factors are shadowed as one state
+  if ( renderState.mBlendSource == _source && renderState.mBlendDestination == _destination )
+  {
+    renderStateStats.mFiltered++;
+    return;
+  }
+  renderState.mBlendSource = _source;
+  renderState.mBlendDestination = _destination;
+  renderStateStats.mIssued++;
+  glBlendFunc( _source, _destination );
+}
+
+void SetCullFace( unsigned int _mode )
+{
+  if ( UpdateState( renderState.mCullFace, _mode ) )
+  {
+    glCullFace( _mode );
+  }
+}
+
+void SetDepthMask( bool _write )
+{
+  if ( UpdateState( renderState.mDepthMask, _write ? 1 : 0 ) )
+  {
+    glDepthMask( _write ? GL_TRUE : GL_FALSE );
+  }
+}
+
+void SetDepthFunc( unsigned int _function )
+{
+  if ( UpdateState( renderState.mDepthFunc, _function ) )
+  {
+    glDepthFunc( _function );
+  }
+}
+
+void SetPolygonMode( unsigned int _mode )
+{
+  if ( UpdateState( renderState.mPolygonMode, _mode ) )
+  {
+    glPolygonMode( GL_FRONT_AND_BACK, _mode );
+  }
+}
+
+void BindVertexArray( unsigned int _vertexArray )
+{
+  if ( UpdateState( renderState.mVertexArray, _vertexArray ) )
+  {
+    glBindVertexArray( _vertexArray );
+  }
+}
+
+void BindUniformBuffer( unsigned int _bindingPoint, unsigned int _buffer, size_t _offset /*= 0*/, size_t _size /*= 0*/ )
+{
+  if ( _bindingPoint >= MAX_UNIFORM_BUFFER_BINDINGS )
+  {
+    return;
+  }
+
+  UniformBufferBinding & binding = renderState.mUniformBuffers[ _bindingPoint ];
+  if ( binding.mBuffer == _buffer && binding.mOffset == _offset && binding.mSize == _size )
+  {
+    renderStateStats.mFiltered++;
+    return;
+  }
+  binding.mBuffer = _buffer;
+  binding.mOffset = _offset;
+  binding.mSize = _size;
+  renderStateStats.mIssued++;
+
+  if ( _size )
+  {
+    glBindBufferRange( GL_UNIFORM_BUFFER, _bindingPoint, _buffer, (GLintptr) _offset, (GLsizeiptr) _size );
+  }
+  else
+  {
+    glBindBufferBase( GL_UNIFORM_BUFFER, _bindingPoint, _buffer );
+  }
+}
+
+void InvalidateRenderState()
+{
+  for ( int i = 0; i < STATE_CAPABILITY_COUNT; i++ )
+  {
+    renderState.mEnabled[ i ] = UNKNOWN_STATE;
+  }
+  renderState.mBlendSource = UNKNOWN_STATE;
+  renderState.mBlendDestination = UNKNOWN_STATE;
+  renderState.mCullFace = UNKNOWN_STATE;
+  renderState.mDepthMask = UNKNOWN_STATE;
+  renderState.mDepthFunc = UNKNOWN_STATE;
+  renderState.mPolygonMode = UNKNOWN_STATE;
+  renderState.mProgram = UNKNOWN_STATE;
+  renderState.mVertexArray = UNKNOWN_STATE;
+  for ( int i = 0; i < MAX_UNIFORM_BUFFER_BINDINGS; i++ )
+  {
+    renderState.mUniformBuffers[ i ].mBuffer = UNKNOWN_STATE;
+  }
+}
+
+const RenderStateStats & GetRenderStateStats()
+{
+  return lastFrameRenderStateStats;
+}
+
+void BindTexture( int _unit, Texture * tex )
+{
+  if ( _unit < 0 || _unit >= MAX_TEXTURE_UNITS )
+  {
+    return;
+  }
+
+  const GLenum target = tex->mType == TEXTURETYPE_1D ? GL_TEXTURE_1D : GL_TEXTURE_2D;
+  TextureBinding & binding = boundTextures[ _unit ];
+  if ( binding.mTarget == target && binding.mTextureID == tex->mGLTextureID )
+  {
+    textureBindStats.mSkipped++;
+    return;
+  }
+
+  if ( activeTextureUnit != _unit )
+  {
+    glActiveTexture( GL_TEXTURE0 + _unit );
+    activeTextureUnit = _unit;
+  }
+  glBindTexture( target, tex->mGLTextureID );
+  binding.mTarget = target;
+  binding.mTextureID = tex->mGLTextureID;
+  textureBindStats.mIssued++;
+}
+
+void InvalidateTextureBindings()
+{
+  for ( int i = 0; i < MAX_TEXTURE_UNITS; i++ )
+  {
+    boundTextures[ i ].mTarget = 0;
+    boundTextures[ i ].mTextureID = 0;
+  }
+  activeTextureUnit = -1;
+}
+
+const TextureBindStats & GetTextureBindStats()
+{
+  return lastFrameTextureBindStats;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Weighted blended transparency
+
+void CreateTransparencyTarget( Texture & _texture, GLenum _internalFormat, GLenum _format, GLenum _type, int _width, int _height )
+{
+  _texture.mWidth = _width;
+  _texture.mHeight = _height;
+  _texture.mType = TEXTURETYPE_2D;
+  glGenTextures( 1, &_texture.mGLTextureID );
+  BindTexture( 0, &_texture );
+  glTexImage2D( GL_TEXTURE_2D, 0, _internalFormat, _width, _height, 0, _format, _type, NULL );
+  // Only read with texelFetch, but without mips the texture has to be complete with these
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+}
+
+bool CreateTransparencyTargets( int _width, int _height )
+{
+  CreateTransparencyTarget( transparencyAccumulation, GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT, _width, _height );
+  CreateTransparencyTarget( transparencyRevealage, GL_R8, GL_RED, GL_UNSIGNED_BYTE, _width, _height );
+
+  // Same format as the window and offscreen depth buffers, so it can be blitted
+  glGenRenderbuffers( 1, &transparencyDepthBuffer );
+  glBindRenderbuffer( GL_RENDERBUFFER, transparencyDepthBuffer );
+  glRenderbufferStorage( GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, _width, _height );
+  glBindRenderbuffer( GL_RENDERBUFFER, 0 );
+
+  glGenFramebuffers( 1, &transparencyFramebuffer );
+  glBindFramebuffer( GL_FRAMEBUFFER, transparencyFramebuffer );
+  glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, transparencyAccumulation.mGLTextureID, 0 );
+  glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, transparencyRevealage.mGLTextureID, 0 );
+  glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, transparencyDepthBuffer );
+  const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+  glDrawBuffers( 2, drawBuffers );
+  const bool complete = glCheckFramebufferStatus( GL_FRAMEBUFFER ) == GL_FRAMEBUFFER_COMPLETE;
+  glBindFramebuffer( GL_FRAMEBUFFER, transparencyTargetFramebuffer );
+  if ( !complete )
+  {
+    printf( "[Renderer] Transparency framebuffer is incomplete\n" );
+    ReleaseTransparencyTargets();
+    return false;
+  }
+
+  transparencyWidth = _width;
+  transparencyHeight = _height;
+  return true;
+}
+
+bool BeginTransparencyAccumulation()
+{
+  GLint * viewport = transparencyTargetViewport;
+  glGetIntegerv( GL_VIEWPORT, viewport );
+  glGetIntegerv( GL_DRAW_FRAMEBUFFER_BINDING, &transparencyTargetFramebuffer );
+
+  if ( transparencyFramebuffer && ( transparencyWidth != viewport[ 2 ] || transparencyHeight != viewport[ 3 ] ) )
+  {
+    ReleaseTransparencyTargets();
+  }
+  if ( !transparencyFramebuffer && !CreateTransparencyTargets( viewport[ 2 ], viewport[ 3 ] ) )
+  {
+    return false;
+  }
+
+  // A multisampled source is resolved by the blit
+  glBindFramebuffer( GL_READ_FRAMEBUFFER, transparencyTargetFramebuffer );
+  glBindFramebuffer( GL_DRAW_FRAMEBUFFER, transparencyFramebuffer );
+  glBlitFramebuffer( viewport[ 0 ], viewport[ 1 ], viewport[ 0 ] + viewport[ 2 ], viewport[ 1 ] + viewport[ 3 ], 0, 0, transparencyWidth, transparencyHeight, GL_DEPTH_BUFFER_BIT, GL_NEAREST );
+  glBindFramebuffer( GL_FRAMEBUFFER, transparencyFramebuffer );
+  glViewport( 0, 0, transparencyWidth, transparencyHeight );
+
+  const GLfloat clearAccumulation[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+  const GLfloat clearRevealage[] = { 1.0f, 0.0f, 0.0f, 0.0f };
+  glClearBufferfv( GL_COLOR, 0, clearAccumulation );
+  glClearBufferfv( GL_COLOR, 1, clearRevealage );
+
+  // Colors add up, revealage multiplies by 1 - alpha; per-target blend
+  // factors aren't shadowed, so the next SetBlendFunc() is always issued
+  SetEnabled( GL_BLEND, true );
+  glBlendFunci( 0, GL_ONE, GL_ONE );
+  glBlendFunci( 1, GL_ZERO, GL_ONE_MINUS_SRC_COLOR );
+  renderState.mBlendSource = UNKNOWN_STATE;
+  renderState.mBlendDestination = UNKNOWN_STATE;
+  SetDepthMask( false );
+  return true;
+}
+
+void CompositeTransparency( Shader * _compositeShader )
+{
+  glBindFramebuffer( GL_FRAMEBUFFER, transparencyTargetFramebuffer );
+  glViewport( transparencyTargetViewport[ 0 ], transparencyTargetViewport[ 1 ], transparencyTargetViewport[ 2 ], transparencyTargetViewport[ 3 ] );
+
+  if ( !transparencyVertexArray )
+  {
+    glGenVertexArrays( 1, &transparencyVertexArray );
+  }
+
+  // The composite's samplers take units that the caller's shader may still
+  // rely on, so whatever was bound there is put back afterwards
+  TextureBinding savedBindings[ MAX_TEXTURE_UNITS ];
+  memcpy( savedBindings, boundTextures, sizeof( boundTextures ) );
+
+  // The composited color has the average color of the layers over the
+  // background times the total revealage
+  SetBlendFunc( GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA );
+  SetEnabled( GL_DEPTH_TEST, false );
+
+  // The fullscreen triangle has to be filled even inside the wireframe pass
+  const unsigned int savedPolygonMode = renderState.mPolygonMode;
+  SetPolygonMode( GL_FILL );
+
+  SetShader( _compositeShader );
+  _compositeShader->SetTexture( "tex_accumulation", &transparencyAccumulation );
+  _compositeShader->SetTexture( "tex_revealage", &transparencyRevealage );
+  BindVertexArray( transparencyVertexArray );
+  glDrawArrays( GL_TRIANGLES, 0, 3 );
+  SetEnabled( GL_DEPTH_TEST, true );
+  if ( savedPolygonMode != UNKNOWN_STATE )
+  {
+    SetPolygonMode( savedPolygonMode );
+  }
+
+  for ( int i = 0; i < MAX_TEXTURE_UNITS; i++ )
+  {
+    if ( savedBindings[ i ].mTarget && ( boundTextures[ i ].mTarget != savedBindings[ i ].mTarget || boundTextures[ i ].mTextureID != savedBindings[ i ].mTextureID ) )
+    {
+      glActiveTexture( GL_TEXTURE0 + i );
+      activeTextureUnit = i;
+      glBindTexture( savedBindings[ i ].mTarget, savedBindings[ i ].mTextureID );
+      boundTextures[ i ] = savedBindings[ i ];
+    }
+  }
 }
 
 void CopyBackbufferToTexture( Texture * tex )
 {
-  glActiveTexture( GL_TEXTURE0 + ( (Texture *) tex )->mGLTextureUnit );
-  glBindTexture( GL_TEXTURE_2D, ( (Texture *) tex )->mGLTextureID );
+  BindTexture( 0, tex );
   glCopyTexImage2D( GL_TEXTURE_2D, 0, GL_RGB, 0, 0, nWidth, nHeight, 0 );
 }
 
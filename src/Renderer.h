@@ -2,6 +2,8 @@
 #include "GLFW/glfw3.h"
 
 #include <string>
+#include <vector>
+#include <unordered_map>
 #include <glm.hpp>
 
 typedef enum
@@ -28,6 +30,13 @@ enum TEXTURETYPE
   TEXTURETYPE_2D = 2,
 };
 
+// Binding points of the uniform blocks; CreateShader() assigns blocks by name
+enum UNIFORMBLOCK
+{
+  UNIFORMBLOCK_FRAME = 0,    // "FrameConstants"
+  UNIFORMBLOCK_MATERIAL = 1, // "MaterialConstants"
+};
+
 struct Texture
 {
   int mWidth;
@@ -35,25 +44,56 @@ struct Texture
   TEXTURETYPE mType;
   std::string mFilename;
   unsigned int mGLTextureID;
-  int mGLTextureUnit;
   bool mTransparent;
   bool mSRGB;
   int mRefCount;
+  void * mStagingData; // decoded pixels waiting for UploadTexture(), NULL once on the GPU
+  bool mStagingFloat;
+  std::string mCacheKey; // empty if the texture isn't in the file texture cache
 };
 
+// Uniform locations are enumerated once after linking; the Set* functions take
+// either a name or a handle from GetUniform(), and skip the GL call if the
+// uniform already holds the value. Samplers are assigned texture units
+// 0..n-1 in declaration order, so SetTexture only has to bind.
 struct Shader
 {
+  struct Uniform
+  {
+    int mLocation;
+    int mTextureUnit; // samplers get a fixed unit when the shader is linked, -1 otherwise
+    bool mValueSet;
+    unsigned char mValue[ sizeof( glm::mat4x4 ) ];
+  };
+
   unsigned int mProgram;
   unsigned int mVertexShader;
   unsigned int mFragmentShader;
-  void SetConstant( const char * szConstName, bool x );
-  void SetConstant( const char * szConstName, uint32_t x );
-  void SetConstant( const char * szConstName, float x );
-  void SetConstant( const char * szConstName, float x, float y );
-  void SetConstant( const char * szConstName, const glm::vec3 & vector );
-  void SetConstant( const char * szConstName, const glm::vec4 & vector );
-  void SetConstant( const char * szConstName, const glm::mat4x4 & matrix );
-  void SetTexture( const char * szTextureName, Texture * tex );
+  std::vector<Uniform> mUniforms;
+  std::unordered_map<std::string, int> mUniformHandles;
+
+  int GetUniform( const char * szConstName ) const; // -1 if the uniform isn't active
+
+  void SetConstant( const char * szConstName, bool x ) { SetConstant( GetUniform( szConstName ), x ); }
+  void SetConstant( const char * szConstName, uint32_t x ) { SetConstant( GetUniform( szConstName ), x ); }
+  void SetConstant( const char * szConstName, float x ) { SetConstant( GetUniform( szConstName ), x ); }
+  void SetConstant( const char * szConstName, float x, float y ) { SetConstant( GetUniform( szConstName ), x, y ); }
+  void SetConstant( const char * szConstName, const glm::vec3 & vector ) { SetConstant( GetUniform( szConstName ), vector ); }
+  void SetConstant( const char * szConstName, const glm::vec4 & vector ) { SetConstant( GetUniform( szConstName ), vector ); }
+  void SetConstant( const char * szConstName, const glm::mat4x4 & matrix ) { SetConstant( GetUniform( szConstName ), matrix ); }
+  void SetTexture( const char * szTextureName, Texture * tex ) { SetTexture( GetUniform( szTextureName ), tex ); }
+
+  void SetConstant( int _uniform, bool x );
+  void SetConstant( int _uniform, uint32_t x );
+  void SetConstant( int _uniform, float x );
+  void SetConstant( int _uniform, float x, float y );
+  void SetConstant( int _uniform, const glm::vec3 & vector );
+  void SetConstant( int _uniform, const glm::vec4 & vector );
+  void SetConstant( int _uniform, const glm::mat4x4 & matrix );
+  void SetTexture( int _uniform, Texture * tex );
+
+private:
+  bool UpdateUniform( int _uniform, const void * _value, unsigned int _size );
 };
 
 extern const char * defaultShaderFilename;
@@ -65,6 +105,11 @@ extern GLFWwindow * mWindow;
 extern RENDERER_WINDOWMODE eMode;
 
 bool Open( RENDERER_SETTINGS * settings );
+// Creates a windowless context (surfaceless EGL) rendering into an offscreen
+// framebuffer of the requested size; mWindowMode and mVsync are ignored.
+// Only available in builds with FOXOTRON_HEADLESS_EGL.
+bool OpenHeadless( RENDERER_SETTINGS * settings );
+bool ReadFramebuffer( unsigned char * _pixels ); // top-down RGBA8, nWidth * nHeight * 4 bytes; headless only
 void SwitchFullscreen( RENDERER_WINDOWMODE newMode );
 
 void StartFrame( glm::vec4 & clearColor );
@@ -83,10 +128,63 @@ Texture * CreateRGBA8TextureFromFile( const char * szFilename, const bool _loadA
 Texture * CreateRGBA8TextureFromMemory( const unsigned char * pMemory, unsigned int nMemorySize, const bool _loadAsSRGB = false );
 Texture * CreateRGBA8TextureFromRawData( const unsigned int * pRGBA, unsigned int nWidth, unsigned int nHeight, const bool _loadAsSRGB = false );
 Texture * CreateRG32FTextureFromRawFile( const char* szFilename, int width, int height );
+// The Stage* functions only decode and don't touch GL, so they can be called from any thread;
+// UploadTexture() has to be called on the render thread before the texture is used.
+// File textures are cached by path and sRGB flag; _cacheHit reports whether an existing texture was reused.
+Texture * StageRGBA8TextureFromFile( const char * szFilename, const bool _loadAsSRGB = false, bool * _cacheHit = NULL );
+Texture * StageRGBA8TextureFromMemory( const unsigned char * pMemory, unsigned int nMemorySize, const bool _loadAsSRGB = false );
+Texture * StageRGBA8TextureFromRawData( const unsigned int * pRGBA, unsigned int nWidth, unsigned int nHeight, const bool _loadAsSRGB = false );
+bool UploadTexture( Texture * tex );
+void AddTextureRef( Texture * tex );
 void ReleaseTexture( Texture *& tex );
+unsigned int GetTextureSize( const Texture * tex );
 
 void SetShader( Shader * _shader );
 
+// Render state changes go through a shadow copy of the GL state, and changes
+// to the value already set are dropped. The shadow is reset every frame since
+// ImGui changes state on its own; code that changes any of this state directly
+// has to call InvalidateRenderState() afterwards.
+struct RenderStateStats
+{
+  unsigned int mIssued;
+  unsigned int mFiltered;
+};
+void SetEnabled( unsigned int _capability, bool _enabled ); // GL_BLEND, GL_DEPTH_TEST, GL_CULL_FACE...
+void SetBlendFunc( unsigned int _source, unsigned int _destination );
+void SetCullFace( unsigned int _mode );
+void SetDepthMask( bool _write );
+void SetDepthFunc( unsigned int _function );
+void SetPolygonMode( unsigned int _mode );
+void BindVertexArray( unsigned int _vertexArray );
+void BindUniformBuffer( unsigned int _bindingPoint, unsigned int _buffer, size_t _offset = 0, size_t _size = 0 ); // 0 size binds the whole buffer
+void InvalidateRenderState();
+const RenderStateStats & GetRenderStateStats(); // of the last finished frame
+
+// Texture binds go through a table of what's bound to each unit, and binds of
+// an already bound texture are skipped. Code that binds textures directly has
+// to call InvalidateTextureBindings() afterwards.
+struct TextureBindStats
+{
+  unsigned int mIssued;
+  unsigned int mSkipped;
+};
+void BindTexture( int _unit, Texture * tex );
+void InvalidateTextureBindings();
+const TextureBindStats & GetTextureBindStats(); // of the last finished frame
+
+// Weighted blended order-independent transparency (McGuire and Bavoil, 2013):
+// transparent surfaces are drawn in any order into a weighted sum of their
+// premultiplied colors and a product of their transmittance ("revealage"),
+// then composited over the frame. The targets are sized like the viewport,
+// and the depth of the bound framebuffer is copied in so opaque surfaces
+// still hide what's behind them. Blending is set up for the targets;
+// fragment shaders write the weighted color to output 0 and alpha to output 1.
+bool BeginTransparencyAccumulation(); // false if the targets couldn't be created
+// Rebinds the framebuffer that was bound at Begin and blends the targets over
+// it with _compositeShader, which reads "tex_accumulation" and "tex_revealage"
+void CompositeTransparency( Shader * _compositeShader );
+
 extern std::string dropEventBuffer[ 512 ];
 extern int dropEventBufferCount;
 } // namespace
@@ -0,0 +1,463 @@
+#include "Simplifier.h"
+
+#include <cmath>
+#include <cstring>
+#include <queue>
+#include <algorithm>
+
+namespace Simplifier
+{
+
+const unsigned int INVALID = ~0u;
+
+// Collapses that turn a neighbouring triangle further than this (cosine of
+// the angle between its normals before and after) are rejected
+const float MAX_NORMAL_CHANGE = 0.2f;
+
+// A level is only kept if it removes at least this fraction of the triangles
+const float MIN_LEVEL_REDUCTION = 0.2f;
+
+//////////////////////////////////////////////////////////////////////////
+// Quadrics
+
+// Symmetric 4x4 error matrix of a set of planes, weighted by triangle area
+struct Quadric
+{
+  double mA00, mA01, mA02, mA11, mA12, mA22;
+  double mB0, mB1, mB2;
+  double mC;
+  double mWeight;
+};
+
+void AddPlane( Quadric & _quadric, double _x, double _y, double _z, double _d, double _weight )
+{
+  _quadric.mA00 += _weight * _x * _x;
+  _quadric.mA01 += _weight * _x * _y;
+  _quadric.mA02 += _weight * _x * _z;
+  _quadric.mA11 += _weight * _y * _y;
+  _quadric.mA12 += _weight * _y * _z;
+  _quadric.mA22 += _weight * _z * _z;
+  _quadric.mB0 += _weight * _x * _d;
+  _quadric.mB1 += _weight * _y * _d;
+  _quadric.mB2 += _weight * _z * _d;
+  _quadric.mC += _weight * _d * _d;
+  _quadric.mWeight += _weight;
+}
+
+void AddQuadric( Quadric & _quadric, const Quadric & _other )
+{
+  _quadric.mA00 += _other.mA00;
+  _quadric.mA01 += _other.mA01;
+  _quadric.mA02 += _other.mA02;
+  _quadric.mA11 += _other.mA11;
+  _quadric.mA12 += _other.mA12;
+  _quadric.mA22 += _other.mA22;
+  _quadric.mB0 += _other.mB0;
+  _quadric.mB1 += _other.mB1;
+  _quadric.mB2 += _other.mB2;
+  _quadric.mC += _other.mC;
+  _quadric.mWeight += _other.mWeight;
+}
+
+// Mean squared distance of the point to the planes of both quadrics
+float EvaluateCollapse( const Quadric & _a, const Quadric & _b, const float * _position )
+{
+  const double x = _position[ 0 ];
+  const double y = _position[ 1 ];
+  const double z = _position[ 2 ];
+  const double a00 = _a.mA00 + _b.mA00, a01 = _a.mA01 + _b.mA01, a02 = _a.mA02 + _b.mA02;
+  const double a11 = _a.mA11 + _b.mA11, a12 = _a.mA12 + _b.mA12, a22 = _a.mA22 + _b.mA22;
+  const double error =
+    a00 * x * x + a11 * y * y + a22 * z * z
+    + 2.0 * ( a01 * x * y + a02 * x * z + a12 * y * z )
+    + 2.0 * ( ( _a.mB0 + _b.mB0 ) * x + ( _a.mB1 + _b.mB1 ) * y + ( _a.mB2 + _b.mB2 ) * z )
+    + _a.mC + _b.mC;
+  const double weight = _a.mWeight + _b.mWeight;
+  return weight > 0.0 ? (float) ( std::max( error, 0.0 ) / weight ) : 0.0f;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Simplification state
+
+struct Collapse
+{
+  float mCost;
+  unsigned int mVertex;
+  unsigned int mTarget;
+  unsigned int mVersion; // stale once the vertex's candidate was recomputed
+
+  bool operator>( const Collapse & _other ) const { return mCost > _other.mCost; }
+};
+
+struct State
+{
+  const float * mPositions;
+  size_t mStride;
+
+  std::vector<unsigned int> mTriangles;
+  std::vector<unsigned char> mTriangleDead;
+  int mLiveTriangles;
+
+  // Triangles around each original vertex; a vertex that absorbed others
+  // through collapses also owns their lists, chained through mGroupNext
+  std::vector<unsigned int> mAdjacencyOffsets;
+  std::vector<unsigned int> mAdjacency;
+  std::vector<unsigned int> mGroupNext;
+  std::vector<unsigned int> mGroupTail;
+
+  std::vector<unsigned char> mLocked;
+  std::vector<unsigned char> mCollapsed;
+  std::vector<unsigned int> mVersions;
+  std::vector<Quadric> mQuadrics;
+
+  std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse> > mQueue;
+
+  const float * GetPosition( unsigned int _vertex ) const
+  {
+    return (const float *) ( (const char *) mPositions + mStride * _vertex );
+  }
+
+  template<typename F> void ForEachTriangle( unsigned int _vertex, F _function )
+  {
+    for ( unsigned int member = _vertex; member != INVALID; member = mGroupNext[ member ] )
+    {
+      for ( unsigned int i = mAdjacencyOffsets[ member ]; i < mAdjacencyOffsets[ member + 1 ]; i++ )
+      {
+        const unsigned int triangle = mAdjacency[ i ];
+        if ( !mTriangleDead[ triangle ] )
+        {
+          _function( triangle );
+        }
+      }
+    }
+  }
+};
+
+void Cross( const float * _a, const float * _b, const float * _c, float * _normal )
+{
+  const float e0[ 3 ] = { _b[ 0 ] - _a[ 0 ], _b[ 1 ] - _a[ 1 ], _b[ 2 ] - _a[ 2 ] };
+  const float e1[ 3 ] = { _c[ 0 ] - _a[ 0 ], _c[ 1 ] - _a[ 1 ], _c[ 2 ] - _a[ 2 ] };
+  _normal[ 0 ] = e0[ 1 ] * e1[ 2 ] - e0[ 2 ] * e1[ 1 ];
+  _normal[ 1 ] = e0[ 2 ] * e1[ 0 ] - e0[ 0 ] * e1[ 2 ];
+  _normal[ 2 ] = e0[ 0 ] * e1[ 1 ] - e0[ 1 ] * e1[ 0 ];
+}
+
+void Setup( State & _state, int _vertexCount )
+{
+  const int triangleCount = (int) _state.mTriangles.size() / 3;
+
+  _state.mTriangleDead.assign( triangleCount, 0 );
+  _state.mLiveTriangles = 0;
+  for ( int i = 0; i < triangleCount; i++ )
+  {
+    const unsigned int * triangle = &_state.mTriangles[ i * 3 ];
+    _state.mTriangleDead[ i ] = triangle[ 0 ] == triangle[ 1 ] || triangle[ 1 ] == triangle[ 2 ] || triangle[ 0 ] == triangle[ 2 ];
+    _state.mLiveTriangles += !_state.mTriangleDead[ i ];
+  }
+
+  _state.mAdjacencyOffsets.assign( _vertexCount + 1, 0 );
+  for ( int i = 0; i < triangleCount * 3; i++ )
+  {
+    _state.mAdjacencyOffsets[ _state.mTriangles[ i ] + 1 ]++;
+  }
+  for ( int i = 0; i < _vertexCount; i++ )
+  {
+    _state.mAdjacencyOffsets[ i + 1 ] += _state.mAdjacencyOffsets[ i ];
+  }
+  _state.mAdjacency.resize( triangleCount * 3 );
+  std::vector<unsigned int> fill( _state.mAdjacencyOffsets.begin(), _state.mAdjacencyOffsets.end() - 1 );
+  for ( int i = 0; i < triangleCount * 3; i++ )
+  {
+    _state.mAdjacency[ fill[ _state.mTriangles[ i ] ]++ ] = i / 3;
+  }
+
+  _state.mGroupNext.assign( _vertexCount, INVALID );
+  _state.mGroupTail.resize( _vertexCount );
+  for ( int i = 0; i < _vertexCount; i++ )
+  {
+    _state.mGroupTail[ i ] = i;
+  }
+  _state.mCollapsed.assign( _vertexCount, 0 );
+  _state.mVersions.assign( _vertexCount, 0 );
+  _state.mLocked.assign( _vertexCount, 0 );
+
+  // Seams: vertices sharing a position with another one
+  std::vector<unsigned int> order( _vertexCount );
+  for ( int i = 0; i < _vertexCount; i++ )
+  {
+    order[ i ] = i;
+  }
+  std::sort( order.begin(), order.end(), [ &_state ]( unsigned int _a, unsigned int _b )
+  {
+    const float * a = _state.GetPosition( _a );
+    const float * b = _state.GetPosition( _b );
+    return a[ 0 ] != b[ 0 ] ? a[ 0 ] < b[ 0 ] : a[ 1 ] != b[ 1 ] ? a[ 1 ] < b[ 1 ] : a[ 2 ] < b[ 2 ];
+  } );
+  for ( int i = 1; i < _vertexCount; i++ )
+  {
+    const float * a = _state.GetPosition( order[ i - 1 ] );
+    const float * b = _state.GetPosition( order[ i ] );
+    if ( a[ 0 ] == b[ 0 ] && a[ 1 ] == b[ 1 ] && a[ 2 ] == b[ 2 ] )
+    {
+      _state.mLocked[ order[ i - 1 ] ] = 1;
+      _state.mLocked[ order[ i ] ] = 1;
+    }
+  }
+
+  // Borders: around an interior vertex every neighbour is shared by two triangles
+  std::vector<unsigned int> neighbours;
+  for ( int v = 0; v < _vertexCount; v++ )
+  {
+    if ( _state.mLocked[ v ] )
+    {
+      continue;
+    }
+    neighbours.clear();
+    _state.ForEachTriangle( v, [ &_state, &neighbours, v ]( unsigned int _triangle )
+    {
+      for ( int k = 0; k < 3; k++ )
+      {
+        if ( _state.mTriangles[ _triangle * 3 + k ] != (unsigned int) v )
+        {
+          neighbours.push_back( _state.mTriangles[ _triangle * 3 + k ] );
+        }
+      }
+    } );
+    std::sort( neighbours.begin(), neighbours.end() );
+    for ( size_t i = 0; i < neighbours.size(); )
+    {
+      size_t j = i;
+      while ( j < neighbours.size() && neighbours[ j ] == neighbours[ i ] )
+      {
+        j++;
+      }
+      if ( ( j - i ) != 2 )
+      {
+        _state.mLocked[ v ] = 1;
+        break;
+      }
+      i = j;
+    }
+  }
+
+  Quadric zero;
+  memset( &zero, 0, sizeof( Quadric ) );
+  _state.mQuadrics.assign( _vertexCount, zero );
+  for ( int i = 0; i < triangleCount; i++ )
+  {
+    if ( _state.mTriangleDead[ i ] )
+    {
+      continue;
+    }
+
+    const unsigned int * triangle = &_state.mTriangles[ i * 3 ];
+    const float * p0 = _state.GetPosition( triangle[ 0 ] );
+    float normal[ 3 ];
+    Cross( p0, _state.GetPosition( triangle[ 1 ] ), _state.GetPosition( triangle[ 2 ] ), normal );
+    const double length = sqrt( (double) normal[ 0 ] * normal[ 0 ] + (double) normal[ 1 ] * normal[ 1 ] + (double) normal[ 2 ] * normal[ 2 ] );
+    if ( length <= 0.0 )
+    {
+      continue;
+    }
+
+    const double x = normal[ 0 ] / length;
+    const double y = normal[ 1 ] / length;
+    const double z = normal[ 2 ] / length;
+    const double d = -( x * p0[ 0 ] + y * p0[ 1 ] + z * p0[ 2 ] );
+    for ( int k = 0; k < 3; k++ )
+    {
+      AddPlane( _state.mQuadrics[ triangle[ k ] ], x, y, z, d, length * 0.5 );
+    }
+  }
+}
+
+// Queues the cheapest collapse of a vertex onto one of its neighbours
+void UpdateCandidate( State & _state, unsigned int _vertex )
+{
+  _state.mVersions[ _vertex ]++;
+  if ( _state.mLocked[ _vertex ] || _state.mCollapsed[ _vertex ] )
+  {
+    return;
+  }
+
+  Collapse best;
+  best.mCost = 0.0f;
+  best.mVertex = _vertex;
+  best.mTarget = INVALID;
+  best.mVersion = _state.mVersions[ _vertex ];
+  _state.ForEachTriangle( _vertex, [ &_state, &best, _vertex ]( unsigned int _triangle )
+  {
+    for ( int k = 0; k < 3; k++ )
+    {
+      const unsigned int target = _state.mTriangles[ _triangle * 3 + k ];
+      if ( target == _vertex )
+      {
+        continue;
+      }
+      const float cost = EvaluateCollapse( _state.mQuadrics[ _vertex ], _state.mQuadrics[ target ], _state.GetPosition( target ) );
+      if ( best.mTarget == INVALID || cost < best.mCost )
+      {
+        best.mCost = cost;
+        best.mTarget = target;
+      }
+    }
+  } );
+
+  if ( best.mTarget != INVALID )
+  {
+    _state.mQueue.push( best );
+  }
+}
+
+// Rejects collapses that would flip or squash one of the remaining triangles
+bool IsCollapseValid( State & _state, unsigned int _vertex, unsigned int _target )
+{
+  const float * targetPosition = _state.GetPosition( _target );
+  bool valid = true;
+  _state.ForEachTriangle( _vertex, [ &_state, &valid, _vertex, _target, targetPosition ]( unsigned int _triangle )
+  {
+    const unsigned int * triangle = &_state.mTriangles[ _triangle * 3 ];
+    if ( !valid || triangle[ 0 ] == _target || triangle[ 1 ] == _target || triangle[ 2 ] == _target )
+    {
+      return;
+    }
+
+    const float * before[ 3 ];
+    const float * after[ 3 ];
+    for ( int k = 0; k < 3; k++ )
+    {
+      before[ k ] = _state.GetPosition( triangle[ k ] );
+      after[ k ] = triangle[ k ] == _vertex ? targetPosition : before[ k ];
+    }
+    float normalBefore[ 3 ];
+    float normalAfter[ 3 ];
+    Cross( before[ 0 ], before[ 1 ], before[ 2 ], normalBefore );
+    Cross( after[ 0 ], after[ 1 ], after[ 2 ], normalAfter );
+    const float dot = normalBefore[ 0 ] * normalAfter[ 0 ] + normalBefore[ 1 ] * normalAfter[ 1 ] + normalBefore[ 2 ] * normalAfter[ 2 ];
+    const float lengthBefore = sqrtf( normalBefore[ 0 ] * normalBefore[ 0 ] + normalBefore[ 1 ] * normalBefore[ 1 ] + normalBefore[ 2 ] * normalBefore[ 2 ] );
+    const float lengthAfter = sqrtf( normalAfter[ 0 ] * normalAfter[ 0 ] + normalAfter[ 1 ] * normalAfter[ 1 ] + normalAfter[ 2 ] * normalAfter[ 2 ] );
+    if ( lengthAfter <= 0.0f || dot < MAX_NORMAL_CHANGE * lengthBefore * lengthAfter )
+    {
+      valid = false;
+    }
+  } );
+  return valid;
+}
+
+void PerformCollapse( State & _state, unsigned int _vertex, unsigned int _target )
+{
+  _state.ForEachTriangle( _vertex, [ &_state, _vertex, _target ]( unsigned int _triangle )
+  {
+    unsigned int * triangle = &_state.mTriangles[ _triangle * 3 ];
+    if ( triangle[ 0 ] == _target || triangle[ 1 ] == _target || triangle[ 2 ] == _target )
+    {
+      _state.mTriangleDead[ _triangle ] = 1;
+      _state.mLiveTriangles--;
+      return;
+    }
+    for ( int k = 0; k < 3; k++ )
+    {
+      if ( triangle[ k ] == _vertex )
+      {
+        triangle[ k ] = _target;
+      }
+    }
+  } );
+
+  AddQuadric( _state.mQuadrics[ _target ], _state.mQuadrics[ _vertex ] );
+  _state.mCollapsed[ _vertex ] = 1;
+  _state.mGroupNext[ _state.mGroupTail[ _target ] ] = _vertex;
+  _state.mGroupTail[ _target ] = _state.mGroupTail[ _vertex ];
+
+  // Everything around the target now sees a different quadric or position
+  UpdateCandidate( _state, _target );
+  std::vector<unsigned int> neighbours;
+  _state.ForEachTriangle( _target, [ &_state, &neighbours, _target ]( unsigned int _triangle )
+  {
+    for ( int k = 0; k < 3; k++ )
+    {
+      if ( _state.mTriangles[ _triangle * 3 + k ] != _target )
+      {
+        neighbours.push_back( _state.mTriangles[ _triangle * 3 + k ] );
+      }
+    }
+  } );
+  std::sort( neighbours.begin(), neighbours.end() );
+  neighbours.erase( std::unique( neighbours.begin(), neighbours.end() ), neighbours.end() );
+  for ( size_t i = 0; i < neighbours.size(); i++ )
+  {
+    UpdateCandidate( _state, neighbours[ i ] );
+  }
+}
+
+void AddLevel( const State & _state, float _error, std::vector<Level> & _levels )
+{
+  _levels.push_back( Level() );
+  Level & level = _levels.back();
+  level.mError = sqrtf( _error );
+  level.mIndices.reserve( _state.mLiveTriangles * 3 );
+  for ( size_t i = 0; i < _state.mTriangleDead.size(); i++ )
+  {
+    if ( !_state.mTriangleDead[ i ] )
+    {
+      level.mIndices.insert( level.mIndices.end(), &_state.mTriangles[ i * 3 ], &_state.mTriangles[ i * 3 ] + 3 );
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+void Simplify( const float * _positions, size_t _stride, int _vertexCount, const unsigned int * _indices, int _triangleCount, int _levelCount, std::vector<Level> & _levels )
+{
+  _levels.clear();
+  if ( _vertexCount <= 0 || _triangleCount <= 0 || _levelCount <= 0 )
+  {
+    return;
+  }
+
+  State state;
+  state.mPositions = _positions;
+  state.mStride = _stride;
+  state.mTriangles.assign( _indices, _indices + _triangleCount * 3 );
+  Setup( state, _vertexCount );
+
+  for ( int i = 0; i < _vertexCount; i++ )
+  {
+    UpdateCandidate( state, i );
+  }
+
+  float maxError = 0.0f;
+  int previousCount = state.mLiveTriangles;
+  int targetCount = previousCount / 2;
+  while ( (int) _levels.size() < _levelCount )
+  {
+    while ( state.mLiveTriangles > targetCount && !state.mQueue.empty() )
+    {
+      const Collapse collapse = state.mQueue.top();
+      state.mQueue.pop();
+      if ( state.mCollapsed[ collapse.mVertex ] || collapse.mVersion != state.mVersions[ collapse.mVertex ]
+        || state.mCollapsed[ collapse.mTarget ] || !IsCollapseValid( state, collapse.mVertex, collapse.mTarget ) )
+      {
+        continue;
+      }
+
+      maxError = std::max( maxError, collapse.mCost );
+      PerformCollapse( state, collapse.mVertex, collapse.mTarget );
+    }
+
+    if ( state.mLiveTriangles > previousCount * ( 1.0f - MIN_LEVEL_REDUCTION ) )
+    {
+      break;
+    }
+    AddLevel( state, maxError, _levels );
+
+    previousCount = state.mLiveTriangles;
+    targetCount = previousCount / 2;
+    if ( state.mQueue.empty() )
+    {
+      break;
+    }
+  }
+}
+
+} // namespace
@@ -0,0 +1,21 @@
+#include <vector>
+#include <stddef.h>
+
+// Quadric error mesh simplification (Garland & Heckbert) by half-edge
+// collapses: vertices only ever move onto a neighbour, so every level indexes
+// the original vertex buffer and only needs an index buffer of its own.
+// Vertices on open borders and on attribute seams (several vertices at the
+// same position) stay in place, which keeps UV charts and outlines intact.
+namespace Simplifier
+{
+struct Level
+{
+  std::vector<unsigned int> mIndices;
+  float mError; // largest collapse error so far, as a distance in mesh units
+};
+
+// Fills _levels with up to _levelCount levels, each with about half the
+// triangles of the one before; stops early when the mesh can't be reduced
+// any further. _positions are three floats, _stride bytes apart.
+void Simplify( const float * _positions, size_t _stride, int _vertexCount, const unsigned int * _indices, int _triangleCount, int _levelCount, std::vector<Level> & _levels );
+} // namespace
@@ -0,0 +1,116 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool( int _threadCount /*= 0*/ )
+  : mQuit( false )
+  , mJobID( 0 )
+  , mFinishedWorkers( 0 )
+  , mFunction( NULL )
+  , mCount( 0 )
+  , mNextIndex( 0 )
+{
+  if ( _threadCount <= 0 )
+  {
+    _threadCount = (int) std::thread::hardware_concurrency();
+  }
+
+  // The calling thread works as well, so it counts as one of the threads
+  for ( int i = 1; i < _threadCount; i++ )
+  {
+    mThreads.push_back( std::thread( &ThreadPool::WorkerMain, this ) );
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock( mMutex );
+    mQuit = true;
+  }
+  mWakeCondition.notify_all();
+
+  for ( int i = 0; i < mThreads.size(); i++ )
+  {
+    mThreads[ i ].join();
+  }
+}
+
+void ThreadPool::ParallelFor( int _count, const std::function<void( int )> & _function )
+{
+  if ( _count <= 0 )
+  {
+    return;
+  }
+
+  std::lock_guard<std::mutex> jobLock( mJobMutex );
+
+  if ( mThreads.empty() || _count == 1 )
+  {
+    for ( int i = 0; i < _count; i++ )
+    {
+      _function( i );
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock( mMutex );
+    mFunction = &_function;
+    mCount = _count;
+    mNextIndex = 0;
+    mFinishedWorkers = 0;
+    mJobID++;
+  }
+  mWakeCondition.notify_all();
+
+  RunJob();
+
+  // Every worker checks in once per job, so none of them can still be
+  // looking at this job when the next one is set up
+  std::unique_lock<std::mutex> lock( mMutex );
+  mDoneCondition.wait( lock, [ this ]() { return mFinishedWorkers == (int) mThreads.size(); } );
+  mFunction = NULL;
+}
+
+ThreadPool & ThreadPool::Get()
+{
+  static ThreadPool pool;
+  return pool;
+}
+
+void ThreadPool::WorkerMain()
+{
+  unsigned int lastJobID = 0;
+  while ( true )
+  {
+    {
+      std::unique_lock<std::mutex> lock( mMutex );
+      mWakeCondition.wait( lock, [ this, lastJobID ]() { return mQuit || mJobID != lastJobID; } );
+      if ( mQuit )
+      {
+        return;
+      }
+      lastJobID = mJobID;
+    }
+
+    RunJob();
+
+    {
+      std::lock_guard<std::mutex> lock( mMutex );
+      mFinishedWorkers++;
+    }
+    mDoneCondition.notify_one();
+  }
+}
+
+void ThreadPool::RunJob()
+{
+  while ( true )
+  {
+    const int index = mNextIndex++;
+    if ( index >= mCount )
+    {
+      break;
+    }
+    ( *mFunction )( index );
+  }
+}
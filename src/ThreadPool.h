@@ -0,0 +1,40 @@
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+// A fixed set of worker threads, sized to the core count by default. Work is
+// handed out as a parallel for loop; the calling thread helps out and returns
+// once every index has been processed. Calls are serialized, so a job must not
+// issue another ParallelFor on the same pool.
+class ThreadPool
+{
+public:
+  ThreadPool( int _threadCount = 0 );
+  ~ThreadPool();
+
+  void ParallelFor( int _count, const std::function<void( int )> & _function );
+
+  int GetThreadCount() const { return (int) mThreads.size() + 1; }
+
+  static ThreadPool & Get();
+
+private:
+  void WorkerMain();
+  void RunJob();
+
+  std::vector<std::thread> mThreads;
+  std::mutex mJobMutex;
+  std::mutex mMutex;
+  std::condition_variable mWakeCondition;
+  std::condition_variable mDoneCondition;
+  bool mQuit;
+  unsigned int mJobID;
+  int mFinishedWorkers;
+
+  const std::function<void( int )> * mFunction;
+  int mCount;
+  std::atomic<int> mNextIndex;
+};
@@ -0,0 +1,529 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <new>
+
+#include "Geometry.h"
+
+#include <jsonxx.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#endif
+
+// Model import benchmark: loads every model of a corpus through the same
+// path the viewer uses and reports wall time, peak resident memory and heap
+// allocations for each stage of the load.
+
+//////////////////////////////////////////////////////////////////////////
+// Allocation tracking, on any thread: everything going through operator new,
+// and stb_image's decodes, which the bench build of the renderer routes
+// through CountedMalloc() / CountedRealloc(). Plain C allocations elsewhere,
+// such as in the libraries Assimp bundles, aren't seen.
+
+std::atomic<uint64_t> gAllocationCount( 0 );
+std::atomic<uint64_t> gAllocatedBytes( 0 );
+
+void * CountedMalloc( size_t _size )
+{
+  gAllocationCount++;
+  gAllocatedBytes += _size;
+  return malloc( _size );
+}
+
+// A reallocation counts as a new allocation of the new size
+void * CountedRealloc( void * _pointer, size_t _size )
+{
+  gAllocationCount++;
+  gAllocatedBytes += _size;
+  return realloc( _pointer, _size );
+}
+
+void * operator new( size_t _size )
+{
+  void * pointer = CountedMalloc( _size ? _size : 1 );
+  if ( !pointer )
+  {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void * operator new[]( size_t _size )
+{
+  return operator new( _size );
+}
+
+void operator delete( void * _pointer ) noexcept
+{
+  free( _pointer );
+}
+
+void operator delete[]( void * _pointer ) noexcept
+{
+  free( _pointer );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Peak resident memory
+
+// Resets the peak so the next reading covers only what follows; returns false
+// if the platform can't, in which case readings are the peak since startup
+bool ResetPeakMemory()
+{
+#if defined( __linux__ )
+  FILE * file = fopen( "/proc/self/clear_refs", "w" );
+  if ( !file )
+  {
+    return false;
+  }
+  const bool success = fputs( "5", file ) >= 0;
+  return fclose( file ) == 0 && success;
+#else
+  return false;
+#endif
+}
+
+uint64_t GetPeakMemory()
+{
+#if defined( _WIN32 )
+  PROCESS_MEMORY_COUNTERS counters;
+  if ( GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters ) ) )
+  {
+    return (uint64_t) counters.PeakWorkingSetSize;
+  }
+  return 0;
+#elif defined( __linux__ )
+  FILE * file = fopen( "/proc/self/status", "r" );
+  if ( !file )
+  {
+    return 0;
+  }
+  uint64_t peak = 0;
+  char line[ 256 ];
+  while ( fgets( line, sizeof( line ), file ) )
+  {
+    unsigned long long kilobytes = 0;
+    if ( sscanf( line, "VmHWM: %llu kB", &kilobytes ) == 1 )
+    {
+      peak = (uint64_t) kilobytes * 1024;
+      break;
+    }
+  }
+  fclose( file );
+  return peak;
+#else
+  struct rusage usage;
+  if ( getrusage( RUSAGE_SELF, &usage ) != 0 )
+  {
+    return 0;
+  }
+#ifdef __APPLE__
+  return (uint64_t) usage.ru_maxrss;
+#else
+  return (uint64_t) usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Stage measurements
+
+const char * gStageNames[ Geometry::LOADSTAGE_COUNT ] =
+{
+  "read",
+  "postProcess",
+  "materials",
+  "vertices",
+  "upload",
+};
+
+struct StageSample
+{
+  float mWallTime;
+  uint64_t mPeakMemory;
+  uint64_t mAllocationCount;
+  uint64_t mAllocatedBytes;
+  bool mReported;
+};
+
+struct StageRecorder
+{
+  StageSample mSamples[ Geometry::LOADSTAGE_COUNT ];
+
+  std::chrono::high_resolution_clock::time_point mStart;
+  uint64_t mStartAllocationCount;
+  uint64_t mStartAllocatedBytes;
+  bool mFinishGL;
+
+  StageRecorder( bool _finishGL )
+    : mStartAllocationCount( 0 )
+    , mStartAllocatedBytes( 0 )
+    , mFinishGL( _finishGL )
+  {
+    memset( mSamples, 0, sizeof( mSamples ) );
+  }
+
+  void Report( Geometry::LOADSTAGE _stage, bool _begin )
+  {
+    StageSample & sample = mSamples[ _stage ];
+    if ( _begin )
+    {
+      ResetPeakMemory();
+      mStartAllocationCount = gAllocationCount.load();
+      mStartAllocatedBytes = gAllocatedBytes.load();
+      mStart = std::chrono::high_resolution_clock::now();
+      return;
+    }
+
+    // GL calls only queue up work; wait for it so the upload is timed in full
+    if ( _stage == Geometry::LOADSTAGE_UPLOAD && mFinishGL )
+    {
+      glFinish();
+    }
+
+    sample.mWallTime += std::chrono::duration<float, std::milli>( std::chrono::high_resolution_clock::now() - mStart ).count();
+    sample.mAllocationCount += gAllocationCount.load() - mStartAllocationCount;
+    sample.mAllocatedBytes += gAllocatedBytes.load() - mStartAllocatedBytes;
+    sample.mPeakMemory = std::max( sample.mPeakMemory, GetPeakMemory() );
+    sample.mReported = true;
+  }
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Corpus
+
+std::string GetExtension( const std::string & _path )
+{
+  const size_t dot = _path.find_last_of( '.' );
+  const size_t slash = _path.find_last_of( "/\\" );
+  if ( dot == std::string::npos || ( slash != std::string::npos && dot < slash ) )
+  {
+    return "";
+  }
+  std::string extension = _path.substr( dot );
+  std::transform( extension.begin(), extension.end(), extension.begin(), ::tolower );
+  return extension;
+}
+
+void CollectModelFiles( const std::string & _path, const std::string & _extensions, std::vector<std::string> & _paths )
+{
+  std::vector<std::string> entries;
+  std::vector<std::string> folders;
+#ifdef _WIN32
+  _finddata_t fileInfo;
+  intptr_t handle = _findfirst( ( _path + "/*" ).c_str(), &fileInfo );
+  if ( handle == -1 )
+  {
+    // Not a folder
+    if ( _extensions.find( GetExtension( _path ) + "," ) != std::string::npos )
+    {
+      _paths.push_back( _path );
+    }
+    return;
+  }
+  do
+  {
+    if ( !strcmp( fileInfo.name, "." ) || !strcmp( fileInfo.name, ".." ) )
+    {
+      continue;
+    }
+    ( ( fileInfo.attrib & _A_SUBDIR ) ? folders : entries ).push_back( _path + "/" + fileInfo.name );
+  } while ( _findnext( handle, &fileInfo ) == 0 );
+  _findclose( handle );
+#else
+  DIR * dir = opendir( _path.c_str() );
+  if ( !dir )
+  {
+    // Not a folder
+    if ( _extensions.find( GetExtension( _path ) + "," ) != std::string::npos )
+    {
+      _paths.push_back( _path );
+    }
+    return;
+  }
+  while ( dirent * entry = readdir( dir ) )
+  {
+    if ( !strcmp( entry->d_name, "." ) || !strcmp( entry->d_name, ".." ) )
+    {
+      continue;
+    }
+    const std::string entryPath = _path + "/" + entry->d_name;
+    struct stat st;
+    if ( stat( entryPath.c_str(), &st ) != 0 )
+    {
+      continue;
+    }
+    if ( S_ISDIR( st.st_mode ) )
+    {
+      folders.push_back( entryPath );
+    }
+    else if ( S_ISREG( st.st_mode ) )
+    {
+      entries.push_back( entryPath );
+    }
+  }
+  closedir( dir );
+#endif
+
+  std::sort( entries.begin(), entries.end() );
+  for ( int i = 0; i < entries.size(); i++ )
+  {
+    const std::string extension = GetExtension( entries[ i ] );
+    if ( !extension.empty() && _extensions.find( extension + "," ) != std::string::npos )
+    {
+      _paths.push_back( entries[ i ] );
+    }
+  }
+
+  std::sort( folders.begin(), folders.end() );
+  for ( int i = 0; i < folders.size(); i++ )
+  {
+    CollectModelFiles( folders[ i ], _extensions, _paths );
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+void PrintUsage()
+{
+  printf( "Usage: foxotron_bench [options] <model or folder>...\n" );
+  printf( "  --iterations <count>      times each model is loaded (default 3)\n" );
+  printf( "  --output <path>           JSON report to write (default foxotron_bench.json)\n" );
+  printf( "  --cache                   allow loading from / writing to .foxocache files\n" );
+  printf( "  --no-upload               skip the GL upload stage\n" );
+  printf( "Folders are scanned recursively for every format Assimp can import.\n" );
+}
+
+int main( int argc, const char * argv[] )
+{
+  std::vector<std::string> inputs;
+  std::string outputPath = "foxotron_bench.json";
+  int iterations = 3;
+  bool useCache = false;
+  bool upload = true;
+  for ( int i = 1; i < argc; i++ )
+  {
+    const std::string arg = argv[ i ];
+    if ( arg == "--iterations" && i + 1 < argc )
+    {
+      iterations = std::max( 1, atoi( argv[ ++i ] ) );
+    }
+    else if ( arg == "--output" && i + 1 < argc )
+    {
+      outputPath = argv[ ++i ];
+    }
+    else if ( arg == "--cache" )
+    {
+      useCache = true;
+    }
+    else if ( arg == "--no-upload" )
+    {
+      upload = false;
+    }
+    else if ( arg == "--help" || arg == "-h" )
+    {
+      PrintUsage();
+      return 0;
+    }
+    else if ( arg.length() > 2 && arg.substr( 0, 2 ) == "--" )
+    {
+      printf( "Unknown option '%s'\n", arg.c_str() );
+      PrintUsage();
+      return -1;
+    }
+    else
+    {
+      inputs.push_back( arg );
+    }
+  }
+
+  if ( inputs.empty() )
+  {
+    PrintUsage();
+    return -1;
+  }
+
+  std::string extensions = Geometry::GetSupportedExtensions() + ",";
+  std::transform( extensions.begin(), extensions.end(), extensions.begin(), ::tolower );
+
+  std::vector<std::string> modelPaths;
+  for ( int i = 0; i < inputs.size(); i++ )
+  {
+    CollectModelFiles( inputs[ i ], extensions, modelPaths );
+  }
+  if ( modelPaths.empty() )
+  {
+    printf( "No models found\n" );
+    return -2;
+  }
+
+  // Software GL (llvmpipe in CI) is still a real driver, so the upload is
+  // measured whenever a headless context can be had
+  if ( upload )
+  {
+    RENDERER_SETTINGS settings;
+    settings.mWidth = 64;
+    settings.mHeight = 64;
+    settings.mWindowMode = RENDERER_WINDOWMODE_WINDOWED;
+    settings.mVsync = false;
+    settings.mMultisampling = false;
+    if ( !Renderer::OpenHeadless( &settings ) )
+    {
+      printf( "[bench] No headless GL context, skipping the upload stage\n" );
+      upload = false;
+    }
+  }
+
+  const bool peakMemoryResets = ResetPeakMemory();
+
+  jsonxx::Array modelReports;
+  std::map<std::string, int> formatCounts;
+  int failedCount = 0;
+  for ( int i = 0; i < modelPaths.size(); i++ )
+  {
+    const std::string & modelPath = modelPaths[ i ];
+    const std::string format = GetExtension( modelPath );
+    formatCounts[ format ]++;
+
+    std::vector<StageRecorder> runs;
+    std::vector<float> totalTimes;
+    bool success = true;
+    for ( int j = 0; j < iterations && success; j++ )
+    {
+      runs.push_back( StageRecorder( upload ) );
+      StageRecorder & recorder = runs.back();
+
+      std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+      Geometry::Staging staging;
+      staging.mUseCache = useCache;
+      staging.mStageCallback = [ &recorder ]( Geometry::LOADSTAGE _stage, bool _begin ) { recorder.Report( _stage, _begin ); };
+      success = Geometry::StageMesh( modelPath.c_str(), staging );
+      if ( success && upload )
+      {
+        Geometry model;
+        model.UploadStagedMesh( staging );
+        model.UnloadMesh();
+      }
+
+      totalTimes.push_back( std::chrono::duration<float, std::milli>( std::chrono::high_resolution_clock::now() - start ).count() );
+    }
+
+    jsonxx::Object report;
+    report << "path" << modelPath;
+    report << "format" << format;
+    report << "success" << success;
+    if ( !success )
+    {
+      printf( "[bench] Failed to load '%s'\n", modelPath.c_str() );
+      failedCount++;
+      modelReports << report;
+      continue;
+    }
+
+    // Minimum is the least noisy figure for time; memory and allocations are
+    // deterministic enough that the first (cold) run is as good as any
+    jsonxx::Object stages;
+    for ( int stage = 0; stage < Geometry::LOADSTAGE_COUNT; stage++ )
+    {
+      if ( !runs[ 0 ].mSamples[ stage ].mReported )
+      {
+        continue;
+      }
+
+      float minTime = runs[ 0 ].mSamples[ stage ].mWallTime;
+      float sumTime = 0.0f;
+      uint64_t peakMemory = 0;
+      for ( int j = 0; j < runs.size(); j++ )
+      {
+        const StageSample & sample = runs[ j ].mSamples[ stage ];
+        minTime = std::min( minTime, sample.mWallTime );
+        sumTime += sample.mWallTime;
+        peakMemory = std::max( peakMemory, sample.mPeakMemory );
+      }
+
+      jsonxx::Object stageReport;
+      stageReport << "minMs" << minTime;
+      stageReport << "meanMs" << sumTime / runs.size();
+      stageReport << "peakRssBytes" << (jsonxx::Number) peakMemory;
+      stageReport << "allocations" << (jsonxx::Number) runs[ 0 ].mSamples[ stage ].mAllocationCount;
+      stageReport << "allocatedBytes" << (jsonxx::Number) runs[ 0 ].mSamples[ stage ].mAllocatedBytes;
+      stages << gStageNames[ stage ] << stageReport;
+    }
+
+    const float minTotal = *std::min_element( totalTimes.begin(), totalTimes.end() );
+    report << "iterations" << (jsonxx::Number) runs.size();
+    report << "totalMinMs" << minTotal;
+    report << "stages" << stages;
+    modelReports << report;
+
+    printf( "[bench] '%s': %.2f ms\n", modelPath.c_str(), minTotal );
+  }
+
+  if ( upload )
+  {
+    Renderer::Close();
+  }
+
+  // Formats Assimp supports that the corpus has nothing for
+  jsonxx::Array formats;
+  jsonxx::Array missingFormats;
+  size_t start = 0;
+  for ( size_t end = extensions.find( ',' ); end != std::string::npos; start = end + 1, end = extensions.find( ',', start ) )
+  {
+    const std::string extension = extensions.substr( start, end - start );
+    if ( extension.empty() )
+    {
+      continue;
+    }
+    std::map<std::string, int>::iterator it = formatCounts.find( extension );
+    if ( it == formatCounts.end() )
+    {
+      missingFormats << extension;
+    }
+    else
+    {
+      jsonxx::Object formatReport;
+      formatReport << "format" << extension;
+      formatReport << "models" << (jsonxx::Number) it->second;
+      formats << formatReport;
+    }
+  }
+
+  jsonxx::Object root;
+  root << "iterations" << (jsonxx::Number) iterations;
+  root << "cache" << useCache;
+  root << "upload" << upload;
+  root << "peakRssPerStage" << peakMemoryResets;
+  root << "allocationsCounted" << std::string( "operator new, stb_image" );
+  root << "failed" << (jsonxx::Number) failedCount;
+  root << "formats" << formats;
+  root << "missingFormats" << missingFormats;
+  root << "models" << modelReports;
+
+  FILE * outputFile = fopen( outputPath.c_str(), "wb" );
+  if ( !outputFile )
+  {
+    printf( "Unable to write report '%s'\n", outputPath.c_str() );
+    return -3;
+  }
+  std::string reportString = root.json();
+  fwrite( reportString.c_str(), 1, reportString.length(), outputFile );
+  fclose( outputFile );
+  printf( "Saved report to '%s'\n", outputPath.c_str() );
+
+  return failedCount ? -4 : 0;
+}